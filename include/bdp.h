@@ -0,0 +1,121 @@
+/** @file
+ * Estimate of the bandwidth-delay product of the connection. The writer times the data it sends until the
+ * remote host gives back the credit for it with READ messages: the shortest time is the round trip time and
+ * the bytes given back over time are the delivered bandwidth. Readahead buffers sized to the bandwidth-delay
+ * product keep the link busy, whatever its latency.
+ */
+
+#ifndef BDP_H
+#define BDP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/** Max number of sends that a netpipe times at once */
+#define BDP_SAMPLES 16
+
+/** The min round trip time is replaced after this time, so a slower path is noticed */
+#define BDP_RTT_EXPIRE_USEC 10000000L
+
+/** Shortest interval over which the delivered bandwidth is measured */
+#define BDP_MIN_INTERVAL_USEC 1000L
+
+/** The window is this many times the bandwidth-delay product, so the bandwidth can grow beyond what the
+ * current window allows */
+#define BDP_GAIN 2
+
+/** Round trip time and delivered bandwidth of the connection */
+struct bdp_estimator {
+    pthread_mutex_t mtx;
+    long rtt;                   // min round trip time in microseconds, -1 if it is unknown
+    struct timespec rtt_time;   // when the min round trip time was measured
+    size_t bandwidth;           // delivered bytes per second, 0 if it is unknown
+    size_t delivered;           // bytes given back since the interval started
+    struct timespec interval_start; // zero if the interval is not started
+};
+
+/** A timed send: when the bytes up to end were sent */
+struct bdp_sample {
+    size_t end;
+    struct timespec time;
+};
+
+/** Sends of a netpipe which are timed. It is protected by the netpipe lock */
+struct bdp_sampler {
+    size_t sent;    // bytes sent
+    size_t acked;   // bytes given back by the remote host
+    unsigned int first;
+    unsigned int count;
+    struct bdp_sample samples[BDP_SAMPLES];
+};
+
+/**
+ * Initialize the estimator. Nothing is known until the first bytes are given back.
+ *
+ * @param est the estimator
+ * @return 0 on success, -1 on error and sets errno
+ */
+int bdp_init(struct bdp_estimator *est);
+
+/**
+ * Destroy the estimator.
+ *
+ * @param est the estimator
+ * @return 0 on success, -1 on error and sets errno
+ */
+int bdp_destroy(struct bdp_estimator *est);
+
+/**
+ * Initialize the sampler of a netpipe, also when the netpipe starts again from zero bytes sent.
+ *
+ * @param sampler the sampler
+ */
+void bdp_sampler_init(struct bdp_sampler *sampler);
+
+/**
+ * Record that bytes were sent. The send is timed unless the sampler is already timing BDP_SAMPLES sends.
+ *
+ * @param sampler the netpipe's sampler
+ * @param bytes how many bytes were sent
+ * @param now current time from CLOCK_MONOTONIC
+ */
+void bdp_sent(struct bdp_sampler *sampler, size_t bytes, const struct timespec *now);
+
+/**
+ * Record that the remote host gave back bytes and update the estimate.
+ *
+ * @param est the estimator
+ * @param sampler the netpipe's sampler
+ * @param bytes how many bytes were given back
+ * @param now current time from CLOCK_MONOTONIC
+ * @return 0 on success, -1 on error and sets errno
+ */
+int bdp_acked(struct bdp_estimator *est, struct bdp_sampler *sampler, size_t bytes, const struct timespec *now);
+
+/**
+ * Get the min round trip time.
+ *
+ * @param est the estimator
+ * @return microseconds or -1 if it is unknown
+ */
+long bdp_rtt(struct bdp_estimator *est);
+
+/**
+ * Get the delivered bandwidth.
+ *
+ * @param est the estimator
+ * @return bytes per second or 0 if it is unknown
+ */
+size_t bdp_bandwidth(struct bdp_estimator *est);
+
+/**
+ * Get how many bytes should be in flight to keep the connection busy: BDP_GAIN times the bandwidth-delay
+ * product.
+ *
+ * @param est the estimator
+ * @return the window or 0 if it is unknown
+ */
+size_t bdp_window(struct bdp_estimator *est);
+
+#endif //BDP_H
@@ -0,0 +1,86 @@
+/** @file
+ * Pool of memory chunks used by the netpipes' buffers. Chunks are grouped in size classes, powers of two
+ * from a page up, and a released chunk is kept for the next buffer of the same class instead of being
+ * unmapped. Chunks are pre-faulted when they are mapped, so a reused chunk costs neither a system call nor
+ * page faults. Chunks can also be backed by huge pages.
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+/** Default max number of released chunks kept for each size class */
+#define DEFAULT_BUFPOOL 8
+
+/** Size of a huge page. With huge pages, chunks are rounded up to it */
+#define BUFPOOL_HUGEPAGE_SIZE (2UL << 20)
+
+/**
+ * Set up the pool. Without this call the pool keeps DEFAULT_BUFPOOL chunks per class, uses normal pages and
+ * has no memory budget.
+ *
+ * @param maxfree max number of released chunks kept for each size class. 0 disables pooling
+ * @param hugepages 1 if chunks should be backed by huge pages, when the system has them
+ * @param budget max number of bytes that the buffers can have all together, see bufpool_charge(). 0 is unlimited
+ */
+void bufpool_init(size_t maxfree, int hugepages, size_t budget);
+
+/**
+ * Take a chunk of at least the given size from the pool, or map a new one if the pool has none.
+ * A mirrored chunk is mapped twice, back to back, so it is 2 * chunk_size bytes long (see cbuf_alloc_mirrored()).
+ *
+ * @param size minimum size, greater than zero
+ * @param mirrored 1 if the chunk should be mirrored
+ * @param chunk_size it will be set with the size of the chunk
+ * @return the chunk or NULL on error and it sets errno
+ */
+void *bufpool_alloc(size_t size, int mirrored, size_t *chunk_size);
+
+/**
+ * Give back the given chunk. It is kept for reuse, unless its size class already has enough free chunks.
+ *
+ * @param chunk the chunk
+ * @param chunk_size size of the chunk, as returned by bufpool_alloc()
+ * @param mirrored 1 if the chunk is mirrored
+ */
+void bufpool_free(void *chunk, size_t chunk_size, int mirrored);
+
+/**
+ * Map in advance free chunks for buffers of the given size, so the first buffers don't wait for it.
+ *
+ * @param size buffer size
+ * @param mirrored 1 if the chunks should be mirrored
+ * @param count how many chunks. It is limited to the max number of free chunks for each size class
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int bufpool_prefill(size_t size, int mirrored, size_t count);
+
+/**
+ * Charge the given number of bytes to the memory budget. Buffers should be charged with their capacity
+ * before they are allocated or grown.
+ *
+ * @param bytes how many bytes
+ * @param force 1 if the bytes should be charged even if the budget is exceeded
+ * @return 0 on success, -1 if the budget would be exceeded and sets errno to ENOMEM
+ */
+int bufpool_charge(size_t bytes, int force);
+
+/**
+ * Give back to the memory budget the given number of bytes, when a buffer is freed or shrunk.
+ *
+ * @param bytes how many bytes
+ */
+void bufpool_uncharge(size_t bytes);
+
+/**
+ * Get how many bytes are charged to the memory budget.
+ *
+ * @return how many bytes are charged
+ */
+size_t bufpool_charged(void);
+
+/** Unmap all the free chunks */
+void bufpool_destroy(void);
+
+#endif //BUFPOOL_H
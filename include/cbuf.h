@@ -2,8 +2,14 @@
 #define CBUF_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-/** Circular buffer data type */
+/**
+ * Circular buffer data type. One producer (cbuf_put(), cbuf_put_memcpy(), cbuf_readn()) and one consumer
+ * (cbuf_get(), cbuf_get_memcpy(), cbuf_writen(), cbuf_iov(), cbuf_iov_at(), cbuf_consume()) can use the buffer
+ * at the same time without any lock. Many producers, or many consumers, should be serialized by the caller.
+ */
 typedef struct cbuf_s cbuf_t;
 
 /**
@@ -14,6 +20,25 @@ typedef struct cbuf_s cbuf_t;
  */
 cbuf_t *cbuf_alloc(size_t capacity);
 
+/**
+ * Creates a new buffer whose memory is mapped twice, back to back, so the data and the free space are
+ * always contiguous: every operation is a single memcpy() or system call and cbuf_iov() sets only one
+ * element. The memory is rounded up to the page size.
+ *
+ * @param capacity how much data the buffer can have, greater than zero
+ * @return the created buffer, NULL on error and it sets errno (ENOSYS if memory can't be mirrored)
+ */
+cbuf_t *cbuf_alloc_mirrored(size_t capacity);
+
+/**
+ * Change the capacity of the given buffer. Data is kept. Nobody else should use the buffer meanwhile.
+ *
+ * @param cbuf the buffer
+ * @param capacity the new capacity, at least the current size of the buffer
+ * @return 0 on success, -1 on error and it sets errno (EINVAL if the data doesn't fit)
+ */
+int cbuf_resize(cbuf_t *cbuf, size_t capacity);
+
 /**
  * Destroys the given buffer. The buffer structure and the remaining data are freed.
  *
@@ -82,6 +107,40 @@ ssize_t cbuf_readn(int fd, cbuf_t *cbuf, size_t n);
  */
 ssize_t cbuf_writen(int fd, cbuf_t *cbuf, size_t n);
 
+/**
+ * Set the given vector of buffers with the memory areas where the first "n" bytes of the circular buffer are.
+ * Data is not removed from the buffer, see cbuf_consume(). At most two memory areas are needed, so the vector
+ * should have at least two elements. Only one is needed if the buffer is mirrored.
+ *
+ * @param cbuf the buffer
+ * @param iov vector of buffers
+ * @param n how many bytes
+ * @return how many elements of the vector were set
+ */
+int cbuf_iov(cbuf_t *cbuf, struct iovec *iov, size_t n);
+
+/**
+ * Same as cbuf_iov() but the memory areas are the ones of the "n" bytes which follow the first "skip" bytes of
+ * the circular buffer. The bytes skipped can be still in use, e.g. handed to another thread, until they are
+ * consumed.
+ *
+ * @param cbuf the buffer
+ * @param skip how many bytes at the beginning of the buffer are skipped
+ * @param iov vector of buffers
+ * @param n how many bytes
+ * @return how many elements of the vector were set
+ */
+int cbuf_iov_at(cbuf_t *cbuf, size_t skip, struct iovec *iov, size_t n);
+
+/**
+ * Remove "n" bytes from the buffer without copying them.
+ *
+ * @param cbuf the buffer
+ * @param n how many bytes should be removed
+ * @return how many bytes were removed
+ */
+size_t cbuf_consume(cbuf_t *cbuf, size_t n);
+
 /**
  * Check if the given buffer is full or not.
  *
@@ -3,14 +3,19 @@
 
 #include "./netpipe.h"
 
+#define DEFAULT_WORKERS 0 // messages are handled by the thread that reads them from the socket
+
 /**
- * Run dispatcher thread
+ * Run dispatcher thread. It waits for messages on the socket and gives the messages of each netpipe to one of the
+ * netpipefs_options.workers worker threads, so the messages of the same netpipe are handled in order. If there
+ * are no workers then the messages are handled by the dispatcher thread itself.
+ *
  * @return 0 on success, -1 on error
  */
 int netpipefs_dispatcher_run(void);
 
 /**
- * Stop dispatcher thread
+ * Stop dispatcher thread and its workers
  * @return 0 on success, -1 on error
  */
 int netpipefs_dispatcher_stop(void);
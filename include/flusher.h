@@ -0,0 +1,41 @@
+/** @file
+ * Flusher thread. It sends the data that was gathered into the netpipes' buffers when their deadline expires.
+ */
+
+#ifndef FLUSHER_H
+#define FLUSHER_H
+
+#include "./netpipe.h"
+
+/**
+ * Run flusher thread
+ * @return 0 on success, -1 on error
+ */
+int netpipefs_flusher_run(void);
+
+/**
+ * Stop flusher thread
+ * @return 0 on success, -1 on error
+ */
+int netpipefs_flusher_stop(void);
+
+/**
+ * Schedule the given netpipe to be flushed after "usec" microseconds. If the netpipe is already scheduled
+ * then the earliest deadline is kept. The netpipe should be locked by the caller.
+ *
+ * @param file the netpipe
+ * @param usec how many microseconds from now
+ * @return 0 on success, -1 on error and sets errno
+ */
+int netpipefs_flusher_schedule(struct netpipe *file, long usec);
+
+/**
+ * Remove the given netpipe from the scheduled ones. It is safe to call it even if the netpipe is not scheduled.
+ * When this function returns, the flusher is not working on the given netpipe.
+ *
+ * @param file the netpipe
+ * @return 0 on success, -1 on error and sets errno
+ */
+int netpipefs_flusher_cancel(struct netpipe *file);
+
+#endif //FLUSHER_H
@@ -2,11 +2,32 @@
 #define NETPIPE_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 #include "options.h"
 #include "cbuf.h"
+#include "bdp.h"
+#include "ratelimit.h"
 
 #define DEFAULT_READAHEAD 0
+#define DEFAULT_MAX_READAHEAD (16 << 20)
+
+/** Readahead buffers sized to the bandwidth-delay product have at least this capacity. Below it, the cost of
+ * the messages outweighs the memory saved */
+#define AUTOTUNE_MIN_READAHEAD (128 << 10)
 #define DEFAULT_WRITEAHEAD 0
+#define DEFAULT_COALESCE 0
+#define DEFAULT_COALESCE_DELAY 200
+#define DEFAULT_ACK_BYTES (64 << 10)
+#define DEFAULT_ACK_DELAY 200
+
+/** Credit for bytes read is given back at once when it reaches this fraction of the readahead buffer */
+#define ACK_WINDOW_FRACTION 4
+
+/** With a memory limit, readahead buffers start with this capacity, at most, and grow while they fill up */
+#define ELASTIC_MIN_READAHEAD (16 << 10)
+/** Readahead buffers grown above the initial capacity shrink back if they receive nothing for this time */
+#define ELASTIC_IDLE_USEC 1000000
 
 /** Print debug info about the given file */
 #define DEBUGFILE(file) \
@@ -16,11 +37,12 @@
             (file)->buffer == NULL ? 0:cbuf_size((file)->buffer),        \
             (file)->buffer == NULL ? 0:cbuf_capacity((file)->buffer));   \
         } else {        \
-            DEBUG("[%s] %d readers, %d writers, %ld/%ld local buffer, %ld/%ld remote bytes\n", \
+            DEBUG("[%s] %d readers, %d writers, %ld/%ld local buffer, %ld/%ld remote bytes, %ld/%ld B/s\n", \
             (file)->path, (file)->readers, (file)->writers,              \
             (file)->buffer == NULL ? 0:cbuf_size((file)->buffer),        \
             (file)->buffer == NULL ? 0:cbuf_capacity((file)->buffer),    \
-            (file)->remotesize, (file)->remotemax); \
+            (file)->remotesize, (file)->remotemax,                       \
+            (file)->limiter.current, (file)->ratelimit); \
         }               \
     } while(0)
 
@@ -28,18 +50,43 @@
 /** Structure for a file in netpipefs */
 struct netpipe {
     const char *path;
+    uint32_t handle;        // used by the remote host to refer to this netpipe
+    uint32_t remote_handle; // used to refer to the remote netpipe
+    size_t refs;    // one of the open files table, plus one for each lookup by handle. Accessed atomically
     int open_mode;  // netpipe was open locally with this mode
     int force_exit; // operations on the netpipe should immediately end
     int writers;    // number of writers
     int readers;    // number of readers
     cbuf_t *buffer; // circular buffer
+    size_t flushing;        // bytes at the start of the buffer given to the sender, consumed once they are written
+    size_t flush_done;      // bytes of flushing already written by the senders of a striped netpipe
     size_t remotemax;  // max number of bytes that can be sent
     size_t remotesize; // number of bytes sent
+    size_t remotewindow;    // capacity of the remote readahead buffer, the part of remotemax without read requests
+    size_t window;          // capacity of the readahead buffer given to the remote host
+    struct timespec last_recv;  // when data was put into the readahead buffer the last time
+    size_t requested_window;    // readahead buffer capacity last asked to the remote host
+    size_t unacked;         // bytes read whose credit is not given back yet. Accessed atomically
+    struct bdp_sampler sampler; // sends timed to measure the connection
+    int priority;           // class of the data sent, see priority.h. Accessed atomically
+    size_t weight;          // share of the connection within the class. Accessed atomically
+    size_t ratelimit;       // bytes per second that can be sent, 0 for no limit. Accessed atomically
+    size_t rateburst;       // bytes that can be sent at once under the rate limit. Accessed atomically
+    struct ratelimit limiter;   // token bucket of the rate limit, it also measures the rate of the data sent
+    struct netpipefs_socket *skt;   // connection with the remote host which carries the netpipe's messages
+    int striped;            // 1 if the data messages take turns on all the connections, with sequence numbers
+    size_t stripe_next;     // how many data messages were striped. Accessed atomically
     pthread_cond_t canopen; // wait for at least one reader and one writer
-    pthread_cond_t close;   // wait that the buffer is flushed before close
-    pthread_mutex_t mtx;    // netpipe lock
+    pthread_cond_t close;   // wait that the buffer is flushed and written before close
+    pthread_cond_t tokens;  // wait that the rate limit lets more data be sent. It uses CLOCK_MONOTONIC
+    pthread_mutex_t mtx;    // netpipe lock. It is not held while data is copied from the messages
+    pthread_mutex_t snd_mtx;    // taken before mtx by who sends data, so the data is sent in order
+    pthread_mutex_t rd_mtx;     // taken by who gets data from the buffer of a reading netpipe, also without mtx
     struct netpipe_req_l *req_l; // FIFO list of read or write requests
     struct poll_handle *poll_handles;
+    int flush_scheduled;                // 1 if the netpipe is waiting to be flushed by the flusher
+    struct timespec flush_deadline;     // when the flusher should flush the netpipe
+    struct netpipe *flush_next;         // next netpipe waiting to be flushed
 };
 
 /**
@@ -50,6 +97,15 @@ struct netpipe {
  */
 struct netpipe *netpipe_alloc(const char *path);
 
+/**
+ * Set the class, the weight, the rate limit and the burst of the data sent by the netpipe with the rules of its
+ * path, after they changed. The data already waiting to be sent moves to the new class. The writers waiting for
+ * the old rate limit are woken up.
+ *
+ * @param file the file
+ */
+void netpipe_apply_rules(struct netpipe *file);
+
 /**
  * Frees the memory allocated for the given file.
  *
@@ -59,6 +115,23 @@ struct netpipe *netpipe_alloc(const char *path);
  */
 int netpipe_free(struct netpipe *file, void (*poll_destroy)(void *));
 
+/**
+ * Take a reference to the given file, so it is not freed until the reference is released with netpipe_put().
+ * The file is allocated with one reference, which is the one of the open files table.
+ *
+ * @param file the file
+ */
+void netpipe_get(struct netpipe *file);
+
+/**
+ * Release a reference to the given file. The file is freed, as netpipe_free(), when there are no more references.
+ *
+ * @param file the file
+ * @param poll_destroy function used to free each poll handle
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int netpipe_put(struct netpipe *file, void (*poll_destroy)(void *));
+
 /**
  * Lock the given file
  *
@@ -92,16 +165,18 @@ int netpipe_open(struct netpipe *file, int mode, int nonblock);
  *
  * @param file the netpipe that was open remotely
  * @param mode open mode
+ * @param remote_handle handle of the remote netpipe
  * @return 0 on success, -1 on error
  */
-int netpipe_open_update(struct netpipe *file, int mode);
+int netpipe_open_update(struct netpipe *file, int mode, uint32_t remote_handle);
 
 /**
  * Send "size" bytes to the remote host. This function will block (if nonblock is 0) when the remote netpipe
  * is full, otherwise if nonblock is 1 then it doesn't block and returns data that was sent without
  * blocking. If it's not possible to send data then it sets errno to EAGAIN it returns -1.
  * If there are no readers than it immediately return how much data was already sent or it returns -1
- * and sets errno to EPIPE.
+ * and sets errno to EPIPE. A netpipe with a rate limit waits for its tokens, or if nonblock is 1 it sends
+ * what the tokens allow and sets errno to EAGAIN if they allow nothing.
  *
  * @param file pointer to the netpipe
  * @param buf data that should be sent
@@ -112,14 +187,15 @@ int netpipe_open_update(struct netpipe *file, int mode);
 ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int nonblock);
 
 /**
- * Receive data from remote host by reading from socket.
+ * Receive data from remote host. Data is moved to pending read requests and what is left is put into the buffer.
  *
  * @param file pointer to netpipe structure
- * @param size how many bytes can be read from socket
+ * @param data data received from socket
+ * @param size how many bytes were received
  * @param poll_notify pointer to a function that will be called to notify each registered poll handle
  * @return how much data was received or -1 on error
  */
-int netpipe_recv(struct netpipe *file, size_t size, void (*poll_notify)(void *)) ;
+int netpipe_recv(struct netpipe *file, const char *data, size_t size, void (*poll_notify)(void *));
 
 /**
  * Read "size" bytes from netpipe. Data read is put into the given buffer. If nonblock
@@ -156,6 +232,45 @@ int netpipe_read_update(struct netpipe *file, size_t size, void (*poll_notify)(v
  */
 int netpipe_read_request(struct netpipe *file, size_t size, void (*poll_notify)(void *));
 
+/**
+ * Notify the netpipe that the remote host changed the capacity of its readahead buffer.
+ *
+ * @param file pointer to netpipe structure
+ * @param size the new capacity
+ * @param poll_notify pointer to a function that will be called to notify each registered poll handle
+ * @return 0 on success, -1 on error
+ */
+int netpipe_window_update(struct netpipe *file, size_t size, void (*poll_notify)(void *));
+
+/**
+ * Handle the remote host's request to resize the readahead buffer to the given capacity. The capacity is
+ * bounded by the readahead and the max readahead, the new one is given to the remote host.
+ *
+ * @param file pointer to netpipe structure
+ * @param size the requested capacity
+ * @return 0 on success, -1 on error
+ */
+int netpipe_window_request(struct netpipe *file, size_t size);
+
+/**
+ * Get the capacity that the readahead buffers have when the netpipes are opened. It is the readahead,
+ * unless there is a memory limit: then the buffers start small.
+ *
+ * @return the initial capacity of the readahead buffers
+ */
+size_t netpipe_initial_readahead(void);
+
+/**
+ * Flush the data gathered into the netpipe's buffer. It is called by the flusher thread, with the netpipe
+ * already locked, when the netpipe's deadline expires. The data that the remote host can't take yet is sent
+ * when it gives more credit. For a netpipe open for reading, it gives back the credit gathered for the bytes
+ * read and it shrinks the readahead buffer if the netpipe is idle.
+ *
+ * @param file pointer to netpipe structure
+ * @return microseconds after which the netpipe should be flushed again or -1 if it is not needed
+ */
+long netpipe_flush_timeout(struct netpipe *file);
+
 /**
  * Do polling by setting the available events and registering a poll handle.
  *
@@ -2,33 +2,204 @@
 #define NETPIPEFS_SOCKET_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include "netpipe.h"
+#include "uring.h"
+#include "bdp.h"
+#include "priority.h"
+#include "replay.h"
+#include "shm.h"
+#include "transport.h"
 
 #define AF_UNIX_LABEL "AF_UNIX"
 #define AF_INET_LABEL "AF_INET"
 #define DEFAULT_PORT 7000
 #define DEFAULT_TIMEOUT 8000    // Massimo tempo, espresso in millisecondi, per avviare una connessione socket
-#define CONNECT_INTERVAL 500    // Ogni quanti millisecondi riprovare la connect se fallisce
+#define CONNECT_INTERVAL 64     // Max milliseconds between two tries of a refused connect
+#define RECV_BUFFER_SIZE 65536  // Initial size of the buffer used to receive messages
+#define URING_ENTRIES 8         // Submission entries of each io_uring ring
+#define DEFAULT_MAX_FRAME 65536 // Larger writes are split into WRITE messages of this many bytes
+#define DEFAULT_STRIPES 1       // Connections with the remote host
+#define MAX_STRIPES 16          // Max connections with the remote host
+#define DEFAULT_REPLAY 0        // Bytes of each connection kept until the remote host acknowledges them. 0 doesn't resume
+#define MIN_REPLAY (64L << 10)  // Min bytes of the replay window, see REPLAY_MAX_BATCH()
+#define MAX_REPLAY (1L << 30)   // Max bytes of the replay window
+
+/** Buffer where data received from socket is staged until it is parsed into messages */
+struct netpipefs_recv_buffer {
+    char *data;
+    size_t capacity;
+    size_t start;   // where the first message not yet parsed begins
+    size_t end;     // where the received data ends
+    size_t needed;  // how many bytes are needed, from start, to have a complete message
+    uint32_t credits_read;  // pairs of credit carried by the first message which were already returned
+};
+
+/** Credit for a remote netpipe waiting to be sent */
+struct netpipefs_credit {
+    uint32_t handle;
+    uint32_t size;
+};
+
+/**
+ * A message waiting to be sent by the sender thread. The header is copied into the frame, and so is the whole
+ * message if it is a control message. The data of a WRITE message is not: the frame points at it, and the sender
+ * calls sent once it is done with it, so who queued the message knows when that memory can be used again.
+ */
+struct netpipefs_frame {
+    struct netpipefs_frame *next;
+    size_t size;    // bytes of the message
+    size_t copied;  // bytes of the message copied into data, then come the memory areas of iov
+    int iovcnt;
+    struct iovec iov[2];
+    void (*sent)(void *arg, size_t bytes);  // called with the bytes of iov once they were written or discarded
+    void *arg;
+    char data[];
+};
+
+/** Data messages of one remote netpipe waiting to be sent, in order */
+struct netpipefs_flow {
+    struct netpipefs_flow *next;    // next flow of the same class to take its turn
+    uint32_t handle;
+    int priority;   // class of the netpipe
+    size_t weight;
+    size_t deficit; // bytes that can still be sent in this turn or in the following ones
+    int turn;       // 1 if the flow's turn began
+    struct netpipefs_frame *head;
+    struct netpipefs_frame *tail;
+};
 
 struct netpipefs_socket {
-    int fd;     // socket file descriptor
-    pthread_mutex_t wr_mtx; // protect write
+    int fd;     // socket file descriptor. With the loopback transport, a file descriptor readable when there is data
+    const struct netpipefs_transport *transport;    // how the connection reaches the remote host
+    void *transport_data;   // state of the transport, if it has any
+    pthread_mutex_t wr_mtx; // protect the send queue
+    pthread_cond_t wr_cond; // signaled when a frame is queued
+    struct netpipefs_frame *ctl_head;   // control messages waiting to be sent. They are sent before the data
+    struct netpipefs_frame *ctl_tail;
+    struct netpipefs_flow *snd_head[PRIORITY_CLASSES]; // flows with data messages waiting to be sent, by class
+    struct netpipefs_flow *snd_tail[PRIORITY_CLASSES];
+    int snd_error;  // errno of the send that failed. Then no more frames are queued
+    struct netpipefs_credit *credits;   // credit waiting to be sent, at most one for each handle. Protected by wr_mtx
+    size_t ncredits;
+    size_t credits_capacity;
     size_t remote_readahead;
+    struct bdp_estimator bdp;  // round trip time and bandwidth, measured by the writing netpipes
+    struct netpipefs_recv_buffer recv_buf; // used only by the dispatcher
+    struct netpipefs_uring *snd_ring; // if not NULL the sender thread sends through it
+    struct netpipefs_uring *rcv_ring; // if not NULL the dispatcher receives through it
+    size_t stripe;      // index of this connection among the connections with the remote host
+    size_t nstripes;    // how many connections there are with the remote host, 0 or 1 if this is the only one
+    struct netpipefs_socket **stripes;  // all the connections with the remote host, this one included
+    uint32_t snd_seq;   // sequence number of the next message of a striped netpipe. Only the first connection's one
+                        // is used, accessed atomically
+    struct netpipefs_shm *shm_tx;   // if not NULL the sender thread writes the messages into this ring
+    struct netpipefs_shm *shm_rx;   // if not NULL the dispatcher parses the messages in this ring, in place
+    size_t maxmessage;  // bytes that a message can take at most, header included, 0 for no limit other than
+                        // MESSAGE_MAX_LENGTH. A message must fit into the remote host's ring or into the replay window
+    uint64_t session;           // tells this session from the earlier ones when the connection is resumed
+    uint64_t remote_session;    // the remote host's session
+    size_t remote_replay;   // bytes that the remote host keeps until they are acknowledged. 0 if the session can't be resumed
+    struct replay replay;   // bytes sent and not yet acknowledged. Used only by the sender thread
+    uint64_t snd_acked;     // position of the first byte sent that the remote host didn't acknowledge. Protected by wr_mtx
+    uint64_t replay_from;   // position from which the sender sends again what was sent before the connection was lost
+    int replay_pending;     // 1 if the sender should send again from replay_from. Protected by wr_mtx
+    uint64_t ack_pos;       // position that the sender should acknowledge. Protected by wr_mtx
+    int ack_pending;        // 1 if the sender should send an ACK message. Protected by wr_mtx
+    int resuming;           // 1 while the connection is resumed. Then the sender doesn't send. Protected by wr_mtx
+    int snd_busy;           // 1 unless the sender waits on wr_cond. Protected by wr_mtx
+    unsigned int resumes;   // how many times the connection was resumed, or failed to be. Protected by wr_mtx
+    uint64_t rcv_pos;       // bytes of the messages received, but the ACK ones. Used only by the dispatcher
+    uint64_t rcv_acked;     // bytes received and acknowledged. Used only by the dispatcher
 };
 
-/** Header sent before each message */
+/** Type of message. It is the first field of the message header */
 enum netpipefs_header {
     OPEN = 100,
     CLOSE,
     READ,
     READ_REQUEST,
-    WRITE
+    WRITE,
+    WINDOW,
+    WINDOW_REQUEST,
+    ACK
 };
 
+/**
+ * Each message begins with a fixed size header. All the fields are sent in network byte order:
+ *  - type:     1 byte, see enum netpipefs_header
+ *  - flags:    1 byte, MESSAGE_FLAG_CREDITS, MESSAGE_FLAG_SEQUENCE or zero
+ *  - reserved: 2 bytes
+ *  - handle:   4 bytes, handle of the netpipe. The receiver's handle for every message but OPEN, which has
+ *              the sender's handle so that the receiver knows which handle it should use
+ *  - arg:      4 bytes, mode for OPEN and CLOSE, how many bytes for READ and READ_REQUEST, the readahead
+ *              buffer capacity for WINDOW and WINDOW_REQUEST, the low 32 bits of a position for ACK
+ *  - length:   4 bytes, how many bytes follow the header: the path for OPEN, the data for WRITE
+ *
+ * A WRITE message with MESSAGE_FLAG_CREDITS carries credit for other netpipes before its data: a 4 bytes count,
+ * then count pairs of 4 bytes handle and 4 bytes credit. The length includes them. Each pair is handled as a
+ * READ message received before the WRITE message, so the credit doesn't need messages of its own when data
+ * is sent the same way.
+ *
+ * The WRITE messages and the writer's CLOSE message of a striped netpipe have MESSAGE_FLAG_SEQUENCE: a 4 bytes
+ * sequence number follows the header and the length includes it. They are spread over all the connections with
+ * the remote host, which handles them by sequence number, so they are handled in the order they were sent.
+ *
+ * When the session can be resumed, see resume_socket_connection(), the bytes of the messages sent on each connection
+ * are numbered by their position. The remote host acknowledges them with ACK messages, which are not numbered
+ * themselves, so the sender can drop them from its replay window.
+ */
+#define MESSAGE_HEADER_SIZE 16
+
+/** Flag of a WRITE message which carries credit for other netpipes */
+#define MESSAGE_FLAG_CREDITS 0x01
+
+/** Flag of a message of a striped netpipe, which carries a sequence number */
+#define MESSAGE_FLAG_SEQUENCE 0x02
 
+/** Bytes of the sequence number of a message with MESSAGE_FLAG_SEQUENCE */
+#define MESSAGE_SEQUENCE_SIZE 4
+
+/** Bytes of credit carried by a WRITE message: the count and the pairs of handle and credit */
+#define MESSAGE_CREDITS_SIZE(count) (4 + (count) * 8)
+
+/** Max number of bytes that follow the header of a message. A message which declares more is not valid */
+#define MESSAGE_MAX_LENGTH (64 << 20)
+
+/** Message received from socket. Path and data point into the socket's receive buffer */
+struct netpipefs_message {
+    enum netpipefs_header header;
+    uint32_t handle;
+    const char *path;   // OPEN path
+    int mode;           // OPEN and CLOSE mode
+    size_t size;        // WRITE, READ, READ_REQUEST, WINDOW and WINDOW_REQUEST size. ACK position, low 32 bits
+    const char *data;   // WRITE data
+    int sequenced;      // 1 if the message has a sequence number
+    uint32_t seq;       // sequence number of a message of a striped netpipe
+};
+
+
+
+/** Transport over TCP, used when the remote host is given by its ipv4 address */
+extern const struct netpipefs_transport netpipefs_tcp_transport;
+
+/** Transport over AF_UNIX sockets, used when the remote host is localhost */
+extern const struct netpipefs_transport netpipefs_unix_transport;
+
+/** Transport over UDP with selective acknowledgements, see rudp.h. Used with an ipv4 remote host if both hosts want it */
+extern const struct netpipefs_transport netpipefs_udp_transport;
+
+/** Transport between two connections of the same process, see loopback_transport_pair() */
+extern const struct netpipefs_transport netpipefs_loopback_transport;
 
 /**
- * Establish a socket connection with a maximum time expressed my the given timeout value.
+ * Establish a socket connection with a maximum time expressed my the given timeout value. The host with the greater
+ * port connects and the other one accepts, then they exchange their settings in one round trip. The connection uses
+ * its transport if it already has one, otherwise the AF_UNIX one if the remote host is localhost and the TCP one
+ * if it isn't, or the UDP one with netpipefs_options.udp. The UDP transport is set up over TCP and it falls back to
+ * TCP if the remote host doesn't want it. When both hosts are on
+ * the same machine the messages go through two shared memory rings, one for each direction, unless one of the hosts
+ * disables them with netpipefs_options.shm. Then the socket is used only to know when the remote host is gone.
  *
  * @param netpipefs_socket socket structure
  * @param timeout maximum time allowed to establish the connection. Expressed in milliseconds.
@@ -38,7 +209,7 @@ enum netpipefs_header {
 int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long timeout);
 
 /**
- * Closes socket connection.
+ * Closes socket connection, together with the other connections with the remote host, through their transport.
  *
  * @param netpipefs_socket socket structure
  *
@@ -47,80 +218,292 @@ int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long
 int end_socket_connection(struct netpipefs_socket *netpipefs_socket);
 
 /**
- * Read from socket the header and sets the header pointer and the path pointer
+ * Returns 1 if the session with the remote host can be resumed after the connection is lost: both hosts keep a
+ * replay window, see netpipefs_options.replay, and the messages go through sockets.
+ *
+ * @param skt the connection
+ * @return 1 if the session can be resumed, 0 otherwise
+ */
+int socket_resumable(const struct netpipefs_socket *skt);
+
+/**
+ * Resume the session after one of the connections with the remote host was lost. The senders stop and the old
+ * connections are shut down, then the hosts connect again as establish_socket_connection() does and tell each other
+ * how many bytes they received on each connection. The senders send again what the remote host didn't receive and
+ * carry on, so the netpipes stay open and their readers and writers keep waiting meanwhile. The new connections take
+ * the place of the old ones. Must be called by the dispatcher, which is the only one that reads the connections.
+ *
+ * @param skt the first connection
+ * @param timeout maximum time allowed to connect again, in milliseconds
+ * @return 0 on success, -1 on error and sets errno. On error the senders fail from then on with ECONNRESET
+ */
+int resume_socket_connection(struct netpipefs_socket *skt, long timeout);
+
+/**
+ * Returns how many connections there are with the remote host.
+ *
+ * @param skt the first connection
+ * @return the number of connections, at least 1
+ */
+size_t socket_stripes(const struct netpipefs_socket *skt);
+
+/**
+ * Get one of the connections with the remote host.
+ *
+ * @param skt the first connection
+ * @param index index of the connection, less than socket_stripes()
+ * @return the connection
+ */
+struct netpipefs_socket *socket_stripe_at(struct netpipefs_socket *skt, size_t index);
+
+/**
+ * Get the connection that carries the messages of a netpipe. The netpipes are spread over the connections by
+ * the hash of their path, so the messages of a netpipe keep their order.
+ *
+ * @param skt the first connection
+ * @param path path of the netpipe
+ * @return the connection
+ */
+struct netpipefs_socket *socket_stripe(struct netpipefs_socket *skt, const char *path);
+
+/**
+ * Returns 1 if the data of the netpipe with the given path is striped: its data messages take turns on all the
+ * connections with the remote host, see MESSAGE_FLAG_SEQUENCE. The netpipes whose path matches one of the shell
+ * patterns of netpipefs_options.stripepaths are striped when there are many connections.
+ *
+ * @param skt the first connection
+ * @param path path of the netpipe
+ * @return 1 if it is striped, 0 otherwise
+ */
+int socket_striped(const struct netpipefs_socket *skt, const char *path);
+
+/**
+ * Create the io_uring rings used to send and to receive. The receive buffer is allocated and registered
+ * to the receiving ring. If io_uring is not available then the socket keeps using blocking system calls.
+ *
+ * @param skt netpipefs socket structure
+ * @return 0 on success, -1 on error and sets errno (ENOSYS if the kernel doesn't support io_uring)
+ */
+int init_socket_uring(struct netpipefs_socket *skt);
+
+/**
+ * Destroy the io_uring rings, if any. Then the socket uses blocking system calls.
+ *
+ * @param skt netpipefs socket structure
+ */
+void free_socket_uring(struct netpipefs_socket *skt);
+
+/**
+ * Read from socket as much data as is available and stage it into the socket's receive buffer. The messages
+ * got by read_socket_message() before calling this function are no longer valid. With a shared memory ring the
+ * room of those messages is given back to the remote host and the receive buffer is set to the data in the ring.
  *
  * @param skt netpipefs socket structure
- * @param header pointer to a header structure
- * @param path file path read
  * @return > 0 on success, 0 if the socket was closed, -1 on error
  */
-int read_socket_header(struct netpipefs_socket *skt, enum netpipefs_header *header, char **path);
+int recv_socket_data(struct netpipefs_socket *skt);
+
+/**
+ * Queue into the receiving ring a read of as much data as fits into the socket's receive buffer. The read is
+ * submitted with the next uring_submit_and_wait() and it is completed by calling complete_socket_recv().
+ *
+ * @param skt netpipefs socket structure
+ * @param user_data used to recognize the completion of the read
+ * @return 0 on success, -1 on error
+ */
+int prep_socket_recv(struct netpipefs_socket *skt, uint64_t user_data);
+
+/**
+ * Stage the data read by the read queued with prep_socket_recv(). The messages got by read_socket_message()
+ * before calling this function are no longer valid.
+ *
+ * @param skt netpipefs socket structure
+ * @param res result of the read
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+int complete_socket_recv(struct netpipefs_socket *skt, int res);
+
+/**
+ * Parse the next complete message from the socket's receive buffer. Path and data are not copied, they point
+ * into the receive buffer and they are valid until the next call of recv_socket_data().
+ *
+ * @param skt netpipefs socket structure
+ * @param message it will be set with the message
+ * @return 1 if a message was parsed, 0 if there isn't a complete message, -1 on error and sets errno. If the
+ * message is longer than MESSAGE_MAX_LENGTH it sets errno to EPROTO
+ */
+int read_socket_message(struct netpipefs_socket *skt, struct netpipefs_message *message);
+
+/**
+ * Handle an ACK message: the remote host received the bytes sent up to its position, so the sender can drop them.
+ *
+ * @param skt the connection where the message was received
+ * @param message the message
+ * @return 1 on success, -1 on error
+ */
+int handle_ack_message(struct netpipefs_socket *skt, const struct netpipefs_message *message);
+
+/**
+ * Acknowledge the bytes received on the connection, if the remote host keeps at least 1 / REPLAY_ACK_FRACTION of
+ * its replay window for the ones not yet acknowledged. The ACK message is sent by the sender thread. Used only by
+ * the dispatcher.
+ *
+ * @param skt the connection
+ * @return 1 on success, -1 on error
+ */
+int send_ack_message(struct netpipefs_socket *skt);
+
+/**
+ * Write an ACK message.
+ *
+ * @param dest buffer of at least MESSAGE_HEADER_SIZE bytes
+ * @param position position of the first byte not yet received
+ */
+void pack_ack_message(unsigned char *dest, uint64_t position);
+
+/**
+ * Free the socket's receive buffer
+ *
+ * @param skt netpipefs socket structure
+ */
+void free_socket_recv_buffer(struct netpipefs_socket *skt);
 
 /**
  * Send OPEN message
  *
  * @param skt netpipefs socket structure
  * @param path file path
+ * @param handle local handle of the file. The remote host will use it for the next messages
  * @param mode open mode
  *
  * @return > 0 on success, 0 if the socket was closed, -1 on error
  */
-int send_open_message(struct netpipefs_socket *skt, const char *path, int mode);
+int send_open_message(struct netpipefs_socket *skt, const char *path, uint32_t handle, int mode);
+
+/**
+ * Move the data messages of the netpipe waiting to be sent into its class and give them its weight, after they
+ * changed. The messages keep their order. It is done on every connection, since those of a striped netpipe are
+ * spread over them.
+ *
+ * @param skt the netpipe's connection
+ * @param file the netpipe
+ * @return 0 on success, -1 on error
+ */
+int update_socket_flow(struct netpipefs_socket *skt, const struct netpipe *file);
 
 /**
- * Send CLOSE message
+ * Send CLOSE message. The writer's CLOSE is sent after its data, with the netpipe's priority.
  *
  * @param skt netpipefs socket structure
- * @param path file path
+ * @param file the file
  * @param mode close mode
  *
  * @return > 0 on success, 0 if the socket was closed, -1 on error
  */
-int send_close_message(struct netpipefs_socket *skt, const char *path, int mode);
+int send_close_message(struct netpipefs_socket *skt, struct netpipe *file, int mode);
 
 /**
- * Send WRITE message and data
+ * Send WRITE message and data with the netpipe's priority. Data larger than netpipefs_options.maxframe, or than
+ * the connection's maxmessage allows, is split into many WRITE messages. If the netpipe is striped they take turns
+ * on all the connections. The data is not copied: the sender writes it from buf, so buf should be kept until
+ * the sender is done with it.
  *
- * @param skt netpipefs socket structure
- * @param path file path
+ * @param skt the netpipe's connection
+ * @param file the file
  * @param buf data
  * @param size how much data should be sent
+ * @param sent if not NULL it is called by the sender, for each message, with arg and the bytes of buf that the
+ * message had once they were written or discarded
+ * @param arg given to sent
  *
- * @return > 0 on success, 0 if the socket was closed, -1 on error
+ * @return how much data was queued, which is less than size only if a message couldn't be queued, 0 if the socket
+ * was closed, -1 on error
  */
-int send_write_message(struct netpipefs_socket *skt, const char *path, const char *buf, size_t size);
+ssize_t send_write_message(struct netpipefs_socket *skt, struct netpipe *file, const char *buf, size_t size,
+                           void (*sent)(void *, size_t), void *arg);
 
 /**
- * Send WRITE message like the function send_write_message() but get data from file buffer
+ * Send WRITE message like the function send_write_message() but get data from file buffer. It is split in the
+ * same way. The data is not removed from the buffer: the sender writes it from there, and the caller should
+ * remove it once sent is called.
  *
  * @param skt netpipefs socket structure
  * @param file the file
+ * @param offset how many bytes at the beginning of the buffer are skipped, because they were already queued
  * @param size how much data should be sent
+ * @param sent called by the sender, as by send_write_message()
+ * @param arg given to sent
  *
- * @return > 0 on success, 0 if the socket was closed, -1 on error
+ * @return how much data was queued, as send_write_message(), 0 if the socket was closed, -1 on error
  */
-int send_flush_message(struct netpipefs_socket *skt, struct netpipe *file, size_t size);
+ssize_t send_flush_message(struct netpipefs_socket *skt, struct netpipe *file, size_t offset, size_t size,
+                           void (*sent)(void *, size_t), void *arg);
 
 /**
- * Send READ message
+ * Give credit to a remote netpipe. It is not sent at once: the sender thread puts it into the first WRITE
+ * message that it sends, or it sends a READ message if there is no data to send. Credit for the same
+ * netpipe is summed.
  *
  * @param skt netpipefs socket structure
- * @param path file path
+ * @param handle remote handle of the file
  * @param size how much data was read
  *
  * @return > 0 on success, 0 if the socket was closed, -1 on error
  */
-int send_read_message(struct netpipefs_socket *skt, const char *path, size_t size);
+int send_read_message(struct netpipefs_socket *skt, uint32_t handle, size_t size);
+
+/**
+ * Put the given credit into a queued WRITE message, so it is sent together with the message's data.
+ *
+ * @param dest buffer of at least MESSAGE_HEADER_SIZE + MESSAGE_CREDITS_SIZE(count) bytes. It is set with the
+ * new header of the message followed by the credit: the message's data should be sent after it
+ * @param message the queued message, which begins with its header
+ * @param credits the credit
+ * @param count how many credits there are
+ * @return 0 on success, -1 if the message can't carry the credit and sets errno
+ */
+int pack_write_credits(unsigned char *dest, const char *message, const struct netpipefs_credit *credits, size_t count);
+
+/**
+ * Put the given credit into READ messages.
+ *
+ * @param dest buffer of at least count * MESSAGE_HEADER_SIZE bytes
+ * @param credits the credit
+ * @param count how many credits there are
+ */
+void pack_read_credits(unsigned char *dest, const struct netpipefs_credit *credits, size_t count);
 
 /**
  * Send READ_REQUEST message
  *
  * @param skt netpipefs socket structure
- * @param path file path
+ * @param handle remote handle of the file
  * @param size how much data can be read
  *
  * @return > 0 on success, 0 if the socket was closed, -1 on error
  */
-int send_read_request_message(struct netpipefs_socket *skt, const char *path, size_t size);
+int send_read_request_message(struct netpipefs_socket *skt, uint32_t handle, size_t size);
+
+/**
+ * Send WINDOW message
+ *
+ * @param skt netpipefs socket structure
+ * @param handle remote handle of the file
+ * @param size capacity of the readahead buffer. The remote host can send this much data without read requests
+ *
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+int send_window_message(struct netpipefs_socket *skt, uint32_t handle, size_t size);
+
+/**
+ * Send WINDOW_REQUEST message
+ *
+ * @param skt netpipefs socket structure
+ * @param handle remote handle of the file
+ * @param size capacity that the remote readahead buffer should have to keep the connection busy
+ *
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+int send_window_request_message(struct netpipefs_socket *skt, uint32_t handle, size_t size);
 
 #endif //NETPIPEFS_SOCKET_H
@@ -1,6 +1,7 @@
 #ifndef OPENFILES_H
 #define OPENFILES_H
 
+#include <stdint.h>
 #include "netpipe.h"
 
 /**
@@ -27,7 +28,30 @@ int netpipefs_open_files_table_destroy(void);
 struct netpipe *netpipefs_get_open_file(const char *path);
 
 /**
- * Removes the file with key path from the open file table. The file structure is also freed.
+ * Returns the file structure which has the given handle or NULL if it doesn't exist. It doesn't lock the table.
+ * The file is returned with a new reference, so it is not freed even if it is closed meanwhile: the caller should
+ * release it with netpipe_put().
+ *
+ * @param handle file's handle
+ *
+ * @return the file structure or NULL if it doesn't exist and sets errno to ENOENT
+ */
+struct netpipe *netpipefs_get_open_file_by_handle(uint32_t handle);
+
+/**
+ * Call the given function on the open file with the given path, if there is one. The table is locked meanwhile,
+ * so the file can't be freed.
+ *
+ * @param path file's path
+ * @param update the function, e.g. netpipe_apply_rules()
+ *
+ * @return 1 if the file is open, 0 if it isn't, -1 on error
+ */
+int netpipefs_update_open_file(const char *path, void (*update)(struct netpipe *));
+
+/**
+ * Removes the file with key path from the open file table. The file structure is not freed: the reference of the
+ * table should be released with netpipe_put().
  *
  * @param path file's path
  *
@@ -36,11 +60,12 @@ struct netpipe *netpipefs_get_open_file(const char *path);
 int netpipefs_remove_open_file(const char *path);
 
 /**
- * Returns the file structure for the given path or NULL if it doesn't exist
+ * Returns the file structure for the given path. If it doesn't exist then it is created and it gets a new handle.
  *
  * @param path file's path
+ * @param just_created it will be set to 1 if the file was created
  *
- * @return the file structure or NULL if it doesn't exist
+ * @return the file structure or NULL on error
  */
 struct netpipe *netpipefs_get_or_create_open_file(const char *path, int *just_created);
 
@@ -22,6 +22,26 @@ struct netpipefs_options {
     int delayconnect;
     size_t writeahead;
     size_t readahead;
+    size_t maxreadahead;    // readahead buffers are sized to the bandwidth-delay product up to this
+    size_t coalesce;    // writes smaller than this are gathered and sent together
+    long coalescedelay; // max microseconds that gathered writes can wait before they are sent
+    size_t ackbytes;    // credit for bytes read is gathered up to this before it is given back
+    long ackdelay;      // max microseconds that gathered credit can wait before it is given back
+    size_t workers;     // threads that handle the received messages
+    size_t maxframe;    // max data bytes of a WRITE message. Larger sends are split. 0 doesn't split them
+    char *priority;     // rules which give class and weight to the netpipes, see priority_add_rules()
+    char *ratelimit;    // rules which give rate limit and burst to the netpipes, see ratelimit_add_rules()
+    size_t stripes;     // connections with the remote host. The netpipes are spread over them
+    char *stripepaths;  // shell patterns of the netpipes whose data is striped over all the connections
+    char *stripelocal;  // local addresses which the connections after the first one are opened from, in turn
+    char *striperemote; // remote addresses which the connections after the first one are opened to, in turn
+    int iouring;        // use io_uring for socket I/O, if the kernel supports it
+    size_t bufpool;     // released buffers kept for reuse for each buffer size
+    int hugepages;      // back the buffers with huge pages, if the system has them
+    size_t memlimit;    // max bytes for all the netpipes' buffers. If not 0 the readahead buffers are elastic
+    int shm;            // use shared memory rings with a remote host on the same machine
+    int udp;            // carry the messages over UDP with an ipv4 remote host, see rudp.h
+    size_t replay;      // bytes sent on each connection kept until acknowledged, to resume the session. 0 doesn't
     /*int intr;
     int intr_signal;*/
 };
@@ -0,0 +1,83 @@
+/** @file
+ * Tables of rules which give a value to the netpipes by their path. Each rule has a pattern, and how the pattern
+ * matches a path is up to the table: among the rules whose pattern matches, the best match wins and the first
+ * one added on a tie. The rules set for a single path come before the others. The table doesn't know what the
+ * values are, it keeps a copy of them.
+ */
+
+#ifndef PATHRULES_H
+#define PATHRULES_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/** Value of the paths which match the pattern, or of a single path if exact is 1 */
+struct pathrule {
+    char *pattern;
+    int exact;
+    void *value;
+};
+
+/** Table of rules. It is locked by its functions, so it can be shared by many threads */
+struct pathrules {
+    struct pathrule *rules;
+    size_t nrules;
+    size_t capacity;
+    size_t value_size;  // bytes of a value
+    int (*parse)(const char *str, size_t len, void *value);     // parse a value, returns -1 and sets errno if invalid
+    long (*match)(const char *pattern, const char *path);       // how well the pattern matches, -1 if it doesn't
+    pthread_mutex_t mtx;
+};
+
+/** Initializer of an empty table with the given size of the values, parse function and match function */
+#define PATHRULES_INITIALIZER(value_size, parse, match) \
+    { NULL, 0, 0, (value_size), (parse), (match), PTHREAD_MUTEX_INITIALIZER }
+
+/**
+ * Add the rules of a comma separated list, where each rule is "PATTERN=VALUE". The value is what follows the
+ * last '=' and it is given to the parse function of the table. The rules come after the rules already added.
+ *
+ * @param t the table
+ * @param list the list of rules
+ * @return 0 on success, -1 on error and sets errno. If a rule is not valid it sets errno to EINVAL and no rule
+ * is added
+ */
+int pathrules_add(struct pathrules *t, const char *list);
+
+/**
+ * Set the value of the given path. It replaces what was set before for the same path.
+ *
+ * @param t the table
+ * @param path the path
+ * @param value the value, it is copied
+ * @return 0 on success, -1 on error and sets errno
+ */
+int pathrules_set(struct pathrules *t, const char *path, const void *value);
+
+/**
+ * Remove what was set with pathrules_set() for the given path, then the path follows the patterns again.
+ *
+ * @param t the table
+ * @param path the path
+ * @return 0 on success, -1 if nothing was set for the path and sets errno to ENOENT
+ */
+int pathrules_unset(struct pathrules *t, const char *path);
+
+/**
+ * Get the value of the given path.
+ *
+ * @param t the table
+ * @param path the path
+ * @param value it will be set with the value, it is left untouched if no rule matches
+ * @return 1 if a rule matches, 0 if none does
+ */
+int pathrules_lookup(struct pathrules *t, const char *path, void *value);
+
+/**
+ * Remove all the rules.
+ *
+ * @param t the table
+ */
+void pathrules_free(struct pathrules *t);
+
+#endif //PATHRULES_H
@@ -0,0 +1,71 @@
+/** @file
+ * Priority of the data that the netpipes send. Each netpipe has a class and a weight: the data of a class is
+ * always sent before the data of the lower classes, while the netpipes of the same class share the connection in
+ * proportion to their weight. They are given by the first rule whose pattern matches the netpipe's path. The
+ * rules set for a single path, with the PRIORITY_XATTR extended attribute, come before the others.
+ */
+
+#ifndef PRIORITY_H
+#define PRIORITY_H
+
+#include <stddef.h>
+
+#define PRIORITY_CLASSES 8      // classes go from 0, the highest, to PRIORITY_CLASSES - 1
+#define DEFAULT_PRIORITY 4      // class of the netpipes which match no rule
+#define DEFAULT_WEIGHT 1        // weight of the netpipes which match no rule or whose rule has no weight
+#define MAX_WEIGHT 1000
+#define PRIORITY_XATTR "user.netpipefs.priority"   // extended attribute with the class and weight of a netpipe
+
+/**
+ * Parse a class with an optional weight: "CLASS" or "CLASS:WEIGHT".
+ *
+ * @param value the string, not necessarily NUL terminated
+ * @param len length of the string
+ * @param priority it will be set with the class
+ * @param weight it will be set with the weight, DEFAULT_WEIGHT if it is missing
+ * @return 0 on success, -1 if the string is not valid and sets errno to EINVAL
+ */
+int priority_parse(const char *value, size_t len, int *priority, size_t *weight);
+
+/**
+ * Add the rules of a comma separated list, where each rule is "PATTERN=CLASS" or "PATTERN=CLASS:WEIGHT". The
+ * pattern is a shell wildcard pattern, see fnmatch(3). The rules are checked in the given order, after the
+ * rules already added.
+ *
+ * @param rules the list of rules
+ * @return 0 on success, -1 on error and sets errno. If a rule is not valid it sets errno to EINVAL and no rule
+ * is added
+ */
+int priority_add_rules(const char *rules);
+
+/**
+ * Set the class and the weight of the given path. It replaces what was set before for the same path.
+ *
+ * @param path the path
+ * @param priority the class
+ * @param weight the weight
+ * @return 0 on success, -1 on error and sets errno
+ */
+int priority_set(const char *path, int priority, size_t weight);
+
+/**
+ * Remove what was set with priority_set() for the given path, then the path follows the patterns again.
+ *
+ * @param path the path
+ * @return 0 on success, -1 if nothing was set for the path and sets errno to ENOENT
+ */
+int priority_unset(const char *path);
+
+/**
+ * Get the class and the weight of the given path.
+ *
+ * @param path the path
+ * @param priority it will be set with the class
+ * @param weight it will be set with the weight
+ */
+void priority_lookup(const char *path, int *priority, size_t *weight);
+
+/** Remove all the rules */
+void priority_free(void);
+
+#endif //PRIORITY_H
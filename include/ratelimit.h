@@ -0,0 +1,130 @@
+/** @file
+ * Rate limits of the data that the netpipes send. A netpipe with a rate limit has a token bucket, filled with
+ * the rate limit in bytes per second up to the burst: a write takes tokens for its bytes and it waits while the
+ * bucket is empty. The rate limit and the burst of a netpipe are given by the longest rule whose path prefix
+ * contains the netpipe's path. The rules set for a single path, with the RATELIMIT_XATTR extended attribute, come
+ * before the others.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define DEFAULT_RATELIMIT 0             // rate limit of the netpipes which match no rule, 0 for no limit
+#define RATELIMIT_BURST_FRACTION 10     // without a burst, a netpipe can send the data of 1/10 of a second at once
+#define RATELIMIT_XATTR "user.netpipefs.ratelimit"  // extended attribute with the rate limit and burst of a netpipe
+
+/** Token bucket of a netpipe, with the measure of the rate of the data that went through it */
+struct ratelimit {
+    double tokens;                  // bytes that can be sent now
+    struct timespec last;           // when the tokens were updated the last time, zero if never
+    size_t window_bytes;            // bytes taken since window_start
+    struct timespec window_start;   // start of the current measure
+    size_t current;                 // bytes per second taken in the last measure
+};
+
+/**
+ * Parse a rate limit with an optional burst: "RATE" or "RATE:BURST". Both are in bytes and can end with one of
+ * the suffixes K, M or G for 2^10, 2^20 and 2^30. A rate of 0 means no limit.
+ *
+ * @param value the string, not necessarily NUL terminated
+ * @param len length of the string
+ * @param rate it will be set with the rate limit in bytes per second
+ * @param burst it will be set with the burst, or with 1/RATELIMIT_BURST_FRACTION of the rate if it is missing
+ * @return 0 on success, -1 if the string is not valid and sets errno to EINVAL
+ */
+int ratelimit_parse(const char *value, size_t len, size_t *rate, size_t *burst);
+
+/**
+ * Add the rules of a comma separated list, where each rule is "PREFIX=RATE" or "PREFIX=RATE:BURST". A rule
+ * applies to the prefix itself and to the paths under it: "/logs" contains "/logs" and "/logs/app", but not
+ * "/logsapp". The longest prefix which contains a path gives its rate limit.
+ *
+ * @param rules the list of rules
+ * @return 0 on success, -1 on error and sets errno. If a rule is not valid it sets errno to EINVAL and no rule
+ * is added
+ */
+int ratelimit_add_rules(const char *rules);
+
+/**
+ * Set the rate limit and the burst of the given path. It replaces what was set before for the same path.
+ *
+ * @param path the path
+ * @param rate the rate limit, 0 for no limit
+ * @param burst the burst
+ * @return 0 on success, -1 on error and sets errno
+ */
+int ratelimit_set(const char *path, size_t rate, size_t burst);
+
+/**
+ * Remove what was set with ratelimit_set() for the given path, then the path follows the prefixes again.
+ *
+ * @param path the path
+ * @return 0 on success, -1 if nothing was set for the path and sets errno to ENOENT
+ */
+int ratelimit_unset(const char *path);
+
+/**
+ * Get the rate limit and the burst of the given path.
+ *
+ * @param path the path
+ * @param rate it will be set with the rate limit, 0 for no limit
+ * @param burst it will be set with the burst
+ */
+void ratelimit_lookup(const char *path, size_t *rate, size_t *burst);
+
+/** Remove all the rules */
+void ratelimit_free(void);
+
+/**
+ * Initialize a token bucket. It is full the first time it is used.
+ *
+ * @param rl the token bucket
+ */
+void ratelimit_init(struct ratelimit *rl);
+
+/**
+ * Take the tokens for at most size bytes. If the bucket holds less tokens than the bytes, it gives what it has.
+ *
+ * @param rl the token bucket
+ * @param rate the rate limit, 0 for no limit
+ * @param burst the burst
+ * @param size bytes to be sent
+ * @param now current time from CLOCK_MONOTONIC
+ * @return how many bytes can be sent now, 0 if they should wait
+ */
+size_t ratelimit_take(struct ratelimit *rl, size_t rate, size_t burst, size_t size, const struct timespec *now);
+
+/**
+ * Returns how long to wait before the bucket has the tokens for the given bytes, or for a full burst if the
+ * bytes are more.
+ *
+ * @param rl the token bucket
+ * @param rate the rate limit, 0 for no limit
+ * @param burst the burst
+ * @param size bytes to be sent
+ * @return the microseconds to wait, 0 if the tokens are there
+ */
+long ratelimit_delay(struct ratelimit *rl, size_t rate, size_t burst, size_t size);
+
+/**
+ * Give back the tokens taken for bytes that were not sent.
+ *
+ * @param rl the token bucket
+ * @param burst the burst
+ * @param bytes the bytes not sent
+ */
+void ratelimit_refund(struct ratelimit *rl, size_t burst, size_t bytes);
+
+/**
+ * Returns the rate of the data that went through the bucket, measured over the last second.
+ *
+ * @param rl the token bucket
+ * @param now current time from CLOCK_MONOTONIC
+ * @return bytes per second
+ */
+size_t ratelimit_current(const struct ratelimit *rl, const struct timespec *now);
+
+#endif //RATELIMIT_H
@@ -0,0 +1,87 @@
+/** @file
+ * Bytes sent on a connection and not yet acknowledged by the remote host. If the connection is lost they are
+ * sent again on the new one, from the first byte that the remote host didn't receive, so the messages carry on
+ * as if nothing happened. Bytes are numbered by their position in everything sent on the connection.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/** Bytes allocated for the ring at first. It grows to keep the bytes not yet acknowledged, at most a window */
+#define REPLAY_MIN_SIZE (64 << 10)
+
+/** The remote host acknowledges the bytes received once this fraction of the window is not acknowledged */
+#define REPLAY_ACK_FRACTION 4
+
+/**
+ * Bytes that can be sent at once with the given window. Fewer than 1 / REPLAY_ACK_FRACTION of the window may never
+ * be acknowledged, so what is sent after them must fit into the rest
+ */
+#define REPLAY_MAX_BATCH(window) ((window) - (window) / REPLAY_ACK_FRACTION)
+
+/** Ring of the bytes sent. It is used by a single thread */
+struct replay {
+    char *data;
+    size_t size;        // bytes allocated
+    uint64_t start;     // position of the first byte kept
+    uint64_t end;       // position after the last byte sent
+};
+
+/**
+ * Initialize an empty ring. Nothing is allocated until bytes are kept.
+ *
+ * @param r the ring
+ */
+void replay_init(struct replay *r);
+
+/**
+ * Free the ring.
+ *
+ * @param r the ring
+ */
+void replay_free(struct replay *r);
+
+/**
+ * Returns how many bytes are kept.
+ *
+ * @param r the ring
+ * @return bytes from the first one not yet acknowledged to the last one sent
+ */
+size_t replay_size(const struct replay *r);
+
+/**
+ * Keep the first bytes of the given buffers, which were sent after the others. The ring grows if they don't fit.
+ *
+ * @param r the ring
+ * @param iov vector of buffers
+ * @param iovcnt how many buffers the vector has
+ * @param bytes how many bytes were sent, at most the bytes of the buffers
+ * @return 0 on success, -1 on error and sets errno
+ */
+int replay_append(struct replay *r, const struct iovec *iov, int iovcnt, size_t bytes);
+
+/**
+ * Drop the bytes before the given position, which the remote host acknowledged. Positions which are not
+ * kept are ignored.
+ *
+ * @param r the ring
+ * @param position position of the first byte that the remote host didn't acknowledge
+ */
+void replay_release(struct replay *r, uint64_t position);
+
+/**
+ * Get the bytes kept from the given position to the last one sent.
+ *
+ * @param r the ring
+ * @param position position of the first byte
+ * @param iov vector of at least two buffers, set with the bytes
+ * @return how many buffers were set, from 0 to 2, or -1 if the bytes from the position are not kept and sets
+ * errno to ERANGE
+ */
+int replay_get(const struct replay *r, uint64_t position, struct iovec *iov);
+
+#endif //REPLAY_H
@@ -0,0 +1,153 @@
+/** @file
+ * Reliable messages over a connected UDP socket, for links where losses are common and the round trip is long.
+ * Over a single TCP connection a lost segment holds back everything sent after it; here every message belongs to
+ * a stream and a message waits only for the messages of its own stream sent before it, so a loss delays only its
+ * stream. Messages of stream 0 are ordered with every stream: a message waits for the stream 0 messages sent before
+ * it too.
+ *
+ * Messages are split into datagrams of at most RUDP_MSS bytes. Every datagram has a new packet number, even when it
+ * carries a segment again, and the receiver acknowledges the ranges of packet numbers that it received (selective
+ * acknowledgements). A datagram is lost when RUDP_REORDER datagrams sent after it were acknowledged, or when it is
+ * not acknowledged within the retransmission timeout, then its segment is sent again. Datagrams are sent within a
+ * congestion window, which grows while nothing is lost and is halved on losses, and they are paced over the round
+ * trip time so a whole window doesn't leave at once.
+ *
+ * The receiver takes at most RUDP_RCV_WINDOW messages after the last one received in order, and keeps at most
+ * RUDP_RCVBUF bytes of the messages being received but the next one in order. The datagrams of the other messages
+ * are dropped without being acknowledged, so they are sent again later.
+ *
+ * A thread for each connection sends, receives and handles the timers. A stream socket connected to the remote
+ * host tells when it is gone.
+ */
+
+#ifndef RUDP_H
+#define RUDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RUDP_MSS 1200               // max bytes of a message carried by a datagram
+#define RUDP_SNDBUF (4 << 20)       // bytes of messages queued or not yet acknowledged before sending waits
+#define RUDP_MAX_MESSAGE (64 << 20) // max bytes of a message
+#define RUDP_RCV_WINDOW 4096        // messages after the last one received in order that can be sent or received
+#define RUDP_RCVBUF (2 * RUDP_SNDBUF)   // max bytes of the messages received out of order, or not yet complete
+#define RUDP_INIT_CWND (10 * RUDP_MSS)  // bytes of the initial congestion window
+#define RUDP_MIN_CWND (2 * RUDP_MSS)    // min bytes of the congestion window
+#define RUDP_PACING_BURST (10 * RUDP_MSS)   // min bytes that can be sent at once by pacing
+#define RUDP_PACING_SLICE_USEC 2000 // pacing sends at once what its rate allows in this many microseconds
+#define RUDP_REORDER 3              // a datagram is lost when this many datagrams sent after it were acknowledged
+#define RUDP_MAX_RANGES 32          // ranges of packet numbers acknowledged by an acknowledgement
+#define RUDP_ACK_DELAY_USEC 1000    // max microseconds that an acknowledgement waits for more datagrams
+#define RUDP_INIT_RTO_USEC 200000   // retransmission timeout before the round trip time is measured
+#define RUDP_MIN_RTO_USEC 5000      // min retransmission timeout
+#define RUDP_MAX_RTO_USEC 2000000   // max retransmission timeout
+#define RUDP_LINGER_USEC 2000000    // max microseconds that closing waits for the messages to be acknowledged
+
+/** Types of datagram */
+#define RUDP_DATA 1
+#define RUDP_ACK 2
+
+struct rudp;
+
+/**
+ * Decides whether a datagram is dropped instead of being sent, to test the recovery from losses.
+ *
+ * @param arg argument given to rudp_set_drop()
+ * @param type RUDP_DATA or RUDP_ACK
+ * @param stream stream of the message, for RUDP_DATA
+ * @param retransmission 1 if the datagram carries a segment sent before
+ * @return 1 if the datagram should be dropped, 0 otherwise
+ */
+typedef int (*rudp_drop_fn)(void *arg, int type, uint32_t stream, int retransmission);
+
+/** Counters of a connection */
+struct rudp_stats {
+    uint64_t sent;          // datagrams sent, dropped ones included
+    uint64_t retransmitted; // datagrams which carried a segment sent before
+    uint64_t received;      // datagrams received
+    uint64_t dropped;       // datagrams dropped by the drop function
+    long srtt;              // smoothed round trip time in microseconds, 0 if not measured yet
+    size_t cwnd;            // bytes of the congestion window
+};
+
+/**
+ * Run a connection on the given sockets. On success the connection owns them.
+ *
+ * @param udpfd UDP socket connected to the remote host
+ * @param ctlfd stream socket connected to the remote host. It is readable when the remote host is gone
+ * @return the connection, NULL on error and sets errno
+ */
+struct rudp *rudp_create(int udpfd, int ctlfd);
+
+/**
+ * Returns a file descriptor which is readable when rudp_recv() doesn't wait.
+ *
+ * @param r the connection
+ * @return the file descriptor
+ */
+int rudp_data_fd(struct rudp *r);
+
+/**
+ * Set the function which drops datagrams. It is called by the connection's thread.
+ *
+ * @param r the connection
+ * @param drop the function, NULL to drop nothing
+ * @param arg argument of the function
+ */
+void rudp_set_drop(struct rudp *r, rudp_drop_fn drop, void *arg);
+
+/**
+ * Queue a message. It is copied from the buffers, starting after offset bytes.
+ *
+ * @param r the connection
+ * @param stream stream of the message
+ * @param iov vector of buffers
+ * @param iovcnt how many buffers the vector has
+ * @param offset bytes of the buffers before the message
+ * @param len bytes of the message
+ * @return 0 on success, -1 on error and sets errno. If RUDP_SNDBUF bytes or more are queued, counting those not
+ * yet acknowledged, or the remote host didn't receive in order enough messages to take one more, it sets errno to
+ * EAGAIN. If the remote host is gone it sets errno to EPIPE
+ */
+int rudp_send(struct rudp *r, uint32_t stream, const struct iovec *iov, int iovcnt, size_t offset, size_t len);
+
+/**
+ * Wait until a message can be queued.
+ *
+ * @param r the connection
+ * @param timeout max milliseconds to wait
+ * @return 1 if a message can be queued, or if the remote host is gone, 0 on timeout, -1 on error and sets errno
+ */
+int rudp_wait_send(struct rudp *r, int timeout);
+
+/**
+ * Read the received messages, in the order they can be received, waiting if there is none. Messages are read as
+ * a stream of bytes: a message can be read with many calls.
+ *
+ * @param r the connection
+ * @param buf where the messages are copied
+ * @param size max bytes to read
+ * @return number of read bytes, 0 if the remote host is gone, -1 on error and sets errno
+ */
+ssize_t rudp_recv(struct rudp *r, void *buf, size_t size);
+
+/**
+ * Get the counters of the connection.
+ *
+ * @param r the connection
+ * @param stats it will be set with the counters
+ */
+void rudp_get_stats(struct rudp *r, struct rudp_stats *stats);
+
+/**
+ * Close the connection after the queued messages are acknowledged, waiting at most RUDP_LINGER_USEC microseconds,
+ * and free it. The remote host reads the messages it received, then 0 bytes.
+ *
+ * @param r the connection
+ * @return 0 on success, -1 on error and sets errno
+ */
+int rudp_close(struct rudp *r);
+
+#endif //RUDP_H
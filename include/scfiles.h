@@ -2,12 +2,14 @@
  * Functions readn and writen.
  * From “Advanced Programming In the UNIX Environment” by W. Richard Stevens
  * and Stephen A. Rago, 2013, 3rd Edition, Addison-Wesley.
+ * Function writevn is the same as writen but it writes from a vector of buffers.
  */
 
 #ifndef SCFILES_H
 #define SCFILES_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * Read "n" bytes from the given file descriptor.
@@ -29,4 +31,15 @@ ssize_t readn(int fd, void *ptr, size_t n);
  */
 ssize_t writen(int fd, void *ptr, size_t n);
 
+/**
+ * Write all the buffers of the given vector into the given file descriptor. Partial writes are handled
+ * by writing again what is left. The vector is modified to keep track of what was already written.
+ *
+ * @param fd file descriptor
+ * @param iov vector of buffers
+ * @param iovcnt how many buffers the vector has
+ * @return number of written bytes or -1 on error
+ */
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt);
+
 #endif //SCFILES_H
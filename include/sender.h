@@ -0,0 +1,35 @@
+/** @file
+ * Sender threads, one for each connection with the remote host. It is the only one that writes messages into its
+ * connection: the messages queued by every netpipe are gathered and sent together with a few large writes.
+ * Control messages and credit are sent before the data messages: at most SENDER_MAX_DATA bytes of data are taken
+ * at once, so that is the most they wait behind.
+ * The data of a higher class is sent first. Within a class the netpipes take turns with deficit round-robin:
+ * in each turn a netpipe can send SENDER_QUANTUM bytes times its weight, and what it doesn't use is kept for
+ * the next turn while it has data waiting.
+ */
+
+#ifndef SENDER_H
+#define SENDER_H
+
+#include "./netpipefs_socket.h"
+
+#define SENDER_MAX_IOV 256          // max buffers sent with a single write
+#define SENDER_WAIT_USEC 100000     // max microseconds waited for the socket to be writable before checking for stop
+#define SENDER_MAX_DATA 262144      // max data bytes sent before checking again for control messages
+#define SENDER_QUANTUM 65536        // data bytes that a netpipe of weight 1 can send in each turn
+
+/**
+ * Run the sender threads
+ * @return 0 on success, -1 on error
+ */
+int netpipefs_sender_run(void);
+
+/**
+ * Stop the sender threads. The frames already queued are sent before stopping, unless the socket doesn't accept
+ * data for more than SENDER_WAIT_USEC microseconds.
+ *
+ * @return 0 on success, -1 on error
+ */
+int netpipefs_sender_stop(void);
+
+#endif //SENDER_H
@@ -0,0 +1,121 @@
+/** @file
+ * Shared memory ring used instead of the socket when both hosts are on the same machine. The ring is a memfd
+ * mapped by both daemons: the sender copies the messages into it and the receiver parses them in place, so the
+ * data crosses from one daemon to the other with a single copy and without system calls. The sender copies the
+ * data of a WRITE message straight from where the netpipe keeps it, the writer's buffer or the writeahead buffer,
+ * since only the message header is copied into the frame (see struct netpipefs_frame). The ring's memory is
+ * mapped twice, one mapping right after the other, so what wraps around the end of the ring is contiguous.
+ * Each side sleeps on an eventfd only when the ring is empty or full, and the other side writes to the eventfd
+ * only if it is sleeping.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define SHM_MIN_SIZE (4 << 20)  // bytes that a ring can hold at least
+
+/** Positions of the ring, at the beginning of the memfd and shared by both daemons */
+struct netpipefs_shm_ctl {
+    uint64_t head;  // bytes written since the ring was created. Written by the producer only
+    uint64_t tail;  // bytes consumed since the ring was created. Written by the consumer only
+    uint32_t reader_waiting;    // 1 while the consumer sleeps, waiting for data
+    uint32_t writer_waiting;    // 1 while the producer sleeps, waiting for room
+};
+
+/** A ring. Only one thread at a time can write into it and only one thread at a time can consume from it */
+struct netpipefs_shm {
+    int memfd;
+    int data_efd;   // written by the producer when the consumer waits for data
+    int space_efd;  // written by the consumer when the producer waits for room
+    size_t size;    // bytes that the ring can hold
+    struct netpipefs_shm_ctl *ctl;
+    char *data;     // the ring, mapped twice
+};
+
+/**
+ * Create a ring with its memfd and its eventfds.
+ *
+ * @param shm the ring
+ * @param size bytes that the ring can hold at least. It is rounded up to a multiple of the page size
+ * @return 0 on success, -1 on error and sets errno (ENOSYS if the kernel doesn't support memfd)
+ */
+int shm_create(struct netpipefs_shm *shm, size_t size);
+
+/**
+ * Map a ring created by another process, given its memfd and its eventfds. On success the ring owns the file
+ * descriptors.
+ *
+ * @param shm the ring
+ * @param memfd the memfd
+ * @param data_efd eventfd written when there is data
+ * @param space_efd eventfd written when there is room
+ * @return 0 on success, -1 on error and sets errno
+ */
+int shm_attach(struct netpipefs_shm *shm, int memfd, int data_efd, int space_efd);
+
+/**
+ * Unmap the ring and close its file descriptors.
+ *
+ * @param shm the ring
+ */
+void shm_free(struct netpipefs_shm *shm);
+
+/**
+ * Copy the buffers into the ring, as much as there is room for. The consumer is woken up if it is sleeping.
+ *
+ * @param shm the ring
+ * @param iov vector of buffers
+ * @param iovcnt how many buffers the vector has
+ * @return how many bytes were written, 0 if the ring is full
+ */
+size_t shm_write(struct netpipefs_shm *shm, const struct iovec *iov, int iovcnt);
+
+/**
+ * Wait until the ring has room.
+ *
+ * @param shm the ring
+ * @param timeout max milliseconds to wait
+ * @return 1 if the ring has room, 0 on timeout, -1 on error and sets errno
+ */
+int shm_wait_space(struct netpipefs_shm *shm, int timeout);
+
+/**
+ * Get the data written into the ring and not yet consumed. It is contiguous and it stays valid until it is
+ * consumed.
+ *
+ * @param shm the ring
+ * @param available it will be set with how many bytes there are
+ * @return pointer to the data
+ */
+const char *shm_peek(struct netpipefs_shm *shm, size_t *available);
+
+/**
+ * Give back the room of the first bytes of the data. The producer is woken up if it is sleeping.
+ *
+ * @param shm the ring
+ * @param bytes how many bytes were consumed
+ */
+void shm_consume(struct netpipefs_shm *shm, size_t bytes);
+
+/**
+ * Tell the producer that the consumer is going to sleep on data_efd. If data was written meanwhile, the consumer
+ * shouldn't sleep.
+ *
+ * @param shm the ring
+ * @param seen how many bytes the consumer already got from shm_peek()
+ * @return 1 if there is more data than seen and the consumer shouldn't sleep, 0 if it can sleep
+ */
+int shm_arm(struct netpipefs_shm *shm, size_t seen);
+
+/**
+ * Tell the producer that the consumer woke up, and clear data_efd.
+ *
+ * @param shm the ring
+ */
+void shm_disarm(struct netpipefs_shm *shm);
+
+#endif //SHM_H
@@ -9,20 +9,23 @@
 #include <sys/un.h>
 #include <netinet/in.h>
 
+#define SOCK_MAX_FDS 8  // max file descriptors sent with a single message
+#define SOCK_CONNECT_BACKOFF 1  // milliseconds before a refused connect is tried again the first time
+
 /**
- * Establish a double connection with the host: one by connect to the remote host and another one by accepting a
- * connection from remote host. If the remote host has not yet called this function, the connection will be tried
- * again after a certain amount of milliseconds and until the timeout. Returns the file descriptor got by accept.
- * If time is out then it returns -1 and sets errno to ETIMEDOUT.
+ * Establish a connection with the host by connect, by accept or both. When connect is refused, because the remote
+ * host isn't listening yet, it is tried again after SOCK_CONNECT_BACKOFF milliseconds, then after twice as long and so
+ * on up to the given interval. Meanwhile a connection from the remote host is accepted as soon as it comes. If time
+ * is out then it returns -1 and sets errno to ETIMEDOUT.
  *
- * @param fdconn file descriptor used by connect
- * @param fdacc file descriptor used by accept
+ * @param fdconn file descriptor used by connect, -1 to only accept
+ * @param fdacc file descriptor used by accept, -1 to only connect
  * @param conn_sa socket address used by connect
  * @param timeout maximum time allowed to establish the connection. Expressed in milliseconds.
- * @param interval how much time should wait before trying connect again. Expressed in milliseconds.
+ * @param interval max time to wait before trying connect again. Expressed in milliseconds.
  *
- * @return the file descriptor got by accept or -1 on error and sets errno. On timeout it returns -1 and errno is set
- * to ETIMEDOUT
+ * @return the file descriptor got by accept, or fdconn if fdacc is -1. It returns -1 on error and sets errno. On
+ * timeout it returns -1 and errno is set to ETIMEDOUT
  */
 int sock_connect_while_accept(int fdconn, int fdacc, struct sockaddr *conn_sa, long timeout, long interval);
 
@@ -48,4 +51,25 @@ int sock_write_h(int fd_skt, void *data, size_t size);
  */
 int sock_read_h(int fd_skt, void **ptr);
 
+/**
+ * Send file descriptors to the process at the other end of an AF_UNIX socket. One byte of data is sent with them.
+ *
+ * @param fd_skt AF_UNIX socket
+ * @param fds the file descriptors
+ * @param nfds how many they are, at most SOCK_MAX_FDS
+ * @return > 0 on success, -1 on error and sets errno
+ */
+int sock_send_fds(int fd_skt, const int *fds, int nfds);
+
+/**
+ * Receive the file descriptors sent with sock_send_fds().
+ *
+ * @param fd_skt AF_UNIX socket
+ * @param fds it will be set with the file descriptors
+ * @param nfds how many file descriptors are expected, at most SOCK_MAX_FDS
+ * @return > 0 on success, 0 if the socket was closed, -1 on error and sets errno. If a different number of file
+ * descriptors was received it sets errno to EPROTO
+ */
+int sock_recv_fds(int fd_skt, int *fds, int nfds);
+
 #endif //SOCKETCONN_H
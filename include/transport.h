@@ -0,0 +1,110 @@
+/** @file
+ * Transports which carry the messages between the two hosts. The connection, see netpipefs_socket.h, reaches the
+ * remote host only through its transport: it is connected, written, read and closed with the transport's functions.
+ * TCP and AF_UNIX transports are sockets. The loopback transport joins two connections of the same process with
+ * two in-memory channels, so the engine can run, and be measured, without sockets.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define LOOPBACK_CAPACITY 1048576   // bytes that a loopback channel can hold, as a socket buffer
+
+struct netpipefs_socket;
+
+/** Functions of a transport */
+struct netpipefs_transport {
+    const char *name;
+    int fd_io;  // 1 if the connection's fd is a socket that can be written and read directly, as io_uring does
+
+    /**
+     * Establish the connection with the remote host and exchange the settings that both hosts need.
+     *
+     * @param skt the connection
+     * @param timeout maximum time allowed to establish the connection. Expressed in milliseconds
+     * @return 0 on success, -1 on error and sets errno. On timeout it returns -1 and sets errno to ETIMEDOUT
+     */
+    int (*connect)(struct netpipefs_socket *skt, long timeout);
+
+    /**
+     * Write the buffers without blocking. As writev(), it can write only a part of them.
+     *
+     * @param skt the connection
+     * @param iov vector of buffers
+     * @param iovcnt how many buffers the vector has
+     * @return number of written bytes or -1 on error and sets errno. If no data can be written it sets errno
+     * to EAGAIN, if the remote host is gone it sets errno to EPIPE
+     */
+    ssize_t (*send)(struct netpipefs_socket *skt, const struct iovec *iov, int iovcnt);
+
+    /**
+     * Wait until data can be written.
+     *
+     * @param skt the connection
+     * @param timeout max milliseconds to wait
+     * @return 1 if data can be written, or if the remote host is gone, 0 on timeout, -1 on error and sets errno
+     */
+    int (*wait_send)(struct netpipefs_socket *skt, int timeout);
+
+    /**
+     * Read as much data as is available, waiting if there is none. The connection's fd is readable when there
+     * is data to read, so it can be waited together with other file descriptors.
+     *
+     * @param skt the connection
+     * @param buf where data is read into
+     * @param size max bytes to read
+     * @return number of read bytes, 0 if the remote host is gone, -1 on error and sets errno
+     */
+    ssize_t (*recv)(struct netpipefs_socket *skt, void *buf, size_t size);
+
+    /**
+     * Close the connection. The remote host reads 0 bytes after the data already written.
+     *
+     * @param skt the connection
+     * @return 0 on success, -1 on error and sets errno
+     */
+    int (*close)(struct netpipefs_socket *skt);
+};
+
+/** Send on the connection's socket. See netpipefs_transport.send */
+ssize_t fd_transport_send(struct netpipefs_socket *skt, const struct iovec *iov, int iovcnt);
+
+/** Wait until the connection's socket is writable. See netpipefs_transport.wait_send */
+int fd_transport_wait_send(struct netpipefs_socket *skt, int timeout);
+
+/** Read from the connection's socket. See netpipefs_transport.recv */
+ssize_t fd_transport_recv(struct netpipefs_socket *skt, void *buf, size_t size);
+
+/** Close the connection's socket. See netpipefs_transport.close */
+int fd_transport_close(struct netpipefs_socket *skt);
+
+/**
+ * Join two connections of this process with the loopback transport. What is sent on a connection is received
+ * by the other one. Each channel holds LOOPBACK_CAPACITY bytes.
+ *
+ * @param first a connection
+ * @param second the other connection
+ * @return 0 on success, -1 on error and sets errno
+ */
+int loopback_transport_pair(struct netpipefs_socket *first, struct netpipefs_socket *second);
+
+/** The connections are joined by loopback_transport_pair(). Both ends have the same settings */
+int loopback_transport_connect(struct netpipefs_socket *skt, long timeout);
+
+/** Copy into the channel read by the other connection. See netpipefs_transport.send */
+ssize_t loopback_transport_send(struct netpipefs_socket *skt, const struct iovec *iov, int iovcnt);
+
+/** Wait until the channel read by the other connection has room. See netpipefs_transport.wait_send */
+int loopback_transport_wait_send(struct netpipefs_socket *skt, int timeout);
+
+/** Copy from the channel written by the other connection. See netpipefs_transport.recv */
+ssize_t loopback_transport_recv(struct netpipefs_socket *skt, void *buf, size_t size);
+
+/** Close both channels. They are freed when both connections are closed. See netpipefs_transport.close */
+int loopback_transport_close(struct netpipefs_socket *skt);
+
+#endif //TRANSPORT_H
@@ -0,0 +1,135 @@
+/** @file
+ * Minimal io_uring wrapper built on the raw system calls. It is used as an alternative to the blocking
+ * read()/writev() calls on the socket: operations are queued as submission entries and many of them are
+ * submitted, and their completions reaped, with a single system call.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** A ring. It is not thread safe: only one thread at a time can queue, submit and reap */
+struct netpipefs_uring {
+    int fd;
+    /* submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_queued;     // entries queued but not yet submitted
+    /* completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    /* mappings */
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    /* registered buffer */
+    struct iovec fixed;     // area read as a fixed buffer, NULL if none
+    int registered;         // 1 while an area is registered, even if it is no longer read as a fixed buffer
+};
+
+/** A completed operation */
+struct netpipefs_uring_cqe {
+    uint64_t user_data;
+    int res;    // as the result of the system call, but -errno on error
+};
+
+/**
+ * Create a ring with the given number of submission entries.
+ *
+ * @param ring the ring
+ * @param entries how many entries can be queued before submitting them
+ * @return 0 on success, -1 on error and sets errno (ENOSYS if the kernel doesn't support io_uring)
+ */
+int uring_init(struct netpipefs_uring *ring, unsigned entries);
+
+/**
+ * Destroy the ring. The operations in flight are cancelled.
+ *
+ * @param ring the ring
+ */
+void uring_free(struct netpipefs_uring *ring);
+
+/**
+ * Register the given memory area, so reads into it don't have to map it on every operation.
+ * Any previously registered area is unregistered. No reads into the old area should be in flight.
+ *
+ * @param ring the ring
+ * @param buf memory area
+ * @param len memory area size
+ * @return 0 on success, -1 on error
+ */
+int uring_register_buffer(struct netpipefs_uring *ring, void *buf, size_t len);
+
+/**
+ * Stop reading into the registered area as a fixed buffer, because it is going to be freed. It stays registered
+ * until another area is registered or the ring is freed, since unregistering it could wait for the operations
+ * in flight.
+ *
+ * @param ring the ring
+ */
+void uring_forget_buffer(struct netpipefs_uring *ring);
+
+/**
+ * Queue a read. If the buffer is inside the registered area then it is read as a fixed buffer.
+ *
+ * @return 0 on success, -1 if the submission queue is full and sets errno to EBUSY
+ */
+int uring_prep_read(struct netpipefs_uring *ring, int fd, void *buf, size_t len, uint64_t user_data);
+
+/**
+ * Queue a vectored write. The vector and its buffers must be valid until the write is completed.
+ *
+ * @return 0 on success, -1 if the submission queue is full and sets errno to EBUSY
+ */
+int uring_prep_writev(struct netpipefs_uring *ring, int fd, const struct iovec *iov, int iovcnt, uint64_t user_data);
+
+/**
+ * Queue a one shot poll for the given events.
+ *
+ * @return 0 on success, -1 if the submission queue is full and sets errno to EBUSY
+ */
+int uring_prep_poll(struct netpipefs_uring *ring, int fd, short events, uint64_t user_data);
+
+/**
+ * Submit all the queued operations and wait until at least wait_nr of them are completed.
+ *
+ * @param ring the ring
+ * @param wait_nr how many completions to wait for
+ * @return the number of submitted operations or -1 on error
+ */
+int uring_submit_and_wait(struct netpipefs_uring *ring, unsigned wait_nr);
+
+/**
+ * Take the next completion, if any.
+ *
+ * @param ring the ring
+ * @param cqe it will be set with the completion
+ * @return 1 if there was a completion, 0 otherwise
+ */
+int uring_next_cqe(struct netpipefs_uring *ring, struct netpipefs_uring_cqe *cqe);
+
+/**
+ * Write the buffers of the given vector into the given file descriptor, waiting at most the given time for
+ * the file descriptor to accept data. As writev(), it can write only a part of the buffers. The ring should
+ * not have other operations in flight.
+ *
+ * @param ring the ring
+ * @param fd file descriptor
+ * @param iov vector of buffers
+ * @param iovcnt how many buffers the vector has
+ * @param usec max microseconds to wait
+ * @return number of written bytes or -1 on error. On timeout it returns -1 and sets errno to EAGAIN
+ */
+ssize_t uring_writev_timeout(struct netpipefs_uring *ring, int fd, const struct iovec *iov, int iovcnt, long usec);
+
+#endif //URING_H
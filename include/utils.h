@@ -71,6 +71,16 @@
  */
 #define MS_TO_NANOSEC(ms) (((ms)%1000L)*1000000L)
 
+/**
+ * Convert microseconds to seconds
+ */
+#define USEC_TO_SEC(us) ((us)/1000000L)
+
+/**
+ * Convert microseconds to nanoseconds
+ */
+#define USEC_TO_NANOSEC(us) (((us)%1000000L)*1000L)
+
 /**
  * Sleep for the given milliseconds
  *
@@ -98,4 +108,23 @@ int ipv4_address_to_array(const char *ipstr, int *res);
  */
 struct timespec elapsed_time(struct timespec *start);
 
+/**
+ * Returns the time that will be after the given microseconds from now.
+ *
+ * @param usec how many microseconds from now
+ * @param res will be set with the resulting time
+ * @return 0 on success, -1 on error and sets errno
+ */
+int deadline_after(long usec, struct timespec *res);
+
+/**
+ * Compares two times and returns a value less than, equal to or greater than zero if the first is
+ * less than, equal to or greater than the second.
+ *
+ * @param first first time
+ * @param second second time
+ * @return less than, equal to or greater than zero
+ */
+int timespec_cmp(const struct timespec *first, const struct timespec *second);
+
 #endif //UTILS_H
@@ -0,0 +1,131 @@
+#include <errno.h>
+#include "../include/bdp.h"
+#include "../include/utils.h"
+
+/** Microseconds from start to end */
+static long usec_between(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000L;
+}
+
+int bdp_init(struct bdp_estimator *est) {
+    int err;
+
+    PTH(err, pthread_mutex_init(&(est->mtx), NULL), return -1)
+    est->rtt = -1;
+    est->rtt_time.tv_sec = 0;
+    est->rtt_time.tv_nsec = 0;
+    est->bandwidth = 0;
+    est->delivered = 0;
+    est->interval_start.tv_sec = 0;
+    est->interval_start.tv_nsec = 0;
+
+    return 0;
+}
+
+int bdp_destroy(struct bdp_estimator *est) {
+    int err;
+
+    PTH(err, pthread_mutex_destroy(&(est->mtx)), return -1)
+
+    return 0;
+}
+
+void bdp_sampler_init(struct bdp_sampler *sampler) {
+    sampler->sent = 0;
+    sampler->acked = 0;
+    sampler->first = 0;
+    sampler->count = 0;
+}
+
+void bdp_sent(struct bdp_sampler *sampler, size_t bytes, const struct timespec *now) {
+    struct bdp_sample *sample;
+
+    sampler->sent += bytes;
+    if (bytes == 0 || sampler->count == BDP_SAMPLES) return;
+
+    sample = &(sampler->samples[(sampler->first + sampler->count) % BDP_SAMPLES]);
+    sample->end = sampler->sent;
+    sample->time = *now;
+    sampler->count++;
+}
+
+int bdp_acked(struct bdp_estimator *est, struct bdp_sampler *sampler, size_t bytes, const struct timespec *now) {
+    int err, timed = 0;
+    long rtt, interval, min_interval;
+    size_t rate;
+    struct timespec sent_time = {0, 0};
+
+    // the newest send which is given back entirely
+    sampler->acked += bytes;
+    while (sampler->count > 0 && sampler->samples[sampler->first].end <= sampler->acked) {
+        sent_time = sampler->samples[sampler->first].time;
+        timed = 1;
+        sampler->first = (sampler->first + 1) % BDP_SAMPLES;
+        sampler->count--;
+    }
+
+    PTH(err, pthread_mutex_lock(&(est->mtx)), return -1)
+
+    if (timed) {
+        rtt = usec_between(&sent_time, now);
+        if (est->rtt == -1 || rtt <= est->rtt || usec_between(&(est->rtt_time), now) > BDP_RTT_EXPIRE_USEC) {
+            est->rtt = rtt;
+            est->rtt_time = *now;
+        }
+    }
+
+    if (est->interval_start.tv_sec == 0 && est->interval_start.tv_nsec == 0) {
+        // the first interval starts when the given back bytes were sent, if it is known
+        if (!timed) goto unlock;
+        est->interval_start = sent_time;
+    }
+
+    est->delivered += bytes;
+    interval = usec_between(&(est->interval_start), now);
+    min_interval = est->rtt > BDP_MIN_INTERVAL_USEC ? est->rtt : BDP_MIN_INTERVAL_USEC;
+    if (interval >= min_interval) {
+        rate = (size_t) ((double) est->delivered * 1000000.0 / (double) interval);
+        // the rate is limited by the window, so the max is kept and it is forgotten slowly
+        if (rate >= est->bandwidth) est->bandwidth = rate;
+        else est->bandwidth -= (est->bandwidth - rate) / 4;
+
+        est->interval_start = *now;
+        est->delivered = 0;
+    }
+
+unlock:
+    PTH(err, pthread_mutex_unlock(&(est->mtx)), return -1)
+
+    return 0;
+}
+
+long bdp_rtt(struct bdp_estimator *est) {
+    long rtt;
+
+    pthread_mutex_lock(&(est->mtx));
+    rtt = est->rtt;
+    pthread_mutex_unlock(&(est->mtx));
+
+    return rtt;
+}
+
+size_t bdp_bandwidth(struct bdp_estimator *est) {
+    size_t bandwidth;
+
+    pthread_mutex_lock(&(est->mtx));
+    bandwidth = est->bandwidth;
+    pthread_mutex_unlock(&(est->mtx));
+
+    return bandwidth;
+}
+
+size_t bdp_window(struct bdp_estimator *est) {
+    size_t window = 0;
+
+    pthread_mutex_lock(&(est->mtx));
+    if (est->rtt >= 0 && est->bandwidth > 0)
+        window = (size_t) ((double) BDP_GAIN * (double) est->bandwidth * (double) est->rtt / 1000000.0);
+    pthread_mutex_unlock(&(est->mtx));
+
+    return window;
+}
@@ -0,0 +1,237 @@
+#define _DEFAULT_SOURCE // syscall(), MAP_ANONYMOUS, MAP_POPULATE
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "../include/bufpool.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#define BUFPOOL_CLASSES 64  // a class for each power of two
+
+/** Free chunks of a size class. The list is linked through the first bytes of each chunk */
+struct bufpool_class {
+    void *head;
+    size_t nfree;
+};
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct bufpool_class classes[2][BUFPOOL_CLASSES];   // plain and mirrored chunks
+static size_t maxfree = DEFAULT_BUFPOOL;
+static int hugepages = 0;
+static size_t budget = 0;   // 0 is unlimited
+static size_t charged = 0;
+
+void bufpool_init(size_t max, int huge, size_t max_charged) {
+    pthread_mutex_lock(&mtx);
+    maxfree = max;
+    hugepages = huge;
+    budget = max_charged;
+    pthread_mutex_unlock(&mtx);
+}
+
+/** Index of the smallest size class that can hold the given size */
+static unsigned size_class(size_t size) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t min = hugepages ? BUFPOOL_HUGEPAGE_SIZE : (pagesize > 0 ? (size_t) pagesize : 4096);
+    unsigned shift = 0;
+
+    if (size < min) size = min;
+    while (shift < BUFPOOL_CLASSES - 1 && ((size_t) 1 << shift) < size) shift++;
+
+    return shift;
+}
+
+static void *map_plain(size_t size, int huge) {
+    void *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | (huge ? MAP_HUGETLB : 0), -1, 0);
+    return chunk == MAP_FAILED ? NULL : chunk;
+}
+
+/** Reserve an inaccessible memory area aligned to the given alignment, if any */
+static char *reserve(size_t size, size_t alignment) {
+    char *area, *aligned;
+
+    area = mmap(NULL, size + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) return NULL;
+    if (alignment == 0) return area;
+
+    /* Give back what is before and after the aligned area */
+    aligned = (char *) (((size_t) area + alignment - 1) / alignment * alignment);
+    if (aligned > area) munmap(area, (size_t) (aligned - area));
+    munmap(aligned + size, (size_t) (area + alignment - aligned));
+
+    return aligned;
+}
+
+static void *map_mirrored(size_t size, int huge) {
+#ifndef SYS_memfd_create
+    errno = ENOSYS;
+    return NULL;
+#else
+    int fd, err;
+    char *area;
+
+    if ((fd = (int) syscall(SYS_memfd_create, "netpipefs", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0))) == -1)
+        return NULL;
+    if (ftruncate(fd, (off_t) size) == -1) goto close_fd;
+
+    /* Reserve twice the size, then map the same pages on both halves. Huge pages need an aligned address */
+    if ((area = reserve(2 * size, huge ? BUFPOOL_HUGEPAGE_SIZE : 0)) == NULL) goto close_fd;
+    if (mmap(area, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED)
+        goto unmap;
+    if (mmap(area + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED)
+        goto unmap;
+
+    close(fd); // the mappings keep the pages
+    return area;
+
+unmap:
+    err = errno;
+    munmap(area, 2 * size);
+    errno = err;
+close_fd:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+#endif
+}
+
+/** Map a new chunk. If there are no huge pages, normal pages are used */
+static void *map_chunk(size_t size, int mirrored, int huge) {
+    void *chunk = mirrored ? map_mirrored(size, huge) : map_plain(size, huge);
+    if (chunk == NULL && huge) chunk = mirrored ? map_mirrored(size, 0) : map_plain(size, 0);
+
+    return chunk;
+}
+
+static void unmap_chunk(void *chunk, size_t size, int mirrored) {
+    munmap(chunk, mirrored ? 2 * size : size);
+}
+
+void *bufpool_alloc(size_t size, int mirrored, size_t *chunk_size) {
+    int huge;
+    void *chunk;
+    struct bufpool_class *class;
+
+    if (size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    mirrored = mirrored != 0;
+
+    pthread_mutex_lock(&mtx);
+    *chunk_size = (size_t) 1 << size_class(size);
+    class = &(classes[mirrored][size_class(size)]);
+    huge = hugepages;
+    chunk = class->head;
+    if (chunk != NULL) {
+        class->head = *(void **) chunk;
+        class->nfree--;
+    }
+    pthread_mutex_unlock(&mtx);
+
+    if (chunk == NULL) chunk = map_chunk(*chunk_size, mirrored, huge);
+
+    return chunk;
+}
+
+void bufpool_free(void *chunk, size_t chunk_size, int mirrored) {
+    struct bufpool_class *class;
+
+    if (chunk == NULL) return;
+    mirrored = mirrored != 0;
+
+    pthread_mutex_lock(&mtx);
+    class = &(classes[mirrored][size_class(chunk_size)]);
+    /* The huge pages option may have changed since the chunk was taken: keep only chunks of the right size */
+    if (class->nfree < maxfree && ((size_t) 1 << size_class(chunk_size)) == chunk_size) {
+        *(void **) chunk = class->head;
+        class->head = chunk;
+        class->nfree++;
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&mtx);
+
+    if (chunk != NULL) unmap_chunk(chunk, chunk_size, mirrored);
+}
+
+int bufpool_prefill(size_t size, int mirrored, size_t count) {
+    size_t chunk_size = 0, i;
+    void *chunk, *chunks = NULL;
+
+    if (count > maxfree) count = maxfree;
+
+    /* Take the chunks all together, so they aren't the same chunk taken and given back */
+    for (i = 0; i < count; i++) {
+        if ((chunk = bufpool_alloc(size, mirrored, &chunk_size)) == NULL) break;
+        *(void **) chunk = chunks;
+        chunks = chunk;
+    }
+
+    while ((chunk = chunks) != NULL) {
+        chunks = *(void **) chunk;
+        bufpool_free(chunk, chunk_size, mirrored);
+    }
+
+    return i == count ? 0 : -1;
+}
+
+int bufpool_charge(size_t bytes, int force) {
+    pthread_mutex_lock(&mtx);
+    if (!force && budget > 0 && charged + bytes > budget) {
+        pthread_mutex_unlock(&mtx);
+        errno = ENOMEM;
+        return -1;
+    }
+    charged += bytes;
+    pthread_mutex_unlock(&mtx);
+
+    return 0;
+}
+
+void bufpool_uncharge(size_t bytes) {
+    pthread_mutex_lock(&mtx);
+    charged = bytes > charged ? 0 : charged - bytes;
+    pthread_mutex_unlock(&mtx);
+}
+
+size_t bufpool_charged(void) {
+    size_t bytes;
+
+    pthread_mutex_lock(&mtx);
+    bytes = charged;
+    pthread_mutex_unlock(&mtx);
+
+    return bytes;
+}
+
+void bufpool_destroy(void) {
+    int mirrored;
+    unsigned shift;
+    void *chunk;
+    struct bufpool_class *class;
+
+    pthread_mutex_lock(&mtx);
+    for (mirrored = 0; mirrored < 2; mirrored++) {
+        for (shift = 0; shift < BUFPOOL_CLASSES; shift++) {
+            class = &(classes[mirrored][shift]);
+            while ((chunk = class->head) != NULL) {
+                class->head = *(void **) chunk;
+                unmap_chunk(chunk, (size_t) 1 << shift, mirrored);
+            }
+            class->nfree = 0;
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+}
@@ -1,28 +1,49 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include "../include/cbuf.h"
+#include "../include/bufpool.h"
 
+#define CBUF_CACHE_LINE 64
+
+/*
+ * head and tail count the bytes put and got since the buffer was created, so the buffer is full when they
+ * differ by the capacity and no flag is needed. The producer only writes head and the consumer only writes
+ * tail: they are on different cache lines, so the two sides don't invalidate each other's line on every
+ * operation.
+ */
 struct cbuf_s {
     char *data;
-    size_t head;
-    size_t tail;
     size_t capacity;
-    int isfull;
-};
+    size_t size;    // size of the memory area. If mirrored it can be greater than the capacity
+    size_t chunk_size;  // size of the chunk taken from the pool
+    int mirrored;   // 1 if the memory area is mapped twice, back to back
+    size_t head __attribute__((aligned(CBUF_CACHE_LINE)));  // written by the producer
+    size_t tail __attribute__((aligned(CBUF_CACHE_LINE)));  // written by the consumer
+} __attribute__((aligned(CBUF_CACHE_LINE)));
+
+static struct cbuf_s *cbuf_struct_alloc(size_t capacity) {
+    struct cbuf_s *cbuf;
+    if (posix_memalign((void **) &cbuf, CBUF_CACHE_LINE, sizeof(struct cbuf_s)) != 0) return NULL;
+
+    cbuf->data = NULL;
+    cbuf->chunk_size = 0;
+    cbuf->capacity = capacity;
+    cbuf->size = capacity;
+    cbuf->mirrored = 0;
+    cbuf->head = 0;
+    cbuf->tail = 0;
+
+    return cbuf;
+}
 
 cbuf_t *cbuf_alloc(size_t capacity) {
-    struct cbuf_s *cbuf = (struct cbuf_s*) malloc(sizeof(struct cbuf_s));
+    struct cbuf_s *cbuf = cbuf_struct_alloc(capacity);
     if (cbuf == NULL) return NULL;
 
-    cbuf->capacity = capacity;
-    cbuf->head = 0;
-    cbuf->tail = 0;
-    cbuf->isfull = 0;
-    if (capacity == 0) {
-        cbuf->data = NULL;
-    } else {
-        cbuf->data = (char *) malloc(sizeof(char) * capacity);
+    if (capacity > 0) {
+        cbuf->data = (char *) bufpool_alloc(capacity, 0, &(cbuf->chunk_size));
         if (cbuf->data == NULL) {
             free(cbuf);
             return NULL;
@@ -32,174 +53,243 @@ cbuf_t *cbuf_alloc(size_t capacity) {
     return cbuf;
 }
 
+cbuf_t *cbuf_alloc_mirrored(size_t capacity) {
+    struct cbuf_s *cbuf;
+
+    if (capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((cbuf = cbuf_struct_alloc(capacity)) == NULL) return NULL;
+
+    cbuf->data = (char *) bufpool_alloc(capacity, 1, &(cbuf->chunk_size));
+    if (cbuf->data == NULL) {
+        free(cbuf);
+        return NULL;
+    }
+    cbuf->size = cbuf->chunk_size;
+    cbuf->mirrored = 1;
+
+    return cbuf;
+}
+
+int cbuf_resize(cbuf_t *cbuf, size_t capacity) {
+    char *data = NULL;
+    size_t chunk_size = 0, size = cbuf_size(cbuf);
+
+    if (capacity < size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (capacity == cbuf->capacity) return 0;
+
+    /* Data is moved to the beginning of the new memory area */
+    if (capacity > 0) {
+        data = (char *) bufpool_alloc(capacity, cbuf->mirrored, &chunk_size);
+        if (data == NULL) return -1;
+        cbuf_get_memcpy(cbuf, data, size);
+    }
+    bufpool_free(cbuf->data, cbuf->chunk_size, cbuf->mirrored);
+
+    cbuf->data = data;
+    cbuf->chunk_size = chunk_size;
+    cbuf->capacity = capacity;
+    cbuf->size = cbuf->mirrored ? chunk_size : capacity;
+    cbuf->head = size;
+    cbuf->tail = 0;
+
+    return 0;
+}
+
 void cbuf_free(cbuf_t *cbuf) {
     if (cbuf) {
-        free(cbuf->data);
+        bufpool_free(cbuf->data, cbuf->chunk_size, cbuf->mirrored);
         free(cbuf);
     }
 }
 
+/* How many bytes are contiguous starting from the given offset. When mirrored, a whole buffer size is */
+static size_t linear_length(cbuf_t *cbuf, size_t offset) {
+    return cbuf->mirrored ? cbuf->size : cbuf->size - offset;
+}
+
+/* Producer side: how much space there is and where it starts. The acquire pairs with the consumer's release,
+ * so the bytes got by the consumer are not overwritten before it has copied them */
+static size_t producer_space(cbuf_t *cbuf, size_t *head) {
+    *head = __atomic_load_n(&(cbuf->head), __ATOMIC_RELAXED);
+    return cbuf->capacity - (*head - __atomic_load_n(&(cbuf->tail), __ATOMIC_ACQUIRE));
+}
+
+/* Consumer side: how much data there is and where it starts. The acquire pairs with the producer's release,
+ * so the bytes put by the producer are visible */
+static size_t consumer_size(cbuf_t *cbuf, size_t *tail) {
+    *tail = __atomic_load_n(&(cbuf->tail), __ATOMIC_RELAXED);
+    return __atomic_load_n(&(cbuf->head), __ATOMIC_ACQUIRE) - *tail;
+}
+
 size_t cbuf_put(cbuf_t *cbuf, const char *data, size_t size) {
     if (cbuf->capacity == 0) return 0;
 
     return cbuf_put_memcpy(cbuf, data, size);
-    /*size_t put = 0;
-    if (cbuf->capacity == 0) return 0;
-
-    while(put < size && !cbuf->isfull) {
-        cbuf->data[cbuf->head] = *(data + put);
-        (cbuf->head)++;
-        if (cbuf->head == cbuf->capacity) cbuf->head = 0;
-        put++;
-        cbuf->isfull = cbuf->head == cbuf->tail;
-    }
-    return put;*/
 }
 
 size_t cbuf_get(cbuf_t *cbuf, char *data, size_t size) {
     if (cbuf->capacity == 0) return 0;
 
     return cbuf_get_memcpy(cbuf, data, size);
-    /*size_t got = 0;
-    if (cbuf->capacity == 0) return 0;
-
-    while(got < size && !cbuf_empty(cbuf)) {
-        *(data+got) = cbuf->data[cbuf->tail];
-        (cbuf->tail)++;
-        if (cbuf->tail == cbuf->capacity) cbuf->tail = 0;
-        got++;
-        cbuf->isfull = 0;
-    }
-    return got;*/
 }
 
 size_t cbuf_get_memcpy(cbuf_t *cbuf, char *data, size_t size) {
+    size_t tail, offset, linear_len;
+    size_t available;
     if (cbuf->capacity == 0) return 0;
 
-    char *dataptr = data;
-    char *bufptr;
-    size_t   nleft;
-    size_t linear_len;
+    available = consumer_size(cbuf, &tail);
+    if (size > available) size = available;
+    if (size == 0) return 0;
 
-    nleft = size;
-    while (nleft > 0 && !cbuf_empty(cbuf)) {
-        if (cbuf->head > cbuf->tail) linear_len = cbuf->head - cbuf->tail;
-        else linear_len = cbuf->capacity - cbuf->tail;
-        if (linear_len > nleft) linear_len = nleft;
+    offset = tail % cbuf->size;
+    linear_len = linear_length(cbuf, offset);
+    if (linear_len > size) linear_len = size;
+    memcpy(data, cbuf->data + offset, linear_len);
+    if (linear_len < size) memcpy(data + linear_len, cbuf->data, size - linear_len); // wrapped
 
-        bufptr = cbuf->data + cbuf->tail;
-        memcpy(dataptr, bufptr, linear_len);
-
-        nleft -= linear_len;
-        dataptr += linear_len;
-        cbuf->tail += linear_len;
-        if (cbuf->tail >= cbuf->capacity) cbuf->tail = 0;
-        cbuf->isfull = 0;
-    }
+    __atomic_store_n(&(cbuf->tail), tail + size, __ATOMIC_RELEASE);
 
-    return(size - nleft); /* return >= 0 */
+    return size;
 }
 
 size_t cbuf_put_memcpy(cbuf_t *cbuf, const char *data, size_t size) {
+    size_t head, offset, linear_len;
+    size_t space;
     if (cbuf->capacity == 0) return 0;
-    char *dataptr = (char *) data;
-    char *bufptr;
-    size_t   nleft;
-    size_t linear_len;
 
-    nleft = size;
-    while (nleft > 0 && !cbuf->isfull) {
-        if (cbuf->head >= cbuf->tail) linear_len = cbuf->capacity - cbuf->head;
-        else linear_len = cbuf->tail - cbuf->head;
-        if (linear_len > nleft) linear_len = nleft;
+    space = producer_space(cbuf, &head);
+    if (size > space) size = space;
+    if (size == 0) return 0;
 
-        bufptr = cbuf->data + cbuf->head;
-        memcpy(bufptr, dataptr, linear_len);
+    offset = head % cbuf->size;
+    linear_len = linear_length(cbuf, offset);
+    if (linear_len > size) linear_len = size;
+    memcpy(cbuf->data + offset, data, linear_len);
+    if (linear_len < size) memcpy(cbuf->data, data + linear_len, size - linear_len); // wrapped
 
-        nleft -= linear_len;
-        dataptr += linear_len;
-        cbuf->head += linear_len;
-        if (cbuf->head >= cbuf->capacity) cbuf->head = 0;
-        cbuf->isfull = cbuf->head == cbuf->tail;
-    }
+    __atomic_store_n(&(cbuf->head), head + size, __ATOMIC_RELEASE);
 
-    return (size - nleft);
+    return size;
 }
 
 ssize_t cbuf_writen(int fd, cbuf_t *cbuf, size_t n) {
-    char *dataptr;
+    size_t tail, offset, available;
     size_t   nleft;
     ssize_t  nwritten;
     size_t linear_len;
     if (cbuf->capacity == 0) return 0;
 
     nleft = n;
-    while (nleft > 0 && !cbuf_empty(cbuf)) {
-        if (cbuf->head > cbuf->tail) linear_len = cbuf->head - cbuf->tail;
-        else linear_len = cbuf->capacity - cbuf->tail;
+    while (nleft > 0 && (available = consumer_size(cbuf, &tail)) > 0) {
+        offset = tail % cbuf->size;
+        linear_len = linear_length(cbuf, offset);
+        if (linear_len > available) linear_len = available;
         if (linear_len > nleft) linear_len = nleft;
 
-        dataptr = cbuf->data + cbuf->tail;
-        if((nwritten = write(fd, dataptr, linear_len)) < 0) {
+        if((nwritten = write(fd, cbuf->data + offset, linear_len)) < 0) {
             if (nleft == n) return -1; /* error, return -1 */
             else break; /* error, return amount written so far */
         } else if (nwritten == 0) break;
 
         nleft -= nwritten;
-        cbuf->tail += nwritten;
-        if (cbuf->tail >= cbuf->capacity) cbuf->tail = 0;
-        cbuf->isfull = 0;
+        __atomic_store_n(&(cbuf->tail), tail + nwritten, __ATOMIC_RELEASE);
     }
 
     return(n - nleft); /* return >= 0 */
 }
 
 ssize_t cbuf_readn(int fd, cbuf_t *cbuf, size_t n) {
-    char *dataptr;
-    if (cbuf->capacity == 0) return 0;
-
+    size_t head, offset, space;
     size_t linear_len;
     size_t   nleft;
     ssize_t  nread;
+    if (cbuf->capacity == 0) return 0;
 
     nleft = n;
-    while (nleft > 0 && !cbuf->isfull) {
-        if (cbuf->head >= cbuf->tail) linear_len = cbuf->capacity - cbuf->head;
-        else linear_len = cbuf->tail - cbuf->head;
+    while (nleft > 0 && (space = producer_space(cbuf, &head)) > 0) {
+        offset = head % cbuf->size;
+        linear_len = linear_length(cbuf, offset);
+        if (linear_len > space) linear_len = space;
         if (linear_len > nleft) linear_len = nleft;
 
-        dataptr = cbuf->data + cbuf->head;
-        if((nread = read(fd, dataptr, linear_len)) < 0) {
+        if((nread = read(fd, cbuf->data + offset, linear_len)) < 0) {
             if (nleft == n) return -1; /* error, return -1 */
             else break; /* error, return amount read so far */
         } else if (nread == 0) break; /* EOF */
 
         nleft -= nread;
-        cbuf->head += nread;
-        if (cbuf->head >= cbuf->capacity) cbuf->head = 0;
-        cbuf->isfull = cbuf->head == cbuf->tail;
+        __atomic_store_n(&(cbuf->head), head + nread, __ATOMIC_RELEASE);
     }
 
     return(n - nleft); /* return >= 0 */
+}
 
+int cbuf_iov(cbuf_t *cbuf, struct iovec *iov, size_t n) {
+    return cbuf_iov_at(cbuf, 0, iov, n);
+}
+
+int cbuf_iov_at(cbuf_t *cbuf, size_t skip, struct iovec *iov, size_t n) {
+    int iovcnt = 0;
+    size_t tail, offset;
+    size_t linear_len;
+    size_t nleft;
+
+    if (cbuf->capacity == 0) return 0;
+
+    nleft = consumer_size(cbuf, &tail);
+    if (nleft <= skip) return 0;
+    nleft -= skip;
+    if (nleft > n) nleft = n;
+    offset = (tail + skip) % cbuf->size;
+    while (nleft > 0) {
+        linear_len = linear_length(cbuf, offset);
+        if (linear_len > nleft) linear_len = nleft;
+
+        iov[iovcnt].iov_base = cbuf->data + offset;
+        iov[iovcnt].iov_len = linear_len;
+        iovcnt++;
+
+        nleft -= linear_len;
+        offset = 0;
+    }
+
+    return iovcnt;
+}
+
+size_t cbuf_consume(cbuf_t *cbuf, size_t n) {
+    size_t tail;
+    size_t size = consumer_size(cbuf, &tail);
+    if (n > size) n = size;
+    if (n == 0) return 0;
+
+    __atomic_store_n(&(cbuf->tail), tail + n, __ATOMIC_RELEASE);
+
+    return n;
 }
 
 int cbuf_full(cbuf_t *cbuf) {
-    return cbuf->isfull;
+    return cbuf->capacity > 0 && cbuf_size(cbuf) == cbuf->capacity;
 }
 
 int cbuf_empty(cbuf_t *cbuf) {
-    return !cbuf->isfull && (cbuf->head == cbuf->tail);
+    return cbuf_size(cbuf) == 0;
 }
 
 size_t cbuf_size(cbuf_t *cbuf) {
-    if (cbuf->isfull) return cbuf->capacity;
+    /* If the other side moves meanwhile, the difference can exceed the capacity: it is a snapshot anyway */
+    size_t tail = __atomic_load_n(&(cbuf->tail), __ATOMIC_ACQUIRE);
+    size_t size = __atomic_load_n(&(cbuf->head), __ATOMIC_ACQUIRE) - tail;
 
-    if (cbuf->head >= cbuf->tail) return cbuf->head - cbuf->tail;
-
-    return cbuf->capacity + cbuf->head - cbuf->tail;
+    return size > cbuf->capacity ? cbuf->capacity : size;
 }
 
 size_t cbuf_capacity(cbuf_t *cbuf) {
     return cbuf->capacity;
-}
\ No newline at end of file
+}
@@ -3,7 +3,8 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdlib.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <string.h>
 #include "../include/options.h"
 #include "../include/dispatcher.h"
@@ -12,31 +13,52 @@
 #include "../include/openfiles.h"
 #include "../include/netpipefs_socket.h"
 
+/** A message waiting to be handled by a worker. Its path and data are copied after the structure */
+struct dispatcher_job {
+    struct netpipefs_message message;
+    int just_created;   // OPEN only: the reader thread created the netpipe
+    struct dispatcher_job *next;
+};
+
+/** Worker thread. It handles, in order, all the messages of the netpipes assigned to it */
+struct dispatcher_worker {
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct dispatcher_job *head;
+    struct dispatcher_job *tail;
+    int stop;
+};
+
 struct dispatcher {
-    pthread_t tid;  // dispatcher's thread id
+    pthread_t tid;  // reader thread id
     int pipefd[2];  // used to communicate with main thread
+    int epollfd;    // waits on the connections and on the pipe
+    size_t nworkers;
+    struct dispatcher_worker *workers;
+    int failed;     // set by a worker when a message can't be handled
+    uint32_t rcv_seq;   // sequence number of the next message of a striped netpipe to be handled
+    struct dispatcher_job *held;    // messages of striped netpipes received before their turn, by sequence number
 };
 
-static struct dispatcher dispatcher = {0, {-1,-1} };
+static struct dispatcher dispatcher = {0, {-1,-1}, -1, 0, NULL, 0, 0, NULL };
 
 extern struct netpipefs_socket netpipefs_socket;
 
-static int on_open(char *path) {
-    int bytes, mode, just_created = 0;
-
-    bytes = readn(netpipefs_socket.fd, &mode, sizeof(int));
-    if (bytes <= 0) return bytes;
+static int on_open(struct netpipefs_message *message, int just_created) {
+    int bytes, created = 0;
 
     /* Get the file struct or create it */
-    struct netpipe *file = netpipefs_get_or_create_open_file(path, &just_created);
+    struct netpipe *file = netpipefs_get_or_create_open_file(message->path, &created);
     if (file == NULL) return -1;
+    just_created = just_created || created;
 
-    DEBUG("remote[%s] OPEN %d\n", path, mode);
-    bytes = netpipe_open_update(file, mode);
+    DEBUG("remote[%s] OPEN %u %d\n", message->path, message->handle, message->mode);
+    bytes = netpipe_open_update(file, message->mode, message->handle);
     if (bytes == -1) {
         if (just_created) {
-            netpipefs_remove_open_file(path);
-            netpipe_free(file, NULL); // for sure there is no poll handle
+            netpipefs_remove_open_file(message->path);
+            netpipe_put(file, NULL); // for sure there is no poll handle
         }
         return -1;
     }
@@ -44,43 +66,35 @@ static int on_open(char *path) {
     return 1; // > 0
 }
 
-static int on_close(char *path) {
-    int bytes, mode;
-    bytes = readn(netpipefs_socket.fd, &mode, sizeof(int));
-    if (bytes <= 0) return bytes;
+static int on_close(struct netpipefs_message *message) {
+    int err;
 
-    struct netpipe *file = netpipefs_get_open_file(path);
+    struct netpipe *file = netpipefs_get_open_file_by_handle(message->handle);
     if (file == NULL) return -1;
 
-    DEBUG("remote[%s] CLOSE %d\n", path, mode);
-    MINUS1(netpipe_close_update(file, mode, &netpipefs_remove_open_file, &netpipefs_poll_notify), return -1)
+    DEBUG("remote[%s] CLOSE %d\n", file->path, message->mode);
+    err = netpipe_close_update(file, message->mode, &netpipefs_remove_open_file, &netpipefs_poll_notify);
+    // the file was kept while it was used, if it was closed for good it is freed now
+    MINUS1(netpipe_put(file, &netpipefs_poll_destroy), err = -1)
+    if (err == -1) return -1;
 
-    return bytes; // > 0
+    return 1; // > 0
 }
 
-static int on_write(char *path) {
+static int on_write(struct netpipefs_message *message) {
     int bytes;
-    size_t size;
-
-    struct netpipe *file = netpipefs_get_open_file(path);
-    if (file == NULL) {
-        errno = ENOENT;
-        return -1;
-    }
 
-    /* Read how much data can be read from socket */
-    bytes = readn(netpipefs_socket.fd, &size, sizeof(size_t));
-    if (bytes <= 0) {
-        DEBUG("bytes <= 0\n");
-        return bytes;
-    }
-    if (size <= 0) {
+    if (message->size <= 0) {
         errno = EINVAL;
         return -1;
     }
 
-    DEBUG("remote[%s] WRITE %ld bytes\n", path, size);
-    bytes = netpipe_recv(file, size, &netpipefs_poll_notify);
+    struct netpipe *file = netpipefs_get_open_file_by_handle(message->handle);
+    if (file == NULL) return -1;
+
+    DEBUG("remote[%s] WRITE %ld bytes\n", file->path, message->size);
+    bytes = netpipe_recv(file, message->data, message->size, &netpipefs_poll_notify);
+    MINUS1(netpipe_put(file, &netpipefs_poll_destroy), return -1)
     if (bytes <= 0) {
         if (errno == EPIPE) {
             DEBUG("on write broken pipe\n");
@@ -92,96 +106,464 @@ static int on_write(char *path) {
     return bytes;
 }
 
-static int on_read(char *path) {
-    int err, bytes;
-    size_t size;
+static int on_read(struct netpipefs_message *message) {
+    int err;
 
-    bytes = readn(netpipefs_socket.fd, &size, sizeof(size_t));
-    if (bytes <= 0) return bytes;
-    if (size <= 0) {
-        EINVAL;
+    if (message->size <= 0) {
+        errno = EINVAL;
         return -1;
     }
 
-    struct netpipe *file = netpipefs_get_open_file(path);
-    if (file == NULL) return -1;
+    // credit can be given back while the netpipe is closed
+    struct netpipe *file = netpipefs_get_open_file_by_handle(message->handle);
+    if (file == NULL) return 1;
 
-    DEBUG("remote[%s] READ %ld bytes\n", path, size);
-    err = netpipe_read_update(file, size, &netpipefs_poll_notify);
+    DEBUG("remote[%s] READ %ld bytes\n", file->path, message->size);
+    err = netpipe_read_update(file, message->size, &netpipefs_poll_notify);
+    MINUS1(netpipe_put(file, &netpipefs_poll_destroy), return -1)
     if (err == -1) return -1;
 
-    return bytes;
+    return 1; // > 0
 }
 
-static int on_read_request(char *path) {
-    int err, bytes;
-    size_t size;
+static int on_read_request(struct netpipefs_message *message) {
+    int err;
 
-    bytes = readn(netpipefs_socket.fd, &size, sizeof(size_t));
-    if (bytes <= 0) return bytes;
-    if (size <= 0) {
-        EINVAL;
+    if (message->size <= 0) {
+        errno = EINVAL;
         return -1;
     }
 
-    struct netpipe *file = netpipefs_get_open_file(path);
+    struct netpipe *file = netpipefs_get_open_file_by_handle(message->handle);
     if (file == NULL) return -1;
 
-    DEBUG("remote[%s] READ_REQUEST %ld bytes\n", path, size);
-    err = netpipe_read_request(file, size, &netpipefs_poll_notify);
+    DEBUG("remote[%s] READ_REQUEST %ld bytes\n", file->path, message->size);
+    err = netpipe_read_request(file, message->size, &netpipefs_poll_notify);
+    MINUS1(netpipe_put(file, &netpipefs_poll_destroy), return -1)
     if (err == -1) return -1;
 
+    return 1; // > 0
+}
+
+static int on_window(struct netpipefs_message *message) {
+    int err;
+
+    // the netpipe can be closed while the message is on its way
+    struct netpipe *file = netpipefs_get_open_file_by_handle(message->handle);
+    if (file == NULL) return 1;
+
+    DEBUG("remote[%s] WINDOW %ld bytes\n", file->path, message->size);
+    err = netpipe_window_update(file, message->size, &netpipefs_poll_notify);
+    MINUS1(netpipe_put(file, &netpipefs_poll_destroy), return -1)
+    if (err == -1) return -1;
+
+    return 1; // > 0
+}
+
+static int on_window_request(struct netpipefs_message *message) {
+    int err;
+
+    // the netpipe can be closed while the message is on its way
+    struct netpipe *file = netpipefs_get_open_file_by_handle(message->handle);
+    if (file == NULL) return 1;
+
+    DEBUG("remote[%s] WINDOW_REQUEST %ld bytes\n", file->path, message->size);
+    err = netpipe_window_request(file, message->size);
+    MINUS1(netpipe_put(file, &netpipefs_poll_destroy), return -1)
+    if (err == -1) return -1;
+
+    return 1; // > 0
+}
+
+/**
+ * Handle a message received from the socket
+ *
+ * @param message the message
+ * @param just_created OPEN only: if the netpipe was created when the message was received
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+static int dispatch_message(struct netpipefs_message *message, int just_created) {
+    int bytes = 1;
+
+    switch (message->header) {
+        case OPEN:
+            bytes = on_open(message, just_created);
+            if (bytes == -1) perror("on_open");
+            break;
+        case CLOSE:
+            bytes = on_close(message);
+            if (bytes == -1) perror("on_close");
+            break;
+        case WRITE:
+            bytes = on_write(message);
+            if (bytes == -1) perror("on_write");
+            break;
+        case READ:
+            bytes = on_read(message);
+            if (bytes == -1) perror("on_read");
+            break;
+        case READ_REQUEST:
+            bytes = on_read_request(message);
+            if (bytes == -1) perror("on_read_request");
+            break;
+        case WINDOW:
+            bytes = on_window(message);
+            if (bytes == -1) perror("on_window");
+            break;
+        case WINDOW_REQUEST:
+            bytes = on_window_request(message);
+            if (bytes == -1) perror("on_window_request");
+            break;
+        default:
+            break;
+    }
+
     return bytes;
 }
 
-static void *netpipefs_dispatcher_fun(void *unused) {
-    int bytes = 1, err, run = 1, nfds;
+static void *netpipefs_worker_fun(void *arg) {
+    int err;
+    struct dispatcher_worker *worker = (struct dispatcher_worker *) arg;
+    struct dispatcher_job *job;
+
+    PTH(err, pthread_mutex_lock(&(worker->mtx)), return NULL)
+    while (!worker->stop) {
+        if (worker->head == NULL) {
+            PTH(err, pthread_cond_wait(&(worker->cond), &(worker->mtx)), break)
+            continue;
+        }
+
+        job = worker->head;
+        worker->head = job->next;
+        if (worker->head == NULL) worker->tail = NULL;
+
+        /* Handle the message without holding the queue lock */
+        PTH(err, pthread_mutex_unlock(&(worker->mtx)), free(job); return NULL)
+        if (dispatch_message(&(job->message), job->just_created) <= 0)
+            __atomic_store_n(&(dispatcher.failed), 1, __ATOMIC_RELEASE);
+        free(job);
+        PTH(err, pthread_mutex_lock(&(worker->mtx)), return NULL)
+    }
+    PTH(err, pthread_mutex_unlock(&(worker->mtx)), return NULL)
+
+    return 0;
+}
+
+/**
+ * Copies the message, with its path or data, into a new job
+ *
+ * @param message the message
+ * @param just_created OPEN only: if the netpipe was created when the message was received
+ * @return the job, NULL on error
+ */
+static struct dispatcher_job *copy_message(struct netpipefs_message *message, int just_created) {
+    size_t length = 0;
+    struct dispatcher_job *job;
+
+    if (message->header == OPEN) length = strlen(message->path) + 1;
+    else if (message->header == WRITE) length = message->size;
+
+    EQNULL(job = (struct dispatcher_job *) malloc(sizeof(struct dispatcher_job) + length), return NULL)
+    job->message = *message;
+    job->just_created = just_created;
+    job->next = NULL;
+    if (message->header == OPEN) {
+        memcpy(job + 1, message->path, length);
+        job->message.path = (const char *) (job + 1);
+    } else if (message->header == WRITE) {
+        memcpy(job + 1, message->data, length);
+        job->message.data = (const char *) (job + 1);
+    }
+
+    return job;
+}
+
+/**
+ * Gives the job to the worker of the given key
+ *
+ * @param job the job
+ * @param key handle of the local netpipe which the message refers to
+ * @return 1 on success, -1 on error
+ */
+static int enqueue_job(struct dispatcher_job *job, uint32_t key) {
+    int err;
+    struct dispatcher_worker *worker = &(dispatcher.workers[key % dispatcher.nworkers]);
+
+    PTH(err, pthread_mutex_lock(&(worker->mtx)), free(job); return -1)
+    if (worker->tail == NULL) worker->head = job;
+    else worker->tail->next = job;
+    worker->tail = job;
+    PTH(err, pthread_cond_signal(&(worker->cond)), pthread_mutex_unlock(&(worker->mtx)); return -1)
+    PTH(err, pthread_mutex_unlock(&(worker->mtx)), return -1)
+
+    return 1;
+}
+
+/**
+ * Copies the message and gives it to the worker of the netpipe it refers to. All the messages of a netpipe are
+ * given to the same worker, so they are handled in the same order they were received.
+ *
+ * @param message the message
+ * @return 1 on success, -1 on error
+ */
+static int enqueue_message(struct netpipefs_message *message) {
+    int just_created = 0;
+    uint32_t key = message->handle;
+    struct dispatcher_job *job;
+
+    if (message->header == OPEN) {
+        /* The remote host sent its own handle. Key the message by the local one, which is the handle used by the
+         * messages that will follow */
+        struct netpipe *file = netpipefs_get_or_create_open_file(message->path, &just_created);
+        if (file == NULL) return -1;
+        key = file->handle;
+    }
 
-    fd_set set, rd_set;
-    FD_ZERO(&set);
-    FD_SET(netpipefs_socket.fd, &set);
-    FD_SET(dispatcher.pipefd[0], &set);
-    nfds = netpipefs_socket.fd > dispatcher.pipefd[0] ? netpipefs_socket.fd : dispatcher.pipefd[0];
+    EQNULL(job = copy_message(message, just_created), return -1)
+
+    return enqueue_job(job, key);
+}
+
+/**
+ * Handle the message, or give it to a worker
+ *
+ * @param message the message
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+static int handle_message(struct netpipefs_message *message) {
+    int bytes;
+
+    if (dispatcher.nworkers == 0) return dispatch_message(message, 0);
+
+    if ((bytes = enqueue_message(message)) == -1) perror("dispatcher. failed to give the message to a worker");
+
+    return bytes;
+}
+
+/**
+ * Handle a message of a striped netpipe in the order it was sent. If the messages sent before it were not received
+ * yet, it is copied and held until they are. Then the held messages that follow it are handled too.
+ *
+ * @param message the message
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+static int handle_sequenced_message(struct netpipefs_message *message) {
+    int bytes;
+    struct dispatcher_job *job, **prev;
+
+    if (message->seq != dispatcher.rcv_seq) {
+        EQNULL(job = copy_message(message, 0), perror("dispatcher. failed to hold the message"); return -1)
+        /* the sequence numbers wrap around, so they are compared by their distance from the next one */
+        prev = &(dispatcher.held);
+        while (*prev != NULL && (*prev)->message.seq - dispatcher.rcv_seq < message->seq - dispatcher.rcv_seq)
+            prev = &((*prev)->next);
+        job->next = *prev;
+        *prev = job;
+        return 1;
+    }
+
+    bytes = handle_message(message);
+    dispatcher.rcv_seq++;
+    while (bytes > 0 && (job = dispatcher.held) != NULL && job->message.seq == dispatcher.rcv_seq) {
+        dispatcher.held = job->next;
+        job->next = NULL;
+        if (dispatcher.nworkers == 0) {
+            bytes = dispatch_message(&(job->message), 0);
+            free(job);
+        } else if ((bytes = enqueue_job(job, job->message.handle)) == -1) {
+            perror("dispatcher. failed to give the message to a worker");
+        }
+        dispatcher.rcv_seq++;
+    }
+
+    return bytes;
+}
+
+/**
+ * Handle, or give to the workers, all the complete messages staged into the connection's receive buffer
+ *
+ * @param skt the connection
+ * @param bytes result of the last receive
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+static int handle_received_messages(struct netpipefs_socket *skt, int bytes) {
+    int err = 0;
+    struct netpipefs_message message;
+
+    while (bytes > 0 && (err = read_socket_message(skt, &message)) > 0) {
+        if (message.header == ACK) bytes = handle_ack_message(skt, &message);
+        else if (message.sequenced) bytes = handle_sequenced_message(&message);
+        else bytes = handle_message(&message);
+    }
+    if (bytes > 0 && err == -1) {
+        perror("dispatcher. invalid socket message");
+        bytes = -1;
+    }
+    if (bytes > 0 && send_ack_message(skt) == -1) {
+        perror("dispatcher. failed to acknowledge socket messages");
+        bytes = -1;
+    }
+    if (__atomic_load_n(&(dispatcher.failed), __ATOMIC_ACQUIRE)) bytes = -1;
+
+    return bytes;
+}
+
+/**
+ * Resume the session after a connection was lost, see resume_socket_connection(). The epoll instance waits on the
+ * new connections
+ *
+ * @return 1 if the session was resumed, 0 if it wasn't
+ */
+static int resume_connection(void) {
+    size_t i;
+    struct epoll_event event;
+    struct netpipefs_socket *skt;
+
+    DEBUG("dispatcher has lost socket connection, resuming the session\n");
+    if (resume_socket_connection(&netpipefs_socket, netpipefs_options.timeout) == -1) {
+        perror("dispatcher. failed to resume the session");
+        return 0;
+    }
+    DEBUG("session resumed\n");
+
+    /* the old connections were closed, so they are no longer into the epoll instance */
+    if (dispatcher.epollfd == -1) return 1;
+    for (i = 0; i < socket_stripes(&netpipefs_socket); i++) {
+        skt = socket_stripe_at(&netpipefs_socket, i);
+        event.events = EPOLLIN;
+        event.data.ptr = skt;
+        MINUS1(epoll_ctl(dispatcher.epollfd, EPOLL_CTL_ADD, skt->fd, &event), perror("dispatcher. epoll_ctl() failed"); return 0)
+    }
+
+    return 1;
+}
+
+#define URING_RECV 1  // completion of a read from the socket
+#define URING_STOP 2  // completion of the poll on the pipe
+
+/** Dispatcher that submits its reads from the socket to the io_uring ring */
+static void *netpipefs_dispatcher_uring_fun(void *unused) {
+    int bytes = 1, run = 1;
+    struct netpipefs_uring *ring = netpipefs_socket.rcv_ring;
+    struct netpipefs_uring_cqe cqe;
+
+    /* Wait for the pipe and for the socket at the same time */
+    MINUS1(uring_prep_poll(ring, dispatcher.pipefd[0], POLLIN, URING_STOP), perror("dispatcher. failed to poll the pipe"); return 0)
+    MINUS1(prep_socket_recv(&netpipefs_socket, URING_RECV), perror("dispatcher. failed to read socket message"); return 0)
 
     while(run) {
-        rd_set = set;
-        err = select(nfds+1, &rd_set, NULL, NULL, NULL);
-        if (err == -1) { // an error occurred then stop running
-            perror("dispatcher. select() failed");
+        /* Submit the next read and wait for a completion with a single system call */
+        if (uring_submit_and_wait(ring, 1) == -1) { // an error occurred then stop running
+            perror("dispatcher. io_uring_enter() failed");
             run = 0;
-        } else if (FD_ISSET(dispatcher.pipefd[0], &rd_set)) {  // pipe can be read then stop running;
+        }
+
+        while (run && uring_next_cqe(ring, &cqe)) {
+            if (cqe.user_data == URING_STOP) { // pipe can be read then stop running
+                run = 0;
+                break;
+            }
+
+            /* Handle all the complete messages, then read again */
+            if ((bytes = complete_socket_recv(&netpipefs_socket, cqe.res)) == -1 && !socket_resumable(&netpipefs_socket)) {
+                perror("dispatcher. failed to read socket message");
+            }
+            if (bytes <= 0 && socket_resumable(&netpipefs_socket)) bytes = resume_connection();
+            else bytes = handle_received_messages(&netpipefs_socket, bytes);
+            if (bytes > 0 && prep_socket_recv(&netpipefs_socket, URING_RECV) == -1) {
+                perror("dispatcher. failed to read socket message");
+                bytes = -1;
+            }
+
+            run = bytes > 0;
+        }
+    }
+    if (bytes == 0)
+        DEBUG("dispatcher has lost socket connection\n");
+
+    return 0;
+}
+
+/**
+ * Dispatcher that parses the messages in the shared memory ring. It sleeps only when the ring has nothing new, and
+ * the socket tells when the remote host is gone
+ */
+static void *netpipefs_dispatcher_shm_fun(void *unused) {
+    int bytes = 1, run = 1, lost = 0;
+    size_t left = 0;    // bytes of the incomplete message at the end of the ring
+    struct netpipefs_shm *ring = netpipefs_socket.shm_rx;
+    struct netpipefs_recv_buffer *buf = &(netpipefs_socket.recv_buf);
+    struct pollfd pfds[3];
+
+    pfds[0].fd = dispatcher.pipefd[0];
+    pfds[1].fd = netpipefs_socket.fd;
+    pfds[2].fd = ring->data_efd;
+
+    while(run) {
+        /* Give back the room of the handled messages and get what was written after them */
+        if ((bytes = recv_socket_data(&netpipefs_socket)) == -1) {
+            perror("dispatcher. failed to read socket message");
+        }
+
+        if (bytes > 0 && buf->end == left) { // nothing new
+            if (lost) { // everything written before the remote host was gone was handled
+                bytes = 0;
+                break;
+            }
+            if (shm_arm(ring, left)) continue; // written meanwhile
+
+            pfds[0].events = POLLIN;
+            pfds[1].events = POLLIN;
+            pfds[2].events = POLLIN;
+            if (poll(pfds, 3, -1) == -1 && errno != EINTR) { // an error occurred then stop running
+                perror("dispatcher. poll() failed");
+                run = 0;
+            }
+            shm_disarm(ring);
+            if (pfds[0].revents) run = 0; // pipe can be read then stop running
+            if (pfds[1].revents) lost = 1;
+            continue;
+        }
+
+        bytes = handle_received_messages(&netpipefs_socket, bytes);
+        left = buf->end - buf->start;
+        run = bytes > 0;
+    }
+    if (bytes == 0)
+        DEBUG("dispatcher has lost socket connection\n");
+
+    return 0;
+}
+
+static void *netpipefs_dispatcher_fun(void *unused) {
+    int bytes = 1, run = 1, i, nevents;
+    struct netpipefs_socket *skt;
+    struct epoll_event events[MAX_STRIPES + 1];
+
+    while(run) {
+        nevents = epoll_wait(dispatcher.epollfd, events, MAX_STRIPES + 1, -1);
+        if (nevents == -1 && errno == EINTR) continue;
+        if (nevents == -1) { // an error occurred then stop running
+            perror("dispatcher. epoll_wait() failed");
             run = 0;
-        } else {    // can read from socket
-            enum netpipefs_header header;
-            char *path = NULL;
-            if ((bytes = read_socket_header(&netpipefs_socket, &header, &path)) == -1) {
+        }
+
+        for (i = 0; run && i < nevents; i++) {
+            if ((skt = (struct netpipefs_socket *) events[i].data.ptr) == NULL) { // pipe can be read then stop running
+                run = 0;
+                break;
+            }
+
+            /* Read as much as possible and then handle all the complete messages */
+            if ((bytes = recv_socket_data(skt)) == -1 && !socket_resumable(skt)) {
                 perror("dispatcher. failed to read socket message");
-            } else if (bytes > 0) {
-                switch (header) {
-                    case OPEN:
-                        bytes = on_open(path);
-                        if (bytes == -1) perror("on_open");
-                        break;
-                    case CLOSE:
-                        bytes = on_close(path);
-                        if (bytes == -1) perror("on_close");
-                        break;
-                    case WRITE:
-                        bytes = on_write(path);
-                        if (bytes == -1) perror("on_write");
-                        break;
-                    case READ:
-                        bytes = on_read(path);
-                        if (bytes == -1) perror("on_read");
-                        break;
-                    case READ_REQUEST:
-                        bytes = on_read_request(path);
-                        if (bytes == -1) perror("on_read_request");
-                    default:
-                        break;
-                }
-                free(path);
             }
+            if (bytes <= 0 && socket_resumable(skt)) {
+                /* the events left are of the old connections */
+                run = bytes = resume_connection();
+                break;
+            }
+            bytes = handle_received_messages(skt, bytes);
 
             run = bytes > 0;
         }
@@ -192,17 +574,125 @@ static void *netpipefs_dispatcher_fun(void *unused) {
     return 0;
 }
 
+/**
+ * Stops the first n workers and frees all the workers
+ *
+ * @param n how many workers are running
+ * @return 0 on success, -1 on error
+ */
+static int stop_workers(size_t n) {
+    int err, ret = 0;
+    size_t i;
+    struct dispatcher_job *job;
+    struct dispatcher_worker *worker;
+
+    for (i = 0; i < n; i++) {
+        worker = &(dispatcher.workers[i]);
+        PTH(err, pthread_mutex_lock(&(worker->mtx)), ret = -1)
+        worker->stop = 1;
+        PTH(err, pthread_cond_signal(&(worker->cond)), ret = -1)
+        PTH(err, pthread_mutex_unlock(&(worker->mtx)), ret = -1)
+        PTH(err, pthread_join(worker->tid, NULL), ret = -1)
+    }
+
+    for (i = 0; i < dispatcher.nworkers; i++) {
+        worker = &(dispatcher.workers[i]);
+        while ((job = worker->head) != NULL) {
+            worker->head = job->next;
+            free(job);
+        }
+        pthread_mutex_destroy(&(worker->mtx));
+        pthread_cond_destroy(&(worker->cond));
+    }
+    free(dispatcher.workers);
+    dispatcher.workers = NULL;
+    dispatcher.nworkers = 0;
+
+    return ret;
+}
+
+/**
+ * Creates the workers. Each one has its own queue of messages
+ *
+ * @param nworkers how many workers
+ * @return 0 on success, -1 on error
+ */
+static int run_workers(size_t nworkers) {
+    int err;
+    size_t i;
+    struct dispatcher_worker *worker;
+
+    dispatcher.nworkers = 0;
+    if (nworkers == 0) return 0;
+
+    EQNULL(dispatcher.workers = (struct dispatcher_worker *) calloc(nworkers, sizeof(struct dispatcher_worker)), return -1)
+    for (i = 0; i < nworkers; i++) {
+        worker = &(dispatcher.workers[i]);
+        PTH(err, pthread_mutex_init(&(worker->mtx), NULL), goto error)
+        PTH(err, pthread_cond_init(&(worker->cond), NULL), pthread_mutex_destroy(&(worker->mtx)); goto error)
+        dispatcher.nworkers++;
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        worker = &(dispatcher.workers[i]);
+        PTH(err, pthread_create(&(worker->tid), NULL, &netpipefs_worker_fun, worker), stop_workers(i); return -1)
+    }
+
+    return 0;
+
+error:
+    stop_workers(0);
+    return -1;
+}
+
 int netpipefs_dispatcher_run(void) {
     int err;
+    size_t i;
+    struct epoll_event event;
+    struct netpipefs_socket *skt;
+    void *(*dispatcher_fun)(void *) = &netpipefs_dispatcher_uring_fun;
+
     MINUS1(pipe(dispatcher.pipefd), return -1)
 
-    PTH(err, pthread_create(&(dispatcher.tid), NULL, &netpipefs_dispatcher_fun, NULL), return -1)
+    /* Without io_uring the dispatcher waits on the pipe and on all the connections with epoll */
+    if (netpipefs_socket.shm_rx != NULL) {
+        dispatcher_fun = &netpipefs_dispatcher_shm_fun;
+    } else if (netpipefs_socket.rcv_ring == NULL) {
+        dispatcher_fun = &netpipefs_dispatcher_fun;
+        MINUS1(dispatcher.epollfd = epoll_create1(EPOLL_CLOEXEC), goto error)
+
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        MINUS1(epoll_ctl(dispatcher.epollfd, EPOLL_CTL_ADD, dispatcher.pipefd[0], &event), goto error)
+        for (i = 0; i < socket_stripes(&netpipefs_socket); i++) {
+            skt = socket_stripe_at(&netpipefs_socket, i);
+            event.events = EPOLLIN;
+            event.data.ptr = skt;
+            MINUS1(epoll_ctl(dispatcher.epollfd, EPOLL_CTL_ADD, skt->fd, &event), goto error)
+        }
+    }
+
+    dispatcher.failed = 0;
+    dispatcher.rcv_seq = 0;
+    MINUS1(run_workers(netpipefs_options.workers), goto error)
+    PTH(err, pthread_create(&(dispatcher.tid), NULL, dispatcher_fun, NULL), stop_workers(dispatcher.nworkers); goto error)
 
     return 0;
+
+error:
+    if (dispatcher.epollfd != -1) close(dispatcher.epollfd);
+    close(dispatcher.pipefd[0]);
+    close(dispatcher.pipefd[1]);
+    dispatcher.epollfd = -1;
+    dispatcher.pipefd[0] = -1;
+    dispatcher.pipefd[1] = -1;
+    return -1;
 }
 
 int netpipefs_dispatcher_stop(void) {
     int err;
+    size_t i;
+    struct dispatcher_job *job;
     if (dispatcher.pipefd[1] == -1) return 0; // already stopped
 
     /* Close write end. Dispatcher will wake up and stop running */
@@ -210,11 +700,24 @@ int netpipefs_dispatcher_stop(void) {
     dispatcher.pipefd[1] = -1;
 
     PTH(err, pthread_join(dispatcher.tid, NULL), return -1)
+
+    /* No more messages will be given to the workers */
+    MINUS1(stop_workers(dispatcher.nworkers), return -1)
     DEBUG("dispatcher stopped\n");
 
-    /* Close the read end of the pipe */
+    /* Close epoll and the read end of the pipe */
+    if (dispatcher.epollfd != -1) close(dispatcher.epollfd);
+    dispatcher.epollfd = -1;
     close(dispatcher.pipefd[0]);
     dispatcher.pipefd[0] = -1;
 
+    /* Discard the messages of striped netpipes that were still waiting for their turn */
+    while ((job = dispatcher.held) != NULL) {
+        dispatcher.held = job->next;
+        free(job);
+    }
+    for (i = 0; i < socket_stripes(&netpipefs_socket); i++)
+        free_socket_recv_buffer(socket_stripe_at(&netpipefs_socket, i));
+
     return 0;
-}
\ No newline at end of file
+}
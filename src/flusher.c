@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include "../include/options.h"
+#include "../include/flusher.h"
+#include "../include/utils.h"
+
+/** How many microseconds should be waited before trying again to flush a busy netpipe */
+#define BUSY_RETRY_USEC 50
+
+struct flusher {
+    pthread_t tid;          // flusher's thread id
+    int running;            // 1 if the thread is running
+    pthread_mutex_t mtx;    // protects the list of scheduled netpipes
+    pthread_cond_t cond;    // signaled when the earliest deadline changes or when the thread should stop
+    struct netpipe *head;   // scheduled netpipes ordered by deadline
+};
+
+static struct flusher flusher = { 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL };
+
+/** Remove the given netpipe from the list. Flusher mutex should be locked */
+static void unlink_netpipe(struct netpipe *file) {
+    struct netpipe **curr = &flusher.head;
+    while (*curr != NULL && *curr != file) curr = &((*curr)->flush_next);
+    if (*curr == file) *curr = file->flush_next;
+
+    file->flush_next = NULL;
+    file->flush_scheduled = 0;
+}
+
+/** Insert the given netpipe by keeping the list ordered by deadline. Flusher mutex should be locked */
+static void insert_netpipe(struct netpipe *file) {
+    struct netpipe **curr = &flusher.head;
+    while (*curr != NULL && timespec_cmp(&((*curr)->flush_deadline), &(file->flush_deadline)) <= 0)
+        curr = &((*curr)->flush_next);
+
+    file->flush_next = *curr;
+    *curr = file;
+    file->flush_scheduled = 1;
+}
+
+int netpipefs_flusher_schedule(struct netpipe *file, long usec) {
+    int err;
+    struct timespec deadline;
+
+    MINUS1(deadline_after(usec, &deadline), return -1)
+
+    PTH(err, pthread_mutex_lock(&flusher.mtx), return -1)
+
+    if (!file->flush_scheduled || timespec_cmp(&deadline, &(file->flush_deadline)) < 0) {
+        if (file->flush_scheduled) unlink_netpipe(file);
+        file->flush_deadline = deadline;
+        insert_netpipe(file);
+
+        /* The earliest deadline is changed */
+        if (flusher.head == file) PTH(err, pthread_cond_signal(&flusher.cond), pthread_mutex_unlock(&flusher.mtx); return -1)
+    }
+
+    PTH(err, pthread_mutex_unlock(&flusher.mtx), return -1)
+
+    return 0;
+}
+
+int netpipefs_flusher_cancel(struct netpipe *file) {
+    int err;
+
+    PTH(err, pthread_mutex_lock(&flusher.mtx), return -1)
+    if (file->flush_scheduled) unlink_netpipe(file);
+    PTH(err, pthread_mutex_unlock(&flusher.mtx), return -1)
+
+    return 0;
+}
+
+static void *netpipefs_flusher_fun(void *unused) {
+    int err;
+    long usec;
+    struct timespec now;
+    struct netpipe *file;
+
+    PTHERR(err, pthread_mutex_lock(&flusher.mtx), return NULL)
+    while (flusher.running) {
+        if (flusher.head == NULL) {
+            PTHERR(err, pthread_cond_wait(&flusher.cond, &flusher.mtx), break)
+            continue;
+        }
+
+        MINUS1ERR(clock_gettime(CLOCK_MONOTONIC, &now), break)
+        file = flusher.head;
+        if (timespec_cmp(&now, &(file->flush_deadline)) < 0) { // wait for the earliest deadline
+            err = pthread_cond_timedwait(&flusher.cond, &flusher.mtx, &(file->flush_deadline));
+            if (err != 0 && err != ETIMEDOUT) {
+                errno = err;
+                perror("flusher. pthread_cond_timedwait() failed");
+                break;
+            }
+            continue;
+        }
+
+        /* The netpipe is locked by someone else which will take care of its data. Try again later */
+        if (pthread_mutex_trylock(&(file->mtx)) != 0) {
+            unlink_netpipe(file);
+            MINUS1ERR(deadline_after(BUSY_RETRY_USEC, &(file->flush_deadline)), break)
+            insert_netpipe(file);
+            continue;
+        }
+
+        /* Flusher mutex is kept locked, so the netpipe cannot be freed meanwhile */
+        unlink_netpipe(file);
+        usec = netpipe_flush_timeout(file);
+        if (usec >= 0) {
+            MINUS1ERR(deadline_after(usec, &(file->flush_deadline)), netpipe_unlock(file); break)
+            insert_netpipe(file);
+        }
+        NOTZERO(netpipe_unlock(file), perror("flusher. failed to unlock netpipe"); break)
+    }
+    PTHERR(err, pthread_mutex_unlock(&flusher.mtx), return NULL)
+
+    return 0;
+}
+
+int netpipefs_flusher_run(void) {
+    int err;
+    pthread_condattr_t attr;
+
+    /* Deadlines are measured with the monotonic clock */
+    PTH(err, pthread_condattr_init(&attr), return -1)
+    PTH(err, pthread_condattr_setclock(&attr, CLOCK_MONOTONIC), pthread_condattr_destroy(&attr); return -1)
+    PTH(err, pthread_cond_destroy(&flusher.cond), pthread_condattr_destroy(&attr); return -1)
+    PTH(err, pthread_cond_init(&flusher.cond, &attr), pthread_condattr_destroy(&attr); return -1)
+    PTH(err, pthread_condattr_destroy(&attr), return -1)
+
+    flusher.running = 1;
+    PTH(err, pthread_create(&(flusher.tid), NULL, &netpipefs_flusher_fun, NULL), flusher.running = 0; return -1)
+
+    return 0;
+}
+
+int netpipefs_flusher_stop(void) {
+    int err;
+
+    PTH(err, pthread_mutex_lock(&flusher.mtx), return -1)
+    if (!flusher.running) { // already stopped
+        pthread_mutex_unlock(&flusher.mtx);
+        return 0;
+    }
+    flusher.running = 0;
+    PTH(err, pthread_cond_signal(&flusher.cond), pthread_mutex_unlock(&flusher.mtx); return -1)
+    PTH(err, pthread_mutex_unlock(&flusher.mtx), return -1)
+
+    PTH(err, pthread_join(flusher.tid, NULL), return -1)
+    DEBUG("flusher stopped\n");
+
+    return 0;
+}
@@ -8,9 +8,14 @@
 #include "../include/signal_handler.h"
 #include "../include/utils.h"
 #include "../include/dispatcher.h"
+#include "../include/flusher.h"
+#include "../include/sender.h"
 #include "../include/netpipe.h"
 #include "../include/openfiles.h"
 #include "../include/netpipefs_socket.h"
+#include "../include/bufpool.h"
+#include "../include/priority.h"
+#include "../include/ratelimit.h"
 
 /* Socket communication */
 struct netpipefs_socket netpipefs_socket;
@@ -38,6 +43,11 @@ static void* init_callback(struct fuse_conn_info *conn) {
         }
     }
 
+    /* Set up the buffers' pool. Buffers for the readahead are mapped in advance */
+    bufpool_init(netpipefs_options.bufpool, netpipefs_options.hugepages, netpipefs_options.memlimit);
+    if (netpipefs_options.readahead > 0 && bufpool_prefill(netpipefs_options.readahead, 1, netpipefs_options.bufpool) == -1)
+        perror("failed to map buffers in advance");
+
     /* Create open files table */
     if (netpipefs_open_files_table_init() == -1) {
         perror("failed to create file table");
@@ -45,6 +55,26 @@ static void* init_callback(struct fuse_conn_info *conn) {
         return 0;
     }
 
+    /* Use io_uring if requested. If it isn't available, keep using blocking system calls. The dispatcher receives
+     * through io_uring from a single connection only */
+    if (netpipefs_options.iouring && netpipefs_socket.shm_tx != NULL) {
+        DEBUG("io_uring is not used with shared memory\n");
+    } else if (netpipefs_options.iouring && !netpipefs_socket.transport->fd_io) {
+        DEBUG("io_uring is not used with the %s transport\n", netpipefs_socket.transport->name);
+    } else if (netpipefs_options.iouring && socket_stripes(&netpipefs_socket) > 1) {
+        DEBUG("io_uring is used with a single connection, using blocking I/O\n");
+    } else if (netpipefs_options.iouring && init_socket_uring(&netpipefs_socket) == -1) {
+        perror("io_uring not available, using blocking I/O");
+    }
+
+    /* Run sender */
+    err = netpipefs_sender_run();
+    if (err == -1) {
+        perror("failed to run sender");
+        fuse_exit(fuse);
+        return 0;
+    }
+
     /* Run dispatcher */
     err = netpipefs_dispatcher_run();
     if (err == -1) {
@@ -53,13 +83,37 @@ static void* init_callback(struct fuse_conn_info *conn) {
         return 0;
     }
 
+    /* Run flusher */
+    err = netpipefs_flusher_run();
+    if (err == -1) {
+        perror("failed to run flusher");
+        fuse_exit(fuse);
+        return 0;
+    }
+
     /* Print a resume */
     DEBUG("dispatcher running\n");
-    DEBUG("connection established: %s\n", (strcmp(netpipefs_options.hostip, "localhost") == 0 ? AF_UNIX_LABEL:AF_INET_LABEL));
+    DEBUG("connection established: %s\n", netpipefs_socket.transport->name);
     DEBUG("host=%s:%d\n", netpipefs_options.hostip, netpipefs_options.hostport);
     DEBUG("local port=%d\n", netpipefs_options.port);
+    DEBUG("connections=%ld\n", socket_stripes(&netpipefs_socket));
+    if (netpipefs_options.stripepaths != NULL) DEBUG("striped netpipes=%s\n", netpipefs_options.stripepaths);
+    if (socket_resumable(&netpipefs_socket))
+        DEBUG("replay window=%ld, host replay window=%ld\n", netpipefs_options.replay, netpipefs_socket.remote_replay);
     DEBUG("max readahead=%ld\n", netpipefs_options.readahead);
+    if (netpipefs_options.maxreadahead > netpipefs_options.readahead)
+        DEBUG("readahead auto-tuning up to %ld\n", netpipefs_options.maxreadahead);
     DEBUG("max writeahead=%ld\n", netpipefs_options.writeahead);
+    if (netpipefs_options.coalesce > 0)
+        DEBUG("coalescing writes smaller than %ld bytes for at most %ld us\n", netpipefs_options.coalesce, netpipefs_options.coalescedelay);
+    DEBUG("credit given back every %ld bytes or %ld us\n", netpipefs_options.ackbytes, netpipefs_options.ackdelay);
+    DEBUG("dispatcher workers=%ld\n", netpipefs_options.workers);
+    if (netpipefs_options.maxframe > 0) DEBUG("max frame=%ld\n", netpipefs_options.maxframe);
+    if (netpipefs_options.priority != NULL) DEBUG("priority rules=%s\n", netpipefs_options.priority);
+    if (netpipefs_options.ratelimit != NULL) DEBUG("rate limit rules=%s\n", netpipefs_options.ratelimit);
+    DEBUG("buffers pool=%ld%s\n", netpipefs_options.bufpool, netpipefs_options.hugepages ? " huge pages" : "");
+    if (netpipefs_options.memlimit > 0) DEBUG("buffers memory limit=%ld\n", netpipefs_options.memlimit);
+    DEBUG("socket I/O: %s\n", netpipefs_socket.shm_tx != NULL ? "shared memory" : netpipefs_socket.snd_ring != NULL ? "io_uring" : "blocking");
     DEBUG("host max readahead=%ld\n", netpipefs_socket.remote_readahead);
 
     return 0;
@@ -78,15 +132,28 @@ static void destroy_callback(void *privatedata) {
     err = netpipefs_dispatcher_stop();
     if (err == -1) perror("failed to stop dispatcher thread");
 
+    /* Stop flusher thread */
+    err = netpipefs_flusher_stop();
+    if (err == -1) perror("failed to stop flusher thread");
+
+    /* Stop sender thread after the messages already queued are sent */
+    err = netpipefs_sender_stop();
+    if (err == -1) perror("failed to stop sender thread");
+
     /* Destroy open files table */
     err = netpipefs_open_files_table_destroy();
     if (err == -1) perror("failed to destroy file table");
 
+    /* Unmap the buffers kept for reuse */
+    bufpool_destroy();
+
     /* Destroy socket and socket's mutex */
     err = end_socket_connection(&netpipefs_socket);
     if (err == -1) perror("failed to close socket connection");
 
     PTH(err, pthread_mutex_destroy(&(netpipefs_socket.wr_mtx)), perror("failed to destroy socket's mutex"))
+    PTH(err, pthread_cond_destroy(&(netpipefs_socket.wr_cond)), perror("failed to destroy socket's condition variable"))
+    MINUS1(bdp_destroy(&(netpipefs_socket.bdp)), perror("failed to destroy bandwidth-delay product estimator"))
 }
 
 /**
@@ -172,7 +239,7 @@ static int open_callback(const char *path, struct fuse_file_info *fi) {
     if (err == -1) {
         if (just_created) {
             netpipefs_remove_open_file(path);
-            netpipe_free(file, NULL); // for sure there is no poll handle
+            netpipe_put(file, NULL); // for sure there is no poll handle
         }
         return -errno;
     }
@@ -295,6 +362,88 @@ static int truncate_callback(const char *path, off_t newsize) {
     return 0;
 }
 
+/**
+ * Set extended attributes. PRIORITY_XATTR sets the class and the weight
+ * of the path, RATELIMIT_XATTR its rate limit and burst, also if the
+ * file is already open.
+ */
+static int setxattr_callback(const char *path, const char *name, const char *value, size_t size, int flags) {
+    int priority;
+    size_t weight, rate, burst;
+
+    if (strcmp(name, PRIORITY_XATTR) == 0) {
+        if (priority_parse(value, size, &priority, &weight) == -1) return -errno;
+        if (priority_set(path, priority, weight) == -1) return -errno;
+        if (netpipefs_update_open_file(path, &netpipe_apply_rules) == -1) return -errno;
+        DEBUG("[%s] priority %d weight %ld\n", path, priority, weight);
+    } else if (strcmp(name, RATELIMIT_XATTR) == 0) {
+        if (ratelimit_parse(value, size, &rate, &burst) == -1) return -errno;
+        if (ratelimit_set(path, rate, burst) == -1) return -errno;
+        if (netpipefs_update_open_file(path, &netpipe_apply_rules) == -1) return -errno;
+        DEBUG("[%s] rate limit %ld B/s burst %ld\n", path, rate, burst);
+    } else {
+        return -ENOTSUP;
+    }
+
+    return 0;
+}
+
+/**
+ * Get extended attributes. PRIORITY_XATTR is the class and the weight
+ * of the path, "CLASS:WEIGHT", and RATELIMIT_XATTR is its rate limit
+ * and burst in bytes, "RATE:BURST". If size is zero, the size of the
+ * value is returned.
+ */
+static int getxattr_callback(const char *path, const char *name, char *value, size_t size) {
+    int priority, len;
+    size_t weight, rate, burst;
+    char buf[48];
+
+    if (strcmp(name, PRIORITY_XATTR) == 0) {
+        priority_lookup(path, &priority, &weight);
+        len = snprintf(buf, sizeof(buf), "%d:%lu", priority, (unsigned long) weight);
+    } else if (strcmp(name, RATELIMIT_XATTR) == 0) {
+        ratelimit_lookup(path, &rate, &burst);
+        len = snprintf(buf, sizeof(buf), "%lu:%lu", (unsigned long) rate, (unsigned long) burst);
+    } else {
+        return -ENODATA;
+    }
+    if (size == 0) return len;
+    if ((size_t) len > size) return -ERANGE;
+    memcpy(value, buf, len);
+
+    return len;
+}
+
+/** List extended attributes */
+static int listxattr_callback(const char *path, char *list, size_t size) {
+    static const char names[] = PRIORITY_XATTR "\0" RATELIMIT_XATTR;
+
+    if (size == 0) return (int) sizeof(names);
+    if (sizeof(names) > size) return -ERANGE;
+    memcpy(list, names, sizeof(names));
+
+    return (int) sizeof(names);
+}
+
+/**
+ * Remove extended attributes. Removing PRIORITY_XATTR or RATELIMIT_XATTR
+ * gives the path the class and the weight of the --priority rules, or
+ * the rate limit of the --ratelimit rules, again.
+ */
+static int removexattr_callback(const char *path, const char *name) {
+    if (strcmp(name, PRIORITY_XATTR) == 0) {
+        if (priority_unset(path) == -1) return errno == ENOENT ? -ENODATA : -errno;
+    } else if (strcmp(name, RATELIMIT_XATTR) == 0) {
+        if (ratelimit_unset(path) == -1) return errno == ENOENT ? -ENODATA : -errno;
+    } else {
+        return -ENODATA;
+    }
+    if (netpipefs_update_open_file(path, &netpipe_apply_rules) == -1) return -errno;
+
+    return 0;
+}
+
 /** Read directory
  *
  * The filesystem may choose between two modes of operation:
@@ -329,6 +478,10 @@ static const struct fuse_operations netpipefs_oper = {
     .truncate = truncate_callback,
     .readdir = readdir_callback,
     .poll = poll_callback,
+    .setxattr = setxattr_callback,
+    .getxattr = getxattr_callback,
+    .listxattr = listxattr_callback,
+    .removexattr = removexattr_callback,
     .flag_nullpath_ok = 1,
     .flag_nopath = 1
     /* The following operations will not receive path information:
@@ -351,6 +504,8 @@ int main(int argc, char** argv) {
 
     /* Init socket mutex */
     PTHERR(err, pthread_mutex_init(&(netpipefs_socket.wr_mtx), NULL), netpipefs_opt_free(&args); return EXIT_FAILURE)
+    PTHERR(err, pthread_cond_init(&(netpipefs_socket.wr_cond), NULL), netpipefs_opt_free(&args); return EXIT_FAILURE)
+    MINUS1ERR(bdp_init(&(netpipefs_socket.bdp)), netpipefs_opt_free(&args); return EXIT_FAILURE)
 
     // if delay connect or it will use af_unix sockets
     if (!netpipefs_options.delayconnect) {
@@ -7,12 +7,29 @@
 #include "../include/netpipe.h"
 #include "../include/utils.h"
 #include "../include/netpipefs_socket.h"
-#include "../include/scfiles.h"
+#include "../include/flusher.h"
+#include "../include/bufpool.h"
+#include "../include/priority.h"
+#include "../include/ratelimit.h"
 
 #define NOT_OPEN (-1)
 
-/** How many bytes can be sent to the remote host */
-#define available_remote(file) ((file)->remotemax - (file)->remotesize)
+/** How many bytes can be sent to the remote host. The remote window can shrink below the bytes already sent */
+#define available_remote(file) \
+    ((file)->remotemax > (file)->remotesize ? (file)->remotemax - (file)->remotesize : 0)
+
+/** True if the readahead buffers are sized to the connection's bandwidth-delay product */
+#define autotuning (netpipefs_options.maxreadahead > netpipefs_options.readahead)
+
+/** True if the readahead buffers grow and shrink, within the memory limit or to the bandwidth-delay product */
+#define elastic_buffers (netpipefs_options.memlimit > 0 || autotuning)
+
+/** True if a write of the given size should be gathered into the buffer instead of being sent directly */
+#define coalescing(file, size) \
+    (netpipefs_options.coalesce > 0 && (size) < netpipefs_options.coalesce && cbuf_capacity((file)->buffer) > 0)
+
+/** How many bytes of the buffer are still to be flushed. The others were given to the sender but not written yet */
+#define buffered(file) (cbuf_size((file)->buffer) - (file)->flushing)
 
 extern struct netpipefs_socket netpipefs_socket;
 
@@ -28,6 +45,9 @@ typedef struct netpipe_req {
     size_t bytes_processed;
     size_t size;
     int error;
+    int busy;   // data is being copied into buf without holding the netpipe lock
+    size_t sending; // bytes of buf given to the sender and not written yet
+    struct netpipe *file;
     pthread_cond_t waiting;
     struct netpipe_req *next; // next request
 } netpipe_req_t;
@@ -41,15 +61,14 @@ typedef struct netpipe_req_l {
 #define foreach_request(file, req) for((req) = ((file)->req_l)->head; (req) != NULL; (req) = (req)->next)
 
 /**
- * Add a new read or write request to the given file.
+ * Create a new read or write request of the given file, without adding it to the file's requests.
  *
- * @param file the file to which the request will be added
+ * @param file the file of the request
  * @param buf request's buffer
  * @param size how many bytes should be processed
- * @param mode if O_RDONLY then the request is a read request. If O_WRONLY then the request is write request
- * @return the request added, NULL on error and it sets errno
+ * @return the request created, NULL on error and it sets errno
  */
-static netpipe_req_t *netpipe_add_request(struct netpipe *file, char *buf, size_t size, int mode) {
+static netpipe_req_t *netpipe_new_request(struct netpipe *file, char *buf, size_t size) {
     int err;
     netpipe_req_t *new_req = (netpipe_req_t *) malloc(sizeof(netpipe_req_t));
     if (new_req == NULL) return NULL;
@@ -58,6 +77,10 @@ static netpipe_req_t *netpipe_add_request(struct netpipe *file, char *buf, size_
     new_req->buf = buf;
     new_req->bytes_processed = 0;
     new_req->error = 0;
+    new_req->busy = 0;
+    new_req->sending = 0;
+    new_req->file = file;
+    new_req->next = NULL;
 
     if ((err = pthread_cond_init(&(new_req->waiting), NULL)) != 0) {
         errno = err;
@@ -65,11 +88,36 @@ static netpipe_req_t *netpipe_add_request(struct netpipe *file, char *buf, size_
         return NULL;
     }
 
-    // add to the end of the list
-    new_req->next = NULL;
-    if ((file->req_l)->tail != NULL) ((file->req_l)->tail)->next = new_req;
-    (file->req_l)->tail = new_req;
-    if ((file->req_l)->head == NULL) (file->req_l)->head = new_req;
+    return new_req;
+}
+
+/**
+ * Add the request to the end of the file's requests.
+ *
+ * @param file the file to which the request will be added
+ * @param req the request
+ */
+static void netpipe_link_request(struct netpipe *file, netpipe_req_t *req) {
+    req->next = NULL;
+    if ((file->req_l)->tail != NULL) ((file->req_l)->tail)->next = req;
+    (file->req_l)->tail = req;
+    if ((file->req_l)->head == NULL) (file->req_l)->head = req;
+}
+
+/**
+ * Add a new read or write request to the given file.
+ *
+ * @param file the file to which the request will be added
+ * @param buf request's buffer
+ * @param size how many bytes should be processed
+ * @param mode if O_RDONLY then the request is a read request. If O_WRONLY then the request is write request
+ * @return the request added, NULL on error and it sets errno
+ */
+static netpipe_req_t *netpipe_add_request(struct netpipe *file, char *buf, size_t size, int mode) {
+    netpipe_req_t *new_req = netpipe_new_request(file, buf, size);
+    if (new_req == NULL) return NULL;
+
+    netpipe_link_request(file, new_req);
 
     return new_req;
 }
@@ -89,6 +137,7 @@ static int netpipe_destroy_request(netpipe_req_t *req) {
 
 struct netpipe *netpipe_alloc(const char *path) {
     int err;
+    pthread_condattr_t attr;
     struct netpipe *file = (struct netpipe *) malloc(sizeof(struct netpipe));
     EQNULL(file, return NULL)
     file->req_l = (struct netpipe_req_l *) malloc(sizeof(struct netpipe_req_l));
@@ -113,25 +162,75 @@ struct netpipe *netpipe_alloc(const char *path) {
         return NULL;
     }
 
+    if ((err = pthread_mutex_init(&(file->snd_mtx), NULL)) != 0) {
+        errno = err;
+        goto error;
+    }
+
+    if ((err = pthread_mutex_init(&(file->rd_mtx), NULL)) != 0) {
+        errno = err;
+        pthread_mutex_destroy(&(file->snd_mtx));
+        goto error;
+    }
+
     if ((err = pthread_cond_init(&(file->canopen), NULL)) != 0) {
         errno = err;
+        pthread_mutex_destroy(&(file->rd_mtx));
+        pthread_mutex_destroy(&(file->snd_mtx));
         goto error;
     }
 
     if ((err = pthread_cond_init(&(file->close), NULL)) != 0) {
         errno = err;
         pthread_cond_destroy(&(file->canopen));
+        pthread_mutex_destroy(&(file->rd_mtx));
+        pthread_mutex_destroy(&(file->snd_mtx));
+        goto error;
+    }
+
+    // writers wait for the tokens until a deadline from CLOCK_MONOTONIC
+    if ((err = pthread_condattr_init(&attr)) == 0) {
+        if ((err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) == 0)
+            err = pthread_cond_init(&(file->tokens), &attr);
+        pthread_condattr_destroy(&attr);
+    }
+    if (err != 0) {
+        errno = err;
+        pthread_cond_destroy(&(file->close));
+        pthread_cond_destroy(&(file->canopen));
+        pthread_mutex_destroy(&(file->rd_mtx));
+        pthread_mutex_destroy(&(file->snd_mtx));
         goto error;
     }
 
     file->buffer = cbuf_alloc(0);
+    file->flushing = 0;
+    file->flush_done = 0;
+    file->handle = 0;
+    file->remote_handle = 0;
+    file->refs = 1;
     file->open_mode = NOT_OPEN;
     file->force_exit = 0;
     file->writers = 0;
     file->readers = 0;
     file->remotemax = netpipefs_socket.remote_readahead;
     file->remotesize = 0;
+    file->remotewindow = netpipefs_socket.remote_readahead;
+    file->window = 0;
+    file->last_recv.tv_sec = 0;
+    file->last_recv.tv_nsec = 0;
+    file->requested_window = 0;
+    file->unacked = 0;
+    bdp_sampler_init(&(file->sampler));
+    priority_lookup(path, &(file->priority), &(file->weight));
+    ratelimit_lookup(path, &(file->ratelimit), &(file->rateburst));
+    ratelimit_init(&(file->limiter));
+    file->skt = socket_stripe(&netpipefs_socket, path);
+    file->striped = socket_striped(&netpipefs_socket, path);
+    file->stripe_next = 0;
     file->poll_handles = NULL;
+    file->flush_scheduled = 0;
+    file->flush_next = NULL;
 
     return file;
 
@@ -143,9 +242,38 @@ error:
     return NULL;
 }
 
+void netpipe_apply_rules(struct netpipe *file) {
+    int priority;
+    size_t weight, rate, burst;
+
+    priority_lookup(file->path, &priority, &weight);
+    __atomic_store_n(&(file->priority), priority, __ATOMIC_RELAXED);
+    __atomic_store_n(&(file->weight), weight, __ATOMIC_RELAXED);
+
+    if (update_socket_flow(file->skt, file) == -1) perror("failed to move the data waiting to be sent");
+
+    ratelimit_lookup(file->path, &rate, &burst);
+    __atomic_store_n(&(file->ratelimit), rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&(file->rateburst), burst, __ATOMIC_RELAXED);
+    // a writer which misses the wake up sends when its old deadline is reached
+    pthread_cond_broadcast(&(file->tokens));
+}
+
+void netpipe_get(struct netpipe *file) {
+    __atomic_add_fetch(&(file->refs), 1, __ATOMIC_RELAXED);
+}
+
+int netpipe_put(struct netpipe *file, void (*poll_destroy)(void *)) {
+    if (__atomic_sub_fetch(&(file->refs), 1, __ATOMIC_ACQ_REL) > 0) return 0;
+
+    return netpipe_free(file, poll_destroy);
+}
+
 int netpipe_free(struct netpipe *file, void (*poll_destroy)(void *)) {
     int ret = 0, err;
 
+    if (netpipefs_flusher_cancel(file) == -1) ret = -1;
+    bufpool_uncharge(cbuf_capacity(file->buffer));
     cbuf_free(file->buffer);
     free((void*) file->path);
 
@@ -171,7 +299,10 @@ int netpipe_free(struct netpipe *file, void (*poll_destroy)(void *)) {
 
     if ((err = pthread_cond_destroy(&(file->canopen))) != 0) { errno = err; ret = -1; }
     if ((err = pthread_cond_destroy(&(file->close))) != 0) { errno = err; ret = -1; }
+    if ((err = pthread_cond_destroy(&(file->tokens))) != 0) { errno = err; ret = -1; }
     if ((err = pthread_mutex_destroy(&(file->mtx))) != 0) { errno = err; ret = -1; }
+    if ((err = pthread_mutex_destroy(&(file->snd_mtx))) != 0) { errno = err; ret = -1; }
+    if ((err = pthread_mutex_destroy(&(file->rd_mtx))) != 0) { errno = err; ret = -1; }
 
     free(file);
 
@@ -223,7 +354,7 @@ int netpipe_open(struct netpipe *file, int mode, int nonblock) {
     /* Notify who's waiting for readers/writers */
     PTH(err, pthread_cond_broadcast(&(file->canopen)), goto undo_open)
 
-    bytes = send_open_message(&netpipefs_socket, file->path, mode);
+    bytes = send_open_message(file->skt, file->path, file->handle, mode);
     if (bytes <= 0) { // cannot write over socket
         goto undo_open;
     }
@@ -258,9 +389,10 @@ undo_open:
     return -1;
 }
 
-int netpipe_open_update(struct netpipe *file, int mode) {
-    int err;
+int netpipe_open_update(struct netpipe *file, int mode, uint32_t remote_handle) {
+    int err, bytes;
     size_t buffer_capacity;
+    cbuf_t *buffer;
 
     if (mode == O_RDWR) {
         errno = EPERM;
@@ -269,15 +401,41 @@ int netpipe_open_update(struct netpipe *file, int mode) {
 
     NOTZERO(netpipe_lock(file), return -1)
 
+    file->remote_handle = remote_handle;
     if (mode == O_RDONLY) file->readers++;
     else if (mode == O_WRONLY) file->writers++;
 
-    /* Alloc buffer */
-    buffer_capacity = mode == O_WRONLY ? netpipefs_options.readahead : netpipefs_options.writeahead;
+    /* Alloc buffer. When coalescing, the writer's buffer should be able to gather the small writes. If the
+     * memory limit is reached the netpipe works without buffer */
+    buffer_capacity = mode == O_WRONLY ? netpipe_initial_readahead() : netpipefs_options.writeahead;
+    if (mode == O_RDONLY && buffer_capacity < netpipefs_options.coalesce)
+        buffer_capacity = netpipefs_options.coalesce;
     if (cbuf_capacity(file->buffer) == 0 && buffer_capacity > 0) {
-        cbuf_free(file->buffer);
-        file->buffer = cbuf_alloc(buffer_capacity);
-        if (file->buffer == NULL) goto undo_open;
+        if (bufpool_charge(buffer_capacity, 0) == -1) {
+            DEBUG("[%s] memory limit reached, no buffer\n", file->path);
+        } else {
+            // a mirrored buffer is sent and filled with one copy, fall back to a plain one if it can't be mapped
+            buffer = cbuf_alloc_mirrored(buffer_capacity);
+            if (buffer == NULL) buffer = cbuf_alloc(buffer_capacity);
+            if (buffer == NULL) {
+                bufpool_uncharge(buffer_capacity);
+                goto undo_open;
+            }
+            // readers can be reading the old buffer without the netpipe lock
+            PTH(err, pthread_mutex_lock(&(file->rd_mtx)), cbuf_free(buffer); bufpool_uncharge(buffer_capacity); goto undo_open)
+            cbuf_free(file->buffer);
+            file->buffer = buffer;
+            PTH(err, pthread_mutex_unlock(&(file->rd_mtx)), goto undo_open)
+        }
+    }
+
+    /* The remote writer starts with the initial readahead. Tell it if the buffer has another capacity */
+    if (mode == O_WRONLY && elastic_buffers) {
+        file->window = cbuf_capacity(file->buffer);
+        if (file->window != netpipe_initial_readahead()) {
+            bytes = send_window_message(file->skt, file->remote_handle, file->window);
+            if (bytes <= 0) goto undo_open;
+        }
     }
 
     DEBUGFILE(file);
@@ -296,48 +454,167 @@ undo_open:
     return -1;
 }
 
+/** Time the bytes sent, so the round trip time is measured when the remote host gives them back */
+static void time_send(struct netpipe *file, size_t bytes) {
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) bdp_sent(&(file->sampler), bytes, &now);
+}
+
+/**
+ * Called by the sender once it wrote the data of a write request, or discarded it. The writer waits for all its
+ * data to be written before its buffer is given back.
+ *
+ * @param arg the request
+ * @param bytes how many bytes of the request were written
+ */
+static void request_sent(void *arg, size_t bytes) {
+    int err;
+    netpipe_req_t *req = (netpipe_req_t *) arg;
+    struct netpipe *file = req->file;
+
+    NOTZERO(netpipe_lock(file), perror("failed to lock the netpipe"); return)
+    req->sending -= bytes;
+    if (req->sending == 0) PTHERR(err, pthread_cond_signal(&(req->waiting)), )
+    NOTZERO(netpipe_unlock(file), perror("failed to unlock the netpipe"))
+}
+
 /**
- * Send data pointed by the given buffer.
+ * Send data pointed by the given buffer. The data is not copied: the sender writes it from the buffer, so the
+ * request's writer should keep it valid until the request has nothing left in sending. The caller should hold the
+ * netpipe's send lock and the netpipe lock.
  *
  * @param file the file
+ * @param req the write request whose buffer is sent
+ * @param bufptr data that should be sent
+ * @param size how much data should be sent
  * @param bytes_sent will be set with how many bytes were sent
  * @return 1 on success and it sets datasent, 0 if connection was lost, -1 on error
  */
-static int do_send(struct netpipe *file, char *bufptr, size_t size, size_t *bytes_sent) {
-    int bytes;
+static int do_send(struct netpipe *file, netpipe_req_t *req, char *bufptr, size_t size, size_t *bytes_sent) {
+    ssize_t bytes;
 
     *bytes_sent = size < available_remote(file) ? size : available_remote(file);
     if (*bytes_sent == 0) return 1;
 
-    bytes = send_write_message(&netpipefs_socket, file->path, bufptr, *bytes_sent);
-    if (bytes <= 0) return bytes;
+    bytes = send_write_message(file->skt, file, bufptr, *bytes_sent, &request_sent, req);
+    if (bytes <= 0) {
+        *bytes_sent = 0;
+        return (int) bytes;
+    }
 
-    *bytes_sent = bytes;
+    *bytes_sent = (size_t) bytes;
+    req->sending += *bytes_sent;
     file->remotesize += *bytes_sent;
+    time_send(file, *bytes_sent);
 
     return 1;
 }
 
 /**
- * Flush data which means that data available from local file buffer is sent to the host.
+ * Put the data of the pending write requests into the buffer (writeahead), in order, as long as there is space.
+ * The requests whose data is all into the buffer are removed and their writers are woken up. The caller should
+ * hold the netpipe lock.
+ *
+ * @param file the file
+ * @return how many bytes were put into the buffer, -1 on error
+ */
+static ssize_t writeahead_requests(struct netpipe *file) {
+    int err;
+    size_t bytes, datasent = 0;
+    netpipe_req_l *req_list = file->req_l;
+    netpipe_req_t *req = req_list->head;
+
+    while(req != NULL && !cbuf_full(file->buffer) && cbuf_capacity(file->buffer) > 0) {
+        bytes = cbuf_put(file->buffer, req->buf + req->bytes_processed, req->size - req->bytes_processed);
+        DEBUG("writeahead[%s] %ld bytes\n", file->path, bytes);
+
+        datasent += bytes;
+        req->bytes_processed += bytes;
+        if (req->bytes_processed == req->size) {
+            PTH(err, pthread_cond_signal(&(req->waiting)), req_list->head = req; return -1)
+            if (req_list->tail == req) req_list->tail = NULL;
+            req = req->next;
+        }
+    }
+    req_list->head = req;
+
+    return (ssize_t) datasent;
+}
+
+/**
+ * Called by the sender once it wrote flushed data, or discarded it. The data is consumed from the buffer, in
+ * order, and the space given back is filled with the data of the pending write requests.
+ *
+ * @param arg the file
+ * @param bytes how many bytes of the buffer were written
+ */
+static void flush_sent(void *arg, size_t bytes) {
+    int err;
+    struct netpipe *file = (struct netpipe *) arg;
+
+    NOTZERO(netpipe_lock(file), perror("failed to lock the netpipe"); return)
+    file->flush_done += bytes;
+    // the senders of a striped netpipe write its data in any order, it is consumed once all of it is written
+    if (!file->striped || file->flush_done == file->flushing) {
+        cbuf_consume(file->buffer, file->flush_done);
+        file->flushing -= file->flush_done;
+        file->flush_done = 0;
+        if (writeahead_requests(file) == -1) perror("failed to writeahead the pending requests");
+        if (file->writers == 0) PTHERR(err, pthread_cond_broadcast(&(file->close)), )
+    }
+    NOTZERO(netpipe_unlock(file), perror("failed to unlock the netpipe"))
+}
+
+/**
+ * Flush data which means that data available from local file buffer is sent to the host. The data is not copied:
+ * the sender writes it from the buffer, which is consumed once it is written. The caller should hold the netpipe
+ * lock.
  *
  * @param file the file to be flushed
  * @param bytes_sent will be set with how many bytes were sent
  * @return 1 on success and it sets datasent, 0 if connection was lost, -1 on error
  */
 static int do_flush(struct netpipe *file, size_t *bytes_sent) {
-    int bytes;
+    ssize_t bytes;
     size_t available_locally;
 
-    available_locally = cbuf_size(file->buffer);
+    available_locally = buffered(file);
     *bytes_sent = available_locally < available_remote(file) ? available_locally : available_remote(file);
     if (*bytes_sent == 0) return 1;
 
-    bytes = send_flush_message(&netpipefs_socket, file, *bytes_sent);
-    if (bytes <= 0) return bytes;
+    bytes = send_flush_message(file->skt, file, file->flushing, *bytes_sent, &flush_sent, file);
+    if (bytes <= 0) return (int) bytes;
 
-    *bytes_sent = bytes;
+    *bytes_sent = (size_t) bytes;
+    file->flushing += *bytes_sent;
     file->remotesize += *bytes_sent;
+    time_send(file, *bytes_sent);
+
+    return 1;
+}
+
+/**
+ * Flush the buffer if the gathered data reached the coalescing threshold, otherwise schedule
+ * the flush so that the gathered data will not wait more than the coalescing delay.
+ *
+ * @param file the file to be flushed
+ * @param bytes_sent will be set with how many bytes were sent
+ * @return 1 on success and it sets datasent, 0 if connection was lost, -1 on error
+ */
+static int flush_coalesced(struct netpipe *file, size_t *bytes_sent) {
+    int err;
+
+    *bytes_sent = 0;
+    if (buffered(file) >= netpipefs_options.coalesce) {
+        err = do_flush(file, bytes_sent);
+        if (err <= 0) return err;
+        if (*bytes_sent > 0) DEBUG("flush[%s] %ld bytes\n", file->path, *bytes_sent);
+    }
+
+    // if the host cannot receive data, the buffer will be flushed when it can
+    if (buffered(file) > 0 && available_remote(file) > 0)
+        MINUS1(netpipefs_flusher_schedule(file, netpipefs_options.coalescedelay), return -1)
 
     return 1;
 }
@@ -360,26 +637,48 @@ static void loop_poll_notify(struct netpipe *file, void (*poll_notify)(void *))
     file->poll_handles = NULL;
 }
 
-ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int nonblock) {
+/**
+ * Send the bytes to the remote host, directly or through the buffer, as netpipe_send() without the rate limit.
+ *
+ * @param file the file
+ * @param buf data that should be sent
+ * @param size how much data should be sent
+ * @param nonblock if it is 1 then this function will send data that can be sent and will not block
+ * @return how much data was sent, -1 on error
+ */
+static ssize_t write_data(struct netpipe *file, const char *buf, size_t size, int nonblock) {
     int err;
     char *bufptr = (char *) buf;
     size_t sent = 0, bytes, remaining = size;
+    netpipe_req_t *request;
 
-    NOTZERO(netpipe_lock(file), return -1)
+    /* The send lock keeps this write from being mixed with other writes while the netpipe is unlocked */
+    PTH(err, pthread_mutex_lock(&(file->snd_mtx)), return -1)
+    NOTZERO(netpipe_lock(file), pthread_mutex_unlock(&(file->snd_mtx)); return -1)
 
     if (file->force_exit || file->readers == 0) {
         errno = EPIPE;
         netpipe_unlock(file);
+        pthread_mutex_unlock(&(file->snd_mtx));
+        return -1;
+    }
+
+    // The request keeps track of the data sent directly from buf, which can't be given back before it is written
+    request = netpipe_new_request(file, bufptr, remaining);
+    if (request == NULL) {
+        netpipe_unlock(file);
+        pthread_mutex_unlock(&(file->snd_mtx));
         return -1;
     }
 
-    // If host can receive data and local buffer is empty or buffer has zero capacity
-    // Directly send data
-    if (available_remote(file) > 0 && (cbuf_empty(file->buffer) || cbuf_capacity(file->buffer) == 0)) {
-        err = do_send(file, bufptr, size, &bytes);
+    // If host can receive data and local buffer has nothing left to flush or buffer has zero capacity
+    // Directly send data. Small writes are gathered into the buffer instead
+    if (available_remote(file) > 0 && (buffered(file) == 0 || cbuf_capacity(file->buffer) == 0)
+        && !coalescing(file, size)) {
+        err = do_send(file, request, bufptr, size, &bytes);
         if (err <= 0) {
-            netpipe_unlock(file);
-            return -1;
+            sent = -1;
+            goto wait_sent;
         }
 
         bufptr += bytes;
@@ -390,24 +689,36 @@ ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int non
 
     // If there is space into the buffer and this request need to send more data
     // Put data from this request into the buffer (writeahead). Data put will be 0 if the buffer is full or has 0 capacity
-    if (remaining > 0) {
+    // When coalescing, the buffer is flushed as soon as it has enough data and then it can be filled again
+    while (remaining > 0) {
         bytes = cbuf_put(file->buffer, bufptr, remaining);
         if (bytes > 0) DEBUG("writeahead[%s] %ld bytes\n", file->path, bytes);
 
         bufptr += bytes;
         sent += bytes;
         remaining -= bytes;
+
+        if (netpipefs_options.coalesce == 0) break;
+        err = flush_coalesced(file, &bytes);
+        if (err <= 0) {
+            sent = -1;
+            goto wait_sent;
+        }
+        if (bytes == 0) break; // nothing was flushed then the buffer has no more space
     }
 
     // If all the bytes were sent or nonblock
     if (remaining == 0 || nonblock) {
         if (sent == 0) errno = EAGAIN;
-        netpipe_unlock(file);
-        return sent;
+        goto wait_sent;
     }
 
-    netpipe_req_t *request = netpipe_add_request(file, bufptr, remaining, O_WRONLY);
-    while(!file->force_exit && request->bytes_processed != remaining && !request->error) {
+    // The rest is sent by who receives the remote host's space, which takes the send lock
+    request->buf = bufptr;
+    request->size = remaining;
+    netpipe_link_request(file, request);
+    PTH(err, pthread_mutex_unlock(&(file->snd_mtx)), netpipe_unlock(file); return -1)
+    while(request->sending > 0 || (!file->force_exit && request->bytes_processed != remaining && !request->error)) {
         PTH(err, pthread_cond_wait(&(request->waiting), &(file->mtx)), netpipe_unlock(file); return -1)
     }
 
@@ -426,140 +737,419 @@ ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int non
         sent = -1;
     NOTZERO(netpipe_unlock(file), return -1)
 
+    return sent;
+
+wait_sent:
+    // The data sent directly is written by the sender from buf, which is given back only after that
+    PTH(err, pthread_mutex_unlock(&(file->snd_mtx)), netpipe_unlock(file); return -1)
+    while (request->sending > 0) {
+        PTH(err, pthread_cond_wait(&(request->waiting), &(file->mtx)), netpipe_unlock(file); return -1)
+    }
+    netpipe_destroy_request(request);
+    NOTZERO(netpipe_unlock(file), return -1)
+
     return sent;
 }
 
-int netpipe_recv(struct netpipe *file, size_t size, void (*poll_notify)(void *)) {
+/**
+ * Take from the token bucket of the netpipe the tokens for at most size bytes. If there aren't enough tokens it
+ * waits for them, until the time given by the bucket, without spinning. The netpipe lock is taken meanwhile, but
+ * not the send lock, so the netpipe can still send the data of the other writers.
+ *
+ * @param file the file
+ * @param size bytes to be sent
+ * @param nonblock if it is 1 then this function will not wait
+ * @param burst it will be set with the burst of the tokens taken, to give them back
+ * @return how many bytes can be sent, -1 on error and sets errno (EAGAIN if nonblock is 1 and there are no tokens)
+ */
+static ssize_t take_tokens(struct netpipe *file, size_t size, int nonblock, size_t *burst) {
+    int err;
+    size_t rate, allowed;
+    struct timespec now, deadline;
+
+    /* without a rate limit there is no bucket to fill, nor a clock to read */
+    if (__atomic_load_n(&(file->ratelimit), __ATOMIC_RELAXED) == 0) {
+        *burst = 0;
+        return (ssize_t) size;
+    }
+
+    NOTZERO(netpipe_lock(file), return -1)
+    for (;;) {
+        if (file->force_exit || file->readers == 0) {
+            errno = EPIPE;
+            goto error;
+        }
+
+        rate = __atomic_load_n(&(file->ratelimit), __ATOMIC_RELAXED);
+        *burst = __atomic_load_n(&(file->rateburst), __ATOMIC_RELAXED);
+        MINUS1(clock_gettime(CLOCK_MONOTONIC, &now), goto error)
+        allowed = ratelimit_take(&(file->limiter), rate, *burst, size, &now);
+        if (allowed > 0) break;
+        if (nonblock) {
+            errno = EAGAIN;
+            goto error;
+        }
+
+        MINUS1(deadline_after(ratelimit_delay(&(file->limiter), rate, *burst, size), &deadline), goto error)
+        DEBUG("[%s] rate limited at %ld/%ld B/s\n", file->path, ratelimit_current(&(file->limiter), &now), rate);
+        err = pthread_cond_timedwait(&(file->tokens), &(file->mtx), &deadline);
+        if (err != 0 && err != ETIMEDOUT) {
+            errno = err;
+            goto error;
+        }
+    }
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    return (ssize_t) allowed;
+
+error:
+    err = errno;
+    netpipe_unlock(file);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Give back to the token bucket of the netpipe the tokens taken for bytes that were not sent.
+ *
+ * @param file the file
+ * @param burst the burst of the tokens taken
+ * @param bytes the bytes not sent
+ */
+static void refund_tokens(struct netpipe *file, size_t burst, size_t bytes) {
+    if (bytes == 0 || burst == 0 || netpipe_lock(file) != 0) return;
+    ratelimit_refund(&(file->limiter), burst, bytes);
+    netpipe_unlock(file);
+}
+
+ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int nonblock) {
+    ssize_t allowed, bytes;
+    size_t sent = 0, burst;
+
+    if (size == 0) return write_data(file, buf, size, nonblock);
+
+    /* Each part is sent as soon as its tokens are taken. Without a rate limit there is one part */
+    do {
+        allowed = take_tokens(file, size - sent, nonblock, &burst);
+        if (allowed == -1) return sent > 0 ? (ssize_t) sent : -1;
+
+        bytes = write_data(file, buf + sent, (size_t) allowed, nonblock);
+        if (bytes == -1) {
+            refund_tokens(file, burst, (size_t) allowed);
+            return sent > 0 ? (ssize_t) sent : -1;
+        }
+        refund_tokens(file, burst, (size_t) (allowed - bytes));
+        sent += (size_t) bytes;
+    } while (!nonblock && bytes == allowed && sent < size);
+
+    return (ssize_t) sent;
+}
+
+size_t netpipe_initial_readahead(void) {
+    if (netpipefs_options.memlimit > 0 && netpipefs_options.readahead > ELASTIC_MIN_READAHEAD)
+        return ELASTIC_MIN_READAHEAD;
+
+    return netpipefs_options.readahead;
+}
+
+/**
+ * Change the capacity of the buffer and charge the difference to the memory budget. The caller should hold
+ * the netpipe lock.
+ *
+ * @param file the file
+ * @param capacity the new capacity
+ * @param force 1 if the buffer should grow even over the memory limit
+ * @return 0 on success, -1 on error and sets errno (ENOMEM if the memory limit is reached)
+ */
+static int resize_buffer(struct netpipe *file, size_t capacity, int force) {
+    int err;
+    size_t old_capacity = cbuf_capacity(file->buffer);
+
+    if (capacity > old_capacity) MINUS1(bufpool_charge(capacity - old_capacity, force), return -1)
+
+    // readers can be reading the buffer without the netpipe lock
+    PTH(err, pthread_mutex_lock(&(file->rd_mtx)), goto undo_charge)
+    err = cbuf_resize(file->buffer, capacity);
+    pthread_mutex_unlock(&(file->rd_mtx));
+    if (err == -1) goto undo_charge;
+
+    if (capacity < old_capacity) bufpool_uncharge(old_capacity - capacity);
+    DEBUG("[%s] buffer capacity %ld -> %ld\n", file->path, old_capacity, capacity);
+
+    return 0;
+
+undo_charge:
+    err = errno;
+    if (capacity > old_capacity) bufpool_uncharge(capacity - old_capacity);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Double the readahead buffer if the remote host filled it, up to the readahead, so a busy netpipe can
+ * receive more data without read requests. The new capacity is given to the remote host. The caller should
+ * hold the netpipe lock.
+ *
+ * @param file the file
+ * @return 0 on success or if the buffer can't grow, -1 on error
+ */
+static int grow_window(struct netpipe *file) {
+    size_t window;
+
+    if (cbuf_size(file->buffer) < file->window || file->window >= netpipefs_options.readahead) return 0;
+
+    window = file->window == 0 ? ELASTIC_MIN_READAHEAD : 2 * file->window;
+    if (window > netpipefs_options.readahead) window = netpipefs_options.readahead;
+    if (window > cbuf_capacity(file->buffer) && resize_buffer(file, window, 0) == -1) {
+        if (errno != ENOMEM) return -1;
+        errno = 0;
+        return 0; // memory limit reached, keep the window
+    }
+
+    file->window = window;
+    MINUS1(netpipefs_flusher_schedule(file, ELASTIC_IDLE_USEC), return -1)
+    if (send_window_message(file->skt, file->remote_handle, window) == -1) return -1;
+
+    return 0;
+}
+
+/**
+ * Shrink the readahead buffer back to the initial capacity if nothing was received for ELASTIC_IDLE_USEC.
+ * The caller should hold the netpipe lock.
+ *
+ * @param file the file
+ * @return microseconds after which the buffer should be checked again or -1 if it is not needed
+ */
+static long shrink_idle_buffer(struct netpipe *file) {
+    long idle;
+    struct timespec elapsed;
+    size_t initial = netpipe_initial_readahead();
+
+    if (file->force_exit || cbuf_capacity(file->buffer) <= initial) return -1;
+
+    elapsed = elapsed_time(&(file->last_recv));
+    if (elapsed.tv_sec == -1) return -1;
+    idle = elapsed.tv_sec * 1000000L + elapsed.tv_nsec / 1000;
+    if (idle < ELASTIC_IDLE_USEC) return ELASTIC_IDLE_USEC - idle;
+    if (!cbuf_empty(file->buffer)) return ELASTIC_IDLE_USEC; // the local readers are idle, not the netpipe
+
+    if (resize_buffer(file, initial, 0) == -1) {
+        perror("failed to shrink readahead buffer");
+        return -1;
+    }
+    if (file->window != initial) {
+        file->window = initial;
+        if (file->writers > 0 && send_window_message(file->skt, file->remote_handle, initial) == -1)
+            perror("failed to send window");
+    }
+
+    return -1;
+}
+
+/**
+ * Send a READ message with the credit gathered for the bytes read. The netpipe lock is not needed.
+ *
+ * @param file the file
+ * @return > 0 on success, 0 if the connection was lost, -1 on error
+ */
+static int flush_credit(struct netpipe *file) {
+    size_t bytes = __atomic_exchange_n(&(file->unacked), 0, __ATOMIC_ACQ_REL);
+
+    if (bytes == 0) return 1;
+
+    return send_read_message(file->skt, file->remote_handle, bytes);
+}
+
+/**
+ * Give back to the remote host the credit for the given bytes read. Credit is gathered and sent with one READ
+ * message when it reaches the ack threshold or a fraction of the readahead buffer, otherwise the flusher
+ * sends it after the ack delay. The netpipe lock is not needed.
+ *
+ * @param file the file
+ * @param bytes how many bytes were read
+ * @param capacity capacity of the readahead buffer
+ * @return > 0 on success, 0 if the connection was lost, -1 on error
+ */
+static int give_credit(struct netpipe *file, size_t bytes, size_t capacity) {
+    size_t unacked, threshold = netpipefs_options.ackbytes;
+
+    if (capacity > 0 && capacity / ACK_WINDOW_FRACTION < threshold) threshold = capacity / ACK_WINDOW_FRACTION;
+
+    unacked = __atomic_add_fetch(&(file->unacked), bytes, __ATOMIC_ACQ_REL);
+    if (unacked >= threshold || netpipefs_options.ackdelay == 0) return flush_credit(file);
+
+    // the first bytes gathered start the timer
+    if (unacked == bytes) MINUS1(netpipefs_flusher_schedule(file, netpipefs_options.ackdelay), return -1)
+
+    return 1;
+}
+
+int netpipe_recv(struct netpipe *file, const char *data, size_t size, void (*poll_notify)(void *)) {
     int err;
     ssize_t bytes;
     char *bufptr;
+    const char *dataptr = data;
     netpipe_req_t *req;
     netpipe_req_l *req_list;
-    size_t toberead, dataread = 0;
+    size_t toberead, capacity, dataread = 0;
 
     NOTZERO(netpipe_lock(file), return -1)
 
-    // Move data from buffer to pending requests
+    // Move data from buffer to pending requests. Readers can get data from the buffer meanwhile, so the
+    // buffer is locked
     req_list = file->req_l;
     req = req_list->head;
-    while(req != NULL && !cbuf_empty(file->buffer)) {
-        bufptr = req->buf + req->bytes_processed;
-        toberead = req->size - req->bytes_processed;
-
-        bytes = cbuf_get(file->buffer, bufptr, toberead);
-        if (bytes == 0) break;
-
-        dataread += bytes;
-        DEBUG("buffered read[%s] %ld bytes\n", file->path, bytes);
-        req->bytes_processed += bytes;
-        if (req->bytes_processed == req->size) {
-            PTH(err, pthread_cond_signal(&(req->waiting)), return dataread);
-            if (req_list->tail == req) req_list->tail = NULL;
-            req = req->next;
-            req_list->head = req;
+    if (req != NULL) {
+        PTH(err, pthread_mutex_lock(&(file->rd_mtx)), netpipe_unlock(file); return -1)
+        while(req != NULL && !cbuf_empty(file->buffer)) {
+            bufptr = req->buf + req->bytes_processed;
+            toberead = req->size - req->bytes_processed;
+
+            bytes = cbuf_get(file->buffer, bufptr, toberead);
+            if (bytes == 0) break;
+
+            dataread += bytes;
+            DEBUG("buffered read[%s] %ld bytes\n", file->path, bytes);
+            req->bytes_processed += bytes;
+            if (req->bytes_processed == req->size) {
+                PTH(err, pthread_cond_signal(&(req->waiting)), pthread_mutex_unlock(&(file->rd_mtx)); netpipe_unlock(file); return -1)
+                if (req_list->tail == req) req_list->tail = NULL;
+                req = req->next;
+                req_list->head = req;
+            }
         }
+        PTH(err, pthread_mutex_unlock(&(file->rd_mtx)), netpipe_unlock(file); return -1)
     }
 
     size_t remaining = size;
-    // Move data from socket to pending requests
-    while(req != NULL && cbuf_empty(file->buffer) && remaining > 0) {
+    // Move received data to pending requests. The netpipe is unlocked while data is copied, the request is
+    // marked as busy so it doesn't end meanwhile
+    while((req = req_list->head) != NULL && cbuf_empty(file->buffer) && remaining > 0) {
         bufptr = req->buf + req->bytes_processed;
         toberead = req->size - req->bytes_processed;
         if (toberead > remaining) toberead = remaining;
 
-        bytes = readn(netpipefs_socket.fd, bufptr, toberead);
-        if (bytes <= 0) {
-            netpipe_unlock(file);
-            return bytes;
+        req->busy = 1;
+        NOTZERO(netpipe_unlock(file), req->busy = 0; return -1)
+        memcpy(bufptr, dataptr, toberead);
+        NOTZERO(netpipe_lock(file), return -1)
+        req->busy = 0;
+
+        if (req_list->head != req) {
+            // the request was ended meanwhile and the reader is waiting for it. It didn't get the bytes copied,
+            // so they go to the next request or to the buffer
+            PTH(err, pthread_cond_signal(&(req->waiting)), netpipe_unlock(file); return -1)
+            continue;
         }
-        dataread += bytes;
-        DEBUG("read[%s] %ld bytes\n", file->path, bytes);
+        dataptr += toberead;
+        dataread += toberead;
+        remaining -= toberead;
+        DEBUG("read[%s] %ld bytes\n", file->path, toberead);
 
-        req->bytes_processed += bytes;
-        remaining -= bytes;
+        req->bytes_processed += toberead;
         if (req->bytes_processed == req->size) {
-            PTH(err, pthread_cond_signal(&(req->waiting)), return dataread);
+            PTH(err, pthread_cond_signal(&(req->waiting)), netpipe_unlock(file); return -1)
             if (req_list->tail == req) req_list->tail = NULL;
-            req = req->next;
-            req_list->head = req;
+            req_list->head = req->next;
         }
     }
 
-    // Put remaining data from socket to the buffer (readahead)
-    if (remaining > 0 && cbuf_capacity(file->buffer) > 0) {
-        bytes = cbuf_readn(netpipefs_socket.fd, file->buffer, remaining);
-        if (bytes <= 0) {
-            netpipe_unlock(file);
-            return bytes;
+    // Put remaining received data to the buffer (readahead)
+    if (remaining > 0 && elastic_buffers) {
+        // data sent before the remote host knew that the buffer shrank can exceed it
+        if (remaining > cbuf_capacity(file->buffer) - cbuf_size(file->buffer)) {
+            MINUS1(resize_buffer(file, cbuf_size(file->buffer) + remaining, 1), netpipe_unlock(file); return -1)
+            MINUS1(netpipefs_flusher_schedule(file, ELASTIC_IDLE_USEC), netpipe_unlock(file); return -1)
         }
+        MINUS1(clock_gettime(CLOCK_MONOTONIC, &(file->last_recv)), netpipe_unlock(file); return -1)
+    }
+    if (remaining > 0 && cbuf_capacity(file->buffer) > 0) {
+        bytes = cbuf_put(file->buffer, dataptr, remaining);
         if ((size_t) bytes != remaining) DEBUG("cannot write locally: buffer is full. SOMETHING IS WRONG!\n");
-        if (dataread + bytes != size) DEBUG("cannot read all data from socket. SOMETHING IS WRONG!\n");
 
         DEBUG("readahead[%s] %ld bytes\n", file->path, bytes);
-    }
-
-    /* Send read message */
-    if (dataread > 0) {
-        bytes = send_read_message(&netpipefs_socket, file->path, dataread);
-        if (bytes <= 0) {
-            netpipe_unlock(file);
-            return bytes;
-        }
+        if (elastic_buffers) MINUS1(grow_window(file), netpipe_unlock(file); return -1)
     }
 
     if (poll_notify) loop_poll_notify(file, poll_notify);
     DEBUGFILE(file);
+    capacity = cbuf_capacity(file->buffer);
 
     NOTZERO(netpipe_unlock(file), return -1)
 
+    /* Give back the credit for data read */
+    if (dataread > 0) {
+        bytes = give_credit(file, dataread, capacity);
+        if (bytes <= 0) return bytes;
+    }
+
     return size;
 }
 
 ssize_t netpipe_read(struct netpipe *file, char *buf, size_t size, int nonblock) {
     int err;
     char *bufptr = (char *) buf;
-    size_t read, remaining;
+    size_t read, bytes, remaining, capacity;
+
+    // Read from buffer (readahead) without the netpipe lock, the dispatcher can put data meanwhile. Bytes read
+    // can be zero if the buffer is empty or the capacity is zero
+    PTH(err, pthread_mutex_lock(&(file->rd_mtx)), return -1)
+    read = cbuf_get(file->buffer, bufptr, size);
+    capacity = cbuf_capacity(file->buffer);
+    PTH(err, pthread_mutex_unlock(&(file->rd_mtx)), return -1)
+    if (read > 0) {
+        DEBUG("buffered read[%s] %ld bytes\n", file->path, read);
+        bufptr += read;
+        if (read == size) {
+            give_credit(file, read, capacity);
+            return read;
+        }
+    }
 
     NOTZERO(netpipe_lock(file), return -1)
 
     if (file->force_exit) {
-        errno = EPIPE;
         netpipe_unlock(file);
+        if (read > 0) return read;
+        errno = EPIPE;
         return -1;
     }
 
-    // Read from buffer (readahead). Bytes read can be zero if the buffer is empty or the capacity is zero
-    read = cbuf_get(file->buffer, bufptr, size);
-    if (read > 0) {
-        err = send_read_message(&netpipefs_socket, file->path, read);
-        if (err <= 0) {
-            netpipe_unlock(file);
-            return read;
-        }
-        DEBUG("buffered read[%s] %ld bytes\n", file->path, read);
-        bufptr += read;
+    // Data may have been put after the buffer was read
+    PTH(err, pthread_mutex_lock(&(file->rd_mtx)), netpipe_unlock(file); return -1)
+    bytes = cbuf_get(file->buffer, bufptr, size - read);
+    capacity = cbuf_capacity(file->buffer);
+    PTH(err, pthread_mutex_unlock(&(file->rd_mtx)), netpipe_unlock(file); return -1)
+    if (bytes > 0) {
+        DEBUG("buffered read[%s] %ld bytes\n", file->path, bytes);
+        bufptr += bytes;
+        read += bytes;
     }
-    // If all the bytes were read
-    if (read == size || nonblock) {
-        if (read == 0) errno = EAGAIN;
+    // If all the bytes were read or there is nothing to wait for. The credit is given back with the netpipe unlocked
+    if (read == size || nonblock || file->writers == 0) {
+        if (read == 0 && (read == size || nonblock)) errno = EAGAIN;
         netpipe_unlock(file);
+        if (read > 0) give_credit(file, read, capacity);
         return read;
     }
 
-    if (file->writers == 0) {
+    // This reader is going to wait, the remote writer may be waiting for the credit gathered so far
+    __atomic_add_fetch(&(file->unacked), read, __ATOMIC_ACQ_REL);
+    err = flush_credit(file);
+    if (err <= 0) {
         netpipe_unlock(file);
         return read;
     }
 
     remaining = size - read;
     netpipe_req_t *request = netpipe_add_request(file, bufptr, remaining, O_RDONLY);
-    err = send_read_request_message(&netpipefs_socket, file->path, remaining);
+    err = send_read_request_message(file->skt, file->remote_handle, remaining);
     if (err <= 0) {
         free(request);
         netpipe_unlock(file);
         return read;
     }
-    while(!file->force_exit && request->bytes_processed != remaining && !request->error) {
+    while(request->busy || (!file->force_exit && request->bytes_processed != remaining && !request->error)) {
         PTH(err, pthread_cond_wait(&(request->waiting), &(file->mtx)), netpipe_unlock(file); return -1)
     }
 
@@ -581,7 +1171,7 @@ ssize_t netpipe_read(struct netpipe *file, char *buf, size_t size, int nonblock)
 }
 
 /**
- * Send data to remote host.
+ * Send data to remote host. The caller should hold the netpipe's send lock and the netpipe lock.
  *
  * @param file the file
  * @return number of bytes sent, 0 if connection is lost, -1 on error
@@ -589,6 +1179,7 @@ ssize_t netpipe_read(struct netpipe *file, char *buf, size_t size, int nonblock)
 static size_t send_data(struct netpipe *file) {
     int err;
     size_t datasent = 0, remaining, bytes;
+    ssize_t written;
     netpipe_req_l *req_list;
     netpipe_req_t *req;
     char *bufptr;
@@ -600,18 +1191,16 @@ static size_t send_data(struct netpipe *file) {
     if (bytes > 0) {
         datasent = bytes;
         DEBUG("flush[%s] %ld bytes\n", file->path, bytes);
-        if (file->writers == 0) PTH(err, pthread_cond_signal(&(file->close)), return -1)
     }
 
-    // If host can still receive data
-    // Handle requests: send data from pending requests
+    // If host can still receive data and the whole buffer was flushed, so the data is sent in order
+    // Handle requests: send data from pending requests. Their writers wait until the sender wrote it
     req_list = file->req_l;
-    req = req_list->head;
-    while(available_remote(file) > 0 && req != NULL) {
+    while(available_remote(file) > 0 && buffered(file) == 0 && (req = req_list->head) != NULL) {
         bufptr = req->buf + req->bytes_processed;
         remaining = req->size - req->bytes_processed;
 
-        err = do_send(file, bufptr, remaining, &bytes);
+        err = do_send(file, req, bufptr, remaining, &bytes);
         if (err <= 0) {
             if (err == 0) req->error = ECONNRESET; //TODO ENOTCONN
             else req->error = errno;
@@ -627,37 +1216,23 @@ static size_t send_data(struct netpipe *file) {
         if (req->bytes_processed == req->size) {
             PTH(err, pthread_cond_signal(&(req->waiting)), return datasent)
             if (req_list->tail == req) req_list->tail = NULL;
-            req = req->next;
+            req_list->head = req->next;
         }
     }
-    req_list->head = req;
 
     // If there are pending requests and there is space into the buffer
     // Put data from requests into the buffer (Writeahead)
-    while(req != NULL && !cbuf_full(file->buffer) && cbuf_capacity(file->buffer) > 0) {
-        bufptr = req->buf + req->bytes_processed;
-        remaining = req->size - req->bytes_processed;
-
-        bytes = cbuf_put(file->buffer, bufptr, remaining);
-        DEBUG("writeahead[%s] %ld bytes\n", file->path, bytes);
-
-        datasent += bytes;
-        req->bytes_processed += bytes;
-        if (req->bytes_processed == req->size) {
-            PTH(err, pthread_cond_signal(&(req->waiting)), return datasent)
-            if (req_list->tail == req) req_list->tail = NULL;
-            req = req->next;
-        }
-    }
-    req_list->head = req;
+    MINUS1(written = writeahead_requests(file), return datasent)
 
-    return datasent;
+    return datasent + written;
 }
 
 int netpipe_read_request(struct netpipe *file, size_t size, void (*poll_notify)(void *)) {
-    int err;
+    int err, mtx_err;
 
-    NOTZERO(netpipe_lock(file), return -1)
+    /* Data is sent by the ones who hold the send lock */
+    PTH(err, pthread_mutex_lock(&(file->snd_mtx)), return -1)
+    NOTZERO(netpipe_lock(file), pthread_mutex_unlock(&(file->snd_mtx)); return -1)
 
     file->remotemax += size;
 
@@ -666,31 +1241,147 @@ int netpipe_read_request(struct netpipe *file, size_t size, void (*poll_notify)(
 
     DEBUGFILE(file);
 
-    NOTZERO(netpipe_unlock(file), return -1)
+    NOTZERO(netpipe_unlock(file), pthread_mutex_unlock(&(file->snd_mtx)); return -1)
+    PTH(mtx_err, pthread_mutex_unlock(&(file->snd_mtx)), return -1)
 
     return err;
 }
 
+/**
+ * Measure the connection with the bytes given back by the remote host, then ask the remote host to resize
+ * its readahead buffer if the bandwidth-delay product changed. The caller should hold the netpipe lock.
+ *
+ * @param file the file
+ * @param size how many bytes were given back
+ * @return 0 on success, -1 on error
+ */
+static int request_window(struct netpipe *file, size_t size) {
+    size_t window, bdp;
+    struct timespec now;
+
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, &now), return -1)
+    MINUS1(bdp_acked(&(netpipefs_socket.bdp), &(file->sampler), size, &now), return -1)
+
+    bdp = bdp_window(&(netpipefs_socket.bdp));
+    if (bdp == 0) return 0;
+
+    // a power of two which shrinks only by a lot, so the window doesn't change at every measure
+    for (window = 1; window < bdp && window < MESSAGE_MAX_LENGTH / 2 + 1; window <<= 1);
+    if (window <= file->requested_window && 4 * window > file->requested_window) return 0;
+
+    file->requested_window = window;
+    if (send_window_request_message(file->skt, file->remote_handle, window) == -1) return -1;
+
+    return 0;
+}
+
 int netpipe_read_update(struct netpipe *file, size_t size, void (*poll_notify)(void *)) {
-    int err;
+    int err, mtx_err;
 
-    NOTZERO(netpipe_lock(file), return -1)
+    /* Data is sent by the ones who hold the send lock */
+    PTH(err, pthread_mutex_lock(&(file->snd_mtx)), return -1)
+    NOTZERO(netpipe_lock(file), pthread_mutex_unlock(&(file->snd_mtx)); return -1)
 
-    file->remotemax -= size;
-    if (file->remotemax < netpipefs_socket.remote_readahead)
-        file->remotemax = netpipefs_socket.remote_readahead;
-    file->remotesize -= size;
+    // the read requests are satisfied, at least the remote buffer can be filled
+    file->remotemax = file->remotemax > file->remotewindow + size ? file->remotemax - size : file->remotewindow;
+    file->remotesize = file->remotesize > size ? file->remotesize - size : 0;
+    MINUS1(request_window(file, size), netpipe_unlock(file); pthread_mutex_unlock(&(file->snd_mtx)); return -1)
 
     err = send_data(file);
     if (err > 0 && poll_notify) loop_poll_notify(file, poll_notify);
 
     DEBUGFILE(file);
 
-    NOTZERO(netpipe_unlock(file), return -1)
+    NOTZERO(netpipe_unlock(file), pthread_mutex_unlock(&(file->snd_mtx)); return -1)
+    PTH(mtx_err, pthread_mutex_unlock(&(file->snd_mtx)), return -1)
 
     return err;
 }
 
+int netpipe_window_update(struct netpipe *file, size_t size, void (*poll_notify)(void *)) {
+    int err, mtx_err;
+
+    /* Data is sent by the ones who hold the send lock */
+    PTH(err, pthread_mutex_lock(&(file->snd_mtx)), return -1)
+    NOTZERO(netpipe_lock(file), pthread_mutex_unlock(&(file->snd_mtx)); return -1)
+
+    // the read requests keep their part of the max
+    file->remotemax = file->remotemax - file->remotewindow + size;
+    file->remotewindow = size;
+    // the remote buffer shrank, it can be asked to grow again
+    if (size < file->requested_window) file->requested_window = size;
+
+    err = send_data(file);
+    if (err > 0 && poll_notify) loop_poll_notify(file, poll_notify);
+
+    DEBUGFILE(file);
+
+    NOTZERO(netpipe_unlock(file), pthread_mutex_unlock(&(file->snd_mtx)); return -1)
+    PTH(mtx_err, pthread_mutex_unlock(&(file->snd_mtx)), return -1)
+
+    return err;
+}
+
+int netpipe_window_request(struct netpipe *file, size_t size) {
+    int ret = 0;
+    size_t initial = netpipe_initial_readahead();
+
+    NOTZERO(netpipe_lock(file), return -1)
+
+    if (!autotuning || file->force_exit || file->open_mode != O_RDONLY) goto unlock;
+
+    if (size < AUTOTUNE_MIN_READAHEAD) size = AUTOTUNE_MIN_READAHEAD;
+    if (size > netpipefs_options.maxreadahead) size = netpipefs_options.maxreadahead;
+    if (size < initial) size = initial;
+    if (size < cbuf_size(file->buffer)) {
+        size = cbuf_capacity(file->buffer); // it will shrink when the netpipe is idle
+    } else if (size != cbuf_capacity(file->buffer) && resize_buffer(file, size, 0) == -1) {
+        if (errno != ENOMEM) {
+            ret = -1;
+            goto unlock;
+        }
+        errno = 0;
+        size = file->window; // memory limit reached, keep the window
+    }
+
+    if (size != file->window) {
+        file->window = size;
+        if (size > initial) MINUS1(netpipefs_flusher_schedule(file, ELASTIC_IDLE_USEC), ret = -1; goto unlock)
+        if (send_window_message(file->skt, file->remote_handle, size) == -1) ret = -1;
+    }
+
+unlock:
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    return ret;
+}
+
+long netpipe_flush_timeout(struct netpipe *file) {
+    int err;
+    size_t bytes;
+
+    if (file->open_mode == O_RDONLY) {
+        if (flush_credit(file) == -1) perror("failed to give back credit");
+        return shrink_idle_buffer(file);
+    }
+
+    if (file->force_exit || file->open_mode != O_WRONLY || file->readers == 0 || buffered(file) == 0)
+        return -1;
+
+    err = do_flush(file, &bytes);
+    if (err <= 0) {
+        perror("failed to flush coalesced data");
+        return -1;
+    }
+
+    if (bytes > 0) DEBUG("flush[%s] %ld bytes\n", file->path, bytes);
+
+    /* What the remote host can't take yet is flushed when it gives more credit, see netpipe_read_update() */
+    if (buffered(file) > 0 && available_remote(file) > 0) return 0;
+
+    return -1;
+}
+
 int netpipe_poll(struct netpipe *file, void *ph, unsigned int *reventsp) {
     struct poll_handle *newph = (struct poll_handle *) malloc(sizeof(struct poll_handle));
     if (newph == NULL) return -1;
@@ -752,20 +1443,26 @@ int netpipe_close(struct netpipe *file, int mode, int (*remove_open_file)(const
                 PTH(err, pthread_cond_wait(&(file->close), &(file->mtx)), netpipe_unlock(file); return -1)
             }
         }
+        // the sender writes the flushed data from the buffer, which can't be freed before
+        while(file->writers == 0 && file->flushing > 0) {
+            PTH(err, pthread_cond_wait(&(file->close), &(file->mtx)), netpipe_unlock(file); return -1)
+        }
     } else if (mode == O_RDONLY) {
         file->readers--;
+        // the credit is given back before the remote host knows that the reader is gone
+        if (flush_credit(file) <= 0) err = -1;
     }
 
     if (poll_notify) loop_poll_notify(file, poll_notify);
 
-    bytes = send_close_message(&netpipefs_socket, file->path, mode);
+    bytes = send_close_message(file->skt, file, mode);
     if (bytes <= 0) err = -1;
 
     DEBUGFILE(file);
     if (file->writers == 0 && file->readers == 0 && available_remote(file) == 0) {
         if (remove_open_file) MINUS1(remove_open_file(file->path), err = -1)
         NOTZERO(netpipe_unlock(file), err = -1)
-        MINUS1(netpipe_free(file, NULL), err = -1)
+        MINUS1(netpipe_put(file, NULL), err = -1)
     } else {
         NOTZERO(netpipe_unlock(file), err = -1)
     }
@@ -796,6 +1493,10 @@ int netpipe_close_update(struct netpipe *file, int mode, int (*remove_open_file)
         if (file->readers == 0) {
             file->remotesize = 0;
             file->remotemax = netpipefs_socket.remote_readahead;
+            file->remotewindow = netpipefs_socket.remote_readahead;
+            file->requested_window = 0;
+            bdp_sampler_init(&(file->sampler));
+            PTH(err, pthread_cond_broadcast(&(file->tokens)), netpipe_unlock(file); return -1)
             foreach_request(file, req) { // set error = EPIPE to all write requests
                 req->error = EPIPE;
                 PTH(err, pthread_cond_signal(&(req->waiting)), netpipe_unlock(file); return -1)
@@ -808,11 +1509,11 @@ int netpipe_close_update(struct netpipe *file, int mode, int (*remove_open_file)
     if (poll_notify) loop_poll_notify(file, poll_notify);
     DEBUGFILE(file);
 
-    if (file->writers == 0 && file->readers == 0 && available_remote(file) == 0) {
+    if (file->writers == 0 && file->readers == 0 && available_remote(file) == 0 && file->flushing == 0) {
         err = 0;
         if (remove_open_file) MINUS1(remove_open_file(file->path), err = -1)
         MINUS1(netpipe_unlock(file), err = -1)
-        MINUS1(netpipe_free(file, NULL), err = -1)
+        MINUS1(netpipe_put(file, NULL), err = -1)
 
         return err;
     }
@@ -831,6 +1532,7 @@ int netpipe_force_exit(struct netpipe *file, void (*poll_notify)(void *)) {
     file->force_exit = 1;
     PTH(err, pthread_cond_broadcast(&(file->canopen)), netpipe_unlock(file); return -1)
     PTH(err, pthread_cond_broadcast(&(file->close)), netpipe_unlock(file); return -1)
+    PTH(err, pthread_cond_broadcast(&(file->tokens)), netpipe_unlock(file); return -1)
 
     // set error = EPIPE to all write requests
     foreach_request(file, req) {
@@ -1,19 +1,41 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include "../include/options.h"
 #include "../include/netpipefs_socket.h"
+#include "../include/rudp.h"
 #include "../include/scfiles.h"
 #include "../include/sock.h"
 #include "../include/utils.h"
 
 #define UNIX_PATH_MAX 108
 #define BASESOCKNAME "/tmp/sockfile"
+#define HELLO_SIZE 48       // bytes of the settings exchanged when connecting, before the host
+#define HELLO_MAX_HOST 255  // max bytes of the host exchanged when connecting
+#define HELLO_SHM 1         // the host wants shared memory and has created its ring
+#define HELLO_UDP 2         // the host wants UDP
+#define HELLO_RESUME 4      // the host resumes its session
+
+/** Settings that the hosts exchange when they connect */
+struct netpipefs_hello {
+    uint64_t readahead; // capacity of the readahead buffers when the netpipes are opened
+    uint64_t flags;     // HELLO_SHM, HELLO_UDP
+    uint64_t stripes;   // how many connections the host wants
+    uint64_t replay;    // bytes of the host's replay window, see netpipefs_options.replay
+    uint64_t session;   // the host's session, the one it resumes with HELLO_RESUME
+    char *host;         // address of the remote host, as the host knows it
+};
 
 /**
  * Set up a AF_INET address with the given ip and port
@@ -80,225 +102,1657 @@ ports_diff:
     return firstport - secondport;
 }
 
-int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long timeout) {
-    int err, fdlisten, fdaccepted, fdconnect, comparison, localhost;
-    char *host_received = NULL;
-    struct sockaddr *conn_sa;
+/** Write the given 64 bits value into dest in network byte order */
+static void pack_u64(unsigned char *dest, uint64_t value) {
+    uint32_t high = htonl((uint32_t) (value >> 32)), low = htonl((uint32_t) value);
+    memcpy(dest, &high, sizeof(uint32_t));
+    memcpy(dest + sizeof(uint32_t), &low, sizeof(uint32_t));
+}
+
+/** Read a 64 bits value written by pack_u64() */
+static uint64_t unpack_u64(const unsigned char *src) {
+    uint32_t high, low;
+    memcpy(&high, src, sizeof(uint32_t));
+    memcpy(&low, src + sizeof(uint32_t), sizeof(uint32_t));
+    return ((uint64_t) ntohl(high) << 32) | ntohl(low);
+}
+
+/** Returns how many items there are in a comma separated list */
+static size_t list_count(const char *list) {
+    size_t count = 1;
+
+    if (list == NULL || *list == '\0') return 0;
+    for (; *list != '\0'; list++) {
+        if (*list == ',') count++;
+    }
+
+    return count;
+}
+
+/**
+ * Copy an item of a comma separated list. The index wraps around, so the items are taken in turn.
+ *
+ * @param list the list
+ * @param index index of the item
+ * @param dest where the item is copied, NUL terminated
+ * @param size size of dest
+ * @return 1 if the item was copied, 0 if the list is empty or the item doesn't fit into dest
+ */
+static int list_item(const char *list, size_t index, char *dest, size_t size) {
+    size_t count = list_count(list), len;
+    const char *end;
+
+    if (count == 0) return 0;
+    for (index %= count; index > 0; index--) list = strchr(list, ',') + 1;
+    if ((end = strchr(list, ',')) == NULL) end = list + strlen(list);
+    len = (size_t) (end - list);
+    if (len >= size) return 0;
+    memcpy(dest, list, len);
+    dest[len] = '\0';
+
+    return 1;
+}
+
+/**
+ * Open another connection with the remote host. Over AF_INET the connection goes from the next address of
+ * netpipefs_options.stripelocal to the next address of netpipefs_options.striperemote, so the connections can
+ * use different network interfaces. Without them it goes from any address to the remote host.
+ *
+ * @param conn_sa address of the remote host
+ * @param index index of the connection
+ * @return the file descriptor of the connection, -1 on error and sets errno
+ */
+static int connect_stripe(const struct sockaddr *conn_sa, size_t index) {
+    int fd;
+    char ip[INET_ADDRSTRLEN];
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(struct sockaddr_un);
+
+    MINUS1(fd = socket(conn_sa->sa_family, SOCK_STREAM, 0), return -1)
+    if (conn_sa->sa_family == AF_INET) {
+        len = sizeof(struct sockaddr_in);
+        if (list_item(netpipefs_options.stripelocal, index - 1, ip, sizeof(ip))) {
+            MINUS1(afinet_address(&sin, 0, ip), close(fd); return -1)
+            MINUS1(bind(fd, (const struct sockaddr *) &sin, len), close(fd); return -1)
+        }
+        memcpy(&sin, conn_sa, len);
+        if (list_item(netpipefs_options.striperemote, index - 1, ip, sizeof(ip)) && inet_pton(AF_INET, ip, &(sin.sin_addr)) != 1) {
+            close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+        conn_sa = (const struct sockaddr *) &sin;
+    }
+    MINUS1(connect(fd, conn_sa, len), close(fd); return -1)
+
+    return fd;
+}
+
+/**
+ * Accept another connection from the remote host.
+ *
+ * @param fdlisten the socket that accepts the connections
+ * @param timeout maximum time to wait, in milliseconds
+ * @return the file descriptor of the connection, -1 on error and sets errno. On timeout it sets errno to ETIMEDOUT
+ */
+static int accept_stripe(int fdlisten, long timeout) {
+    int res;
+    struct pollfd pfd;
+
+    pfd.fd = fdlisten;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    MINUS1(res = poll(&pfd, 1, (int) timeout), return -1)
+    if (res == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return accept(fdlisten, NULL, 0);
+}
+
+/** Close the connections with the remote host after the first one and free them */
+static void end_stripes(struct netpipefs_socket *skt) {
+    size_t i;
+    struct netpipefs_socket *stripe;
+
+    for (i = 1; i < skt->nstripes; i++) {
+        if ((stripe = skt->stripes[i]) == NULL) continue;
+        stripe->transport->close(stripe);
+        free_socket_recv_buffer(stripe);
+        replay_free(&(stripe->replay));
+        pthread_mutex_destroy(&(stripe->wr_mtx));
+        pthread_cond_destroy(&(stripe->wr_cond));
+        free(stripe);
+    }
+    free(skt->stripes);
+    skt->stripes = NULL;
+}
+
+/**
+ * Open the connections with the remote host after the first one. The host that keeps the connection it opened
+ * opens the others too: it sends the index of each connection first. The other host accepts them.
+ *
+ * @param skt the first connection. Its nstripes is how many connections there should be
+ * @param fdlisten the socket that accepts the connections
+ * @param conn_sa address of the remote host
+ * @param opener 1 if the connections are opened by this host, 0 if they are accepted
+ * @param timeout maximum time allowed to establish each connection, in milliseconds
+ * @return 0 on success, -1 on error and sets errno
+ */
+static int establish_stripes(struct netpipefs_socket *skt, int fdlisten, struct sockaddr *conn_sa, int opener, long timeout) {
+    int err, fd;
+    size_t i;
+    uint32_t index;
+    struct netpipefs_socket *stripe;
+
+    EQNULL(skt->stripes = (struct netpipefs_socket **) calloc(skt->nstripes, sizeof(struct netpipefs_socket *)), return -1)
+    skt->stripes[0] = skt;
+    skt->stripe = 0;
+
+    for (i = 1; i < skt->nstripes; i++) {
+        if (opener) {
+            MINUS1(fd = connect_stripe(conn_sa, i), return -1)
+            index = htonl((uint32_t) i);
+            if ((err = writen(fd, &index, sizeof(uint32_t))) <= 0) {
+                close(fd);
+                if (err == 0) errno = ECONNRESET;
+                return -1;
+            }
+            index = (uint32_t) i;
+        } else {
+            MINUS1(fd = accept_stripe(fdlisten, timeout), return -1)
+            if ((err = readn(fd, &index, sizeof(uint32_t))) <= 0) {
+                close(fd);
+                if (err == 0) errno = ECONNRESET;
+                return -1;
+            }
+            index = ntohl(index);
+            if (index == 0 || index >= skt->nstripes || skt->stripes[index] != NULL) {
+                close(fd);
+                errno = EPROTO;
+                return -1;
+            }
+        }
+
+        EQNULL(stripe = (struct netpipefs_socket *) calloc(1, sizeof(struct netpipefs_socket)), close(fd); return -1)
+        if ((err = pthread_mutex_init(&(stripe->wr_mtx), NULL)) != 0) {
+            close(fd);
+            free(stripe);
+            errno = err;
+            return -1;
+        }
+        if ((err = pthread_cond_init(&(stripe->wr_cond), NULL)) != 0) {
+            pthread_mutex_destroy(&(stripe->wr_mtx));
+            close(fd);
+            free(stripe);
+            errno = err;
+            return -1;
+        }
+        stripe->fd = fd;
+        stripe->transport = skt->transport;
+        stripe->remote_readahead = skt->remote_readahead;
+        stripe->remote_replay = skt->remote_replay;
+        stripe->maxmessage = skt->maxmessage;
+        stripe->stripe = index;
+        stripe->nstripes = skt->nstripes;
+        stripe->stripes = skt->stripes;
+        skt->stripes[index] = stripe;
+    }
+
+    return 0;
+}
+
+/**
+ * Create the shared memory ring where the remote host, on the same machine, will write the messages. It should fit
+ * the largest message, the data that fills the local readahead buffer, with SHM_MIN_SIZE bytes to spare for the
+ * read requests that it can answer too and for the messages that follow.
+ *
+ * @param skt the connection
+ * @return 0 on success, -1 on error and sets errno (ENOSYS if the kernel doesn't support memfd)
+ */
+static int create_shm(struct netpipefs_socket *skt) {
+    size_t size = SHM_MIN_SIZE, largest = netpipefs_options.readahead;
+
+    if (netpipefs_options.maxreadahead > largest) largest = netpipefs_options.maxreadahead;
+    while (size < largest + SHM_MIN_SIZE) size *= 2;
+
+    EQNULL(skt->shm_rx = (struct netpipefs_shm *) malloc(sizeof(struct netpipefs_shm)), return -1)
+    if (shm_create(skt->shm_rx, size) == -1) {
+        free(skt->shm_rx);
+        skt->shm_rx = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Unmap the shared memory rings, if any, and free them */
+static void end_shm(struct netpipefs_socket *skt) {
+    if (skt->shm_rx) {
+        shm_free(skt->shm_rx);
+        free(skt->shm_rx);
+        skt->shm_rx = NULL;
+    }
+    if (skt->shm_tx) {
+        shm_free(skt->shm_tx);
+        free(skt->shm_tx);
+        skt->shm_tx = NULL;
+    }
+}
+
+/**
+ * Give the local ring to the remote host through the AF_UNIX socket and map the remote host's one, where the
+ * messages will be sent.
+ *
+ * @param skt the connection, with the local ring
+ * @return 0 on success, -1 on error and sets errno
+ */
+static int exchange_shm(struct netpipefs_socket *skt) {
+    int err, fds[3];
+
+    fds[0] = skt->shm_rx->memfd;
+    fds[1] = skt->shm_rx->data_efd;
+    fds[2] = skt->shm_rx->space_efd;
+    MINUS1(sock_send_fds(skt->fd, fds, 3), return -1)
+    if ((err = sock_recv_fds(skt->fd, fds, 3)) <= 0) {
+        if (err == 0) errno = ECONNRESET;
+        return -1;
+    }
+
+    EQNULL(skt->shm_tx = (struct netpipefs_shm *) malloc(sizeof(struct netpipefs_shm)), goto error)
+    if (shm_attach(skt->shm_tx, fds[0], fds[1], fds[2]) == -1) {
+        free(skt->shm_tx);
+        skt->shm_tx = NULL;
+        goto error;
+    }
+
+    return 0;
+
+error:
+    err = errno;
+    close(fds[0]);
+    close(fds[1]);
+    close(fds[2]);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Carry the messages over UDP from now on, see rudp.h. Each host binds its UDP socket to its own port and connects
+ * it to the remote host's one. The TCP connection stays open, so each host knows when the other one is gone.
+ *
+ * @param skt the connection, over TCP
+ * @return 0 on success, -1 on error and sets errno. On error the connection is still over TCP
+ */
+static int establish_udp(struct netpipefs_socket *skt) {
+    int fd, err, size = RUDP_SNDBUF;
+    unsigned char ready[8];
+    struct sockaddr_in local, remote;
+    struct rudp *r;
+
+    MINUS1(afinet_address(&local, netpipefs_options.port, NULL), return -1)
+    MINUS1(afinet_address(&remote, netpipefs_options.hostport, netpipefs_options.hostip), return -1)
+    MINUS1(fd = socket(AF_INET, SOCK_DGRAM, 0), return -1)
+    MINUS1(bind(fd, (const struct sockaddr *) &local, sizeof(local)), goto error)
+    MINUS1(connect(fd, (const struct sockaddr *) &remote, sizeof(remote)), goto error)
+
+    /* room for a congestion window, if the system allows it */
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(int)) == -1) errno = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int)) == -1) errno = 0;
+
+    /* both sockets exist before the first datagram is sent */
+    pack_u64(ready, 1);
+    if ((err = writen(skt->fd, ready, sizeof(ready))) <= 0 || (err = readn(skt->fd, ready, sizeof(ready))) <= 0) {
+        if (err == 0) errno = ECONNRESET;
+        goto error;
+    }
+
+    EQNULL(r = rudp_create(fd, skt->fd), goto error)
+    skt->transport_data = r;
+    skt->fd = rudp_data_fd(r);
+
+    return 0;
+
+error:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Write the settings of this host, in a single message: the readahead value, the capabilities, how many connections
+ * it wants, its replay window and session and the address of the remote host as this host knows it.
+ *
+ * @param fd connection with the remote host
+ * @param hello the settings
+ * @return > 0 on success, 0 if the connection was closed, -1 on error and sets errno
+ */
+static int write_hello(int fd, const struct netpipefs_hello *hello) {
+    int res;
+    size_t host_len = strlen(hello->host);
+    unsigned char *buf;
+
+    if (host_len > HELLO_MAX_HOST) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    EQNULL(buf = (unsigned char *) malloc(HELLO_SIZE + host_len), return -1)
+    pack_u64(buf, hello->readahead);
+    pack_u64(buf + 8, hello->flags);
+    pack_u64(buf + 16, hello->stripes);
+    pack_u64(buf + 24, hello->replay);
+    pack_u64(buf + 32, hello->session);
+    pack_u64(buf + 40, (uint64_t) host_len);
+    memcpy(buf + HELLO_SIZE, hello->host, host_len);
+    res = writen(fd, buf, HELLO_SIZE + host_len);
+    free(buf);
+
+    return res;
+}
+
+/**
+ * Read the settings written by the remote host with write_hello(). The host is allocated and the caller should free
+ * it.
+ *
+ * @param fd connection with the remote host
+ * @param hello it will be set with the settings
+ * @return > 0 on success, 0 if the connection was closed, -1 on error and sets errno. If the message is not valid it
+ * sets errno to EPROTO
+ */
+static int read_hello(int fd, struct netpipefs_hello *hello) {
+    int res;
+    uint64_t host_len;
+    unsigned char buf[HELLO_SIZE];
+
+    if ((res = readn(fd, buf, HELLO_SIZE)) <= 0) return res;
+    hello->readahead = unpack_u64(buf);
+    hello->flags = unpack_u64(buf + 8);
+    hello->stripes = unpack_u64(buf + 16);
+    hello->replay = unpack_u64(buf + 24);
+    hello->session = unpack_u64(buf + 32);
+    host_len = unpack_u64(buf + 40);
+    if (host_len > HELLO_MAX_HOST) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    EQNULL(hello->host = (char *) malloc(host_len + 1), return -1)
+    if (host_len > 0 && (res = readn(fd, hello->host, host_len)) <= 0) {
+        free(hello->host);
+        hello->host = NULL;
+        return res;
+    }
+    hello->host[host_len] = '\0';
 
-    size_t host_len = strlen(netpipefs_options.hostip);
-    if (host_len == 0) return -1;
+    return 1;
+}
+
+/** A number which tells a session from the earlier ones of the same hosts */
+static uint64_t new_session(void) {
+    struct timespec now = {0, 0};
+
+    if (clock_gettime(CLOCK_REALTIME, &now) == -1) errno = 0;
+    return ((uint64_t) getpid() << 32) ^ ((uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec);
+}
+
+/**
+ * Establish the connection over sockets. When the hosts have different ports the one with the greater port connects
+ * and the other one accepts, so only one connection is opened. With the same port, on different machines, each host
+ * knows only the address of the other one: both hosts connect and accept, and the one chosen by hostcmp() keeps the
+ * connection that it opened. The hosts exchange their settings at once, then set up what both of them want.
+ * When a session is resumed both hosts should resume the same one, with the same connections, and nothing else
+ * is set up.
+ *
+ * @param netpipefs_socket socket structure
+ * @param localhost 1 if AF_UNIX sockets are used, 0 if AF_INET
+ * @param timeout maximum time allowed to establish the connection. Expressed in milliseconds.
+ * @param resumed the first connection of the session that is resumed, NULL to begin a new session
+ * @return 0 on success, -1 on error and sets errno. On timeout it returns -1 and sets errno to ETIMEDOUT. If the
+ * remote host doesn't resume the same session it sets errno to EPROTO
+ */
+static int establish_fd_connection(struct netpipefs_socket *netpipefs_socket, int localhost, long timeout, const struct netpipefs_socket *resumed) {
+    int err, fd, fdlisten = -1, fdaccepted = -1, fdconnect = -1, comparison, shm = 0, udp = 0, reuse = 1;
+    struct netpipefs_hello hello, remote_hello;
+    struct sockaddr_un conn_sa_un, acc_sa_un;
+    struct sockaddr_in conn_sa_in, acc_sa_in;
+    struct sockaddr *conn_sa, *acc_sa;
+    socklen_t acc_len;
+
+    remote_hello.host = NULL;
+    if (strlen(netpipefs_options.hostip) == 0) return -1;
 
     /* Set the sock addresses used for connect() and accept() */
-    localhost = strcmp(netpipefs_options.hostip, "localhost") == 0;
     if (localhost) { // af_unix
-        struct sockaddr_un acc_sa_un;
-        struct sockaddr_un conn_sa_un;
         afunix_address(&conn_sa_un, netpipefs_options.hostport);
         conn_sa = (struct sockaddr *) &conn_sa_un;
         afunix_address(&acc_sa_un, netpipefs_options.port);
-
-        /* Create accept() socket */
-        MINUS1(fdlisten = socket(acc_sa_un.sun_family, SOCK_STREAM, 0), return -1)
-        /* Bind */
-        MINUS1(bind(fdlisten, (const struct sockaddr *) &acc_sa_un, sizeof(acc_sa_un)), close(fdlisten); return -1)
+        acc_sa = (struct sockaddr *) &acc_sa_un;
+        acc_len = sizeof(acc_sa_un);
     } else { // af_inet
-        struct sockaddr_in acc_sa_in;
-        struct sockaddr_in conn_sa_in;
-        err = afinet_address(&conn_sa_in, netpipefs_options.hostport, netpipefs_options.hostip);
-        if (err == -1) return -1;
+        MINUS1(afinet_address(&conn_sa_in, netpipefs_options.hostport, netpipefs_options.hostip), return -1)
         conn_sa = (struct sockaddr *) &conn_sa_in;
+        MINUS1(afinet_address(&acc_sa_in, netpipefs_options.port, NULL), return -1)
+        acc_sa = (struct sockaddr *) &acc_sa_in;
+        acc_len = sizeof(acc_sa_in);
+    }
 
-        err = afinet_address(&acc_sa_in, netpipefs_options.port, NULL);
-        if (err == -1) return -1;
+    /* less than 0 if this host connects, greater than 0 if it accepts, 0 if it does both */
+    comparison = netpipefs_options.hostport - netpipefs_options.port;
 
-        /* Create accept() socket */
-        MINUS1(fdlisten = socket(acc_sa_in.sin_family, SOCK_STREAM, 0), return -1)
-        /* Bind */
-        MINUS1(bind(fdlisten, (const struct sockaddr *) &acc_sa_in, sizeof(acc_sa_in)), close(fdlisten); return -1)
+    if (comparison >= 0) {
+        /* Create accept() socket, bind and listen. It keeps listening for the other connections, if any */
+        MINUS1(fdlisten = socket(acc_sa->sa_family, SOCK_STREAM, 0), return -1)
+        /* the port is still taken by the lost connection when the session is resumed */
+        if (!localhost) MINUS1(setsockopt(fdlisten, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)), close(fdlisten); return -1)
+        MINUS1(bind(fdlisten, (const struct sockaddr *) acc_sa, acc_len), close(fdlisten); return -1)
+        MINUS1(listen(fdlisten, SOMAXCONN), goto error)
+    }
+    if (comparison <= 0) {
+        /* Create connect() socket */
+        MINUS1(fdconnect = socket(conn_sa->sa_family, SOCK_STREAM, 0), goto error)
     }
 
-    /* Create connect() socket */
-    MINUS1(fdconnect = socket(conn_sa->sa_family, SOCK_STREAM, 0), return -1)
-    /* Listen */
-    MINUS1(listen(fdlisten, SOMAXCONN), close(fdlisten); close(fdconnect); return -1)
+    MINUS1(fd = sock_connect_while_accept(fdconnect, fdlisten, conn_sa, timeout, CONNECT_INTERVAL), goto error)
+    if (fdlisten != -1) fdaccepted = fd;
 
-    fdaccepted = sock_connect_while_accept(fdconnect, fdlisten, conn_sa, timeout, CONNECT_INTERVAL);
-    // do not listen for other connections
-    close(fdlisten);
-    if (localhost)
-        MINUS1(unlink_afunix_socket(netpipefs_options.port), goto error)
-
-    if (fdaccepted == -1) { // double connect failed
-        close(fdconnect);
-        return -1;
+    /* on the same machine both hosts use shared memory if they can and want to */
+    if (localhost && netpipefs_options.shm && resumed == NULL) {
+        if (create_shm(netpipefs_socket) == 0) shm = 1;
+        else errno = 0; // without memfd the socket is used
     }
-
-    /* send host */
-    err = sock_write_h(fdconnect, (void *) netpipefs_options.hostip, sizeof(char) * (1 + host_len));
+    /* over AF_INET both hosts use UDP if both of them want to */
+    if (!localhost && netpipefs_socket->transport == &netpipefs_udp_transport && resumed == NULL) udp = 1;
+
+    /*
+     * send the local settings: the readahead value is the capacity that the readahead buffers have when the netpipes
+     * are opened. Then read the remote ones
+     */
+    hello.readahead = netpipe_initial_readahead();
+    hello.flags = (shm ? HELLO_SHM : 0) | (udp ? HELLO_UDP : 0) | (resumed != NULL ? HELLO_RESUME : 0);
+    hello.stripes = resumed != NULL ? socket_stripes(resumed) : netpipefs_options.stripes;
+    hello.replay = netpipefs_options.replay;
+    hello.session = resumed != NULL ? resumed->session : new_session();
+    hello.host = netpipefs_options.hostip;
+    err = write_hello(fdconnect != -1 ? fdconnect : fdaccepted, &hello);
     if (err <= 0) goto error;
-
-    /* read other host */
-    err = sock_read_h(fdaccepted, (void **) &host_received);
+    err = read_hello(fdaccepted != -1 ? fdaccepted : fdconnect, &remote_hello);
     if (err <= 0) goto error;
 
-    /* compare the hosts */
-    comparison = hostcmp(netpipefs_options.hostip, netpipefs_options.hostport, host_received, netpipefs_options.port);
+    /* a session is resumed only if the remote host resumes the same one */
+    if (resumed != NULL && (!(remote_hello.flags & HELLO_RESUME) || remote_hello.session != resumed->remote_session ||
+                            remote_hello.stripes != hello.stripes)) {
+        errno = EPROTO;
+        goto error;
+    }
+    if (resumed == NULL && (remote_hello.flags & HELLO_RESUME)) {
+        errno = EPROTO;
+        goto error;
+    }
 
+    /* with two connections compare the hosts */
+    if (comparison == 0) {
+        comparison = hostcmp(netpipefs_options.hostip, netpipefs_options.hostport, remote_hello.host, netpipefs_options.port);
+        if (comparison == 0) {
+            errno = EINVAL;
+            goto error;
+        }
+    }
     if (comparison > 0) { // use fdaccepted (acc_sa)
-        MINUS1(close(fdconnect), goto error)
+        if (fdconnect != -1) MINUS1(close(fdconnect), fdconnect = -1; goto error)
         fdconnect = -1;
-
         netpipefs_socket->fd = fdaccepted;
-    } else if (comparison < 0) { // use fdconnect (conn_sa)
-        MINUS1(close(fdaccepted), goto error)
+    } else { // use fdconnect (conn_sa)
+        if (fdaccepted != -1) MINUS1(close(fdaccepted), fdaccepted = -1; goto error)
         fdaccepted = -1;
-
         netpipefs_socket->fd = fdconnect;
+    }
+    netpipefs_socket->remote_readahead = remote_hello.readahead;
+
+    /* with shared memory one connection is enough */
+    if (shm && (remote_hello.flags & HELLO_SHM)) {
+        MINUS1(exchange_shm(netpipefs_socket), goto error)
     } else {
-        errno = EINVAL;
-        goto error;
+        shm = 0;
+        end_shm(netpipefs_socket);
+    }
+    netpipefs_socket->maxmessage = shm ? netpipefs_socket->shm_tx->size : 0;
+
+    /* with UDP one connection is enough too */
+    if (!localhost) {
+        if (!udp || !(remote_hello.flags & HELLO_UDP)) {
+            udp = 0;
+            netpipefs_socket->transport = &netpipefs_tcp_transport;
+        }
     }
 
-    /* send local readahead value */
-    err = writen(netpipefs_socket->fd, &netpipefs_options.readahead, sizeof(size_t));
-    if (err <= 0) goto error;
+    /* the session can be resumed if both hosts keep what they send, and it goes through sockets */
+    netpipefs_socket->session = hello.session;
+    netpipefs_socket->remote_session = remote_hello.session;
+    netpipefs_socket->remote_replay = 0;
+    if (!shm && !udp && hello.replay > 0) netpipefs_socket->remote_replay = (size_t) remote_hello.replay;
+    if (netpipefs_socket->remote_replay > 0) netpipefs_socket->maxmessage = REPLAY_MAX_BATCH(netpipefs_options.replay);
 
-    /* read remote readahead value */
-    err = readn(netpipefs_socket->fd, &netpipefs_socket->remote_readahead, sizeof(size_t));
-    if (err <= 0) goto error;
+    /* both hosts use as many connections as the one that wants less */
+    netpipefs_socket->nstripes = remote_hello.stripes < hello.stripes ? remote_hello.stripes : hello.stripes;
+    if (shm || udp || netpipefs_socket->nstripes == 0) netpipefs_socket->nstripes = 1;
+    if (netpipefs_socket->nstripes > 1)
+        MINUS1(establish_stripes(netpipefs_socket, fdlisten, conn_sa, comparison < 0, timeout), goto error)
+    if (udp) MINUS1(establish_udp(netpipefs_socket), goto error)
 
-    free(host_received);
+    // do not listen for other connections
+    if (fdlisten != -1) {
+        close(fdlisten);
+        if (localhost) unlink_afunix_socket(netpipefs_options.port);
+    }
+
+    free(remote_hello.host);
     return 0;
 
 error:
+    err = errno;
+    if (fdlisten != -1) {
+        close(fdlisten);
+        if (localhost) unlink_afunix_socket(netpipefs_options.port);
+    }
+    if (netpipefs_socket->stripes) end_stripes(netpipefs_socket);
+    end_shm(netpipefs_socket);
     if (fdaccepted != -1) close(fdaccepted);
     if (fdconnect != -1) close(fdconnect);
-    if (host_received) free(host_received);
+    if (remote_hello.host) free(remote_hello.host);
+    errno = err;
     return -1;
 }
 
+static int tcp_connect(struct netpipefs_socket *skt, long timeout) {
+    return establish_fd_connection(skt, 0, timeout, NULL);
+}
+
+static int unix_connect(struct netpipefs_socket *skt, long timeout) {
+    return establish_fd_connection(skt, 1, timeout, NULL);
+}
+
+/** Over TCP, until both hosts agree to use UDP. Then the transport's functions go to the UDP connection */
+static int udp_connect(struct netpipefs_socket *skt, long timeout) {
+    return establish_fd_connection(skt, 0, timeout, NULL);
+}
+
+/**
+ * Queue the whole messages at the start of the buffers on the UDP connection. The messages for a netpipe go on the
+ * stream of the handle which they are sent to, so a lost datagram delays only that netpipe. OPEN messages carry the
+ * sender's handle and go on stream 0, which every stream waits for: a netpipe is never written before it is opened.
+ */
+static ssize_t udp_send(struct netpipefs_socket *skt, const struct iovec *iov, int iovcnt) {
+    int i;
+    unsigned char header[MESSAGE_HEADER_SIZE];
+    size_t total = 0, offset = 0, skip, copied, n, length;
+    uint32_t value, stream;
+
+    for (i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    while (total - offset >= MESSAGE_HEADER_SIZE) {
+        /* the header can be split between buffers */
+        for (i = 0, skip = offset, copied = 0; copied < MESSAGE_HEADER_SIZE; i++) {
+            if (skip >= iov[i].iov_len) {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            n = iov[i].iov_len - skip < MESSAGE_HEADER_SIZE - copied ? iov[i].iov_len - skip : MESSAGE_HEADER_SIZE - copied;
+            memcpy(header + copied, (char *) iov[i].iov_base + skip, n);
+            copied += n;
+            skip = 0;
+        }
+
+        memcpy(&value, header + 12, sizeof(uint32_t));
+        length = MESSAGE_HEADER_SIZE + (size_t) ntohl(value);
+        if (total - offset < length) break; // the rest of the message comes with the next call
+        memcpy(&value, header + 4, sizeof(uint32_t));
+        stream = header[0] == OPEN ? 0 : ntohl(value);
+
+        if (rudp_send((struct rudp *) skt->transport_data, stream, iov, iovcnt, offset, length) == -1) {
+            if (offset > 0 && errno == EAGAIN) break;
+            return -1;
+        }
+        offset += length;
+    }
+    if (offset == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return (ssize_t) offset;
+}
+
+static int udp_wait_send(struct netpipefs_socket *skt, int timeout) {
+    return rudp_wait_send((struct rudp *) skt->transport_data, timeout);
+}
+
+static ssize_t udp_recv(struct netpipefs_socket *skt, void *buf, size_t size) {
+    return rudp_recv((struct rudp *) skt->transport_data, buf, size);
+}
+
+static int udp_close(struct netpipefs_socket *skt) {
+    int res;
+
+    if (skt->transport_data == NULL) return fd_transport_close(skt); // the connection failed before UDP was used
+    res = rudp_close((struct rudp *) skt->transport_data);
+    skt->transport_data = NULL;
+    skt->fd = -1;
+
+    return res;
+}
+
+const struct netpipefs_transport netpipefs_tcp_transport = {
+        AF_INET_LABEL, 1, &tcp_connect, &fd_transport_send, &fd_transport_wait_send, &fd_transport_recv, &fd_transport_close
+};
+
+const struct netpipefs_transport netpipefs_unix_transport = {
+        AF_UNIX_LABEL, 1, &unix_connect, &fd_transport_send, &fd_transport_wait_send, &fd_transport_recv, &fd_transport_close
+};
+
+const struct netpipefs_transport netpipefs_udp_transport = {
+        "udp", 0, &udp_connect, &udp_send, &udp_wait_send, &udp_recv, &udp_close
+};
+
+const struct netpipefs_transport netpipefs_loopback_transport = {
+        "loopback", 0, &loopback_transport_connect, &loopback_transport_send, &loopback_transport_wait_send,
+        &loopback_transport_recv, &loopback_transport_close
+};
+
+int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long timeout) {
+    if (netpipefs_socket->transport == NULL) {
+        if (netpipefs_options.hostip == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (strcmp(netpipefs_options.hostip, "localhost") == 0) netpipefs_socket->transport = &netpipefs_unix_transport;
+        else if (netpipefs_options.udp) netpipefs_socket->transport = &netpipefs_udp_transport;
+        else netpipefs_socket->transport = &netpipefs_tcp_transport;
+    }
+
+    return netpipefs_socket->transport->connect(netpipefs_socket, timeout);
+}
+
 int end_socket_connection(struct netpipefs_socket *netpipefs_socket) {
-    return close(netpipefs_socket->fd);
+    free_socket_uring(netpipefs_socket);
+    if (netpipefs_socket->stripes) end_stripes(netpipefs_socket);
+    free_socket_recv_buffer(netpipefs_socket);
+    replay_free(&(netpipefs_socket->replay));
+    end_shm(netpipefs_socket);
+    if (netpipefs_socket->transport == NULL) return close(netpipefs_socket->fd); // never connected
+    return netpipefs_socket->transport->close(netpipefs_socket);
+}
+
+int socket_resumable(const struct netpipefs_socket *skt) {
+    return skt->remote_replay > 0;
 }
 
 /**
- * Write to the socket the message header
+ * Tell the remote host how many bytes were received on each connection and read how many it received, on the new
+ * connections. What it received should still be into the replay window, together with what follows.
  *
- * @param fd_skt socket file descriptor
- * @param message message header
- * @param path path relative to the message
- * @return 0 if the connection is lost, more than zero on success, -1 on error
+ * @param skt the first connection of the session
+ * @param fresh the first of the new connections
+ * @param positions it will be set with the position of the first byte that the remote host didn't receive, for
+ * each connection
+ * @return 0 on success, -1 on error and sets errno. If the bytes that the remote host didn't receive were dropped
+ * it sets errno to ERANGE
  */
-static int send_socket_header(int fd_skt, enum netpipefs_header message, const char *path) {
-    int bytes = writen(fd_skt, &message, sizeof(enum netpipefs_header));
-    if (bytes <= 0) return bytes;
+static int exchange_positions(struct netpipefs_socket *skt, struct netpipefs_socket *fresh, uint64_t *positions) {
+    int err;
+    size_t i;
+    unsigned char buf[8];
+    struct netpipefs_socket *stripe;
+
+    for (i = 0; i < socket_stripes(skt); i++) {
+        pack_u64(buf, socket_stripe_at(skt, i)->rcv_pos);
+        if ((err = writen(socket_stripe_at(fresh, i)->fd, buf, sizeof(buf))) <= 0) {
+            if (err == 0) errno = ECONNRESET;
+            return -1;
+        }
+    }
 
-    bytes = sock_write_h(fd_skt, (void *) path, sizeof(char) * (strlen(path) + 1));
-    return bytes;
+    for (i = 0; i < socket_stripes(skt); i++) {
+        if ((err = readn(socket_stripe_at(fresh, i)->fd, buf, sizeof(buf))) <= 0) {
+            if (err == 0) errno = ECONNRESET;
+            return -1;
+        }
+        stripe = socket_stripe_at(skt, i);
+        positions[i] = unpack_u64(buf);
+        if (positions[i] < stripe->replay.start || positions[i] > stripe->replay.end) {
+            errno = ERANGE;
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
-int read_socket_header(struct netpipefs_socket *skt, enum netpipefs_header *header, char **path) {
-    int bytes = readn(skt->fd, header, sizeof(enum netpipefs_header));
-    if (bytes > 0)
-        return sock_read_h(skt->fd, (void **) path);
+/**
+ * Establish new connections for the session within the given time. A connection which is closed before the
+ * settings are exchanged, as by a proxy when the remote host doesn't listen yet, is tried again.
+ *
+ * @param fresh it will be set with the new connections
+ * @param skt the first connection of the session
+ * @param timeout maximum time allowed, in milliseconds
+ * @return 0 on success, -1 on error and sets errno
+ */
+static int connect_again(struct netpipefs_socket *fresh, const struct netpipefs_socket *skt, long timeout) {
+    long left = timeout;
+    struct timespec start, elapsed;
+
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, &start), return -1)
+    while (establish_fd_connection(fresh, skt->transport == &netpipefs_unix_transport, left, skt) == -1) {
+        if (errno != ECONNRESET && errno != EPIPE) return -1;
+        elapsed = elapsed_time(&start);
+        left = timeout - (elapsed.tv_sec * 1000L + elapsed.tv_nsec / 1000000L);
+        if (left <= CONNECT_INTERVAL) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        MINUS1(msleep(CONNECT_INTERVAL), return -1)
+        left -= CONNECT_INTERVAL;
+    }
 
-    return bytes; // <= 0
+    return 0;
 }
 
-int send_open_message(struct netpipefs_socket *skt, const char *path, int mode) {
-    int err, bytes;
+int resume_socket_connection(struct netpipefs_socket *skt, long timeout) {
+    int err, fd, res = -1, error;
+    size_t i, n = socket_stripes(skt);
+    uint64_t positions[MAX_STRIPES];
+    struct netpipefs_socket fresh, *stripe, *fresh_stripe;
 
-    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    if (!socket_resumable(skt)) {
+        errno = ENOTSUP;
+        return -1;
+    }
 
-    bytes = send_socket_header(skt->fd, OPEN, path);
-    if (bytes > 0) {
-        bytes = writen(skt->fd, &mode, sizeof(int));
+    /* The senders stop. A sender blocked on a connection gives up when it is shut down */
+    for (i = 0; i < n; i++) {
+        stripe = socket_stripe_at(skt, i);
+        PTH(err, pthread_mutex_lock(&(stripe->wr_mtx)), return -1)
+        stripe->resuming = 1;
+        PTH(err, pthread_cond_broadcast(&(stripe->wr_cond)), pthread_mutex_unlock(&(stripe->wr_mtx)); return -1)
+        PTH(err, pthread_mutex_unlock(&(stripe->wr_mtx)), return -1)
+        if (shutdown(stripe->fd, SHUT_RDWR) == -1) errno = 0;
+    }
+    for (i = 0; i < n; i++) {
+        stripe = socket_stripe_at(skt, i);
+        PTH(err, pthread_mutex_lock(&(stripe->wr_mtx)), return -1)
+        while (stripe->snd_busy)
+            PTH(err, pthread_cond_wait(&(stripe->wr_cond), &(stripe->wr_mtx)), pthread_mutex_unlock(&(stripe->wr_mtx)); return -1)
+        PTH(err, pthread_mutex_unlock(&(stripe->wr_mtx)), return -1)
     }
 
-    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
-    if (bytes > 0) DEBUG("sent: OPEN %s %d\n", path, mode);
+    /* Connect again, then the new connections take the place of the old ones, which are closed */
+    memset(&fresh, 0, sizeof(struct netpipefs_socket));
+    fresh.fd = -1;
+    fresh.transport = skt->transport;
+    if (connect_again(&fresh, skt, timeout) == 0) {
+        if (exchange_positions(skt, &fresh, positions) == 0) {
+            res = 0;
+            for (i = 0; i < n; i++) {
+                stripe = socket_stripe_at(skt, i);
+                fresh_stripe = socket_stripe_at(&fresh, i);
+                fd = stripe->fd;
+                stripe->fd = fresh_stripe->fd;
+                fresh_stripe->fd = fd;
+            }
+        }
+        error = errno;
+        if (fresh.stripes) end_stripes(&fresh);
+        fresh.transport->close(&fresh);
+        errno = error;
+    }
+    error = errno;
+
+    /* The senders carry on, sending again what the remote host didn't receive. Or they fail */
+    for (i = 0; i < n; i++) {
+        stripe = socket_stripe_at(skt, i);
+        PTH(err, pthread_mutex_lock(&(stripe->wr_mtx)), return -1)
+        if (res == 0) {
+            stripe->snd_acked = positions[i];
+            stripe->replay_from = positions[i];
+            stripe->replay_pending = 1;
+            stripe->rcv_acked = stripe->rcv_pos;
+            stripe->recv_buf.start = 0;
+            stripe->recv_buf.end = 0;
+            stripe->recv_buf.needed = 0;
+            stripe->recv_buf.credits_read = 0;
+        } else if (stripe->snd_error == 0) {
+            stripe->snd_error = ECONNRESET;
+        }
+        stripe->resuming = 0;
+        stripe->resumes++;
+        PTH(err, pthread_cond_broadcast(&(stripe->wr_cond)), pthread_mutex_unlock(&(stripe->wr_mtx)); return -1)
+        PTH(err, pthread_mutex_unlock(&(stripe->wr_mtx)), return -1)
+    }
+    errno = error;
 
-    return bytes;
+    return res;
 }
 
-int send_close_message(struct netpipefs_socket *skt, const char *path, int mode) {
-    int err, bytes;
+size_t socket_stripes(const struct netpipefs_socket *skt) {
+    return skt->stripes != NULL ? skt->nstripes : 1;
+}
 
-    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+struct netpipefs_socket *socket_stripe_at(struct netpipefs_socket *skt, size_t index) {
+    return skt->stripes != NULL ? skt->stripes[index] : skt;
+}
 
-    bytes = send_socket_header(skt->fd, CLOSE, path);
-    if (bytes > 0) {
-        bytes = writen(skt->fd, &mode, sizeof(int));
+struct netpipefs_socket *socket_stripe(struct netpipefs_socket *skt, const char *path) {
+    uint32_t hash = 2166136261u; // FNV-1a
+
+    if (skt->stripes == NULL) return skt;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char) *path;
+        hash *= 16777619u;
     }
 
-    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
-    if (bytes > 0) DEBUG("sent: CLOSE %s %d\n", path, mode);
+    return skt->stripes[hash % skt->nstripes];
+}
 
-    return bytes;
+int socket_striped(const struct netpipefs_socket *skt, const char *path) {
+    char pattern[PATH_MAX];
+    size_t i;
+
+    if (skt->stripes == NULL || netpipefs_options.stripepaths == NULL) return 0;
+    for (i = 0; i < list_count(netpipefs_options.stripepaths); i++) {
+        if (list_item(netpipefs_options.stripepaths, i, pattern, sizeof(pattern)) && fnmatch(pattern, path, 0) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write the message header into the given buffer
+ *
+ * @param dest buffer with at least MESSAGE_HEADER_SIZE bytes
+ * @param header message type
+ * @param handle netpipe's handle
+ * @param arg message argument
+ * @param length how many bytes follow the header
+ * @return 0 on success, -1 if arg or length cannot be sent and sets errno to EOVERFLOW
+ */
+static int pack_header(unsigned char *dest, enum netpipefs_header header, uint32_t handle, size_t arg, size_t length) {
+    uint32_t value;
+
+    if (arg > UINT32_MAX || length > MESSAGE_MAX_LENGTH) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    dest[0] = (unsigned char) header;
+    dest[1] = 0; // flags
+    dest[2] = 0; // reserved
+    dest[3] = 0;
+    value = htonl(handle);
+    memcpy(dest + 4, &value, sizeof(uint32_t));
+    value = htonl((uint32_t) arg);
+    memcpy(dest + 8, &value, sizeof(uint32_t));
+    value = htonl((uint32_t) length);
+    memcpy(dest + 12, &value, sizeof(uint32_t));
+
+    return 0;
 }
 
-int send_flush_message(struct netpipefs_socket *skt, struct netpipe *file, size_t size) {
-    int err, bytes;
+/** Write a 32 bits value in network byte order */
+static void pack_u32(unsigned char *dest, uint32_t value) {
+    value = htonl(value);
+    memcpy(dest, &value, sizeof(uint32_t));
+}
 
-    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+/** Read a 32 bits value in network byte order */
+static uint32_t unpack_u32(const char *src) {
+    uint32_t value;
+    memcpy(&value, src, sizeof(uint32_t));
+    return ntohl(value);
+}
 
-    bytes = send_socket_header(skt->fd, WRITE, file->path);
-    if (bytes > 0)
-        bytes = writen(skt->fd, &size, sizeof(size_t));
-    if (bytes > 0 && size > 0) {
-        bytes = cbuf_writen(skt->fd, file->buffer, size);
+/**
+ * Queue a data frame after the other data frames of the same netpipe. A netpipe which had none waiting takes
+ * its turn after the others of its class. Must be called with the socket's wr_mtx locked.
+ *
+ * @param skt netpipefs socket structure
+ * @param file the netpipe
+ * @param frame the frame
+ * @return 0 on success, -1 on error
+ */
+static int queue_data_frame(struct netpipefs_socket *skt, const struct netpipe *file, struct netpipefs_frame *frame) {
+    int i, priority;
+    struct netpipefs_flow *flow = NULL;
+
+    for (i = 0; i < PRIORITY_CLASSES && flow == NULL; i++) {
+        for (flow = skt->snd_head[i]; flow != NULL && flow->handle != file->remote_handle; flow = flow->next);
+    }
+    if (flow == NULL) {
+        EQNULL(flow = (struct netpipefs_flow *) malloc(sizeof(struct netpipefs_flow)), return -1)
+        priority = __atomic_load_n(&(file->priority), __ATOMIC_RELAXED);
+        flow->next = NULL;
+        flow->handle = file->remote_handle;
+        flow->priority = priority;
+        flow->weight = __atomic_load_n(&(file->weight), __ATOMIC_RELAXED);
+        flow->deficit = 0;
+        flow->turn = 0;
+        flow->head = NULL;
+        flow->tail = NULL;
+        if (skt->snd_tail[priority] == NULL) skt->snd_head[priority] = flow;
+        else skt->snd_tail[priority]->next = flow;
+        skt->snd_tail[priority] = flow;
     }
 
-    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
-    if (bytes > 0) DEBUG("sent: WRITE %s %ld <DATA>\n", file->path, size);
+    if (flow->tail == NULL) flow->head = frame;
+    else flow->tail->next = frame;
+    flow->tail = frame;
 
-    return bytes;
+    return 0;
 }
 
-int send_write_message(struct netpipefs_socket *skt, const char *path, const char *buf, size_t size) {
-    int err, bytes;
+int update_socket_flow(struct netpipefs_socket *skt, const struct netpipe *file) {
+    int err, i, priority = __atomic_load_n(&(file->priority), __ATOMIC_RELAXED);
+    size_t s, weight = __atomic_load_n(&(file->weight), __ATOMIC_RELAXED);
+    struct netpipefs_socket *stripe;
+    struct netpipefs_flow *flow, *prev;
+
+    for (s = 0; s < socket_stripes(skt); s++) {
+        stripe = socket_stripe_at(skt, s);
+        PTH(err, pthread_mutex_lock(&(stripe->wr_mtx)), return -1)
+        for (i = 0; i < PRIORITY_CLASSES; i++) {
+            prev = NULL;
+            for (flow = stripe->snd_head[i]; flow != NULL && flow->handle != file->remote_handle; flow = flow->next)
+                prev = flow;
+            if (flow != NULL) break;
+        }
+        if (flow != NULL) {
+            flow->weight = weight;
+            if (flow->priority != priority) { // it takes its turn after the others of the new class
+                if (prev == NULL) stripe->snd_head[i] = flow->next;
+                else prev->next = flow->next;
+                if (stripe->snd_tail[i] == flow) stripe->snd_tail[i] = prev;
+
+                flow->next = NULL;
+                flow->priority = priority;
+                flow->deficit = 0;
+                flow->turn = 0;
+                if (stripe->snd_tail[priority] == NULL) stripe->snd_head[priority] = flow;
+                else stripe->snd_tail[priority]->next = flow;
+                stripe->snd_tail[priority] = flow;
+            }
+        }
+        PTH(err, pthread_mutex_unlock(&(stripe->wr_mtx)), return -1)
+    }
 
-    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    return 0;
+}
 
-    bytes = send_socket_header(skt->fd, WRITE, path);
-    if (bytes > 0) {
-        bytes = sock_write_h(skt->fd, (void *) buf, size);
+/**
+ * Create a frame with a copy of the given buffers
+ *
+ * @param iov vector of buffers
+ * @param iovcnt how many buffers the vector has
+ * @return the frame, NULL on error
+ */
+static struct netpipefs_frame *new_frame(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    struct netpipefs_frame *frame;
+
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    EQNULL(frame = (struct netpipefs_frame *) malloc(sizeof(struct netpipefs_frame) + total), return NULL)
+    frame->next = NULL;
+    frame->size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(frame->data + frame->size, iov[i].iov_base, iov[i].iov_len);
+        frame->size += iov[i].iov_len;
     }
+    frame->copied = frame->size;
+    frame->iovcnt = 0;
+    frame->sent = NULL;
+    frame->arg = NULL;
 
+    return frame;
+}
+
+/**
+ * Queue the frame. The sender thread will send it together with the other frames that are queued. Control
+ * messages are sent before the data messages queued earlier, so they don't wait behind bulk data. Data messages
+ * are sent according to the priority of their netpipe. A message with MESSAGE_FLAG_SEQUENCE gets the next
+ * sequence number once it is queued. If the frame can't be queued it is freed.
+ *
+ * @param skt netpipefs socket structure
+ * @param frame the frame
+ * @param file the netpipe whose data is sent, or NULL if it is a control message
+ * @return 1 on success, -1 on error or if a previous message couldn't be sent
+ */
+static int queue_frame(struct netpipefs_socket *skt, struct netpipefs_frame *frame, const struct netpipe *file) {
+    int err, snd_error;
+    uint32_t seq;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), free(frame); return -1)
+    if ((snd_error = skt->snd_error) != 0) {
+        PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), free(frame); return -1)
+        free(frame);
+        errno = snd_error;
+        return -1;
+    }
+    if (file == NULL) {
+        if (skt->ctl_tail == NULL) skt->ctl_head = frame;
+        else skt->ctl_tail->next = frame;
+        skt->ctl_tail = frame;
+    } else if (queue_data_frame(skt, file, frame) == -1) {
+        PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), free(frame); return -1)
+        free(frame);
+        errno = ENOMEM;
+        return -1;
+    }
+    /* a number taken by a message that is not queued would hold up the following ones at the remote host forever */
+    if (frame->data[1] == MESSAGE_FLAG_SEQUENCE) {
+        seq = __atomic_fetch_add(&(skt->stripes[0]->snd_seq), 1, __ATOMIC_RELAXED);
+        pack_u32((unsigned char *) frame->data + MESSAGE_HEADER_SIZE, seq);
+    }
+    PTH(err, pthread_cond_signal(&(skt->wr_cond)), pthread_mutex_unlock(&(skt->wr_mtx)); return -1)
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
-    if (bytes > 0) DEBUG("sent: WRITE %s %ld <DATA>\n", path, size);
 
-    return bytes;
+    return 1;
 }
 
-int send_read_message(struct netpipefs_socket *skt, const char *path, size_t size) {
-    int err, bytes;
+/**
+ * Copy the message into a frame and queue it, see queue_frame().
+ *
+ * @param skt netpipefs socket structure
+ * @param iov vector of buffers with the message
+ * @param iovcnt how many buffers the vector has
+ * @param file the netpipe whose data is sent, or NULL if it is a control message
+ * @return 1 on success, -1 on error or if a previous message couldn't be sent
+ */
+static int send_message(struct netpipefs_socket *skt, const struct iovec *iov, int iovcnt, const struct netpipe *file) {
+    struct netpipefs_frame *frame;
 
-    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    EQNULL(frame = new_frame(iov, iovcnt), return -1)
+
+    return queue_frame(skt, frame, file);
+}
+
+/**
+ * Queue a WRITE message whose data is not copied, see queue_frame(). The sender writes the data from where it is
+ * and then calls sent.
+ *
+ * @param skt netpipefs socket structure
+ * @param iov vector of buffers with the header of the message, which are copied
+ * @param iovcnt how many buffers the vector has
+ * @param data vector of buffers with the data of the message, at most two
+ * @param datacnt how many buffers the data vector has
+ * @param file the netpipe whose data is sent
+ * @param sent called by the sender once it is done with the data, or NULL
+ * @param arg given to sent
+ * @return 1 on success, -1 on error or if a previous message couldn't be sent
+ */
+static int send_data_message(struct netpipefs_socket *skt, const struct iovec *iov, int iovcnt,
+                             const struct iovec *data, int datacnt, const struct netpipe *file,
+                             void (*sent)(void *, size_t), void *arg) {
+    struct netpipefs_frame *frame;
+
+    EQNULL(frame = new_frame(iov, iovcnt), return -1)
+    for (int i = 0; i < datacnt; i++) {
+        frame->iov[i] = data[i];
+        frame->size += data[i].iov_len;
+    }
+    frame->iovcnt = datacnt;
+    frame->sent = sent;
+    frame->arg = arg;
+
+    return queue_frame(skt, frame, file);
+}
+
+int init_socket_uring(struct netpipefs_socket *skt) {
+    size_t capacity;
+    struct netpipefs_recv_buffer *buf = &(skt->recv_buf);
+
+    /* io_uring reads and writes the socket itself */
+    if (skt->transport != NULL && !skt->transport->fd_io) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    EQNULL(skt->snd_ring = (struct netpipefs_uring *) calloc(1, sizeof(struct netpipefs_uring)), return -1)
+    skt->snd_ring->fd = -1;
+    EQNULL(skt->rcv_ring = (struct netpipefs_uring *) calloc(1, sizeof(struct netpipefs_uring)), goto error)
+    skt->rcv_ring->fd = -1;
+    MINUS1(uring_init(skt->snd_ring, URING_ENTRIES), goto error)
+    MINUS1(uring_init(skt->rcv_ring, URING_ENTRIES), goto error)
+
+    /* The remote host can't send more than the local readahead at once, so a receive buffer that fits it is
+     * usually never reallocated and can be registered once. If it grows, the reads are done without registration */
+    capacity = RECV_BUFFER_SIZE;
+    while (capacity < netpipefs_options.readahead + MESSAGE_HEADER_SIZE) capacity *= 2;
+    if (buf->capacity < capacity) {
+        char *data;
+        EQNULL(data = (char *) realloc(buf->data, capacity), goto error)
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    MINUS1(uring_register_buffer(skt->rcv_ring, buf->data, buf->capacity), goto error)
+
+    return 0;
+
+error:
+    free_socket_uring(skt);
+    return -1;
+}
+
+void free_socket_uring(struct netpipefs_socket *skt) {
+    if (skt->snd_ring) {
+        uring_free(skt->snd_ring);
+        free(skt->snd_ring);
+        skt->snd_ring = NULL;
+    }
+    if (skt->rcv_ring) {
+        uring_free(skt->rcv_ring);
+        free(skt->rcv_ring);
+        skt->rcv_ring = NULL;
+    }
+}
+
+/**
+ * Prepare the receive buffer to receive more data: the incomplete message is moved at the beginning of the buffer
+ * and the buffer grows to contain the whole message.
+ *
+ * @param buf the receive buffer
+ * @return 0 on success, -1 on error
+ */
+static int make_recv_space(struct netpipefs_recv_buffer *buf) {
+    size_t capacity;
+    char *data;
+
+    /* Move the incomplete message at the beginning of the buffer */
+    if (buf->start == buf->end) {
+        buf->start = 0;
+        buf->end = 0;
+    } else if (buf->start > 0 && (buf->start + buf->needed > buf->capacity || buf->end == buf->capacity)) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+
+    /* The buffer should be able to contain the whole message */
+    capacity = buf->capacity == 0 ? RECV_BUFFER_SIZE : buf->capacity;
+    while (capacity < buf->needed) capacity *= 2;
+    if (capacity != buf->capacity) {
+        EQNULL(data = (char *) realloc(buf->data, capacity), return -1)
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+
+    return 0;
+}
+
+/**
+ * Give back to the remote host the room of the messages already parsed and set the receive buffer to the data
+ * written into the shared memory ring after them. The messages are parsed in place.
+ *
+ * @param skt netpipefs socket structure
+ * @return 1 on success, -1 on error
+ */
+static int recv_shm_data(struct netpipefs_socket *skt) {
+    size_t available;
+    struct netpipefs_recv_buffer *buf = &(skt->recv_buf);
+
+    /* a message must be contiguous into the ring */
+    if (buf->needed > skt->shm_rx->size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    shm_consume(skt->shm_rx, buf->start);
+    buf->data = (char *) shm_peek(skt->shm_rx, &available);
+    buf->capacity = skt->shm_rx->size;
+    buf->start = 0;
+    buf->end = available;
+
+    return 1;
+}
+
+int recv_socket_data(struct netpipefs_socket *skt) {
+    ssize_t bytes;
+    struct netpipefs_recv_buffer *buf = &(skt->recv_buf);
+
+    if (skt->shm_rx != NULL) return recv_shm_data(skt);
+
+    MINUS1(make_recv_space(buf), return -1)
+
+    bytes = skt->transport->recv(skt, buf->data + buf->end, buf->capacity - buf->end);
+    if (bytes <= 0) return bytes;
+    buf->end += bytes;
+
+    return 1;
+}
+
+int prep_socket_recv(struct netpipefs_socket *skt, uint64_t user_data) {
+    struct netpipefs_recv_buffer *buf = &(skt->recv_buf);
+    char *data = buf->data;
+    size_t capacity = buf->capacity;
+
+    MINUS1(make_recv_space(buf), return -1)
+    /* the registered buffer is no longer the receive buffer, the reads are done without registration */
+    if (buf->data != data || buf->capacity != capacity) uring_forget_buffer(skt->rcv_ring);
 
-    bytes = send_socket_header(skt->fd, READ, path);
-    if (bytes > 0) {
-        bytes = writen(skt->fd, &size, sizeof(size_t));
+    return uring_prep_read(skt->rcv_ring, skt->fd, buf->data + buf->end, buf->capacity - buf->end, user_data);
+}
+
+int complete_socket_recv(struct netpipefs_socket *skt, int res) {
+    if (res < 0) {
+        errno = -res;
+        return -1;
     }
+    if (res == 0) return 0;
+    skt->recv_buf.end += res;
+
+    return 1;
+}
+
+int read_socket_message(struct netpipefs_socket *skt, struct netpipefs_message *message) {
+    uint32_t length, arg, ncredits, extra_size = 0; // credit or sequence number before the path or the data
+    const char *header, *pair;
+    struct netpipefs_recv_buffer *buf = &(skt->recv_buf);
+
+    if (buf->end - buf->start < MESSAGE_HEADER_SIZE) {
+        buf->needed = MESSAGE_HEADER_SIZE;
+        return 0;
+    }
+
+    header = buf->data + buf->start;
+    length = unpack_u32(header + 12);
+    /* the receive buffer should not grow to whatever the remote host declares */
+    if (length > MESSAGE_MAX_LENGTH) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (buf->end - buf->start < MESSAGE_HEADER_SIZE + (size_t) length) {
+        buf->needed = MESSAGE_HEADER_SIZE + (size_t) length;
+        return 0;
+    }
+
+    message->header = (enum netpipefs_header) (unsigned char) header[0];
+    message->handle = unpack_u32(header + 4);
+    arg = unpack_u32(header + 8);
+    message->path = NULL;
+    message->mode = 0;
+    message->size = 0;
+    message->data = NULL;
+    message->sequenced = 0;
+    message->seq = 0;
+
+    /* The sequence number of a message of a striped netpipe comes before what the message carries */
+    if (header[1] == MESSAGE_FLAG_SEQUENCE) {
+        if ((message->header != WRITE && message->header != CLOSE) || length < MESSAGE_SEQUENCE_SIZE) {
+            errno = EINVAL;
+            return -1;
+        }
+        message->sequenced = 1;
+        message->seq = unpack_u32(header + MESSAGE_HEADER_SIZE);
+        extra_size = MESSAGE_SEQUENCE_SIZE;
+        header += extra_size;
+        length -= extra_size;
+    } else if (header[1] != 0) {
+        /* Credit carried by a WRITE message is returned as READ messages, then the WRITE message is returned */
+        if (header[1] != MESSAGE_FLAG_CREDITS || message->header != WRITE || length < MESSAGE_CREDITS_SIZE(0)) {
+            errno = EINVAL;
+            return -1;
+        }
+        ncredits = unpack_u32(header + MESSAGE_HEADER_SIZE);
+        if (ncredits > (length - MESSAGE_CREDITS_SIZE(0)) / MESSAGE_CREDITS_SIZE(1)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (buf->credits_read < ncredits) {
+            pair = header + MESSAGE_HEADER_SIZE + MESSAGE_CREDITS_SIZE(buf->credits_read);
+            message->header = READ;
+            message->handle = unpack_u32(pair);
+            message->size = unpack_u32(pair + 4);
+            buf->credits_read++;
+            return 1;
+        }
+        extra_size = MESSAGE_CREDITS_SIZE(ncredits);
+        header += extra_size;
+        length -= extra_size;
+    }
+
+    /* Path and data are not copied */
+    switch (message->header) {
+        case OPEN:
+            message->path = header + MESSAGE_HEADER_SIZE;
+            if (length == 0 || message->path[length - 1] != '\0') {
+                errno = EINVAL;
+                return -1;
+            }
+            message->mode = (int) arg;
+            break;
+        case CLOSE:
+            message->mode = (int) arg;
+            break;
+        case READ:
+        case READ_REQUEST:
+        case WINDOW:
+        case WINDOW_REQUEST:
+        case ACK:
+            message->size = arg;
+            break;
+        case WRITE:
+            message->size = length;
+            message->data = header + MESSAGE_HEADER_SIZE;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    buf->start += MESSAGE_HEADER_SIZE + (size_t) extra_size + (size_t) length;
+    if (message->header != ACK) skt->rcv_pos += MESSAGE_HEADER_SIZE + (uint64_t) extra_size + (uint64_t) length;
+    buf->needed = 0;
+    buf->credits_read = 0;
+
+    return 1;
+}
+
+int handle_ack_message(struct netpipefs_socket *skt, const struct netpipefs_message *message) {
+    int err;
+    uint32_t acked;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    /* only the low 32 bits are sent: the position is the nearest one after the last acknowledged */
+    acked = (uint32_t) message->size - (uint32_t) skt->snd_acked;
+    if (acked < UINT32_C(1) << 31) skt->snd_acked += acked;
+    PTH(err, pthread_cond_broadcast(&(skt->wr_cond)), pthread_mutex_unlock(&(skt->wr_mtx)); return -1)
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+
+    return 1;
+}
 
+int send_ack_message(struct netpipefs_socket *skt) {
+    int err;
+
+    if (skt->remote_replay == 0 || skt->rcv_pos - skt->rcv_acked < skt->remote_replay / REPLAY_ACK_FRACTION) return 1;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    skt->ack_pos = skt->rcv_pos;
+    skt->ack_pending = 1;
+    PTH(err, pthread_cond_broadcast(&(skt->wr_cond)), pthread_mutex_unlock(&(skt->wr_mtx)); return -1)
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
-    if (bytes > 0) DEBUG("sent: READ %s %ld\n", path, size);
+    skt->rcv_acked = skt->rcv_pos;
+
+    return 1;
+}
+
+void free_socket_recv_buffer(struct netpipefs_socket *skt) {
+    if (skt->shm_rx == NULL) free(skt->recv_buf.data); // otherwise it points into the ring
+    memset(&(skt->recv_buf), 0, sizeof(struct netpipefs_recv_buffer));
+}
+
+int send_open_message(struct netpipefs_socket *skt, const char *path, uint32_t handle, int mode) {
+    int bytes;
+    unsigned char header[MESSAGE_HEADER_SIZE];
+    size_t path_len = sizeof(char) * (strlen(path) + 1);
+    struct iovec iov[2];
+
+    MINUS1(pack_header(header, OPEN, handle, mode, path_len), return -1)
+    iov[0].iov_base = header;
+    iov[0].iov_len = MESSAGE_HEADER_SIZE;
+    iov[1].iov_base = (void *) path;
+    iov[1].iov_len = path_len;
+
+    bytes = send_message(skt, iov, 2, NULL);
+    if (bytes > 0) DEBUG("sent: OPEN %s %u %d\n", path, handle, mode);
 
     return bytes;
 }
 
-int send_read_request_message(struct netpipefs_socket *skt, const char *path, size_t size) {
-    int err, bytes;
+/**
+ * Choose the connection of the next data message of a netpipe. The data messages of a striped netpipe take turns
+ * on all the connections, beginning with the netpipe's own connection. Their sequence number is set by
+ * send_message() when they are queued.
+ *
+ * @param skt the netpipe's connection
+ * @param file the netpipe
+ * @param header header of the message. If the netpipe is striped MESSAGE_FLAG_SEQUENCE is set and the length
+ * grows by MESSAGE_SEQUENCE_SIZE, which the sequence number takes after the header
+ * @return the connection that sends the message
+ */
+static struct netpipefs_socket *data_socket(struct netpipefs_socket *skt, struct netpipe *file, unsigned char *header) {
+    size_t turn;
+
+    if (!file->striped || skt->stripes == NULL) return skt;
+
+    header[1] = MESSAGE_FLAG_SEQUENCE;
+    pack_u32(header + 12, unpack_u32((const char *) header + 12) + MESSAGE_SEQUENCE_SIZE);
+    turn = __atomic_fetch_add(&(file->stripe_next), 1, __ATOMIC_RELAXED);
+
+    return skt->stripes[(skt->stripe + turn) % skt->nstripes];
+}
+
+int send_close_message(struct netpipefs_socket *skt, struct netpipe *file, int mode) {
+    int bytes;
+    unsigned char header[MESSAGE_HEADER_SIZE], seq[MESSAGE_SEQUENCE_SIZE] = {0};
+    struct iovec iov[2];
+
+    MINUS1(pack_header(header, CLOSE, file->remote_handle, mode, 0), return -1)
+    iov[0].iov_base = header;
+    iov[0].iov_len = MESSAGE_HEADER_SIZE;
+    iov[1].iov_base = seq;
+    iov[1].iov_len = 0;
+
+    /* the writer's CLOSE can't overtake its data */
+    if (mode == O_WRONLY) {
+        skt = data_socket(skt, file, header);
+        if (header[1] == MESSAGE_FLAG_SEQUENCE) iov[1].iov_len = MESSAGE_SEQUENCE_SIZE;
+        bytes = send_message(skt, iov, 2, file);
+    } else {
+        bytes = send_message(skt, iov, 1, NULL);
+    }
+    if (bytes > 0) DEBUG("sent: CLOSE %u %d\n", file->remote_handle, mode);
+
+    return bytes;
+}
+
+/** How many of the given bytes are sent with the next WRITE message of the netpipe */
+static size_t frame_length(const struct netpipe *file, size_t size) {
+    size_t seq = file->striped ? MESSAGE_SEQUENCE_SIZE : 0, max = MESSAGE_MAX_LENGTH - seq;
+
+    if (netpipefs_options.maxframe > 0 && netpipefs_options.maxframe < max) max = netpipefs_options.maxframe;
+    /* a message larger than the remote host's ring could never be received, even without --maxframe */
+    if (file->skt->maxmessage > 0 && file->skt->maxmessage - MESSAGE_HEADER_SIZE - seq < max)
+        max = file->skt->maxmessage - MESSAGE_HEADER_SIZE - seq;
+
+    return size < max ? size : max;
+}
+
+ssize_t send_flush_message(struct netpipefs_socket *skt, struct netpipe *file, size_t offset, size_t size,
+                           void (*sent)(void *, size_t), void *arg) {
+    int bytes, datacnt;
+    size_t length, queued = 0;
+    unsigned char header[MESSAGE_HEADER_SIZE], seq[MESSAGE_SEQUENCE_SIZE] = {0};
+    struct netpipefs_socket *dest;
+    struct iovec iov[2], data[2];
+
+    while (queued < size) {
+        length = frame_length(file, size - queued);
+        MINUS1(pack_header(header, WRITE, file->remote_handle, 0, length), break)
+        dest = data_socket(skt, file, header);
+        iov[0].iov_base = header;
+        iov[0].iov_len = MESSAGE_HEADER_SIZE;
+        iov[1].iov_base = seq;
+        iov[1].iov_len = header[1] == MESSAGE_FLAG_SEQUENCE ? MESSAGE_SEQUENCE_SIZE : 0;
+        /* data is sent directly from the buffer, which gives at most two memory areas */
+        datacnt = cbuf_iov_at(file->buffer, offset + queued, data, length);
+
+        bytes = send_data_message(dest, iov, 2, data, datacnt, file, sent, arg);
+        if (bytes <= 0) break;
+
+        queued += length;
+    }
+    if (queued == 0 && size > 0) return -1;
+    DEBUG("sent: WRITE %u %ld <DATA>\n", file->remote_handle, queued);
+
+    return (ssize_t) queued;
+}
+
+ssize_t send_write_message(struct netpipefs_socket *skt, struct netpipe *file, const char *buf, size_t size,
+                           void (*sent)(void *, size_t), void *arg) {
+    int bytes;
+    size_t length, queued = 0;
+    unsigned char header[MESSAGE_HEADER_SIZE], seq[MESSAGE_SEQUENCE_SIZE] = {0};
+    struct netpipefs_socket *dest;
+    struct iovec iov[2], data[1];
+
+    while (queued < size) {
+        length = frame_length(file, size - queued);
+        MINUS1(pack_header(header, WRITE, file->remote_handle, 0, length), break)
+        dest = data_socket(skt, file, header);
+        iov[0].iov_base = header;
+        iov[0].iov_len = MESSAGE_HEADER_SIZE;
+        iov[1].iov_base = seq;
+        iov[1].iov_len = header[1] == MESSAGE_FLAG_SEQUENCE ? MESSAGE_SEQUENCE_SIZE : 0;
+        /* data is sent directly from the writer's buffer */
+        data[0].iov_base = (void *) (buf + queued);
+        data[0].iov_len = length;
+
+        bytes = send_data_message(dest, iov, 2, data, 1, file, sent, arg);
+        if (bytes <= 0) break;
+
+        queued += length;
+    }
+    if (queued == 0 && size > 0) return -1;
+    DEBUG("sent: WRITE %u %ld <DATA>\n", file->remote_handle, queued);
+
+    return (ssize_t) queued;
+}
+
+int send_read_message(struct netpipefs_socket *skt, uint32_t handle, size_t size) {
+    int err, snd_error;
+    size_t i, capacity;
+    uint32_t credit;
+    struct netpipefs_credit *credits;
 
     PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    if ((snd_error = skt->snd_error) != 0) {
+        PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+        errno = snd_error;
+        return -1;
+    }
 
-    bytes = send_socket_header(skt->fd, READ_REQUEST, path);
-    if (bytes > 0) {
-        bytes = writen(skt->fd, &size, sizeof(size_t));
+    while (size > 0) {
+        credit = size > UINT32_MAX ? UINT32_MAX : (uint32_t) size;
+
+        /* Sum the credit for the same netpipe, unless it doesn't fit into the message */
+        for (i = 0; i < skt->ncredits; i++) {
+            if (skt->credits[i].handle == handle && skt->credits[i].size <= UINT32_MAX - credit) break;
+        }
+        if (i == skt->ncredits) {
+            if (skt->ncredits == skt->credits_capacity) {
+                capacity = skt->credits_capacity == 0 ? 16 : 2 * skt->credits_capacity;
+                credits = (struct netpipefs_credit *) realloc(skt->credits, capacity * sizeof(struct netpipefs_credit));
+                EQNULL(credits, pthread_mutex_unlock(&(skt->wr_mtx)); return -1)
+                skt->credits = credits;
+                skt->credits_capacity = capacity;
+            }
+            skt->credits[i].handle = handle;
+            skt->credits[i].size = 0;
+            skt->ncredits++;
+        }
+        skt->credits[i].size += credit;
+        size -= credit;
     }
 
+    PTH(err, pthread_cond_signal(&(skt->wr_cond)), pthread_mutex_unlock(&(skt->wr_mtx)); return -1)
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
-    if (bytes > 0) DEBUG("sent: READ_REQUEST %s %ld\n", path, size);
+
+    return 1;
+}
+
+int pack_write_credits(unsigned char *dest, const char *message, const struct netpipefs_credit *credits, size_t count) {
+    size_t i, length;
+    unsigned char *pair;
+
+    length = unpack_u32(message + 12) + MESSAGE_CREDITS_SIZE(count);
+    if ((unsigned char) message[0] != WRITE || message[1] != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (count > UINT32_MAX || length > MESSAGE_MAX_LENGTH) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    MINUS1(pack_header(dest, WRITE, unpack_u32(message + 4), 0, length), return -1)
+    dest[1] = MESSAGE_FLAG_CREDITS;
+    pack_u32(dest + MESSAGE_HEADER_SIZE, (uint32_t) count);
+    for (i = 0; i < count; i++) {
+        pair = dest + MESSAGE_HEADER_SIZE + MESSAGE_CREDITS_SIZE(i);
+        pack_u32(pair, credits[i].handle);
+        pack_u32(pair + 4, credits[i].size);
+        DEBUG("sent: READ %u %u with WRITE\n", credits[i].handle, credits[i].size);
+    }
+
+    return 0;
+}
+
+void pack_read_credits(unsigned char *dest, const struct netpipefs_credit *credits, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        pack_header(dest + i * MESSAGE_HEADER_SIZE, READ, credits[i].handle, credits[i].size, 0);
+        DEBUG("sent: READ %u %u\n", credits[i].handle, credits[i].size);
+    }
+}
+
+void pack_ack_message(unsigned char *dest, uint64_t position) {
+    pack_header(dest, ACK, 0, (uint32_t) position, 0);
+}
+
+int send_read_request_message(struct netpipefs_socket *skt, uint32_t handle, size_t size) {
+    int bytes;
+    unsigned char header[MESSAGE_HEADER_SIZE];
+    struct iovec iov[1];
+
+    MINUS1(pack_header(header, READ_REQUEST, handle, size, 0), return -1)
+    iov[0].iov_base = header;
+    iov[0].iov_len = MESSAGE_HEADER_SIZE;
+
+    bytes = send_message(skt, iov, 1, NULL);
+    if (bytes > 0) DEBUG("sent: READ_REQUEST %u %ld\n", handle, size);
+
+    return bytes;
+}
+
+int send_window_message(struct netpipefs_socket *skt, uint32_t handle, size_t size) {
+    int bytes;
+    unsigned char header[MESSAGE_HEADER_SIZE];
+    struct iovec iov[1];
+
+    if (size > UINT32_MAX) size = UINT32_MAX;
+    MINUS1(pack_header(header, WINDOW, handle, size, 0), return -1)
+    iov[0].iov_base = header;
+    iov[0].iov_len = MESSAGE_HEADER_SIZE;
+
+    bytes = send_message(skt, iov, 1, NULL);
+    if (bytes > 0) DEBUG("sent: WINDOW %u %ld\n", handle, size);
+
+    return bytes;
+}
+
+int send_window_request_message(struct netpipefs_socket *skt, uint32_t handle, size_t size) {
+    int bytes;
+    unsigned char header[MESSAGE_HEADER_SIZE];
+    struct iovec iov[1];
+
+    if (size > UINT32_MAX) size = UINT32_MAX;
+    MINUS1(pack_header(header, WINDOW_REQUEST, handle, size, 0), return -1)
+    iov[0].iov_base = header;
+    iov[0].iov_len = MESSAGE_HEADER_SIZE;
+
+    bytes = send_message(skt, iov, 1, NULL);
+    if (bytes > 0) DEBUG("sent: WINDOW_REQUEST %u %ld\n", handle, size);
 
     return bytes;
-}
\ No newline at end of file
+}
@@ -1,22 +1,114 @@
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <sched.h>
 #include "../include/openfiles.h"
 #include "../include/utils.h"
 #include "../include/icl_hash.h"
 
 #define NBUCKETS 128 // number of buckets used for the open files hash table
 
+/* A handle has the index of its slot into the lower bits and the slot's generation into the higher bits,
+ * so that a handle of a removed file is not valid anymore even if its slot is reused. Slots are grouped into
+ * chunks which are allocated when needed and never moved, then they can be read without locking. A lookup takes
+ * a reference to the file, and the slot counts the lookups running on it: the handle is released only after
+ * they are over, so a file is never freed between being found and being referenced. */
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1U << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_CHUNK_BITS 10
+#define HANDLE_CHUNK_SIZE (1U << HANDLE_CHUNK_BITS)
+#define HANDLE_NCHUNKS (1U << (HANDLE_INDEX_BITS - HANDLE_CHUNK_BITS))
+
+/** Slot of the handles table */
+struct handle_slot {
+    struct netpipe *file;   // file which has this handle or NULL
+    uint32_t generation;    // incremented each time the slot is released
+    uint32_t next_free;     // next free slot index, if this slot is free
+    uint32_t lookups;       // lookups by handle running on this slot. Accessed atomically
+};
+
+/** Direct-indexed table of handles. Slot with index 0 is never used, so that 0 is not a valid handle */
+struct handles_table {
+    struct handle_slot *chunks[HANDLE_NCHUNKS];
+    uint32_t next_index;    // first index never used
+    uint32_t free_head;     // index of the first released slot or 0
+};
+
 extern struct netpipefs_socket netpipefs_socket;
 
 static icl_hash_t *open_files_table = NULL; // hash table with all the open files. Each file has its path as key
+static struct handles_table handles_table;  // files by handle. Protected by the same mutex of the hash table
 static pthread_mutex_t open_files_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+/** Returns the slot with the given index. The slot's chunk is allocated if needed. Mutex should be locked */
+static struct handle_slot *get_handle_slot(uint32_t index, int alloc) {
+    struct handle_slot *chunk = __atomic_load_n(&(handles_table.chunks[index >> HANDLE_CHUNK_BITS]), __ATOMIC_ACQUIRE);
+
+    if (chunk == NULL && alloc) {
+        EQNULL(chunk = (struct handle_slot *) calloc(HANDLE_CHUNK_SIZE, sizeof(struct handle_slot)), return NULL)
+        __atomic_store_n(&(handles_table.chunks[index >> HANDLE_CHUNK_BITS]), chunk, __ATOMIC_RELEASE);
+    }
+    if (chunk == NULL) return NULL;
+
+    return &(chunk[index & (HANDLE_CHUNK_SIZE - 1)]);
+}
+
+/** Gives a new handle to the given file. Mutex should be locked */
+static int alloc_handle(struct netpipe *file) {
+    uint32_t index;
+    struct handle_slot *slot;
+
+    if (handles_table.free_head != 0) {
+        index = handles_table.free_head;
+        slot = get_handle_slot(index, 0);
+        handles_table.free_head = slot->next_free;
+    } else {
+        if (handles_table.next_index > HANDLE_INDEX_MASK) {
+            errno = EMFILE;
+            return -1;
+        }
+        index = handles_table.next_index;
+        EQNULL(slot = get_handle_slot(index, 1), return -1)
+        handles_table.next_index++;
+    }
+
+    file->handle = (slot->generation << HANDLE_INDEX_BITS) | index;
+    __atomic_store_n(&(slot->file), file, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/** Releases the handle of the given file, once the lookups which could find it are over. Mutex should be locked */
+static void free_handle(struct netpipe *file) {
+    uint32_t index = file->handle & HANDLE_INDEX_MASK;
+    struct handle_slot *slot = get_handle_slot(index, 0);
+    if (slot == NULL || slot->file != file) return;
+
+    __atomic_store_n(&(slot->file), NULL, __ATOMIC_SEQ_CST);
+    // the lookups starting from now don't find the file. The running ones take a reference before they end
+    while (__atomic_load_n(&(slot->lookups), __ATOMIC_SEQ_CST) != 0) sched_yield();
+    slot->generation = (slot->generation + 1) & (0xFFFFFFFFU >> HANDLE_INDEX_BITS);
+    slot->next_free = handles_table.free_head;
+    handles_table.free_head = index;
+}
+
+/** Frees all the handles table */
+static void destroy_handles_table(void) {
+    for (uint32_t i = 0; i < HANDLE_NCHUNKS; i++) {
+        free(handles_table.chunks[i]);
+        handles_table.chunks[i] = NULL;
+    }
+    handles_table.next_index = 1;
+    handles_table.free_head = 0;
+}
+
 int netpipefs_open_files_table_init(void) {
     // destroys the table if it already exists
     if (open_files_table != NULL) MINUS1(netpipefs_open_files_table_destroy(), return -1)
 
     open_files_table = icl_hash_create(NBUCKETS, NULL, NULL);
     if (open_files_table == NULL) return -1;
+    destroy_handles_table();
 
     return 0;
 }
@@ -64,6 +156,7 @@ int netpipefs_open_files_table_destroy(void) {
     if (icl_hash_destroy(open_files_table, NULL, &openfiles_free_netpipe) == -1)
         return -1;
     open_files_table = NULL;
+    destroy_handles_table();
     return 0;
 }
 
@@ -84,14 +177,59 @@ struct netpipe *netpipefs_get_open_file(const char *path) {
     return file;
 }
 
+struct netpipe *netpipefs_get_open_file_by_handle(uint32_t handle) {
+    struct handle_slot *slot;
+    struct netpipe *file = NULL;
+
+    /* No locking: the slot's chunk is never moved and the slot is read atomically. The handle is not released
+     * while the lookup runs, so the file can't be freed before the reference is taken */
+    slot = get_handle_slot(handle & HANDLE_INDEX_MASK, 0);
+    if (slot != NULL) {
+        __atomic_add_fetch(&(slot->lookups), 1, __ATOMIC_SEQ_CST);
+        file = __atomic_load_n(&(slot->file), __ATOMIC_SEQ_CST);
+        // the handle was released, maybe the slot was given to another file
+        if (file != NULL && file->handle != handle) file = NULL;
+        if (file != NULL) netpipe_get(file);
+        __atomic_sub_fetch(&(slot->lookups), 1, __ATOMIC_RELEASE);
+    }
+
+    if (file == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return file;
+}
+
+int netpipefs_update_open_file(const char *path, void (*update)(struct netpipe *)) {
+    int err, found = 0;
+    struct netpipe *file;
+
+    PTH(err, pthread_mutex_lock(&open_files_mtx), return -1)
+
+    if (open_files_table == NULL) {
+        errno = EPERM;
+        found = -1;
+    } else if ((file = icl_hash_find(open_files_table, (char *) path)) != NULL) {
+        update(file);
+        found = 1;
+    }
+
+    PTH(err, pthread_mutex_unlock(&open_files_mtx), return -1)
+    return found;
+}
+
 int netpipefs_remove_open_file(const char *path) {
     int deleted, err;
+    struct netpipe *file;
     PTH(err, pthread_mutex_lock(&open_files_mtx), return -1)
 
     if (open_files_table == NULL) {
         errno = EPERM;
         deleted = -1;
     } else {
+        file = icl_hash_find(open_files_table, (char *) path);
+        if (file != NULL) free_handle(file);
         deleted = icl_hash_delete(open_files_table, (char *) path, NULL, NULL);
     }
 
@@ -115,7 +253,11 @@ struct netpipe *netpipefs_get_or_create_open_file(const char *path, int *just_cr
     EQNULL(file, file = netpipe_alloc(path); *just_created = 1)
 
     if (file != NULL && *just_created) {
-        if (icl_hash_insert(open_files_table, (void*) file->path, file) == NULL) {
+        if (alloc_handle(file) == -1) {
+            netpipe_free(file, NULL); // there are no poll handle
+            file = NULL;
+        } else if (icl_hash_insert(open_files_table, (void*) file->path, file) == NULL) {
+            free_handle(file);
             netpipe_free(file, NULL); // there are no poll handle
             file = NULL;
         }
@@ -2,6 +2,11 @@
 #include "../include/netpipefs_socket.h"
 #include "../include/utils.h"
 #include "../include/netpipe.h"
+#include "../include/dispatcher.h"
+#include "../include/bufpool.h"
+#include "../include/priority.h"
+#include "../include/ratelimit.h"
+#include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,11 +32,52 @@ static const struct fuse_opt netpipefs_opts[] = {
         NETPIPEFS_OPT("--hostport=%i",      hostport, 0),
         NETPIPEFS_OPT("--writeahead=%i",    writeahead, 0),
         NETPIPEFS_OPT("--readahead=%i",     readahead, 0),
+        NETPIPEFS_OPT("--maxreadahead=%lu", maxreadahead, 0),
+        NETPIPEFS_OPT("--coalesce=%lu",     coalesce, 0),
+        NETPIPEFS_OPT("--coalescedelay=%li", coalescedelay, 0),
+        NETPIPEFS_OPT("--ackbytes=%lu",     ackbytes, 0),
+        NETPIPEFS_OPT("--ackdelay=%li",     ackdelay, 0),
+        NETPIPEFS_OPT("--workers=%lu",      workers, 0),
+        NETPIPEFS_OPT("--maxframe=%lu",     maxframe, 0),
+        NETPIPEFS_OPT("--priority=%s",      priority, 0),
+        NETPIPEFS_OPT("--ratelimit=%s",     ratelimit, 0),
+        NETPIPEFS_OPT("--stripes=%lu",      stripes, 0),
+        NETPIPEFS_OPT("--stripepaths=%s",   stripepaths, 0),
+        NETPIPEFS_OPT("--stripelocal=%s",   stripelocal, 0),
+        NETPIPEFS_OPT("--striperemote=%s",  striperemote, 0),
         NETPIPEFS_OPT("-delayconnect",      delayconnect, 1),
+        NETPIPEFS_OPT("--iouring",          iouring, 1),
+        NETPIPEFS_OPT("--bufpool=%lu",      bufpool, 0),
+        NETPIPEFS_OPT("--hugepages",        hugepages, 1),
+        NETPIPEFS_OPT("--memlimit=%lu",     memlimit, 0),
+        NETPIPEFS_OPT("--noshm",            shm, 0),
+        NETPIPEFS_OPT("--udp",              udp, 1),
+        NETPIPEFS_OPT("--replay=%lu",       replay, 0),
 
         FUSE_OPT_END
 };
 
+/** Returns 1 if the comma separated list is made of ipv4 addresses, or if it is NULL */
+static int valid_addresses(const char *list) {
+    int array[4];
+    char ip[16];
+    size_t len;
+    const char *end;
+
+    if (list == NULL) return 1;
+    do {
+        if ((end = strchr(list, ',')) == NULL) end = list + strlen(list);
+        len = (size_t) (end - list);
+        if (len == 0 || len >= sizeof(ip)) return 0;
+        memcpy(ip, list, len);
+        ip[len] = '\0';
+        if (ipv4_address_to_array(ip, array) == -1) return 0;
+        list = end + 1;
+    } while (*end != '\0');
+
+    return 1;
+}
+
 int netpipefs_opt_parse(const char *progname, struct fuse_args *args) {
     /* Set defaults */
     netpipefs_options.mountpoint = NULL;
@@ -43,7 +89,27 @@ int netpipefs_opt_parse(const char *progname, struct fuse_args *args) {
     netpipefs_options.hostport = DEFAULT_PORT;
     netpipefs_options.delayconnect = 0;
     netpipefs_options.readahead = DEFAULT_READAHEAD;
+    netpipefs_options.maxreadahead = DEFAULT_MAX_READAHEAD;
     netpipefs_options.writeahead = DEFAULT_WRITEAHEAD;
+    netpipefs_options.coalesce = DEFAULT_COALESCE;
+    netpipefs_options.coalescedelay = DEFAULT_COALESCE_DELAY;
+    netpipefs_options.ackbytes = DEFAULT_ACK_BYTES;
+    netpipefs_options.ackdelay = DEFAULT_ACK_DELAY;
+    netpipefs_options.workers = DEFAULT_WORKERS;
+    netpipefs_options.maxframe = DEFAULT_MAX_FRAME;
+    netpipefs_options.priority = NULL;
+    netpipefs_options.ratelimit = NULL;
+    netpipefs_options.stripes = DEFAULT_STRIPES;
+    netpipefs_options.stripepaths = NULL;
+    netpipefs_options.stripelocal = NULL;
+    netpipefs_options.striperemote = NULL;
+    netpipefs_options.iouring = 0;
+    netpipefs_options.bufpool = DEFAULT_BUFPOOL;
+    netpipefs_options.hugepages = 0;
+    netpipefs_options.memlimit = 0;
+    netpipefs_options.shm = 1;
+    netpipefs_options.udp = 0;
+    netpipefs_options.replay = DEFAULT_REPLAY;
     //netpipefs_options.intr = 1;
 
     /* Parse options */
@@ -80,6 +146,49 @@ int netpipefs_opt_parse(const char *progname, struct fuse_args *args) {
         return 1;
     }
 
+    /* Check coalescing delay */
+    if (netpipefs_options.coalescedelay < 0) {
+        fprintf(stderr, "invalid coalescing delay\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check ack delay */
+    if (netpipefs_options.ackdelay < 0) {
+        fprintf(stderr, "invalid ack delay\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check priority rules */
+    if (netpipefs_options.priority != NULL && priority_add_rules(netpipefs_options.priority) == -1) {
+        if (errno != EINVAL) return -1;
+        fprintf(stderr, "invalid priority rules\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check rate limit rules */
+    if (netpipefs_options.ratelimit != NULL && ratelimit_add_rules(netpipefs_options.ratelimit) == -1) {
+        if (errno != EINVAL) return -1;
+        fprintf(stderr, "invalid rate limit rules\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check connections */
+    if (netpipefs_options.stripes == 0 || netpipefs_options.stripes > MAX_STRIPES) {
+        fprintf(stderr, "invalid number of connections, it should be from 1 to %d\nsee '%s -h' for usage\n", MAX_STRIPES, progname);
+        return 1;
+    }
+    if (!valid_addresses(netpipefs_options.stripelocal) || !valid_addresses(netpipefs_options.striperemote)) {
+        fprintf(stderr, "invalid connection addresses\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check replay window */
+    if (netpipefs_options.replay > MAX_REPLAY || (netpipefs_options.replay > 0 && netpipefs_options.replay < MIN_REPLAY)) {
+        fprintf(stderr, "invalid replay window, it should be 0 or from %ld to %ld bytes\nsee '%s -h' for usage\n",
+                MIN_REPLAY, MAX_REPLAY, progname);
+        return 1;
+    }
+
     /*if (netpipefs_options.pipecapacity < 0) {
         fprintf(stderr, "invalid pipe capacity\nsee '%s -h' for usage\n", progname);
         return 1;
@@ -108,6 +217,28 @@ void netpipefs_opt_free(struct fuse_args *args) {
         free((void*) netpipefs_options.mountpoint);
         netpipefs_options.mountpoint = NULL;
     }
+    if (netpipefs_options.priority) {
+        free((void*) netpipefs_options.priority);
+        netpipefs_options.priority = NULL;
+    }
+    priority_free();
+    if (netpipefs_options.ratelimit) {
+        free((void*) netpipefs_options.ratelimit);
+        netpipefs_options.ratelimit = NULL;
+    }
+    ratelimit_free();
+    if (netpipefs_options.stripepaths) {
+        free((void*) netpipefs_options.stripepaths);
+        netpipefs_options.stripepaths = NULL;
+    }
+    if (netpipefs_options.stripelocal) {
+        free((void*) netpipefs_options.stripelocal);
+        netpipefs_options.stripelocal = NULL;
+    }
+    if (netpipefs_options.striperemote) {
+        free((void*) netpipefs_options.striperemote);
+        netpipefs_options.striperemote = NULL;
+    }
     fuse_opt_free_args(args);
 }
 
@@ -123,9 +254,43 @@ void netpipefs_usage(const char *progname) {
            "    --hostport=<d>          remote port used for the socket connection (default: %d)\n"
            "    --timeout=<d>           connection timeout expressed in milliseconds (default: %d ms)\n"
            "    -delayconnect           connect to host after the filesystem is mounted\n"
+           "    --iouring               send and receive through io_uring. blocking system calls are used if the kernel doesn't support it\n"
            "    --readahead=<d>         how many bytes can be received and put into the buffer to anticipate read requests (default: %d)\n"
+           "    --maxreadahead=<d>      readahead buffers grow up to this to match the connection's bandwidth-delay product.\n"
+           "                            not greater than readahead disables it (default: %d)\n"
            "    --writeahead=<d>        how many bytes can be bufferized on write requests if the remote host can't receive data (default: %d)\n"
-           "\n", DEFAULT_PORT, DEFAULT_PORT, DEFAULT_TIMEOUT, DEFAULT_READAHEAD, DEFAULT_WRITEAHEAD);
+           "    --coalesce=<d>          writes smaller than this are gathered and sent together. 0 disables coalescing (default: %d)\n"
+           "    --coalescedelay=<d>     max microseconds that gathered writes can wait before they are sent (default: %d us)\n"
+           "    --ackbytes=<d>          credit for bytes read is given back once it reaches this, or a quarter of the readahead.\n"
+           "                            0 gives it back at every read (default: %d)\n"
+           "    --ackdelay=<d>          max microseconds that credit for bytes read can wait before it is given back (default: %d us)\n"
+           "    --workers=<d>           threads that handle the received messages. 0 handles them on the thread that reads the socket (default: %d)\n"
+           "    --maxframe=<d>          larger writes are split into messages of this many bytes, so the netpipes take turns\n"
+           "                            on the connection. 0 doesn't split them (default: %d)\n"
+           "    --priority=<s>          comma separated rules PATTERN=CLASS[:WEIGHT] which give the netpipes a class, from 0\n"
+           "                            the highest to %d, and a weight within the class (default class: %d, weight: %d)\n"
+           "    --ratelimit=<s>         comma separated rules PREFIX=RATE[:BURST] which limit the bytes per second sent by the\n"
+           "                            netpipes under the path prefix. sizes can end with K, M or G (default: no limit)\n"
+           "    --stripes=<d>           connections with the remote host, up to %d. the netpipes are spread over them by path.\n"
+           "                            both hosts use the lower of their values (default: %d)\n"
+           "    --stripepaths=<s>       comma separated shell patterns of the netpipes whose data takes turns on all the connections\n"
+           "    --stripelocal=<s>       comma separated local ipv4 addresses which the connections after the first are opened from\n"
+           "    --striperemote=<s>      comma separated remote ipv4 addresses which the connections after the first are opened to\n"
+           "    --bufpool=<d>           released buffers kept for reuse for each buffer size. 0 frees them (default: %d)\n"
+           "    --hugepages             back the buffers with 2MB huge pages, if the system has them. buffers are rounded up to 2MB\n"
+           "    --memlimit=<d>          max bytes for all the buffers. readahead buffers start small, grow while the netpipe is busy\n"
+           "                            and shrink when it is idle. 0 is unlimited and buffers have a fixed size (default: 0)\n"
+           "    --noshm                 with localhost, send the messages through the AF_UNIX socket instead of shared memory\n"
+           "    --udp                   with an ipv4 host, send the messages over UDP, so a lost packet delays only its netpipe.\n"
+           "                            both hosts must ask for it, otherwise TCP is used\n"
+           "    --replay=<d>            bytes sent on each connection kept until the host acknowledges them, at most. if the\n"
+           "                            connection is lost it is resumed within the timeout and the netpipes carry on. both\n"
+           "                            hosts must keep them and it isn't done with shared memory or UDP. 0 doesn't, otherwise\n"
+           "                            at least %ld (default: %d)\n"
+           "\n", DEFAULT_PORT, DEFAULT_PORT, DEFAULT_TIMEOUT, DEFAULT_READAHEAD, DEFAULT_MAX_READAHEAD, DEFAULT_WRITEAHEAD, DEFAULT_COALESCE,
+           DEFAULT_COALESCE_DELAY, DEFAULT_ACK_BYTES, DEFAULT_ACK_DELAY, DEFAULT_WORKERS, DEFAULT_MAX_FRAME,
+           PRIORITY_CLASSES - 1, DEFAULT_PRIORITY, DEFAULT_WEIGHT, MAX_STRIPES, DEFAULT_STRIPES, DEFAULT_BUFPOOL,
+           MIN_REPLAY, DEFAULT_REPLAY);
     fuse_usage();
 }
 
@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/pathrules.h"
+#include "../include/utils.h"
+
+/** Make room for more rules. Mutex should be locked */
+static int reserve_rules(struct pathrules *t, size_t count) {
+    size_t new_capacity = t->capacity == 0 ? 8 : t->capacity;
+    struct pathrule *new_rules;
+
+    if (t->nrules + count <= t->capacity) return 0;
+    while (new_capacity < t->nrules + count) new_capacity *= 2;
+    EQNULL(new_rules = (struct pathrule *) realloc(t->rules, new_capacity * sizeof(struct pathrule)), return -1)
+    t->rules = new_rules;
+    t->capacity = new_capacity;
+
+    return 0;
+}
+
+/** Returns the index of the rule set for the path, nrules if there is none. Mutex should be locked */
+static size_t find_exact(const struct pathrules *t, const char *path) {
+    size_t i;
+
+    for (i = 0; i < t->nrules; i++) {
+        if (t->rules[i].exact && strcmp(t->rules[i].pattern, path) == 0) break;
+    }
+
+    return i;
+}
+
+int pathrules_add(struct pathrules *t, const char *list) {
+    int err;
+    size_t added = 0, i;
+    const char *rule = list, *end, *equal;
+    struct pathrule *parsed = NULL, *tmp;
+
+    /* Every rule is parsed before adding them, so none is added if one is not valid */
+    while (*rule != '\0') {
+        if ((end = strchr(rule, ',')) == NULL) end = rule + strlen(rule);
+        equal = end;
+        while (equal > rule && *(equal - 1) != '=') equal--;
+        if (equal == rule || equal - 1 == rule) { // no value or no pattern
+            errno = EINVAL;
+            goto error;
+        }
+
+        EQNULL(tmp = (struct pathrule *) realloc(parsed, (added + 1) * sizeof(struct pathrule)), goto error)
+        parsed = tmp;
+        EQNULL(parsed[added].value = malloc(t->value_size), goto error)
+        if (t->parse(equal, (size_t) (end - equal), parsed[added].value) == -1 ||
+            (parsed[added].pattern = strndup(rule, (size_t) (equal - 1 - rule))) == NULL) {
+            free(parsed[added].value);
+            goto error;
+        }
+        parsed[added].exact = 0;
+        added++;
+
+        rule = *end == ',' ? end + 1 : end;
+    }
+
+    PTH(err, pthread_mutex_lock(&(t->mtx)), goto error)
+    if (reserve_rules(t, added) == -1) {
+        pthread_mutex_unlock(&(t->mtx));
+        goto error;
+    }
+    memcpy(t->rules + t->nrules, parsed, added * sizeof(struct pathrule));
+    t->nrules += added;
+    PTH(err, pthread_mutex_unlock(&(t->mtx)), free(parsed); return -1)
+    free(parsed);
+
+    return 0;
+
+error:
+    err = errno;
+    for (i = 0; i < added; i++) {
+        free(parsed[i].pattern);
+        free(parsed[i].value);
+    }
+    free(parsed);
+    errno = err;
+    return -1;
+}
+
+int pathrules_set(struct pathrules *t, const char *path, const void *value) {
+    int err;
+    size_t i;
+    char *pattern;
+    void *copy;
+
+    PTH(err, pthread_mutex_lock(&(t->mtx)), return -1)
+    i = find_exact(t, path);
+    if (i == t->nrules) { // a new rule for this path
+        if (reserve_rules(t, 1) == -1 || (copy = malloc(t->value_size)) == NULL) {
+            pthread_mutex_unlock(&(t->mtx));
+            return -1;
+        }
+        if ((pattern = strdup(path)) == NULL) {
+            free(copy);
+            pthread_mutex_unlock(&(t->mtx));
+            return -1;
+        }
+        t->rules[i].pattern = pattern;
+        t->rules[i].exact = 1;
+        t->rules[i].value = copy;
+        t->nrules++;
+    }
+    memcpy(t->rules[i].value, value, t->value_size);
+    PTH(err, pthread_mutex_unlock(&(t->mtx)), return -1)
+
+    return 0;
+}
+
+int pathrules_unset(struct pathrules *t, const char *path) {
+    int err;
+    size_t i;
+
+    PTH(err, pthread_mutex_lock(&(t->mtx)), return -1)
+    i = find_exact(t, path);
+    if (i == t->nrules) {
+        PTH(err, pthread_mutex_unlock(&(t->mtx)), return -1)
+        errno = ENOENT;
+        return -1;
+    }
+    free(t->rules[i].pattern);
+    free(t->rules[i].value);
+    memmove(t->rules + i, t->rules + i + 1, (t->nrules - i - 1) * sizeof(struct pathrule));
+    t->nrules--;
+    PTH(err, pthread_mutex_unlock(&(t->mtx)), return -1)
+
+    return 0;
+}
+
+int pathrules_lookup(struct pathrules *t, const char *path, void *value) {
+    size_t i, found;
+    long score, best = -1;
+
+    pthread_mutex_lock(&(t->mtx));
+    /* a rule for the path itself comes first, then the best match */
+    if ((found = find_exact(t, path)) == t->nrules) {
+        for (i = 0; i < t->nrules; i++) {
+            if (t->rules[i].exact || (score = t->match(t->rules[i].pattern, path)) <= best) continue;
+            best = score;
+            found = i;
+        }
+    }
+    if (found < t->nrules) memcpy(value, t->rules[found].value, t->value_size);
+    pthread_mutex_unlock(&(t->mtx));
+
+    return found < t->nrules;
+}
+
+void pathrules_free(struct pathrules *t) {
+    size_t i;
+
+    pthread_mutex_lock(&(t->mtx));
+    for (i = 0; i < t->nrules; i++) {
+        free(t->rules[i].pattern);
+        free(t->rules[i].value);
+    }
+    free(t->rules);
+    t->rules = NULL;
+    t->nrules = 0;
+    t->capacity = 0;
+    pthread_mutex_unlock(&(t->mtx));
+}
@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <fnmatch.h>
+#include "../include/pathrules.h"
+#include "../include/priority.h"
+
+/** Class and weight given by a rule */
+struct priority_value {
+    int priority;
+    size_t weight;
+};
+
+static int parse_value(const char *str, size_t len, void *value);
+static long match_pattern(const char *pattern, const char *path);
+
+static struct pathrules rules = PATHRULES_INITIALIZER(sizeof(struct priority_value), &parse_value, &match_pattern);
+
+/** Parse a decimal number made only of digits */
+static int parse_number(const char *str, size_t len, size_t max, size_t *number) {
+    size_t i;
+
+    if (len == 0) return -1;
+    *number = 0;
+    for (i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9') return -1;
+        *number = *number * 10 + (size_t) (str[i] - '0');
+        if (*number > max) return -1;
+    }
+
+    return 0;
+}
+
+int priority_parse(const char *value, size_t len, int *priority, size_t *weight) {
+    size_t cls, colon = 0;
+
+    while (colon < len && value[colon] != ':') colon++;
+    if (parse_number(value, colon, PRIORITY_CLASSES - 1, &cls) == -1) goto invalid;
+    *weight = DEFAULT_WEIGHT;
+    if (colon < len) {
+        if (parse_number(value + colon + 1, len - colon - 1, MAX_WEIGHT, weight) == -1 || *weight == 0)
+            goto invalid;
+    }
+    *priority = (int) cls;
+
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+static int parse_value(const char *str, size_t len, void *value) {
+    struct priority_value *v = (struct priority_value *) value;
+
+    return priority_parse(str, len, &(v->priority), &(v->weight));
+}
+
+/** Every pattern that matches is as good, so the first one wins */
+static long match_pattern(const char *pattern, const char *path) {
+    return fnmatch(pattern, path, 0) == 0 ? 0 : -1;
+}
+
+int priority_add_rules(const char *list) {
+    return pathrules_add(&rules, list);
+}
+
+int priority_set(const char *path, int priority, size_t weight) {
+    struct priority_value v;
+
+    v.priority = priority;
+    v.weight = weight;
+
+    return pathrules_set(&rules, path, &v);
+}
+
+int priority_unset(const char *path) {
+    return pathrules_unset(&rules, path);
+}
+
+void priority_lookup(const char *path, int *priority, size_t *weight) {
+    struct priority_value v;
+
+    v.priority = DEFAULT_PRIORITY;
+    v.weight = DEFAULT_WEIGHT;
+    pathrules_lookup(&rules, path, &v);
+    *priority = v.priority;
+    *weight = v.weight;
+}
+
+void priority_free(void) {
+    pathrules_free(&rules);
+}
@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "../include/pathrules.h"
+#include "../include/ratelimit.h"
+
+/** Rate limit and burst given by a rule */
+struct ratelimit_value {
+    size_t rate;
+    size_t burst;
+};
+
+static int parse_value(const char *str, size_t len, void *value);
+static long contains(const char *prefix, const char *path);
+
+static struct pathrules rules = PATHRULES_INITIALIZER(sizeof(struct ratelimit_value), &parse_value, &contains);
+
+/** Parse a number of bytes made of digits and an optional K, M or G suffix */
+static int parse_bytes(const char *str, size_t len, size_t *bytes) {
+    size_t i, shift = 0;
+
+    if (len > 0) {
+        switch (str[len - 1]) {
+            case 'K': case 'k': shift = 10; break;
+            case 'M': case 'm': shift = 20; break;
+            case 'G': case 'g': shift = 30; break;
+            default: break;
+        }
+        if (shift > 0) len--;
+    }
+    if (len == 0) return -1;
+
+    *bytes = 0;
+    for (i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9') return -1;
+        if (*bytes > (SIZE_MAX - (size_t) (str[i] - '0')) / 10) return -1;
+        *bytes = *bytes * 10 + (size_t) (str[i] - '0');
+    }
+    if (*bytes > (SIZE_MAX >> shift)) return -1;
+    *bytes <<= shift;
+
+    return 0;
+}
+
+int ratelimit_parse(const char *value, size_t len, size_t *rate, size_t *burst) {
+    size_t colon = 0;
+
+    while (colon < len && value[colon] != ':') colon++;
+    if (parse_bytes(value, colon, rate) == -1) goto invalid;
+    if (colon < len) {
+        if (parse_bytes(value + colon + 1, len - colon - 1, burst) == -1 || *burst == 0) goto invalid;
+    } else {
+        *burst = *rate / RATELIMIT_BURST_FRACTION;
+        if (*burst == 0) *burst = 1;
+    }
+
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+static int parse_value(const char *str, size_t len, void *value) {
+    struct ratelimit_value *v = (struct ratelimit_value *) value;
+
+    return ratelimit_parse(str, len, &(v->rate), &(v->burst));
+}
+
+/** Returns the length of the prefix if it contains the path, otherwise -1. The longest prefix wins */
+static long contains(const char *prefix, const char *path) {
+    size_t len = strlen(prefix);
+
+    if (strncmp(prefix, path, len) != 0) return -1;
+    if (path[len] != '\0' && path[len] != '/' && prefix[len - 1] != '/') return -1;
+
+    return (long) len;
+}
+
+int ratelimit_add_rules(const char *list) {
+    return pathrules_add(&rules, list);
+}
+
+int ratelimit_set(const char *path, size_t rate, size_t burst) {
+    struct ratelimit_value v;
+
+    v.rate = rate;
+    v.burst = burst;
+
+    return pathrules_set(&rules, path, &v);
+}
+
+int ratelimit_unset(const char *path) {
+    return pathrules_unset(&rules, path);
+}
+
+void ratelimit_lookup(const char *path, size_t *rate, size_t *burst) {
+    struct ratelimit_value v;
+
+    v.rate = DEFAULT_RATELIMIT;
+    v.burst = 0;
+    pathrules_lookup(&rules, path, &v);
+    *rate = v.rate;
+    *burst = v.burst;
+}
+
+void ratelimit_free(void) {
+    pathrules_free(&rules);
+}
+
+void ratelimit_init(struct ratelimit *rl) {
+    rl->tokens = 0;
+    rl->last.tv_sec = 0;
+    rl->last.tv_nsec = 0;
+    rl->window_bytes = 0;
+    rl->window_start.tv_sec = 0;
+    rl->window_start.tv_nsec = 0;
+    rl->current = 0;
+}
+
+/** Seconds from start to end */
+static double seconds_between(const struct timespec *start, const struct timespec *end) {
+    return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+size_t ratelimit_take(struct ratelimit *rl, size_t rate, size_t burst, size_t size, const struct timespec *now) {
+    double elapsed;
+    size_t allowed = size;
+
+    if (burst == 0) burst = 1;
+    if (rl->last.tv_sec == 0 && rl->last.tv_nsec == 0) { // never used
+        rl->tokens = (double) burst;
+        rl->window_start = *now;
+    } else {
+        rl->tokens += seconds_between(&(rl->last), now) * (double) rate;
+        if (rl->tokens > (double) burst) rl->tokens = (double) burst;
+    }
+    rl->last = *now;
+
+    elapsed = seconds_between(&(rl->window_start), now);
+    if (elapsed >= 1) {
+        rl->current = (size_t) ((double) rl->window_bytes / elapsed);
+        rl->window_bytes = 0;
+        rl->window_start = *now;
+    }
+
+    if (rate > 0) {
+        /* waiting for a full burst, or for the whole write if smaller, avoids many tiny sends */
+        if (rl->tokens < (double) (size < burst ? size : burst)) return 0;
+        if ((double) allowed > rl->tokens) allowed = (size_t) rl->tokens;
+        rl->tokens -= (double) allowed;
+    }
+    rl->window_bytes += allowed;
+
+    return allowed;
+}
+
+long ratelimit_delay(struct ratelimit *rl, size_t rate, size_t burst, size_t size) {
+    double needed = (double) (size < burst ? size : burst) - rl->tokens;
+
+    if (rate == 0 || needed <= 0) return 0;
+
+    return (long) (needed * 1e6 / (double) rate) + 1;
+}
+
+void ratelimit_refund(struct ratelimit *rl, size_t burst, size_t bytes) {
+    rl->tokens += (double) bytes;
+    if (rl->tokens > (double) burst) rl->tokens = (double) burst;
+    rl->window_bytes = rl->window_bytes > bytes ? rl->window_bytes - bytes : 0;
+}
+
+size_t ratelimit_current(const struct ratelimit *rl, const struct timespec *now) {
+    double elapsed;
+
+    if (rl->window_start.tv_sec == 0 && rl->window_start.tv_nsec == 0) return 0;
+
+    /* the measure of a netpipe that stopped sending goes down over time */
+    elapsed = seconds_between(&(rl->window_start), now);
+    if (elapsed >= 1) return (size_t) ((double) rl->window_bytes / elapsed);
+
+    return rl->current;
+}
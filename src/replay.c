@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/replay.h"
+#include "../include/utils.h"
+
+void replay_init(struct replay *r) {
+    r->data = NULL;
+    r->size = 0;
+    r->start = 0;
+    r->end = 0;
+}
+
+void replay_free(struct replay *r) {
+    free(r->data);
+    r->data = NULL;
+    r->size = 0;
+    r->start = r->end;
+}
+
+size_t replay_size(const struct replay *r) {
+    return (size_t) (r->end - r->start);
+}
+
+/** Move the bytes kept into a larger ring, where they begin at the position modulo its size */
+static int replay_grow(struct replay *r, size_t needed) {
+    size_t size = r->size == 0 ? REPLAY_MIN_SIZE : r->size, kept = replay_size(r), first;
+    char *data;
+
+    while (size < needed) size *= 2;
+    EQNULL(data = (char *) malloc(size), return -1)
+    if (kept > 0) {
+        /* the bytes kept wrap around the end of the old ring at most once, and around the new one at most once */
+        size_t from = (size_t) (r->start % r->size), to = (size_t) (r->start % size), i = 0, n;
+        while (i < kept) {
+            first = r->size - (from + i) % r->size;
+            n = size - (to + i) % size;
+            if (first < n) n = first;
+            if (kept - i < n) n = kept - i;
+            memcpy(data + (to + i) % size, r->data + (from + i) % r->size, n);
+            i += n;
+        }
+    }
+    free(r->data);
+    r->data = data;
+    r->size = size;
+
+    return 0;
+}
+
+int replay_append(struct replay *r, const struct iovec *iov, int iovcnt, size_t bytes) {
+    size_t offset, n, len;
+    int i;
+
+    if (replay_size(r) + bytes > r->size) MINUS1(replay_grow(r, replay_size(r) + bytes), return -1)
+
+    for (i = 0; i < iovcnt && bytes > 0; i++) {
+        len = iov[i].iov_len < bytes ? iov[i].iov_len : bytes;
+        bytes -= len;
+        for (offset = 0; offset < len; offset += n) {
+            size_t at = (size_t) (r->end % r->size);
+            n = r->size - at < len - offset ? r->size - at : len - offset;
+            memcpy(r->data + at, (const char *) iov[i].iov_base + offset, n);
+            r->end += n;
+        }
+    }
+
+    return 0;
+}
+
+void replay_release(struct replay *r, uint64_t position) {
+    if (position > r->start && position <= r->end) r->start = position;
+}
+
+int replay_get(const struct replay *r, uint64_t position, struct iovec *iov) {
+    size_t at, n;
+
+    if (position < r->start || position > r->end) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (position == r->end) return 0;
+
+    at = (size_t) (position % r->size);
+    n = (size_t) (r->end - position);
+    iov[0].iov_base = r->data + at;
+    if (at + n <= r->size) {
+        iov[0].iov_len = n;
+        return 1;
+    }
+    iov[0].iov_len = r->size - at;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = n - iov[0].iov_len;
+
+    return 2;
+}
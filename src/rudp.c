@@ -0,0 +1,948 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "../include/rudp.h"
+#include "../include/ratelimit.h"
+#include "../include/utils.h"
+
+/*
+ * A data datagram has type, flags, 2 reserved bytes, packet number, message number, the message of the same stream
+ * sent before, the last message of stream 0 sent before, length of the message and offset of the segment, then
+ * the segment. An acknowledgement has type, flags, number of ranges, the message up to which all the messages were
+ * received in order, then the ranges of packet numbers received, from the highest: first and last of each range.
+ * Everything is in network byte order. Packet and message numbers start from 1, 0 means none.
+ */
+#define DATA_HEADER_SIZE 44
+#define ACK_HEADER_SIZE 12
+#define RANGE_SIZE 16
+#define DATAGRAM_SIZE (DATA_HEADER_SIZE + RUDP_MSS)
+
+#define MSG_BUCKETS 1024    // buckets of the received messages, by message number
+#define STREAM_BUCKETS 256  // buckets of the streams, by stream
+
+/** A message queued and not yet acknowledged */
+struct out_msg {
+    struct out_msg *prev, *next;    // in the order they were queued
+    uint64_t msn;       // message number
+    uint64_t after;     // message of the same stream sent before, 0 if none
+    uint64_t control;   // last message of stream 0 sent before, 0 if none
+    uint32_t stream;
+    size_t len;
+    uint32_t nsegs;
+    uint32_t next_seg;  // first segment never sent
+    uint32_t acked_segs;
+    unsigned char *acked;   // 1 for each segment acknowledged
+    char *data;
+};
+
+/** A segment sent and not yet acknowledged, or lost and waiting to be sent again */
+struct segment {
+    struct segment *next;
+    struct out_msg *msg;
+    uint32_t index;
+    uint64_t pn;        // packet number of the last datagram which carried it
+    uint64_t sent;      // when that datagram was sent, in microseconds
+};
+
+/** Last message sent on a stream, until the remote host received it in order */
+struct stream {
+    struct stream *next;
+    uint32_t id;
+    uint64_t last;
+};
+
+/** A message being received, or received out of order and kept until the messages before it are received */
+struct in_msg {
+    struct in_msg *next;        // in the bucket
+    struct in_msg *next_ready;  // complete messages waiting for those before them
+    uint64_t msn, after, control;
+    size_t len;
+    uint32_t nsegs;
+    uint32_t received;
+    int delivered;
+    unsigned char *got;     // 1 for each segment received
+    char *data;             // NULL after the message is delivered
+};
+
+struct rudp {
+    int udpfd, ctlfd;
+    int wakefd;     // wakes up the thread when there are new messages or the connection is closed
+    int datafd;     // readable while there is data to read or the remote host is gone
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;    // signaled when messages are acknowledged or received and when the remote host is gone
+    int closing;
+    int gone;       // 1 when the remote host is gone
+    int blocked;    // 1 while the socket buffer is full
+    rudp_drop_fn drop;
+    void *drop_arg;
+    struct rudp_stats stats;
+
+    /* sending side */
+    uint64_t next_msn, next_pn;
+    struct out_msg *msgs_head, *msgs_tail;
+    struct out_msg *unsent;     // first message with segments never sent
+    size_t queued;              // bytes of the messages not yet acknowledged
+    struct stream *streams[STREAM_BUCKETS];
+    struct segment *inflight_head, *inflight_tail;  // by packet number
+    struct segment *lost_head, *lost_tail;
+    size_t inflight;            // bytes sent and not yet acknowledged
+    size_t cwnd, ssthresh;
+    uint64_t largest_acked;
+    uint64_t recovery;          // losses of datagrams sent up to this packet number are the same congestion event
+    long srtt, rttvar, rto;     // microseconds
+    int backoff;                // the retransmission timeout is doubled for each timeout without acknowledgements
+    struct ratelimit pacer;
+    uint64_t remote_delivered;  // the remote host received in order the messages up to this one
+
+    /* receiving side */
+    struct in_msg *msgs[MSG_BUCKETS];
+    size_t reassembly;          // bytes of the messages received and not yet delivered
+    struct in_msg *ready;       // by message number
+    uint64_t delivered;         // all the messages up to this one were delivered
+    uint64_t ranges[RUDP_MAX_RANGES][2];    // ranges of packet numbers received, from the highest
+    int nranges;
+    int ack_pending;            // datagrams received and not yet acknowledged
+    uint64_t ack_deadline;
+    char *rbuf;                 // messages delivered and not yet read
+    size_t rstart, rcount, rcap;
+};
+
+static void put_u16(unsigned char *dest, uint16_t value) {
+    dest[0] = (unsigned char) (value >> 8);
+    dest[1] = (unsigned char) value;
+}
+
+static void put_u32(unsigned char *dest, uint32_t value) {
+    put_u16(dest, (uint16_t) (value >> 16));
+    put_u16(dest + 2, (uint16_t) value);
+}
+
+static void put_u64(unsigned char *dest, uint64_t value) {
+    put_u32(dest, (uint32_t) (value >> 32));
+    put_u32(dest + 4, (uint32_t) value);
+}
+
+static uint16_t get_u16(const unsigned char *src) {
+    return (uint16_t) ((src[0] << 8) | src[1]);
+}
+
+static uint32_t get_u32(const unsigned char *src) {
+    return ((uint32_t) get_u16(src) << 16) | get_u16(src + 2);
+}
+
+static uint64_t get_u64(const unsigned char *src) {
+    return ((uint64_t) get_u32(src) << 32) | get_u32(src + 4);
+}
+
+static uint64_t usec_of(const struct timespec *ts) {
+    return (uint64_t) ts->tv_sec * 1000000u + (uint64_t) ts->tv_nsec / 1000u;
+}
+
+/** Make the eventfd readable */
+static void notify(int efd) {
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(uint64_t)) == -1) errno = 0; // already readable
+}
+
+static uint32_t segment_size(const struct out_msg *msg, uint32_t index) {
+    size_t left = msg->len - (size_t) index * RUDP_MSS;
+    return left < RUDP_MSS ? (uint32_t) left : RUDP_MSS;
+}
+
+static long current_rto(const struct rudp *r) {
+    long rto = r->rto << r->backoff;
+    return rto < RUDP_MAX_RTO_USEC && rto > 0 ? rto : RUDP_MAX_RTO_USEC;
+}
+
+/* ---------------------------------------------- sending side ---------------------------------------------- */
+
+static struct stream *find_stream(struct rudp *r, uint32_t id) {
+    struct stream *s = r->streams[id % STREAM_BUCKETS];
+    while (s != NULL && s->id != id) s = s->next;
+    return s;
+}
+
+/** Forget the streams whose last message was received in order by the remote host */
+static void forget_streams(struct rudp *r) {
+    int i;
+    struct stream **p, *s;
+
+    for (i = 0; i < STREAM_BUCKETS; i++) {
+        p = &(r->streams[i]);
+        while ((s = *p) != NULL) {
+            if (s->last <= r->remote_delivered) {
+                *p = s->next;
+                free(s);
+            } else {
+                p = &(s->next);
+            }
+        }
+    }
+}
+
+/**
+ * Send a datagram, unless the drop function drops it. Must be called with the mtx locked.
+ *
+ * @return 0 if it was sent or dropped, -1 if the socket buffer is full
+ */
+static int send_datagram(struct rudp *r, const unsigned char *buf, size_t len, int type, uint32_t stream, int retransmission) {
+    if (r->drop != NULL && r->drop(r->drop_arg, type, stream, retransmission)) {
+        r->stats.sent++;
+        r->stats.dropped++;
+        return 0;
+    }
+
+    if (send(r->udpfd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            errno = 0;
+            r->blocked = 1;
+            return -1;
+        }
+        errno = 0; // as a lost datagram, like when the remote host is not listening yet
+    }
+    r->stats.sent++;
+
+    return 0;
+}
+
+/** Send the segment in a new datagram. Returns 0 on success, -1 if the socket buffer is full */
+static int send_segment(struct rudp *r, struct segment *seg, int retransmission, uint64_t now) {
+    unsigned char buf[DATAGRAM_SIZE];
+    struct out_msg *msg = seg->msg;
+    uint32_t size = segment_size(msg, seg->index);
+    size_t offset = (size_t) seg->index * RUDP_MSS;
+
+    buf[0] = RUDP_DATA;
+    buf[1] = 0;
+    put_u16(buf + 2, 0);
+    put_u64(buf + 4, r->next_pn);
+    put_u64(buf + 12, msg->msn);
+    put_u64(buf + 20, msg->after);
+    put_u64(buf + 28, msg->control);
+    put_u32(buf + 36, (uint32_t) msg->len);
+    put_u32(buf + 40, (uint32_t) offset);
+    memcpy(buf + DATA_HEADER_SIZE, msg->data + offset, size);
+    MINUS1(send_datagram(r, buf, DATA_HEADER_SIZE + size, RUDP_DATA, msg->stream, retransmission), return -1)
+
+    seg->pn = r->next_pn++;
+    seg->sent = now;
+    seg->next = NULL;
+    if (r->inflight_tail == NULL) r->inflight_head = seg;
+    else r->inflight_tail->next = seg;
+    r->inflight_tail = seg;
+    r->inflight += size;
+    if (retransmission) r->stats.retransmitted++;
+
+    return 0;
+}
+
+/**
+ * Send the lost segments, then the new ones, within the congestion window and at the pacing rate.
+ *
+ * @return microseconds to wait before pacing lets the next datagram go, 0 if there is nothing to wait for
+ */
+static long send_segments(struct rudp *r, const struct timespec *now) {
+    int retransmission;
+    uint32_t size;
+    size_t rate = 0, burst = RUDP_PACING_BURST;
+    struct segment *seg, *next_lost = NULL;
+
+    /* a congestion window every round trip, a bit faster so pacing doesn't slow down the window's growth */
+    if (r->srtt > 0) {
+        rate = (size_t) ((double) r->cwnd * 1.25 * 1e6 / (double) r->srtt);
+        if (rate / (1000000 / RUDP_PACING_SLICE_USEC) > burst) burst = rate / (1000000 / RUDP_PACING_SLICE_USEC);
+    }
+
+    while (!r->blocked && !r->gone) {
+        if (r->lost_head != NULL) {
+            seg = r->lost_head;
+            next_lost = seg->next;
+            retransmission = 1;
+        } else if (r->unsent != NULL) {
+            EQNULL(seg = (struct segment *) malloc(sizeof(struct segment)), errno = 0; return 0)
+            seg->msg = r->unsent;
+            seg->index = r->unsent->next_seg;
+            retransmission = 0;
+        } else {
+            return 0;
+        }
+
+        size = segment_size(seg->msg, seg->index);
+        if ((r->inflight > 0 && r->inflight + size > r->cwnd) || ratelimit_take(&(r->pacer), rate, burst, size, now) == 0) {
+            if (!retransmission) free(seg);
+            if (r->inflight > 0 && r->inflight + size > r->cwnd) return 0; // waits for acknowledgements
+            return ratelimit_delay(&(r->pacer), rate, burst, size);
+        }
+
+        if (send_segment(r, seg, retransmission, usec_of(now)) == -1) {
+            ratelimit_refund(&(r->pacer), burst, size);
+            if (!retransmission) free(seg);
+            return 0;
+        }
+
+        if (retransmission) {
+            if ((r->lost_head = next_lost) == NULL) r->lost_tail = NULL;
+        } else if (++(r->unsent->next_seg) == r->unsent->nsegs) {
+            r->unsent = r->unsent->next;
+        }
+    }
+
+    return 0;
+}
+
+/** The message was acknowledged. Must be called with the mtx locked */
+static void finish_msg(struct rudp *r, struct out_msg *msg) {
+    if (msg->prev == NULL) r->msgs_head = msg->next;
+    else msg->prev->next = msg->next;
+    if (msg->next == NULL) r->msgs_tail = msg->prev;
+    else msg->next->prev = msg->prev;
+    r->queued -= msg->len;
+    free(msg);
+}
+
+/** The segment can be sent again. Must be called with the mtx locked */
+static void lose_segment(struct rudp *r, struct segment *seg) {
+    r->inflight -= segment_size(seg->msg, seg->index);
+    seg->next = NULL;
+    if (r->lost_tail == NULL) r->lost_head = seg;
+    else r->lost_tail->next = seg;
+    r->lost_tail = seg;
+
+    /* a congestion event for each window */
+    if (seg->pn > r->recovery) {
+        r->ssthresh = r->cwnd / 2 > RUDP_MIN_CWND ? r->cwnd / 2 : RUDP_MIN_CWND;
+        r->cwnd = r->ssthresh;
+        r->recovery = r->next_pn - 1;
+    }
+}
+
+/** Nothing was acknowledged for a retransmission timeout: everything in flight is lost */
+static void on_timeout(struct rudp *r) {
+    struct segment *seg;
+
+    while ((seg = r->inflight_head) != NULL) {
+        r->inflight_head = seg->next;
+        lose_segment(r, seg);
+    }
+    r->inflight_tail = NULL;
+    r->cwnd = RUDP_MIN_CWND;
+    if (r->backoff < 16) r->backoff++;
+}
+
+static void update_rtt(struct rudp *r, long rtt) {
+    long var;
+
+    if (rtt <= 0) rtt = 1;
+    if (r->srtt == 0) {
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+    } else {
+        r->rttvar = (3 * r->rttvar + labs(r->srtt - rtt)) / 4;
+        r->srtt = (7 * r->srtt + rtt) / 8;
+    }
+
+    /* the remote host can delay the acknowledgements */
+    var = 4 * r->rttvar;
+    r->rto = r->srtt + (var > RUDP_ACK_DELAY_USEC ? var : RUDP_ACK_DELAY_USEC) + RUDP_ACK_DELAY_USEC;
+    if (r->rto < RUDP_MIN_RTO_USEC) r->rto = RUDP_MIN_RTO_USEC;
+    if (r->rto > RUDP_MAX_RTO_USEC) r->rto = RUDP_MAX_RTO_USEC;
+    r->backoff = 0;
+}
+
+static void on_ack(struct rudp *r, const unsigned char *buf, size_t len, uint64_t now) {
+    int nranges, j;
+    uint32_t size;
+    uint64_t first, last;
+    size_t acked = 0;
+    long rtt = -1;
+    struct segment **p, *seg, *kept = NULL;
+    struct out_msg *msg;
+    const unsigned char *range;
+
+    if (len < ACK_HEADER_SIZE) return;
+    nranges = get_u16(buf + 2);
+    if (nranges > RUDP_MAX_RANGES || len < ACK_HEADER_SIZE + (size_t) nranges * RANGE_SIZE) return;
+
+    if (get_u64(buf + 4) > r->remote_delivered) {
+        r->remote_delivered = get_u64(buf + 4);
+        forget_streams(r);
+        pthread_cond_broadcast(&(r->cond)); // the receive window moved on
+    }
+
+    /* the datagrams in flight and the ranges are both walked from the lowest packet number */
+    j = nranges - 1;
+    p = &(r->inflight_head);
+    while ((seg = *p) != NULL) {
+        while (j >= 0 && get_u64(buf + ACK_HEADER_SIZE + j * RANGE_SIZE + 8) < seg->pn) j--;
+        if (j < 0) break;
+        range = buf + ACK_HEADER_SIZE + j * RANGE_SIZE;
+        first = get_u64(range);
+        last = get_u64(range + 8);
+        if (seg->pn < first || seg->pn > last) {
+            kept = seg;
+            p = &(seg->next);
+            continue;
+        }
+
+        *p = seg->next;
+        size = segment_size(seg->msg, seg->index);
+        r->inflight -= size;
+        acked += size;
+        if (seg->pn > r->largest_acked) {
+            r->largest_acked = seg->pn;
+            rtt = (long) (now - seg->sent);
+        }
+
+        msg = seg->msg;
+        if (!msg->acked[seg->index]) {
+            msg->acked[seg->index] = 1;
+            if (++(msg->acked_segs) == msg->nsegs) finish_msg(r, msg);
+        }
+        free(seg);
+    }
+    if (*p == NULL) r->inflight_tail = kept;
+    if (acked == 0) return;
+
+    if (rtt >= 0) update_rtt(r, rtt);
+    if (r->largest_acked > r->recovery) { // not recovering from a loss
+        if (r->cwnd < r->ssthresh) r->cwnd += acked;
+        else r->cwnd += (size_t) RUDP_MSS * acked / r->cwnd;
+        if (r->cwnd > RUDP_SNDBUF) r->cwnd = RUDP_SNDBUF;
+    }
+
+    /* lost if enough datagrams sent after it were acknowledged */
+    while ((seg = r->inflight_head) != NULL && seg->pn + RUDP_REORDER <= r->largest_acked) {
+        if ((r->inflight_head = seg->next) == NULL) r->inflight_tail = NULL;
+        lose_segment(r, seg);
+    }
+
+    pthread_cond_broadcast(&(r->cond));
+}
+
+/* --------------------------------------------- receiving side --------------------------------------------- */
+
+static struct in_msg *find_in_msg(struct rudp *r, uint64_t msn) {
+    struct in_msg *m = r->msgs[msn % MSG_BUCKETS];
+    while (m != NULL && m->msn != msn) m = m->next;
+    return m;
+}
+
+static int is_delivered(struct rudp *r, uint64_t msn) {
+    struct in_msg *m;
+
+    if (msn <= r->delivered) return 1;
+    m = find_in_msg(r, msn);
+    return m != NULL && m->delivered;
+}
+
+static void free_in_msg(struct in_msg *m) {
+    free(m->data);
+    free(m);
+}
+
+/** Copy the message where it is read. Returns 0 on success, -1 on error */
+static int append_delivery(struct rudp *r, const char *data, size_t len) {
+    size_t cap;
+    char *rbuf;
+
+    if (r->rstart > 0 && r->rstart + r->rcount + len > r->rcap) {
+        memmove(r->rbuf, r->rbuf + r->rstart, r->rcount);
+        r->rstart = 0;
+    }
+    if (r->rcount + len > r->rcap) {
+        cap = r->rcap == 0 ? RUDP_MSS : r->rcap;
+        while (cap < r->rcount + len) cap *= 2;
+        EQNULL(rbuf = (char *) realloc(r->rbuf, cap), return -1)
+        r->rbuf = rbuf;
+        r->rcap = cap;
+    }
+
+    memcpy(r->rbuf + r->rstart + r->rcount, data, len);
+    if (r->rcount == 0) notify(r->datafd);
+    r->rcount += len;
+
+    return 0;
+}
+
+/** Deliver the complete messages whose messages before were delivered */
+static void deliver_ready(struct rudp *r) {
+    int progress = 1;
+    struct in_msg **p, *m;
+
+    while (progress) {
+        progress = 0;
+        p = &(r->ready);
+        while ((m = *p) != NULL) {
+            if (!is_delivered(r, m->after) || !is_delivered(r, m->control)) {
+                p = &(m->next_ready);
+                continue;
+            }
+            MINUS1(append_delivery(r, m->data, m->len), errno = 0; return) // tried again with the next message
+
+            *p = m->next_ready;
+            free(m->data);
+            m->data = NULL;
+            r->reassembly -= m->len;
+            m->delivered = 1;
+            progress = 1;
+        }
+    }
+
+    /* forget the messages delivered in order */
+    while ((m = find_in_msg(r, r->delivered + 1)) != NULL && m->delivered) {
+        p = &(r->msgs[m->msn % MSG_BUCKETS]);
+        while (*p != m) p = &((*p)->next);
+        *p = m->next;
+        free_in_msg(m);
+        r->delivered++;
+    }
+
+    pthread_cond_broadcast(&(r->cond));
+}
+
+/**
+ * Add the packet number to the ranges received.
+ *
+ * @return 1 if it follows the highest one, 0 if there is a gap before it, -1 if it was already received
+ */
+static int record_packet(struct rudp *r, uint64_t pn) {
+    int i, n, next;
+
+    for (i = 0; i < r->nranges && pn <= r->ranges[i][1]; i++) {
+        if (pn >= r->ranges[i][0]) return -1;
+    }
+    next = i == 0 && (r->nranges == 0 || pn == r->ranges[0][1] + 1);
+
+    if (i < r->nranges && pn == r->ranges[i][1] + 1) {
+        r->ranges[i][1] = pn;
+        if (i > 0 && r->ranges[i - 1][0] == pn + 1) { // it joins two ranges
+            r->ranges[i - 1][0] = r->ranges[i][0];
+            memmove(r->ranges[i], r->ranges[i + 1], (size_t) (r->nranges - i - 1) * sizeof(r->ranges[0]));
+            r->nranges--;
+        }
+    } else if (i > 0 && r->ranges[i - 1][0] == pn + 1) {
+        r->ranges[i - 1][0] = pn;
+    } else if (i < RUDP_MAX_RANGES) { // the lowest range is forgotten when there are too many
+        n = r->nranges < RUDP_MAX_RANGES ? r->nranges - i : r->nranges - i - 1;
+        memmove(r->ranges[i + 1], r->ranges[i], (size_t) n * sizeof(r->ranges[0]));
+        r->ranges[i][0] = pn;
+        r->ranges[i][1] = pn;
+        if (r->nranges < RUDP_MAX_RANGES) r->nranges++;
+    }
+
+    return next;
+}
+
+/** Store the segment. Returns 0 on success, -1 if it is not valid or on error */
+static int store_segment(struct rudp *r, const unsigned char *buf, size_t len) {
+    uint64_t msn = get_u64(buf + 12);
+    uint32_t msglen = get_u32(buf + 36), offset = get_u32(buf + 40), size = (uint32_t) (len - DATA_HEADER_SIZE), index;
+    struct in_msg *m, **p;
+
+    if (msn == 0 || msglen == 0 || msglen > RUDP_MAX_MESSAGE || offset % RUDP_MSS != 0 || offset >= msglen ||
+        size != (msglen - offset < RUDP_MSS ? msglen - offset : RUDP_MSS)) return -1;
+    if (is_delivered(r, msn)) return 0; // received again
+    if (msn > r->delivered + RUDP_RCV_WINDOW) return -1; // out of the window
+
+    if ((m = find_in_msg(r, msn)) == NULL) {
+        /* the next message in order is always taken, so the messages kept are delivered in the end */
+        if (msn != r->delivered + 1 && r->reassembly + msglen > RUDP_RCVBUF) return -1;
+        EQNULL(m = (struct in_msg *) malloc(sizeof(struct in_msg) + (msglen + RUDP_MSS - 1) / RUDP_MSS), return -1)
+        EQNULL(m->data = (char *) malloc(msglen), free(m); return -1)
+        m->msn = msn;
+        m->after = get_u64(buf + 20);
+        m->control = get_u64(buf + 28);
+        m->len = msglen;
+        m->nsegs = (msglen + RUDP_MSS - 1) / RUDP_MSS;
+        m->received = 0;
+        m->delivered = 0;
+        m->got = (unsigned char *) (m + 1);
+        memset(m->got, 0, m->nsegs);
+        m->next = r->msgs[msn % MSG_BUCKETS];
+        r->msgs[msn % MSG_BUCKETS] = m;
+        r->reassembly += msglen;
+    } else if (m->len != msglen) {
+        return -1;
+    }
+
+    index = offset / RUDP_MSS;
+    if (m->got[index]) return 0;
+    memcpy(m->data + offset, buf + DATA_HEADER_SIZE, size);
+    m->got[index] = 1;
+    if (++(m->received) < m->nsegs) return 0;
+
+    /* complete, it waits with the others by message number */
+    p = &(r->ready);
+    while (*p != NULL && (*p)->msn < msn) p = &((*p)->next_ready);
+    m->next_ready = *p;
+    *p = m;
+    deliver_ready(r);
+
+    return 0;
+}
+
+static void on_data(struct rudp *r, const unsigned char *buf, size_t len, uint64_t now) {
+    int res;
+
+    if (len < DATA_HEADER_SIZE) return;
+
+    /* not acknowledged if it can't be stored, so it is sent again */
+    MINUS1(store_segment(r, buf, len), errno = 0; return)
+    res = record_packet(r, get_u64(buf + 4));
+
+    /* an acknowledgement every two datagrams, and at once when something is missing */
+    r->ack_pending++;
+    if (res != 1 || r->ack_pending >= 2) r->ack_deadline = now;
+    else if (r->ack_pending == 1) r->ack_deadline = now + RUDP_ACK_DELAY_USEC;
+}
+
+static void send_ack(struct rudp *r) {
+    int i;
+    unsigned char buf[ACK_HEADER_SIZE + RUDP_MAX_RANGES * RANGE_SIZE];
+
+    buf[0] = RUDP_ACK;
+    buf[1] = 0;
+    put_u16(buf + 2, (uint16_t) r->nranges);
+    put_u64(buf + 4, r->delivered);
+    for (i = 0; i < r->nranges; i++) {
+        put_u64(buf + ACK_HEADER_SIZE + i * RANGE_SIZE, r->ranges[i][0]);
+        put_u64(buf + ACK_HEADER_SIZE + i * RANGE_SIZE + 8, r->ranges[i][1]);
+    }
+
+    if (send_datagram(r, buf, ACK_HEADER_SIZE + (size_t) r->nranges * RANGE_SIZE, RUDP_ACK, 0, 0) == 0)
+        r->ack_pending = 0;
+}
+
+static void receive_datagrams(struct rudp *r, uint64_t now) {
+    unsigned char buf[DATAGRAM_SIZE];
+    ssize_t len;
+
+    while (1) {
+        if ((len = recv(r->udpfd, buf, sizeof(buf), MSG_DONTWAIT)) == -1) {
+            if (errno == EINTR || errno == ECONNREFUSED) continue;
+            errno = 0;
+            return;
+        }
+
+        r->stats.received++;
+        if (len > 0 && buf[0] == RUDP_DATA) on_data(r, buf, (size_t) len, now);
+        else if (len > 0 && buf[0] == RUDP_ACK) on_ack(r, buf, (size_t) len, now);
+    }
+}
+
+/* ------------------------------------------------- thread ------------------------------------------------- */
+
+/** Sets the poll timeout to the microseconds until the deadline, if it is sooner */
+static void sooner(long *timeout, uint64_t deadline, uint64_t now) {
+    long usec = deadline > now ? (long) (deadline - now) : 0;
+    if (*timeout == -1 || usec < *timeout) *timeout = usec;
+}
+
+static void *rudp_thread(void *arg) {
+    struct rudp *r = (struct rudp *) arg;
+    struct pollfd pfd[3];
+    struct timespec ts;
+    uint64_t now, linger = 0, count;
+    long timeout, wait;
+    char c;
+
+    pthread_mutex_lock(&(r->mtx));
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = usec_of(&ts);
+
+        if (!r->gone && r->inflight_head != NULL && now >= r->inflight_head->sent + (uint64_t) current_rto(r))
+            on_timeout(r);
+        wait = send_segments(r, &ts);
+        if (!r->gone && !r->blocked && r->ack_pending > 0 && (now >= r->ack_deadline || r->closing)) send_ack(r);
+
+        if (r->closing) {
+            if (linger == 0) linger = now + RUDP_LINGER_USEC;
+            if (r->msgs_head == NULL || r->gone || now >= linger) break;
+        }
+
+        /* sleep until something is received or the next timer */
+        timeout = wait > 0 ? wait : -1;
+        if (!r->gone && !r->blocked && r->ack_pending > 0) sooner(&timeout, r->ack_deadline, now);
+        if (!r->gone && r->inflight_head != NULL) sooner(&timeout, r->inflight_head->sent + (uint64_t) current_rto(r), now);
+        if (r->closing) sooner(&timeout, linger, now);
+        if (timeout > 0) timeout = (timeout + 999) / 1000;
+
+        pfd[0].fd = r->udpfd;
+        pfd[0].events = POLLIN | (r->blocked ? POLLOUT : 0);
+        pfd[1].fd = r->gone ? -1 : r->ctlfd;
+        pfd[1].events = POLLIN;
+        pfd[2].fd = r->wakefd;
+        pfd[2].events = POLLIN;
+        pthread_mutex_unlock(&(r->mtx));
+        if (poll(pfd, 3, (int) timeout) == -1) {
+            pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+            errno = 0;
+        }
+        pthread_mutex_lock(&(r->mtx));
+
+        if (pfd[2].revents & POLLIN && read(r->wakefd, &count, sizeof(uint64_t)) == -1) errno = 0;
+        if (pfd[0].revents & (POLLOUT | POLLERR)) r->blocked = 0;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        if (pfd[0].revents & POLLIN) receive_datagrams(r, usec_of(&ts));
+
+        /* nothing is written on the stream socket after the handshake, it is readable when the remote host is gone */
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR) && read(r->ctlfd, &c, 1) <= 0) {
+            errno = 0;
+            r->gone = 1;
+            if (r->rcount == 0) notify(r->datafd);
+            pthread_cond_broadcast(&(r->cond));
+        }
+    }
+    pthread_mutex_unlock(&(r->mtx));
+
+    return NULL;
+}
+
+/* ------------------------------------------------- API ------------------------------------------------- */
+
+struct rudp *rudp_create(int udpfd, int ctlfd) {
+    int err;
+    struct rudp *r;
+    pthread_condattr_t attr;
+
+    EQNULL(r = (struct rudp *) calloc(1, sizeof(struct rudp)), return NULL)
+    r->udpfd = udpfd;
+    r->ctlfd = ctlfd;
+    r->next_msn = 1;
+    r->next_pn = 1;
+    r->cwnd = RUDP_INIT_CWND;
+    r->ssthresh = SIZE_MAX;
+    r->rto = RUDP_INIT_RTO_USEC;
+    ratelimit_init(&(r->pacer));
+
+    MINUS1(r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), free(r); return NULL)
+    MINUS1(r->datafd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), err = errno; goto error)
+    PTH(err, pthread_mutex_init(&(r->mtx), NULL), goto error)
+
+    /* senders wait for room until a deadline from CLOCK_MONOTONIC */
+    PTH(err, pthread_condattr_init(&attr), goto error_mtx)
+    PTH(err, pthread_condattr_setclock(&attr, CLOCK_MONOTONIC), pthread_condattr_destroy(&attr); goto error_mtx)
+    PTH(err, pthread_cond_init(&(r->cond), &attr), pthread_condattr_destroy(&attr); goto error_mtx)
+    pthread_condattr_destroy(&attr);
+
+    PTH(err, pthread_create(&(r->thread), NULL, &rudp_thread, r), pthread_cond_destroy(&(r->cond)); goto error_mtx)
+
+    return r;
+
+error_mtx:
+    pthread_mutex_destroy(&(r->mtx));
+error:
+    close(r->wakefd);
+    if (r->datafd > 0) close(r->datafd);
+    free(r);
+    errno = err;
+    return NULL;
+}
+
+int rudp_data_fd(struct rudp *r) {
+    return r->datafd;
+}
+
+void rudp_set_drop(struct rudp *r, rudp_drop_fn drop, void *arg) {
+    pthread_mutex_lock(&(r->mtx));
+    r->drop = drop;
+    r->drop_arg = arg;
+    pthread_mutex_unlock(&(r->mtx));
+}
+
+/** Returns 1 if a message can be queued: there is room for its bytes and the remote host can receive it */
+static int send_room(const struct rudp *r) {
+    return r->queued < RUDP_SNDBUF && r->next_msn <= r->remote_delivered + RUDP_RCV_WINDOW;
+}
+
+int rudp_send(struct rudp *r, uint32_t stream, const struct iovec *iov, int iovcnt, size_t offset, size_t len) {
+    int err, i;
+    size_t nsegs = (len + RUDP_MSS - 1) / RUDP_MSS, copied = 0, n;
+    struct out_msg *msg;
+    struct stream *s, *control;
+
+    if (len == 0 || len > RUDP_MAX_MESSAGE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    EQNULL(msg = (struct out_msg *) malloc(sizeof(struct out_msg) + nsegs + len), return -1)
+    msg->acked = (unsigned char *) (msg + 1);
+    msg->data = (char *) msg->acked + nsegs;
+    memset(msg->acked, 0, nsegs);
+    for (i = 0; i < iovcnt && copied < len; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - offset < len - copied ? iov[i].iov_len - offset : len - copied;
+        memcpy(msg->data + copied, (char *) iov[i].iov_base + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    if (copied < len) {
+        free(msg);
+        errno = EINVAL;
+        return -1;
+    }
+
+    PTH(err, pthread_mutex_lock(&(r->mtx)), free(msg); return -1)
+    if (r->gone || r->closing) {
+        err = EPIPE;
+        goto error;
+    }
+    if (!send_room(r)) {
+        err = EAGAIN;
+        goto error;
+    }
+
+    if ((s = find_stream(r, stream)) == NULL) {
+        EQNULL(s = (struct stream *) malloc(sizeof(struct stream)), err = ENOMEM; goto error)
+        s->id = stream;
+        s->last = 0;
+        s->next = r->streams[stream % STREAM_BUCKETS];
+        r->streams[stream % STREAM_BUCKETS] = s;
+    }
+    control = find_stream(r, 0);
+    msg->msn = r->next_msn++;
+    msg->after = s->last;
+    msg->control = stream == 0 || control == NULL ? 0 : control->last;
+    msg->stream = stream;
+    msg->len = len;
+    msg->nsegs = (uint32_t) nsegs;
+    msg->next_seg = 0;
+    msg->acked_segs = 0;
+    s->last = msg->msn;
+
+    msg->next = NULL;
+    msg->prev = r->msgs_tail;
+    if (r->msgs_tail == NULL) r->msgs_head = msg;
+    else r->msgs_tail->next = msg;
+    r->msgs_tail = msg;
+    if (r->unsent == NULL) r->unsent = msg;
+    r->queued += len;
+    pthread_mutex_unlock(&(r->mtx));
+
+    notify(r->wakefd);
+    return 0;
+
+error:
+    pthread_mutex_unlock(&(r->mtx));
+    free(msg);
+    errno = err;
+    return -1;
+}
+
+int rudp_wait_send(struct rudp *r, int timeout) {
+    int err = 0, res;
+    struct timespec deadline;
+
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, &deadline), return -1)
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (long) (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    PTH(err, pthread_mutex_lock(&(r->mtx)), return -1)
+    while (!send_room(r) && !r->gone && err == 0) {
+        err = pthread_cond_timedwait(&(r->cond), &(r->mtx), &deadline);
+    }
+    res = send_room(r) || r->gone;
+    PTH(err, pthread_mutex_unlock(&(r->mtx)), return -1)
+
+    return res;
+}
+
+ssize_t rudp_recv(struct rudp *r, void *buf, size_t size) {
+    int err;
+    size_t len;
+    uint64_t count;
+
+    PTH(err, pthread_mutex_lock(&(r->mtx)), return -1)
+    while (r->rcount == 0 && !r->gone) {
+        PTH(err, pthread_cond_wait(&(r->cond), &(r->mtx)), pthread_mutex_unlock(&(r->mtx)); return -1)
+    }
+
+    len = size < r->rcount ? size : r->rcount;
+    memcpy(buf, r->rbuf + r->rstart, len);
+    r->rstart += len;
+    r->rcount -= len;
+    if (r->rcount == 0) {
+        r->rstart = 0;
+        /* the eventfd stays readable after the remote host is gone, so the reader reads 0 bytes */
+        if (!r->gone && read(r->datafd, &count, sizeof(uint64_t)) == -1) errno = 0;
+    }
+    PTH(err, pthread_mutex_unlock(&(r->mtx)), return -1)
+
+    return (ssize_t) len;
+}
+
+void rudp_get_stats(struct rudp *r, struct rudp_stats *stats) {
+    pthread_mutex_lock(&(r->mtx));
+    *stats = r->stats;
+    stats->srtt = r->srtt;
+    stats->cwnd = r->cwnd;
+    pthread_mutex_unlock(&(r->mtx));
+}
+
+int rudp_close(struct rudp *r) {
+    int err, i;
+    struct out_msg *msg;
+    struct segment *seg;
+    struct stream *s;
+    struct in_msg *m;
+
+    PTH(err, pthread_mutex_lock(&(r->mtx)), return -1)
+    r->closing = 1;
+    PTH(err, pthread_mutex_unlock(&(r->mtx)), return -1)
+    notify(r->wakefd);
+    PTH(err, pthread_join(r->thread, NULL), return -1)
+
+    /* the remote host sees the stream socket closed */
+    close(r->ctlfd);
+    close(r->udpfd);
+    close(r->wakefd);
+    close(r->datafd);
+
+    while ((msg = r->msgs_head) != NULL) {
+        r->msgs_head = msg->next;
+        free(msg);
+    }
+    while ((seg = r->inflight_head) != NULL) {
+        r->inflight_head = seg->next;
+        free(seg);
+    }
+    while ((seg = r->lost_head) != NULL) {
+        r->lost_head = seg->next;
+        free(seg);
+    }
+    for (i = 0; i < STREAM_BUCKETS; i++) {
+        while ((s = r->streams[i]) != NULL) {
+            r->streams[i] = s->next;
+            free(s);
+        }
+    }
+    for (i = 0; i < MSG_BUCKETS; i++) {
+        while ((m = r->msgs[i]) != NULL) {
+            r->msgs[i] = m->next;
+            free_in_msg(m);
+        }
+    }
+    free(r->rbuf);
+    pthread_mutex_destroy(&(r->mtx));
+    pthread_cond_destroy(&(r->cond));
+    free(r);
+
+    return 0;
+}
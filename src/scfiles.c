@@ -31,4 +31,32 @@ ssize_t writen(int fd, void *ptr, size_t n) {
         ptr = (char*) ptr + nwritten;
     }
     return(n - nleft); /* return >= 0 */
+}
+
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt) {
+    size_t   n = 0, nleft;
+    ssize_t  nwritten;
+
+    for (int i = 0; i < iovcnt; i++) n += iov[i].iov_len;
+
+    nleft = n;
+    while (nleft > 0) {
+        if((nwritten = writev(fd, iov, iovcnt)) < 0) {
+            if (nleft == n) return -1; /* error, return -1 */
+            else break; /* error, return amount written so far */
+        } else if (nwritten == 0) break;
+        nleft -= nwritten;
+
+        /* skip the buffers that were completely written */
+        while (iovcnt > 0 && (size_t) nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return(n - nleft); /* return >= 0 */
 }
\ No newline at end of file
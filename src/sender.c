@@ -0,0 +1,604 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../include/options.h"
+#include "../include/sender.h"
+#include "../include/utils.h"
+
+struct sender {
+    pthread_t tid;  // sender's thread id
+    int running;    // 1 if the thread is running. Protected by the socket's wr_mtx
+    struct netpipefs_socket *skt;   // the connection where the thread sends
+    struct netpipefs_credit *credits;   // credit taken from the socket, swapped with the socket's array
+    size_t credits_capacity;
+};
+
+/* One sender for each connection with the remote host */
+static struct sender *senders = NULL;
+static size_t nsenders = 0;
+
+extern struct netpipefs_socket netpipefs_socket;
+
+/**
+ * Copy the buffers into the shared memory ring, waiting at most SENDER_WAIT_USEC microseconds for room. As
+ * writev(), it can write only a part of them. The buffers of the data point at the writer's or the writeahead
+ * memory, so this is the only copy of the data on its way to the ring.
+ *
+ * @return number of written bytes, 0 if the remote host is gone or -1 on error. If the ring is full it returns -1
+ * and sets errno to EAGAIN
+ */
+static ssize_t send_shm(struct netpipefs_socket *skt, struct iovec *iov, int iovcnt) {
+    size_t bytes;
+    struct pollfd pfd;
+
+    if ((bytes = shm_write(skt->shm_tx, iov, iovcnt)) > 0) return (ssize_t) bytes;
+
+    /* The ring is full. The socket tells if the remote host, which should make room, is gone */
+    pfd.fd = skt->fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    MINUS1(poll(&pfd, 1, 0), return -1)
+    if (pfd.revents & (POLLHUP | POLLERR)) return 0;
+
+    MINUS1(shm_wait_space(skt->shm_tx, SENDER_WAIT_USEC / 1000), return -1)
+    if ((bytes = shm_write(skt->shm_tx, iov, iovcnt)) > 0) return (ssize_t) bytes;
+    errno = EAGAIN;
+
+    return -1;
+}
+
+/**
+ * Write the buffers without blocking for more than SENDER_WAIT_USEC microseconds. As writev(), it can write
+ * only a part of them.
+ *
+ * @return number of written bytes or -1 on error. If the socket doesn't accept data it returns -1 and sets errno
+ * to EAGAIN
+ */
+static ssize_t send_iov(struct netpipefs_socket *skt, struct iovec *iov, int iovcnt) {
+    ssize_t bytes;
+
+    if (skt->shm_tx != NULL) return send_shm(skt, iov, iovcnt);
+    if (skt->snd_ring != NULL)
+        return uring_writev_timeout(skt->snd_ring, skt->fd, iov, iovcnt, SENDER_WAIT_USEC);
+
+    bytes = skt->transport->send(skt, iov, iovcnt);
+    if (bytes != -1 || errno != EAGAIN) return bytes;
+
+    /* The transport's buffer is full. Wait until there is room */
+    MINUS1(skt->transport->wait_send(skt, SENDER_WAIT_USEC / 1000), return -1)
+
+    return skt->transport->send(skt, iov, iovcnt);
+}
+
+/** Over TCP, data not yet sent is kept out of the kernel too, where control messages couldn't overtake it */
+static void set_notsent_lowat(struct netpipefs_socket *skt) {
+    int lowat = SENDER_MAX_DATA;
+
+    if (skt->transport == &netpipefs_tcp_transport &&
+        setsockopt(skt->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(int)) == -1) errno = 0;
+}
+
+static int send_all(struct sender *sender, struct iovec *iov, int iovcnt, int record);
+
+/**
+ * Wait while the connection is resumed, then send again what the remote host didn't receive and the
+ * acknowledgement of what this host received. Must be called with the socket's wr_mtx locked, which is released
+ * while the sender sends.
+ *
+ * @param lost 1 if the sender found the connection lost: it waits until the connection is resumed. It is in the
+ * middle of a message, so nothing else is sent but what the remote host didn't receive
+ * @return 0 on success, -1 if the connection couldn't be resumed or the sender is stopping and sets errno
+ */
+static int resume_sender(struct sender *sender, int lost) {
+    int err;
+    unsigned int resumes;
+    uint64_t position;
+    struct iovec iov[2];
+    unsigned char ack[MESSAGE_HEADER_SIZE];
+    struct netpipefs_socket *skt = sender->skt;
+
+    if (lost || skt->resuming) {
+        resumes = skt->resumes;
+        skt->snd_busy = 0;
+        PTH(err, pthread_cond_broadcast(&(skt->wr_cond)), return -1)
+        while (sender->running && (skt->resuming || (lost && skt->resumes == resumes)))
+            PTH(err, pthread_cond_wait(&(skt->wr_cond), &(skt->wr_mtx)), return -1)
+        skt->snd_busy = 1;
+        if (skt->snd_error != 0) {
+            errno = skt->snd_error;
+            return -1;
+        }
+        if (skt->resuming || skt->resumes == resumes) { // it is stopping
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        set_notsent_lowat(skt);
+    }
+
+    if (skt->replay_pending) {
+        position = skt->replay_from;
+        skt->replay_pending = 0;
+        PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+        if ((err = replay_get(&(skt->replay), position, iov)) > 0) send_all(sender, iov, err, 0);
+        PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    }
+
+    if (!lost && skt->ack_pending) {
+        pack_ack_message(ack, skt->ack_pos);
+        skt->ack_pending = 0;
+        PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+        iov[0].iov_base = ack;
+        iov[0].iov_len = MESSAGE_HEADER_SIZE;
+        send_all(sender, iov, 1, 0);
+        PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    }
+
+    return 0;
+}
+
+/**
+ * Wait until the remote host acknowledges enough bytes that the given ones fit into the replay window. They are
+ * at most REPLAY_MAX_BATCH() bytes, so they fit once the remote host acknowledges what it received. Meanwhile the
+ * acknowledgements of this host are sent, so two hosts that wait for each other don't get stuck. Then the
+ * acknowledged bytes are dropped.
+ *
+ * @param bytes how many bytes should be sent
+ * @return 0 on success, -1 on error
+ */
+static int wait_replay_room(struct sender *sender, size_t bytes) {
+    int err;
+    uint64_t acked, unacked;
+    struct netpipefs_socket *skt = sender->skt;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    for (;;) {
+        if (skt->resuming || skt->replay_pending || skt->ack_pending)
+            MINUS1(resume_sender(sender, 0), pthread_mutex_unlock(&(skt->wr_mtx)); return -1)
+
+        unacked = skt->replay.end > skt->snd_acked ? skt->replay.end - skt->snd_acked : 0;
+        if (unacked == 0 || unacked + bytes <= netpipefs_options.replay) break;
+        if (!sender->running) {
+            pthread_mutex_unlock(&(skt->wr_mtx));
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        skt->snd_busy = 0;
+        PTH(err, pthread_cond_wait(&(skt->wr_cond), &(skt->wr_mtx)), pthread_mutex_unlock(&(skt->wr_mtx)); return -1)
+        skt->snd_busy = 1;
+    }
+    acked = skt->snd_acked;
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+    replay_release(&(skt->replay), acked);
+
+    return 0;
+}
+
+/**
+ * The connection was lost. If the session can be resumed, the connection is shut down so the dispatcher resumes
+ * it. When a message was being sent, the sender waits for the new connection and sends again what the remote
+ * host didn't receive.
+ *
+ * @param record 1 if a message was being sent
+ * @return 0 if the sender can carry on, -1 otherwise
+ */
+static int connection_lost(struct sender *sender, int record) {
+    int err, res;
+    struct netpipefs_socket *skt = sender->skt;
+
+    if (!socket_resumable(skt)) return -1;
+    if (shutdown(skt->fd, SHUT_RDWR) == -1) errno = 0;
+    if (!record) return 0; // sent again, if needed, after the connection is resumed
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    res = resume_sender(sender, 1);
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+
+    return res;
+}
+
+/**
+ * Write all the given buffers. Partial writes are handled by writing again what is left. If the session can be
+ * resumed, the connection can be lost meanwhile: then the sender carries on once it is resumed.
+ *
+ * @param iov vector of buffers. It is modified to keep track of what was already written
+ * @param iovcnt how many buffers the vector has
+ * @param record 1 if the buffers are messages kept into the replay window, 0 if they were already kept or they
+ * are an acknowledgement, which is never sent again
+ * @return 0 on success, -1 on error
+ */
+static int send_all(struct sender *sender, struct iovec *iov, int iovcnt, int record) {
+    int err, i, running;
+    size_t bytes = 0;
+    ssize_t written;
+
+    record = record && socket_resumable(sender->skt);
+    if (record) {
+        for (i = 0; i < iovcnt; i++) bytes += iov[i].iov_len;
+        MINUS1(wait_replay_room(sender, bytes), return -1)
+    }
+
+    while (iovcnt > 0) {
+        if ((written = send_iov(sender->skt, iov, iovcnt)) == -1) {
+            if (errno != EAGAIN) {
+                if (connection_lost(sender, record) == -1) return -1;
+                if (!record) return 0;
+                continue;
+            }
+
+            /* Keep waiting unless the sender is stopping */
+            PTH(err, pthread_mutex_lock(&(sender->skt->wr_mtx)), return -1)
+            running = sender->running;
+            PTH(err, pthread_mutex_unlock(&(sender->skt->wr_mtx)), return -1)
+            if (!running) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            continue;
+        } else if (written == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (record) MINUS1(replay_append(&(sender->skt->replay), iov, iovcnt, (size_t) written), return -1)
+
+        /* skip the buffers that were completely written */
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+/** Tell who queued the frame that the sender is done with the data that was not copied, then free the frame */
+static void free_frame(struct netpipefs_frame *frame) {
+    size_t bytes = 0;
+    int i;
+
+    if (frame->sent != NULL) {
+        for (i = 0; i < frame->iovcnt; i++) bytes += frame->iov[i].iov_len;
+        frame->sent(frame->arg, bytes);
+    }
+    free(frame);
+}
+
+/**
+ * Send the given frames, many of them with each write, and free them. The credit is put into the first WRITE
+ * message that can carry it, or it is sent with READ messages before the frames. If the session can be resumed,
+ * each write fits into the replay window, see REPLAY_MAX_BATCH().
+ *
+ * @param frames list of frames
+ * @param credits credit to be sent
+ * @param ncredits how many credits there are
+ * @return 0 on success, -1 on error
+ */
+static int send_frames(struct sender *sender, struct netpipefs_frame *frames, struct netpipefs_credit *credits, size_t ncredits) {
+    int iovcnt, j, ret = 0;
+    size_t i, n, bytes, size, limit = 0;
+    struct iovec iov[SENDER_MAX_IOV];
+    struct netpipefs_frame *frame, *next, *carrier = NULL;
+    unsigned char *packed = NULL;
+
+    if (socket_resumable(sender->skt)) limit = REPLAY_MAX_BATCH(netpipefs_options.replay);
+
+    if (ncredits > 0) {
+        size_t packed_size = MESSAGE_HEADER_SIZE * (ncredits + 1) + MESSAGE_CREDITS_SIZE(0);
+        EQNULL(packed = (unsigned char *) malloc(packed_size), ret = -1)
+        for (carrier = frames; packed != NULL && carrier != NULL; carrier = carrier->next) {
+            if (sender->skt->maxmessage > 0 && carrier->size + MESSAGE_CREDITS_SIZE(ncredits) > sender->skt->maxmessage)
+                continue;
+            if (pack_write_credits(packed, carrier->data, credits, ncredits) == 0) break;
+        }
+        if (packed != NULL && carrier == NULL) pack_read_credits(packed, credits, ncredits);
+    }
+
+    /* Without data to carry it, the credit is sent alone */
+    if (packed != NULL && carrier == NULL) {
+        for (i = 0; i < ncredits && ret == 0; i += n) {
+            n = ncredits - i;
+            if (limit > 0 && n * MESSAGE_HEADER_SIZE > limit) n = limit / MESSAGE_HEADER_SIZE;
+            iov[0].iov_base = packed + i * MESSAGE_HEADER_SIZE;
+            iov[0].iov_len = n * MESSAGE_HEADER_SIZE;
+            MINUS1(send_all(sender, iov, 1, 1), ret = -1)
+        }
+    }
+
+    while (frames != NULL) {
+        iovcnt = 0;
+        bytes = 0;
+        /* a frame takes at most four buffers: the carrier's header and credit, what was copied and two areas of data */
+        for (frame = frames; frame != NULL && iovcnt + 4 <= SENDER_MAX_IOV; frame = frame->next) {
+            size = frame == carrier ? frame->size + MESSAGE_CREDITS_SIZE(ncredits) : frame->size;
+            if (limit > 0 && iovcnt > 0 && bytes + size > limit) break;
+            bytes += size;
+            if (frame == carrier) { // the new header and the credit, then the rest of the message
+                iov[iovcnt].iov_base = packed;
+                iov[iovcnt].iov_len = MESSAGE_HEADER_SIZE + MESSAGE_CREDITS_SIZE(ncredits);
+                iovcnt++;
+                if (frame->copied > MESSAGE_HEADER_SIZE) {
+                    iov[iovcnt].iov_base = frame->data + MESSAGE_HEADER_SIZE;
+                    iov[iovcnt].iov_len = frame->copied - MESSAGE_HEADER_SIZE;
+                    iovcnt++;
+                }
+            } else {
+                iov[iovcnt].iov_base = frame->data;
+                iov[iovcnt].iov_len = frame->copied;
+                iovcnt++;
+            }
+            /* the data which was not copied is written from where it is */
+            for (j = 0; j < frame->iovcnt; j++) iov[iovcnt++] = frame->iov[j];
+        }
+
+        if (ret == 0) MINUS1(send_all(sender, iov, iovcnt, 1), ret = -1)
+
+        /* Free what was sent. After an error the frames are discarded */
+        while (frames != frame) {
+            next = frames->next;
+            free_frame(frames);
+            frames = next;
+        }
+    }
+    free(packed);
+
+    return ret;
+}
+
+/** 1 if there are data frames waiting. Must be called with the socket's wr_mtx locked */
+static int data_waiting(struct netpipefs_socket *skt) {
+    int i;
+
+    for (i = 0; i < PRIORITY_CLASSES; i++) {
+        if (skt->snd_head[i] != NULL) return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Take the frames to be sent next: all the control frames, followed by the data frames up to SENDER_MAX_DATA
+ * bytes. The data frames are taken from the highest class with frames waiting, by deficit round-robin. At least
+ * one data frame is taken, even if it is larger. Must be called with the socket's wr_mtx locked.
+ *
+ * @return list of frames
+ */
+static struct netpipefs_frame *take_frames(struct netpipefs_socket *skt) {
+    int cls;
+    size_t data = 0;
+    struct netpipefs_frame *frames, *last = NULL, *frame;
+    struct netpipefs_flow *flow;
+
+    /* control frames first */
+    frames = skt->ctl_head;
+    if (frames != NULL) last = skt->ctl_tail;
+    skt->ctl_head = NULL;
+    skt->ctl_tail = NULL;
+
+    /* then the data frames which fit into SENDER_MAX_DATA */
+    for (;;) {
+        for (cls = 0; cls < PRIORITY_CLASSES && skt->snd_head[cls] == NULL; cls++);
+        if (cls == PRIORITY_CLASSES) break;
+        flow = skt->snd_head[cls];
+
+        if (flow->deficit < flow->head->size) {
+            if (!flow->turn) { // its turn begins
+                flow->deficit += flow->weight * SENDER_QUANTUM;
+                flow->turn = 1;
+            } else { // its turn is over, it waits for the next one
+                flow->turn = 0;
+                if (flow->next != NULL) {
+                    skt->snd_head[cls] = flow->next;
+                    flow->next = NULL;
+                    skt->snd_tail[cls]->next = flow;
+                    skt->snd_tail[cls] = flow;
+                }
+            }
+            continue;
+        }
+        if (data > 0 && data + flow->head->size > SENDER_MAX_DATA) break;
+
+        frame = flow->head;
+        flow->head = frame->next;
+        flow->deficit -= frame->size;
+        if (flow->head == NULL) { // nothing else to send for this netpipe
+            skt->snd_head[cls] = flow->next;
+            if (flow->next == NULL) skt->snd_tail[cls] = NULL;
+            free(flow);
+        }
+
+        frame->next = NULL;
+        if (last == NULL) frames = frame;
+        else last->next = frame;
+        last = frame;
+        data += frame->size;
+    }
+
+    return frames;
+}
+
+/**
+ * Take all the frames waiting to be sent, to discard them. Must be called with the socket's wr_mtx locked, and the
+ * frames should be freed with free_frame() after unlocking it, since who queued them is told.
+ *
+ * @return list of frames
+ */
+static struct netpipefs_frame *take_all_frames(struct netpipefs_socket *skt) {
+    int i;
+    struct netpipefs_frame *frames, *last;
+    struct netpipefs_flow *flow;
+
+    frames = skt->ctl_head;
+    last = skt->ctl_tail;
+    skt->ctl_head = NULL;
+    skt->ctl_tail = NULL;
+    for (i = 0; i < PRIORITY_CLASSES; i++) {
+        while ((flow = skt->snd_head[i]) != NULL) {
+            skt->snd_head[i] = flow->next;
+            if (last == NULL) frames = flow->head;
+            else last->next = flow->head;
+            last = flow->tail;
+            free(flow);
+        }
+        skt->snd_tail[i] = NULL;
+    }
+
+    return frames;
+}
+
+/** Free the frames of the list, see free_frame() */
+static void free_frames(struct netpipefs_frame *frames) {
+    struct netpipefs_frame *next;
+
+    while (frames != NULL) {
+        next = frames->next;
+        free_frame(frames);
+        frames = next;
+    }
+}
+
+static void *netpipefs_sender_fun(void *arg) {
+    int err;
+    size_t ncredits, capacity;
+    struct sender *sender = (struct sender *) arg;
+    struct netpipefs_socket *skt = sender->skt;
+    struct netpipefs_frame *frames;
+    struct netpipefs_credit *credits;
+
+    PTHERR(err, pthread_mutex_lock(&(skt->wr_mtx)), return NULL)
+    skt->snd_busy = 1;
+    while (sender->running || skt->ctl_head != NULL || data_waiting(skt) || skt->ncredits > 0) {
+        if (skt->resuming || skt->replay_pending || skt->ack_pending) {
+            if (resume_sender(sender, 0) == -1) { // the following frames will not be queued
+                perror("sender. failed to resume the connection");
+                skt->snd_error = errno;
+                break;
+            }
+            continue;
+        }
+        if (skt->ctl_head == NULL && !data_waiting(skt) && skt->ncredits == 0) {
+            skt->snd_busy = 0;
+            PTHERR(err, pthread_cond_wait(&(skt->wr_cond), &(skt->wr_mtx)), break)
+            skt->snd_busy = 1;
+            continue;
+        }
+
+        /* Take the frames and the credit, so the netpipes can keep queueing while they are sent */
+        frames = take_frames(skt);
+        credits = skt->credits;
+        ncredits = skt->ncredits;
+        capacity = skt->credits_capacity;
+        skt->credits = sender->credits;
+        skt->ncredits = 0;
+        skt->credits_capacity = sender->credits_capacity;
+        sender->credits = credits;
+        sender->credits_capacity = capacity;
+        PTHERR(err, pthread_mutex_unlock(&(skt->wr_mtx)), return NULL)
+
+        err = send_frames(sender, frames, credits, ncredits);
+
+        PTHERR(err, pthread_mutex_lock(&(skt->wr_mtx)), return NULL)
+        if (err == -1) { // the following frames will not be queued
+            perror("sender. failed to send messages");
+            skt->snd_error = errno;
+            break;
+        }
+    }
+    /* after an error nothing else is sent, and who waits for its data to be sent shouldn't wait until stop */
+    frames = skt->snd_error != 0 ? take_all_frames(skt) : NULL;
+    /* the connection can be resumed without waiting for this sender */
+    skt->snd_busy = 0;
+    pthread_cond_broadcast(&(skt->wr_cond));
+    PTHERR(err, pthread_mutex_unlock(&(skt->wr_mtx)), return NULL)
+    free_frames(frames);
+
+    return 0;
+}
+
+/**
+ * Stop the sender of a connection after it sent the frames already queued, then discard what couldn't be sent
+ *
+ * @param sender the sender
+ * @return 0 on success, -1 on error
+ */
+static int stop_sender(struct sender *sender) {
+    int err;
+    struct netpipefs_socket *skt = sender->skt;
+    struct netpipefs_frame *frames;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    if (!sender->running) { // already stopped
+        pthread_mutex_unlock(&(skt->wr_mtx));
+        return 0;
+    }
+    sender->running = 0;
+    PTH(err, pthread_cond_broadcast(&(skt->wr_cond)), pthread_mutex_unlock(&(skt->wr_mtx)); return -1)
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+
+    PTH(err, pthread_join(sender->tid, NULL), return -1)
+
+    /* Discard what couldn't be sent */
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+    frames = take_all_frames(skt);
+    free(skt->credits);
+    skt->credits = NULL;
+    skt->ncredits = 0;
+    skt->credits_capacity = 0;
+    free(sender->credits);
+    sender->credits = NULL;
+    sender->credits_capacity = 0;
+    if (skt->snd_error == 0) skt->snd_error = EPIPE;
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), free_frames(frames); return -1)
+    free_frames(frames);
+
+    return 0;
+}
+
+int netpipefs_sender_run(void) {
+    int err;
+    size_t i, n = socket_stripes(&netpipefs_socket);
+    struct sender *sender;
+
+    EQNULL(senders = (struct sender *) calloc(n, sizeof(struct sender)), return -1)
+    for (i = 0; i < n; i++) {
+        sender = &(senders[i]);
+        sender->skt = socket_stripe_at(&netpipefs_socket, i);
+
+        set_notsent_lowat(sender->skt);
+
+        PTH(err, pthread_mutex_lock(&(sender->skt->wr_mtx)), netpipefs_sender_stop(); return -1)
+        sender->skt->snd_error = 0;
+        sender->running = 1;
+        PTH(err, pthread_mutex_unlock(&(sender->skt->wr_mtx)), netpipefs_sender_stop(); return -1)
+
+        PTH(err, pthread_create(&(sender->tid), NULL, &netpipefs_sender_fun, sender), sender->running = 0; netpipefs_sender_stop(); return -1)
+        nsenders++;
+    }
+
+    return 0;
+}
+
+int netpipefs_sender_stop(void) {
+    int ret = 0;
+    size_t i;
+
+    if (senders == NULL) return 0; // already stopped
+
+    for (i = 0; i < nsenders; i++) MINUS1(stop_sender(&(senders[i])), ret = -1)
+    DEBUG("sender stopped\n");
+    free(senders);
+    senders = NULL;
+    nsenders = 0;
+
+    return ret;
+}
@@ -0,0 +1,206 @@
+#define _DEFAULT_SOURCE // syscall(), MAP_ANONYMOUS
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "../include/shm.h"
+#include "../include/utils.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/** Bytes of the memfd before the ring: the positions, on a page of their own */
+static size_t ctl_size(void) {
+    return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static int sys_memfd_create(const char *name, unsigned int flags) {
+#ifdef __NR_memfd_create
+    return (int) syscall(__NR_memfd_create, name, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Map the positions and the ring of the memfd. The ring is mapped twice, one mapping right after the other
+ *
+ * @param shm the ring, with its memfd and its size
+ * @return 0 on success, -1 on error and sets errno
+ */
+static int shm_map(struct netpipefs_shm *shm) {
+    char *area;
+
+    shm->ctl = (struct netpipefs_shm_ctl *) mmap(NULL, ctl_size(), PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0);
+    if (shm->ctl == MAP_FAILED) {
+        shm->ctl = NULL;
+        return -1;
+    }
+
+    /* reserve the address space for both the mappings, then put the ring twice into it */
+    area = (char *) mmap(NULL, 2 * shm->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) return -1;
+    if (mmap(area, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, shm->memfd, (off_t) ctl_size()) == MAP_FAILED ||
+        mmap(area + shm->size, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, shm->memfd, (off_t) ctl_size()) == MAP_FAILED) {
+        munmap(area, 2 * shm->size);
+        return -1;
+    }
+    shm->data = area;
+
+    return 0;
+}
+
+int shm_create(struct netpipefs_shm *shm, size_t size) {
+    size_t page = ctl_size();
+
+    memset(shm, 0, sizeof(struct netpipefs_shm));
+    shm->memfd = -1;
+    shm->data_efd = -1;
+    shm->space_efd = -1;
+    shm->size = (size + page - 1) / page * page;
+
+    MINUS1(shm->memfd = sys_memfd_create("netpipefs", MFD_CLOEXEC), goto error)
+    MINUS1(ftruncate(shm->memfd, (off_t) (page + shm->size)), goto error)
+    MINUS1(shm->data_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), goto error)
+    MINUS1(shm->space_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), goto error)
+    MINUS1(shm_map(shm), goto error)
+
+    return 0;
+
+error:
+    shm_free(shm);
+    return -1;
+}
+
+int shm_attach(struct netpipefs_shm *shm, int memfd, int data_efd, int space_efd) {
+    struct stat st;
+
+    memset(shm, 0, sizeof(struct netpipefs_shm));
+    MINUS1(fstat(memfd, &st), return -1)
+    if ((size_t) st.st_size <= ctl_size() || ((size_t) st.st_size - ctl_size()) % ctl_size() != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    shm->memfd = memfd;
+    shm->data_efd = data_efd;
+    shm->space_efd = space_efd;
+    shm->size = (size_t) st.st_size - ctl_size();
+    if (shm_map(shm) == -1) {
+        if (shm->ctl) munmap(shm->ctl, ctl_size());
+        memset(shm, 0, sizeof(struct netpipefs_shm));
+        return -1;
+    }
+
+    return 0;
+}
+
+void shm_free(struct netpipefs_shm *shm) {
+    if (shm->data) munmap(shm->data, 2 * shm->size);
+    if (shm->ctl) munmap(shm->ctl, ctl_size());
+    if (shm->memfd != -1) close(shm->memfd);
+    if (shm->data_efd != -1) close(shm->data_efd);
+    if (shm->space_efd != -1) close(shm->space_efd);
+    memset(shm, 0, sizeof(struct netpipefs_shm));
+    shm->memfd = -1;
+    shm->data_efd = -1;
+    shm->space_efd = -1;
+}
+
+/** Wake up the other side, which sleeps on the given eventfd */
+static void ring_doorbell(int efd) {
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(uint64_t)) == -1) errno = 0; // the counter can't overflow in practice
+}
+
+size_t shm_write(struct netpipefs_shm *shm, const struct iovec *iov, int iovcnt) {
+    int i;
+    size_t room, len, written = 0;
+    uint64_t head = shm->ctl->head, tail = __atomic_load_n(&(shm->ctl->tail), __ATOMIC_ACQUIRE);
+    char *dest = shm->data + head % shm->size;
+
+    room = shm->size - (size_t) (head - tail);
+    for (i = 0; i < iovcnt && written < room; i++) {
+        len = iov[i].iov_len < room - written ? iov[i].iov_len : room - written;
+        memcpy(dest + written, iov[i].iov_base, len);
+        written += len;
+    }
+    if (written == 0) return 0;
+
+    /* publish the data, then look if the consumer sleeps. It does the opposite, so one of them sees the other */
+    __atomic_store_n(&(shm->ctl->head), head + written, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(shm->ctl->reader_waiting), __ATOMIC_RELAXED)) ring_doorbell(shm->data_efd);
+
+    return written;
+}
+
+/** Bytes that the ring has room for */
+static size_t shm_room(struct netpipefs_shm *shm) {
+    return shm->size - (size_t) (shm->ctl->head - __atomic_load_n(&(shm->ctl->tail), __ATOMIC_ACQUIRE));
+}
+
+int shm_wait_space(struct netpipefs_shm *shm, int timeout) {
+    int res;
+    uint64_t count;
+    struct pollfd pfd;
+
+    __atomic_store_n(&(shm->ctl->writer_waiting), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shm_room(shm) == 0) {
+        pfd.fd = shm->space_efd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        res = poll(&pfd, 1, timeout);
+        if (res == -1 && errno != EINTR) {
+            __atomic_store_n(&(shm->ctl->writer_waiting), 0, __ATOMIC_RELAXED);
+            return -1;
+        }
+        if (read(shm->space_efd, &count, sizeof(uint64_t)) == -1) errno = 0; // nothing to clear
+    }
+    __atomic_store_n(&(shm->ctl->writer_waiting), 0, __ATOMIC_RELAXED);
+
+    return shm_room(shm) > 0;
+}
+
+const char *shm_peek(struct netpipefs_shm *shm, size_t *available) {
+    uint64_t tail = shm->ctl->tail;
+
+    *available = (size_t) (__atomic_load_n(&(shm->ctl->head), __ATOMIC_ACQUIRE) - tail);
+
+    return shm->data + tail % shm->size;
+}
+
+void shm_consume(struct netpipefs_shm *shm, size_t bytes) {
+    if (bytes == 0) return;
+
+    __atomic_store_n(&(shm->ctl->tail), shm->ctl->tail + bytes, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(shm->ctl->writer_waiting), __ATOMIC_RELAXED)) ring_doorbell(shm->space_efd);
+}
+
+int shm_arm(struct netpipefs_shm *shm, size_t seen) {
+    size_t available;
+
+    __atomic_store_n(&(shm->ctl->reader_waiting), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    shm_peek(shm, &available);
+    if (available > seen) {
+        __atomic_store_n(&(shm->ctl->reader_waiting), 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    return 0;
+}
+
+void shm_disarm(struct netpipefs_shm *shm) {
+    uint64_t count;
+
+    __atomic_store_n(&(shm->ctl->reader_waiting), 0, __ATOMIC_RELAXED);
+    if (read(shm->data_efd, &count, sizeof(uint64_t)) == -1) errno = 0; // nothing to clear
+}
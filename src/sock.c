@@ -2,8 +2,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/select.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
 #include <stdlib.h>
 #include "../include/utils.h"
 #include "../include/sock.h"
@@ -21,104 +24,123 @@ static socklen_t get_socklen(struct sockaddr *sa) {
     return 0; // unsupported socket family
 }
 
+/** Returns the milliseconds from now until the given time, rounded up, or 0 if it is past */
+static int ms_until(const struct timespec *when) {
+    struct timespec now;
+    int64_t nsec;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) return 0;
+    nsec = (int64_t) (when->tv_sec - now.tv_sec) * 1000000000LL + (when->tv_nsec - now.tv_nsec);
+    if (nsec <= 0) return 0;
+    nsec = (nsec + 999999LL) / 1000000LL;
+    return nsec > INT_MAX ? INT_MAX : (int) nsec;
+}
+
+/** Returns 1 if a connect which failed with the given error should be tried again because the host isn't listening */
+static int connect_again(int err) {
+    switch (err) {
+        case ECONNREFUSED:  // nothing listens on the port yet
+        case ENOENT:        // the AF_UNIX socket file doesn't exist yet
+        case EAGAIN:        // the AF_UNIX listen queue is full
+        case ETIMEDOUT:     // the host didn't answer yet
+            return 1;
+    }
+    return 0;
+}
+
 int sock_connect_while_accept(int fdconn, int fdacc, struct sockaddr *conn_sa, long timeout, long interval) {
-    struct timeval select_timeout;
-    long remaining, sleeptime;
-    int connflags, res, nsel, accepted_fd = -1, connectdone = 0;
-    fd_set rset, wset;
+    struct pollfd pfd[2];
+    struct timespec deadline, retry;
+    long backoff = SOCK_CONNECT_BACKOFF;
+    int connflags = 0, res = 0, err, wait, i, nfds, accepted_fd = -1;
+    int connecting = 0, connectdone = fdconn == -1;
+    socklen_t errlen;
+
+    if (fdconn == -1 && fdacc == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    MINUS1(deadline_after(timeout * 1000L, &deadline), return -1)
+    MINUS1(deadline_after(0, &retry), return -1)
 
     /* Set socket for connect to nonblock */
-    MINUS1(connflags = fcntl(fdconn, F_GETFL, 0), return -1)
-    MINUS1(fcntl(fdconn, F_SETFL, connflags | O_NONBLOCK), return -1)
-
-    /* Connect */
-    res = connect(fdconn, conn_sa, get_socklen(conn_sa));
-    if (res == -1) {
-        if (errno != EINPROGRESS && errno != ENOENT) goto end;
+    if (fdconn != -1) {
+        MINUS1(connflags = fcntl(fdconn, F_GETFL, 0), return -1)
+        MINUS1(fcntl(fdconn, F_SETFL, connflags | O_NONBLOCK), return -1)
     }
-    if (res == 0) connectdone = 1; /* connect completed immediately */
-
-    remaining = timeout;
-    while(!connectdone || accepted_fd == -1) {
-        nsel = -1;
-        FD_ZERO(&rset);
-        if (!connectdone) {
-            FD_SET(fdconn, &rset); // rset += connect fd
-            nsel = fdconn;
-            wset = rset; // wset = connect fd
-        }
-        if (accepted_fd == -1) {
-            FD_SET(fdacc, &rset); // rset += accept fd
-            nsel = fdacc > nsel ? fdacc : nsel;
-        }
 
-        /* Set the remaining timeout */
-        select_timeout.tv_sec = MS_TO_SEC(remaining);
-        select_timeout.tv_usec = MS_TO_USEC(remaining);
+    while (!connectdone || (fdacc != -1 && accepted_fd == -1)) {
+        /* Connect, the first time or when the backoff is over */
+        if (!connectdone && !connecting && ms_until(&retry) == 0) {
+            if (connect(fdconn, conn_sa, get_socklen(conn_sa)) == 0) {
+                connectdone = 1;
+            } else if (errno == EINPROGRESS || errno == EALREADY) {
+                connecting = 1;
+            } else if (connect_again(errno)) {
+                MINUS1(deadline_after(backoff * 1000L, &retry), res = -1; break)
+                backoff = backoff * 2 < interval ? backoff * 2 : interval;
+            } else {
+                res = -1;
+                break;
+            }
+            errno = 0;
+            continue;
+        }
 
-        /* select() for connect and accept */
-        res = select(nsel + 1, &rset, !connectdone ? &wset:NULL, NULL, &select_timeout);
-        if (res == 0) {
+        if ((wait = ms_until(&deadline)) == 0) {
             errno = ETIMEDOUT;
             res = -1;
             break;
-        } else if (res == -1) {
-            break;
         }
 
-        if (!connectdone) {
-            /* Check for connect */
-            if (FD_ISSET(fdconn, &rset) || FD_ISSET(fdconn, &wset)) {
-                res = connect(fdconn, conn_sa, get_socklen(conn_sa));
-                if (res >= 0) connectdone = 1; /* connect completed immediately */
-                if (res == -1) {
-                    switch (errno) {
-                        case EISCONN: // successful connect
-                            connectdone = 1;
-                            res = 1;
-                            break;
-                        case ECONNREFUSED:
-                        case ENOENT:
-                            remaining = (select_timeout.tv_sec * 1000L) + (select_timeout.tv_usec / 1000L);
-                            if (remaining == 0) {
-                                errno = ETIMEDOUT;
-                            } else {
-                                sleeptime = remaining < interval ? remaining : interval;
-                                MINUS1(msleep(sleeptime), res = -1)
-                                remaining -= sleeptime;
-                                res = 1;
-                            }
-                            break;
-                        case EALREADY:
-                        case EINPROGRESS:
-                            res = 1;
-                            break;
-                        default: // there is some error
-                            break;
-                    }
+        /* Wait for the connect to complete or for its next try, and for a connection to accept */
+        nfds = 0;
+        if (!connectdone && connecting) {
+            pfd[nfds].fd = fdconn;
+            pfd[nfds++].events = POLLOUT;
+        } else if (!connectdone && ms_until(&retry) < wait) {
+            wait = ms_until(&retry);
+        }
+        if (fdacc != -1 && accepted_fd == -1) {
+            pfd[nfds].fd = fdacc;
+            pfd[nfds++].events = POLLIN;
+        }
+        MINUS1(res = poll(pfd, (nfds_t) nfds, wait), if (errno == EINTR) continue; break)
+
+        for (i = 0; i < nfds && res > 0; i++) {
+            if (pfd[i].revents == 0) continue;
+            if (pfd[i].fd == fdconn) { // the connect completed
+                errlen = sizeof(int);
+                MINUS1(res = getsockopt(fdconn, SOL_SOCKET, SO_ERROR, &err, &errlen), break)
+                connecting = 0;
+                if (err == 0) {
+                    connectdone = 1;
+                } else if (connect_again(err)) {
+                    MINUS1(res = deadline_after(backoff * 1000L, &retry), break)
+                    backoff = backoff * 2 < interval ? backoff * 2 : interval;
+                } else {
+                    errno = err;
+                    res = -1;
+                    break;
                 }
-                // if it is still -1 then an error occurred
-                if (res == -1) break;
+            } else { // there is a connection to accept
+                MINUS1(res = accept(fdacc, NULL, 0), break)
+                accepted_fd = res;
             }
         }
-
-        /* Check for accept */
-        if (accepted_fd == -1 && FD_ISSET(fdacc, &rset)) {
-            res = accept(fdacc, NULL, 0);
-            if (res == -1) break;
-            accepted_fd = res;
-        }
+        if (res == -1) break;
+        res = 0;
     }
 
-end:
-    MINUS1(fcntl(fdconn, F_SETFL, connflags), return -1) /* restore file status flags */
+    /* restore file status flags */
+    if (fdconn != -1) MINUS1(fcntl(fdconn, F_SETFL, connflags), res = -1)
 
     if (res == -1) {
         if (accepted_fd != -1) close(accepted_fd);
         return -1;
     }
 
-    return accepted_fd;
+    return fdacc != -1 ? accepted_fd : fdconn;
 }
 
 int sock_write_h(int fd_skt, void *data, size_t size) {
@@ -146,4 +168,81 @@ int sock_read_h(int fd_skt, void **ptr) {
     if (bytes <= 0) free(*ptr);
 
     return bytes;
-}
\ No newline at end of file
+}
+int sock_send_fds(int fd_skt, const int *fds, int nfds) {
+    char byte = 0;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union { // aligned as a control message
+        char buf[CMSG_SPACE(SOCK_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    if (nfds <= 0 || nfds > SOCK_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* at least one byte of data is sent with the file descriptors */
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(struct msghdr));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    return (int) sendmsg(fd_skt, &msg, MSG_NOSIGNAL);
+}
+
+int sock_recv_fds(int fd_skt, int *fds, int nfds) {
+    int bytes;
+    char byte;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(SOCK_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    if (nfds <= 0 || nfds > SOCK_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    MINUS1(bytes = (int) recvmsg(fd_skt, &msg, 0), return -1)
+    if (bytes == 0) return 0;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(nfds * sizeof(int))) {
+        /* close what was received anyway */
+        for (; cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int i, n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                for (i = 0; i < n; i++) close(((int *) CMSG_DATA(cmsg))[i]);
+            }
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+
+    return bytes;
+}
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "../include/transport.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/utils.h"
+
+ssize_t fd_transport_send(struct netpipefs_socket *skt, const struct iovec *iov, int iovcnt) {
+    ssize_t bytes;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+
+    bytes = sendmsg(skt->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (bytes == -1 && errno == EWOULDBLOCK) errno = EAGAIN;
+
+    return bytes;
+}
+
+int fd_transport_wait_send(struct netpipefs_socket *skt, int timeout) {
+    struct pollfd pfd;
+
+    pfd.fd = skt->fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, timeout);
+}
+
+ssize_t fd_transport_recv(struct netpipefs_socket *skt, void *buf, size_t size) {
+    return read(skt->fd, buf, size);
+}
+
+int fd_transport_close(struct netpipefs_socket *skt) {
+    return close(skt->fd);
+}
+
+/** Bytes written by one connection and not yet read by the other one */
+struct loopback_channel {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;    // signaled when data is written, when it is read and when the channel is closed
+    char *data;
+    size_t start;   // where the data not yet read begins
+    size_t count;   // how many bytes were not yet read
+    int closed;
+    int efd;        // readable while there is data or the channel is closed. It is the reader's fd
+};
+
+/** Two channels, one for each direction */
+struct loopback {
+    struct loopback_channel channels[2];
+    int ends;   // how many connections are not closed yet. Accessed atomically
+};
+
+/** State of a connection joined by the loopback transport */
+struct loopback_end {
+    struct loopback *loopback;
+    struct loopback_channel *rx;    // read by this connection
+    struct loopback_channel *tx;    // written by this connection
+};
+
+static int channel_init(struct loopback_channel *ch) {
+    int err;
+    pthread_condattr_t attr;
+
+    ch->start = 0;
+    ch->count = 0;
+    ch->closed = 0;
+    EQNULL(ch->data = (char *) malloc(LOOPBACK_CAPACITY), return -1)
+    MINUS1(ch->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), free(ch->data); return -1)
+    PTH(err, pthread_mutex_init(&(ch->mtx), NULL), goto error)
+
+    /* writers wait for room until a deadline from CLOCK_MONOTONIC */
+    PTH(err, pthread_condattr_init(&attr), pthread_mutex_destroy(&(ch->mtx)); goto error)
+    PTH(err, pthread_condattr_setclock(&attr, CLOCK_MONOTONIC), pthread_condattr_destroy(&attr); pthread_mutex_destroy(&(ch->mtx)); goto error)
+    PTH(err, pthread_cond_init(&(ch->cond), &attr), pthread_condattr_destroy(&attr); pthread_mutex_destroy(&(ch->mtx)); goto error)
+    pthread_condattr_destroy(&attr);
+
+    return 0;
+
+error:
+    close(ch->efd);
+    free(ch->data);
+    errno = err;
+    return -1;
+}
+
+static void channel_destroy(struct loopback_channel *ch) {
+    pthread_mutex_destroy(&(ch->mtx));
+    pthread_cond_destroy(&(ch->cond));
+    close(ch->efd);
+    free(ch->data);
+}
+
+/** Make the channel's eventfd readable. Must be called with the channel's mtx locked */
+static void channel_notify(struct loopback_channel *ch) {
+    uint64_t one = 1;
+    if (write(ch->efd, &one, sizeof(uint64_t)) == -1) errno = 0; // already readable
+}
+
+int loopback_transport_pair(struct netpipefs_socket *first, struct netpipefs_socket *second) {
+    int err;
+    struct loopback *loopback;
+    struct loopback_end *ends[2];
+
+    EQNULL(loopback = (struct loopback *) malloc(sizeof(struct loopback)), return -1)
+    MINUS1(channel_init(&(loopback->channels[0])), free(loopback); return -1)
+    MINUS1(channel_init(&(loopback->channels[1])), goto error)
+    loopback->ends = 2;
+
+    EQNULL(ends[0] = (struct loopback_end *) malloc(sizeof(struct loopback_end)), channel_destroy(&(loopback->channels[1])); goto error)
+    EQNULL(ends[1] = (struct loopback_end *) malloc(sizeof(struct loopback_end)), free(ends[0]); channel_destroy(&(loopback->channels[1])); goto error)
+    ends[0]->loopback = loopback;
+    ends[0]->rx = &(loopback->channels[0]);
+    ends[0]->tx = &(loopback->channels[1]);
+    ends[1]->loopback = loopback;
+    ends[1]->rx = &(loopback->channels[1]);
+    ends[1]->tx = &(loopback->channels[0]);
+
+    first->transport = &netpipefs_loopback_transport;
+    first->transport_data = ends[0];
+    first->fd = ends[0]->rx->efd;
+    second->transport = &netpipefs_loopback_transport;
+    second->transport_data = ends[1];
+    second->fd = ends[1]->rx->efd;
+
+    return 0;
+
+error:
+    err = errno;
+    channel_destroy(&(loopback->channels[0]));
+    free(loopback);
+    errno = err;
+    return -1;
+}
+
+int loopback_transport_connect(struct netpipefs_socket *skt, long timeout) {
+    if (skt->transport_data == NULL) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    /* both connections are in this process, with the same options */
+    skt->remote_readahead = netpipe_initial_readahead();
+    skt->nstripes = 1;
+
+    return 0;
+}
+
+ssize_t loopback_transport_send(struct netpipefs_socket *skt, const struct iovec *iov, int iovcnt) {
+    int err, i;
+    size_t room, len, end, first, written = 0;
+    struct loopback_channel *ch = ((struct loopback_end *) skt->transport_data)->tx;
+
+    PTH(err, pthread_mutex_lock(&(ch->mtx)), return -1)
+    if (ch->closed) {
+        pthread_mutex_unlock(&(ch->mtx));
+        errno = EPIPE;
+        return -1;
+    }
+
+    room = LOOPBACK_CAPACITY - ch->count;
+    for (i = 0; i < iovcnt && written < room; i++) {
+        len = iov[i].iov_len < room - written ? iov[i].iov_len : room - written;
+        end = (ch->start + ch->count + written) % LOOPBACK_CAPACITY;
+        first = len < LOOPBACK_CAPACITY - end ? len : LOOPBACK_CAPACITY - end;
+        memcpy(ch->data + end, iov[i].iov_base, first);
+        memcpy(ch->data, (char *) iov[i].iov_base + first, len - first);
+        written += len;
+    }
+    if (written == 0) {
+        pthread_mutex_unlock(&(ch->mtx));
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (ch->count == 0) channel_notify(ch);
+    ch->count += written;
+    PTH(err, pthread_cond_broadcast(&(ch->cond)), pthread_mutex_unlock(&(ch->mtx)); return -1)
+    PTH(err, pthread_mutex_unlock(&(ch->mtx)), return -1)
+
+    return (ssize_t) written;
+}
+
+int loopback_transport_wait_send(struct netpipefs_socket *skt, int timeout) {
+    int err = 0, res;
+    struct timespec deadline;
+    struct loopback_channel *ch = ((struct loopback_end *) skt->transport_data)->tx;
+
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, &deadline), return -1)
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (long) (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    PTH(err, pthread_mutex_lock(&(ch->mtx)), return -1)
+    while (ch->count == LOOPBACK_CAPACITY && !ch->closed && err == 0) {
+        err = pthread_cond_timedwait(&(ch->cond), &(ch->mtx), &deadline);
+    }
+    res = ch->count < LOOPBACK_CAPACITY || ch->closed;
+    PTH(err, pthread_mutex_unlock(&(ch->mtx)), return -1)
+
+    return res;
+}
+
+ssize_t loopback_transport_recv(struct netpipefs_socket *skt, void *buf, size_t size) {
+    int err;
+    size_t len, first;
+    uint64_t count;
+    struct loopback_channel *ch = ((struct loopback_end *) skt->transport_data)->rx;
+
+    PTH(err, pthread_mutex_lock(&(ch->mtx)), return -1)
+    while (ch->count == 0 && !ch->closed) {
+        PTH(err, pthread_cond_wait(&(ch->cond), &(ch->mtx)), pthread_mutex_unlock(&(ch->mtx)); return -1)
+    }
+
+    len = size < ch->count ? size : ch->count;
+    first = len < LOOPBACK_CAPACITY - ch->start ? len : LOOPBACK_CAPACITY - ch->start;
+    memcpy(buf, ch->data + ch->start, first);
+    memcpy((char *) buf + first, ch->data, len - first);
+    ch->start = (ch->start + len) % LOOPBACK_CAPACITY;
+    ch->count -= len;
+
+    /* the eventfd stays readable after the channel is closed, so the reader reads 0 bytes */
+    if (ch->count == 0 && !ch->closed && read(ch->efd, &count, sizeof(uint64_t)) == -1) errno = 0;
+    PTH(err, pthread_cond_broadcast(&(ch->cond)), pthread_mutex_unlock(&(ch->mtx)); return -1)
+    PTH(err, pthread_mutex_unlock(&(ch->mtx)), return -1)
+
+    return (ssize_t) len;
+}
+
+int loopback_transport_close(struct netpipefs_socket *skt) {
+    int i;
+    struct loopback_end *end = (struct loopback_end *) skt->transport_data;
+    struct loopback *loopback;
+
+    if (end == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    loopback = end->loopback;
+
+    /* the other connection reads what was written, then 0 bytes. Its writes fail */
+    for (i = 0; i < 2; i++) {
+        pthread_mutex_lock(&(loopback->channels[i].mtx));
+        if (!loopback->channels[i].closed) channel_notify(&(loopback->channels[i]));
+        loopback->channels[i].closed = 1;
+        pthread_cond_broadcast(&(loopback->channels[i].cond));
+        pthread_mutex_unlock(&(loopback->channels[i].mtx));
+    }
+
+    free(end);
+    skt->transport_data = NULL;
+    skt->fd = -1;
+    if (__atomic_sub_fetch(&(loopback->ends), 1, __ATOMIC_ACQ_REL) == 0) {
+        channel_destroy(&(loopback->channels[0]));
+        channel_destroy(&(loopback->channels[1]));
+        free(loopback);
+    }
+
+    return 0;
+}
@@ -0,0 +1,251 @@
+#define _DEFAULT_SOURCE // syscall()
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "../include/uring.h"
+#include "../include/utils.h"
+
+#if !defined(__NR_io_uring_setup) || !defined(__NR_io_uring_enter) || !defined(__NR_io_uring_register)
+#define URING_UNSUPPORTED
+#endif
+
+#ifndef URING_UNSUPPORTED
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+#endif
+
+int uring_init(struct netpipefs_uring *ring, unsigned entries) {
+#ifdef URING_UNSUPPORTED
+    errno = ENOSYS;
+    return -1;
+#else
+    struct io_uring_params params;
+    char *sq_ptr, *cq_ptr;
+
+    memset(ring, 0, sizeof(struct netpipefs_uring));
+    memset(&params, 0, sizeof(struct io_uring_params));
+    MINUS1(ring->fd = sys_io_uring_setup(entries, &params), return -1)
+
+    /* Map submission queue, completion queue and submission entries */
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) goto error;
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) goto error;
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto error;
+
+    sq_ptr = (char *) ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq_ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ptr + params.sq_off.array);
+
+    cq_ptr = (char *) ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+
+    return 0;
+
+error:
+    if (ring->sq_ptr == MAP_FAILED) ring->sq_ptr = NULL;
+    if (ring->cq_ptr == MAP_FAILED) ring->cq_ptr = NULL;
+    if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+    uring_free(ring);
+    return -1;
+#endif
+}
+
+void uring_free(struct netpipefs_uring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(struct netpipefs_uring));
+    ring->fd = -1;
+}
+
+int uring_register_buffer(struct netpipefs_uring *ring, void *buf, size_t len) {
+#ifdef URING_UNSUPPORTED
+    errno = ENOSYS;
+    return -1;
+#else
+    struct iovec fixed;
+
+    if (ring->registered) {
+        MINUS1(sys_io_uring_register(ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0), return -1)
+        ring->registered = 0;
+        uring_forget_buffer(ring);
+    }
+
+    fixed.iov_base = buf;
+    fixed.iov_len = len;
+    MINUS1(sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, &fixed, 1), return -1)
+    ring->fixed = fixed;
+    ring->registered = 1;
+
+    return 0;
+#endif
+}
+
+void uring_forget_buffer(struct netpipefs_uring *ring) {
+    ring->fixed.iov_base = NULL;
+    ring->fixed.iov_len = 0;
+}
+
+/**
+ * Take a free submission entry and reset it.
+ *
+ * @return the entry or NULL if the submission queue is full and sets errno to EBUSY
+ */
+static struct io_uring_sqe *get_sqe(struct netpipefs_uring *ring, unsigned char opcode, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *(ring->sq_tail) + ring->sq_queued;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head > ring->sq_mask) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    sqe = &(ring->sqes[tail & ring->sq_mask]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    ring->sq_queued++;
+
+    return sqe;
+}
+
+int uring_prep_read(struct netpipefs_uring *ring, int fd, void *buf, size_t len, uint64_t user_data) {
+    struct io_uring_sqe *sqe;
+    char *fixed = (char *) ring->fixed.iov_base;
+    int is_fixed = fixed != NULL && (char *) buf >= fixed && (char *) buf + len <= fixed + ring->fixed.iov_len;
+
+    if (len > UINT32_MAX) len = UINT32_MAX;
+    EQNULL(sqe = get_sqe(ring, is_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, user_data), return -1)
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = (uint32_t) len;
+    sqe->off = 0; // ignored by sockets and pipes
+    if (is_fixed) sqe->buf_index = 0;
+
+    return 0;
+}
+
+int uring_prep_writev(struct netpipefs_uring *ring, int fd, const struct iovec *iov, int iovcnt, uint64_t user_data) {
+    struct io_uring_sqe *sqe;
+
+    EQNULL(sqe = get_sqe(ring, IORING_OP_WRITEV, fd, user_data), return -1)
+    sqe->addr = (uint64_t) (uintptr_t) iov;
+    sqe->len = (uint32_t) iovcnt;
+    sqe->off = 0;
+
+    return 0;
+}
+
+int uring_prep_poll(struct netpipefs_uring *ring, int fd, short events, uint64_t user_data) {
+    struct io_uring_sqe *sqe;
+
+    EQNULL(sqe = get_sqe(ring, IORING_OP_POLL_ADD, fd, user_data), return -1)
+    sqe->poll_events = (uint16_t) events;
+
+    return 0;
+}
+
+int uring_submit_and_wait(struct netpipefs_uring *ring, unsigned wait_nr) {
+#ifdef URING_UNSUPPORTED
+    errno = ENOSYS;
+    return -1;
+#else
+    int submitted, total = 0;
+    unsigned to_submit = ring->sq_queued;
+
+    /* Make the queued entries visible to the kernel */
+    __atomic_store_n(ring->sq_tail, *(ring->sq_tail) + to_submit, __ATOMIC_RELEASE);
+    ring->sq_queued = 0;
+
+    for (;;) {
+        submitted = sys_io_uring_enter(ring->fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted == -1) {
+            if (errno != EINTR) return -1;
+            // entries that were submitted before the interruption are not submitted again
+            to_submit = *(ring->sq_tail) - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        total += submitted;
+        to_submit -= submitted;
+        if (to_submit == 0) break;
+    }
+
+    return total;
+#endif
+}
+
+int uring_next_cqe(struct netpipefs_uring *ring, struct netpipefs_uring_cqe *cqe) {
+    unsigned head = *(ring->cq_head);
+    struct io_uring_cqe *entry;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+
+    entry = &(ring->cqes[head & ring->cq_mask]);
+    cqe->user_data = entry->user_data;
+    cqe->res = entry->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+ssize_t uring_writev_timeout(struct netpipefs_uring *ring, int fd, const struct iovec *iov, int iovcnt, long usec) {
+    int completed = 0;
+    ssize_t written = -1;
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec ts;
+    struct netpipefs_uring_cqe cqe;
+
+    /* The write is linked to a timeout which cancels it */
+    MINUS1(uring_prep_writev(ring, fd, iov, iovcnt, 1), return -1)
+    ring->sqes[(*(ring->sq_tail) + ring->sq_queued - 1) & ring->sq_mask].flags |= IOSQE_IO_LINK;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    EQNULL(sqe = get_sqe(ring, IORING_OP_LINK_TIMEOUT, -1, 2), ring->sq_queued--; return -1)
+    sqe->addr = (uint64_t) (uintptr_t) &ts;
+    sqe->len = 1;
+
+    /* Both the write and the timeout complete, whichever comes first */
+    MINUS1(uring_submit_and_wait(ring, 2), return -1)
+    while (completed < 2) {
+        if (uring_next_cqe(ring, &cqe) == 0) {
+            MINUS1(uring_submit_and_wait(ring, 2 - completed), return -1)
+            continue;
+        }
+        completed++;
+        if (cqe.user_data != 1) continue;
+
+        if (cqe.res >= 0) {
+            written = cqe.res;
+        } else {
+            errno = cqe.res == -ECANCELED ? EAGAIN : -cqe.res;
+        }
+    }
+
+    return written;
+}
@@ -49,4 +49,23 @@ struct timespec elapsed_time(struct timespec *start) {
 
     //diff.tv_sec * 1000L + diff.tv_nsec / 1000000L
     return diff;
+}
+
+int deadline_after(long usec, struct timespec *res) {
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, res), return -1)
+
+    res->tv_sec += USEC_TO_SEC(usec);
+    res->tv_nsec += USEC_TO_NANOSEC(usec);
+    if (res->tv_nsec >= LONG1E9) {
+        res->tv_sec += 1;
+        res->tv_nsec -= LONG1E9;
+    }
+
+    return 0;
+}
+
+int timespec_cmp(const struct timespec *first, const struct timespec *second) {
+    if (first->tv_sec != second->tv_sec) return first->tv_sec < second->tv_sec ? -1:1;
+    if (first->tv_nsec != second->tv_nsec) return first->tv_nsec < second->tv_nsec ? -1:1;
+    return 0;
 }
\ No newline at end of file
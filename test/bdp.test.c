@@ -0,0 +1,164 @@
+#include "testutilities.h"
+#include "../include/bdp.h"
+
+static void test_unknown(void);
+static void test_estimate(void);
+static void test_min_rtt(void);
+static void test_bandwidth(void);
+static void test_samples(void);
+
+/** Time after the given microseconds */
+static struct timespec at(long usec) {
+    struct timespec t = {100 + usec / 1000000L, (usec % 1000000L) * 1000L};
+    return t;
+}
+
+int main(int argc, char** argv) {
+    test_unknown();
+    test_estimate();
+    test_min_rtt();
+    test_bandwidth();
+    test_samples();
+
+    testpassed("Bandwidth-delay product");
+    return 0;
+}
+
+/* Nothing is known before the first bytes are given back */
+static void test_unknown(void) {
+    struct bdp_estimator est;
+    struct bdp_sampler sampler;
+    struct timespec now = at(0);
+
+    test(bdp_init(&est) == 0)
+    bdp_sampler_init(&sampler);
+    test(bdp_rtt(&est) == -1)
+    test(bdp_bandwidth(&est) == 0)
+    test(bdp_window(&est) == 0)
+
+    /* Bytes given back before any timed send */
+    test(bdp_acked(&est, &sampler, 100, &now) == 0)
+    test(bdp_rtt(&est) == -1)
+    test(bdp_window(&est) == 0)
+
+    test(bdp_destroy(&est) == 0)
+}
+
+/* 1000 bytes given back after 10ms: 100KB/s, the window is twice 1000 bytes */
+static void test_estimate(void) {
+    struct bdp_estimator est;
+    struct bdp_sampler sampler;
+    struct timespec now;
+
+    test(bdp_init(&est) == 0)
+    bdp_sampler_init(&sampler);
+
+    now = at(0);
+    bdp_sent(&sampler, 1000, &now);
+    now = at(10000);
+    test(bdp_acked(&est, &sampler, 1000, &now) == 0)
+    test(bdp_rtt(&est) == 10000)
+    test(bdp_bandwidth(&est) == 100000)
+    test(bdp_window(&est) == BDP_GAIN * 1000)
+
+    test(bdp_destroy(&est) == 0)
+}
+
+/* The shortest round trip time is kept until it expires */
+static void test_min_rtt(void) {
+    struct bdp_estimator est;
+    struct bdp_sampler sampler;
+    struct timespec now;
+
+    test(bdp_init(&est) == 0)
+    bdp_sampler_init(&sampler);
+
+    now = at(0);
+    bdp_sent(&sampler, 100, &now);
+    now = at(5000);
+    test(bdp_acked(&est, &sampler, 100, &now) == 0)
+    test(bdp_rtt(&est) == 5000)
+
+    /* Not entirely given back: not timed */
+    bdp_sent(&sampler, 100, &now);
+    now = at(6000);
+    test(bdp_acked(&est, &sampler, 50, &now) == 0)
+    test(bdp_rtt(&est) == 5000)
+    now = at(7000);
+    test(bdp_acked(&est, &sampler, 50, &now) == 0)
+    test(bdp_rtt(&est) == 2000)
+
+    /* A longer one is ignored */
+    bdp_sent(&sampler, 100, &now);
+    now = at(17000);
+    test(bdp_acked(&est, &sampler, 100, &now) == 0)
+    test(bdp_rtt(&est) == 2000)
+
+    /* Unless the shortest one expired */
+    now = at(7000 + BDP_RTT_EXPIRE_USEC);
+    bdp_sent(&sampler, 100, &now);
+    now = at(17001 + BDP_RTT_EXPIRE_USEC);
+    test(bdp_acked(&est, &sampler, 100, &now) == 0)
+    test(bdp_rtt(&est) == 10001)
+
+    test(bdp_destroy(&est) == 0)
+}
+
+/* The bandwidth grows at once and decreases slowly */
+static void test_bandwidth(void) {
+    struct bdp_estimator est;
+    struct bdp_sampler sampler;
+    struct timespec now;
+
+    test(bdp_init(&est) == 0)
+    bdp_sampler_init(&sampler);
+
+    now = at(0);
+    bdp_sent(&sampler, 4000, &now);
+    now = at(1000);
+    test(bdp_acked(&est, &sampler, 4000, &now) == 0)
+    test(bdp_bandwidth(&est) == 4000000)
+
+    /* Shorter than the round trip time: not measured yet */
+    bdp_sent(&sampler, 8000, &now);
+    now = at(1500);
+    test(bdp_acked(&est, &sampler, 4000, &now) == 0)
+    test(bdp_bandwidth(&est) == 4000000)
+    now = at(2000);
+    test(bdp_acked(&est, &sampler, 4000, &now) == 0)
+    test(bdp_bandwidth(&est) == 8000000)
+
+    /* A quarter of the difference is forgotten */
+    bdp_sent(&sampler, 4000, &now);
+    now = at(4000);
+    test(bdp_acked(&est, &sampler, 4000, &now) == 0)
+    test(bdp_bandwidth(&est) == 6500000)
+
+    test(bdp_destroy(&est) == 0)
+}
+
+/* At most BDP_SAMPLES sends are timed at once */
+static void test_samples(void) {
+    int i;
+    struct bdp_estimator est;
+    struct bdp_sampler sampler;
+    struct timespec now = at(0);
+
+    test(bdp_init(&est) == 0)
+    bdp_sampler_init(&sampler);
+
+    for (i = 0; i < 2 * BDP_SAMPLES; i++) bdp_sent(&sampler, 10, &now);
+    test(sampler.count == BDP_SAMPLES)
+    test(sampler.sent == 2 * BDP_SAMPLES * 10)
+
+    /* The last timed send is the newest one given back */
+    now = at(3000);
+    test(bdp_acked(&est, &sampler, 2 * BDP_SAMPLES * 10, &now) == 0)
+    test(sampler.count == 0)
+    test(bdp_rtt(&est) == 3000)
+
+    bdp_sent(&sampler, 10, &now);
+    test(sampler.count == 1)
+
+    test(bdp_destroy(&est) == 0)
+}
@@ -0,0 +1,144 @@
+#include <unistd.h>
+#include "testutilities.h"
+#include "../include/bufpool.h"
+
+static void test_size_classes(void);
+static void test_reuse(void);
+static void test_mirrored(void);
+static void test_prefill(void);
+static void test_disabled(void);
+static void test_budget(void);
+
+int main(int argc, char** argv) {
+    test_size_classes();
+    test_reuse();
+    test_mirrored();
+    test_prefill();
+    test_disabled();
+    test_budget();
+
+    bufpool_destroy();
+    testpassed("Buffers pool");
+    return 0;
+}
+
+/* Chunks are at least a page and a power of two */
+static void test_size_classes(void) {
+    size_t chunk_size, pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    char *chunk;
+
+    test(bufpool_alloc(0, 0, &chunk_size) == NULL)
+    test(errno == EINVAL)
+    errno = 0;
+
+    test((chunk = bufpool_alloc(10, 0, &chunk_size)) != NULL)
+    test(chunk_size == pagesize)
+    memset(chunk, 'a', chunk_size);
+    bufpool_free(chunk, chunk_size, 0);
+
+    test((chunk = bufpool_alloc(3 * pagesize + 1, 0, &chunk_size)) != NULL)
+    test(chunk_size == 4 * pagesize)
+    memset(chunk, 'a', chunk_size);
+    bufpool_free(chunk, chunk_size, 0);
+}
+
+/* A released chunk is given to the next buffer of the same size class */
+static void test_reuse(void) {
+    size_t chunk_size, other_size;
+    void *chunk, *other;
+
+    test((chunk = bufpool_alloc(100000, 0, &chunk_size)) != NULL)
+    bufpool_free(chunk, chunk_size, 0);
+    test((other = bufpool_alloc(chunk_size, 0, &other_size)) == chunk)
+    test(other_size == chunk_size)
+
+    /* A different size class gets another chunk */
+    test((chunk = bufpool_alloc(chunk_size + 1, 0, &other_size)) != other)
+    test(other_size == 2 * chunk_size)
+
+    bufpool_free(chunk, other_size, 0);
+    bufpool_free(other, chunk_size, 0);
+}
+
+/* Both halves of a mirrored chunk are the same memory */
+static void test_mirrored(void) {
+    size_t chunk_size;
+    char *chunk, *plain;
+
+    chunk = (char *) bufpool_alloc(5000, 1, &chunk_size);
+    if (chunk == NULL) { // memfd_create() is not supported
+        test(errno == ENOSYS)
+        errno = 0;
+        return;
+    }
+
+    memcpy(chunk + chunk_size - 3, "abcdef", 6);
+    test(memcmp(chunk, "def", 3) == 0)
+    test(memcmp(chunk + 2 * chunk_size - 3, "abc", 3) == 0)
+
+    /* Plain and mirrored chunks are kept apart */
+    bufpool_free(chunk, chunk_size, 1);
+    test((plain = (char *) bufpool_alloc(chunk_size, 0, &chunk_size)) != NULL)
+    test(plain != chunk)
+    memset(plain, 'a', chunk_size);
+    bufpool_free(plain, chunk_size, 0);
+}
+
+/* At most DEFAULT_BUFPOOL chunks are mapped in advance, more chunks can be taken anyway */
+static void test_prefill(void) {
+    size_t chunk_size, i;
+    void *chunks[DEFAULT_BUFPOOL + 1];
+
+    bufpool_destroy();
+    test(bufpool_prefill(8192, 0, DEFAULT_BUFPOOL + 1) == 0)
+    for (i = 0; i < DEFAULT_BUFPOOL + 1; i++) {
+        test((chunks[i] = bufpool_alloc(8192, 0, &chunk_size)) != NULL)
+    }
+    for (i = 0; i < DEFAULT_BUFPOOL + 1; i++) bufpool_free(chunks[i], chunk_size, 0);
+}
+
+/* Without pooling every chunk is unmapped when released */
+static void test_disabled(void) {
+    size_t chunk_size;
+    void *chunk;
+
+    bufpool_destroy();
+    bufpool_init(0, 0, 0);
+    test((chunk = bufpool_alloc(8192, 0, &chunk_size)) != NULL)
+    bufpool_free(chunk, chunk_size, 0);
+    test(bufpool_prefill(8192, 0, 4) == 0)
+
+    /* With huge pages, chunks are at least a huge page even if the system has none */
+    bufpool_init(DEFAULT_BUFPOOL, 1, 0);
+    test((chunk = bufpool_alloc(8192, 0, &chunk_size)) != NULL)
+    test(chunk_size == BUFPOOL_HUGEPAGE_SIZE)
+    memset(chunk, 'a', 4096);
+    bufpool_free(chunk, chunk_size, 0);
+    bufpool_init(DEFAULT_BUFPOOL, 0, 0);
+}
+
+/* Bytes can't be charged over the budget, unless forced */
+static void test_budget(void) {
+    bufpool_init(DEFAULT_BUFPOOL, 0, 1000);
+    test(bufpool_charged() == 0)
+
+    test(bufpool_charge(600, 0) == 0)
+    test(bufpool_charge(600, 0) == -1)
+    test(errno == ENOMEM)
+    errno = 0;
+    test(bufpool_charged() == 600)
+
+    test(bufpool_charge(400, 0) == 0)
+    test(bufpool_charge(100, 1) == 0)
+    test(bufpool_charged() == 1100)
+
+    bufpool_uncharge(500);
+    test(bufpool_charge(400, 0) == 0)
+    bufpool_uncharge(1000);
+    test(bufpool_charged() == 0)
+
+    /* Unlimited budget */
+    bufpool_init(DEFAULT_BUFPOOL, 0, 0);
+    test(bufpool_charge((size_t) 1 << 40, 0) == 0)
+    bufpool_uncharge((size_t) 1 << 40);
+}
@@ -1,11 +1,17 @@
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include "testutilities.h"
 #include "../include/cbuf.h"
 
 static void test_operations(void);
 static void test_zero_capacity(void);
 static void test_from_file_descriptor(void);
+static void test_iov(void);
+static void test_producer_consumer(void);
+static void test_mirrored(void);
+static void test_resize(void);
 
 int main(int argc, char** argv) {
     size_t capacity = 8192;
@@ -46,6 +52,10 @@ int main(int argc, char** argv) {
     test_operations();
     test_zero_capacity();
     test_from_file_descriptor();
+    test_iov();
+    test_producer_consumer();
+    test_mirrored();
+    test_resize();
     testpassed("Circular buffer");
     return 0;
 }
@@ -159,4 +169,217 @@ static void test_from_file_descriptor(void) {
 
     /* Free buffer */
     cbuf_free(buffer);
-}
\ No newline at end of file
+}
+
+static void test_iov(void) {
+    size_t capacity = 10;
+    struct iovec iov[2];
+
+    /* Alloc buffer */
+    cbuf_t *buffer = cbuf_alloc(capacity);
+    test(buffer != NULL)
+
+    /* Empty buffer */
+    test(cbuf_iov(buffer, iov, capacity) == 0)
+    test(cbuf_consume(buffer, capacity) == 0)
+
+    char dummydata[capacity];
+    for(size_t i=0; i<capacity; i++) dummydata[i] = (char)(97+i);
+
+    /* Linear data */
+    test(cbuf_put(buffer, dummydata, 6) == 6)
+    test(cbuf_iov(buffer, iov, capacity) == 1)
+    test(iov[0].iov_len == 6)
+    test(memcmp(iov[0].iov_base, dummydata, 6) == 0)
+    test(cbuf_iov(buffer, iov, 4) == 1)
+    test(iov[0].iov_len == 4)
+    test(cbuf_size(buffer) == 6)
+
+    /* Consume without copying */
+    test(cbuf_consume(buffer, 4) == 4)
+    test(cbuf_size(buffer) == 2)
+
+    /* Wrapped data */
+    test(cbuf_put(buffer, dummydata + 6, 4) == 4)
+    test(cbuf_put(buffer, dummydata, 4) == 4)
+    test(cbuf_full(buffer) == 1)
+    test(cbuf_iov(buffer, iov, capacity) == 2)
+    test(iov[0].iov_len == 6)
+    test(iov[1].iov_len == 4)
+    test(memcmp(iov[0].iov_base, dummydata + 4, 6) == 0)
+    test(memcmp(iov[1].iov_base, dummydata, 4) == 0)
+
+    /* Skip the bytes already handed out */
+    test(cbuf_iov_at(buffer, 3, iov, capacity) == 2)
+    test(iov[0].iov_len == 3)
+    test(iov[1].iov_len == 4)
+    test(memcmp(iov[0].iov_base, dummydata + 7, 3) == 0)
+    test(cbuf_iov_at(buffer, 6, iov, 2) == 1)
+    test(iov[0].iov_len == 2)
+    test(memcmp(iov[0].iov_base, dummydata, 2) == 0)
+    test(cbuf_iov_at(buffer, capacity, iov, capacity) == 0)
+
+    /* Consume more than the available data */
+    test(cbuf_consume(buffer, capacity + 1) == capacity)
+    test(cbuf_empty(buffer) == 1)
+
+    /* Free buffer */
+    cbuf_free(buffer);
+}
+
+#define PRODCONS_BYTES (1 << 20)
+
+static void *producer(void *arg) {
+    cbuf_t *buffer = (cbuf_t *) arg;
+    char data[97];
+    size_t put = 0, bytes, i;
+
+    while (put < PRODCONS_BYTES) {
+        bytes = sizeof(data);
+        if (bytes > PRODCONS_BYTES - put) bytes = PRODCONS_BYTES - put;
+        for (i = 0; i < bytes; i++) data[i] = (char) (put + i);
+        bytes = cbuf_put(buffer, data, bytes);
+        if (bytes == 0) sched_yield(); // full, let the consumer run
+        put += bytes;
+    }
+
+    return NULL;
+}
+
+/* One thread puts while another one gets, without any lock. Data must be got in order */
+static void test_producer_consumer(void) {
+    pthread_t tid;
+    char data[61];
+    size_t got = 0, bytes, i;
+    int corrupted = 0;
+
+    /* The capacity is not a multiple of the operations sizes, so they wrap in different positions */
+    cbuf_t *buffer = cbuf_alloc(1000);
+    test(buffer != NULL)
+    test(pthread_create(&tid, NULL, &producer, buffer) == 0)
+
+    while (got < PRODCONS_BYTES) {
+        test(cbuf_size(buffer) <= cbuf_capacity(buffer))
+        bytes = cbuf_get(buffer, data, sizeof(data));
+        if (bytes == 0) sched_yield(); // empty, let the producer run
+        for (i = 0; i < bytes; i++) if (data[i] != (char) (got + i)) corrupted = 1;
+        got += bytes;
+    }
+
+    test(pthread_join(tid, NULL) == 0)
+    test(corrupted == 0)
+    test(cbuf_empty(buffer) == 1)
+
+    /* Free buffer */
+    cbuf_free(buffer);
+}
+
+/* Wrapped data is contiguous when the buffer is mirrored */
+static void test_mirrored(void) {
+    size_t capacity = 4096 + 10, i;
+    int pipefd[2];
+    struct iovec iov[2];
+    char dummydata[capacity], datagot[capacity];
+
+    cbuf_t *buffer = cbuf_alloc_mirrored(capacity);
+    if (buffer == NULL) { // memfd_create() is not supported
+        test(errno == ENOSYS)
+        errno = 0;
+        return;
+    }
+    test(cbuf_capacity(buffer) == capacity)
+    test(cbuf_alloc_mirrored(0) == NULL)
+    test(errno == EINVAL)
+    errno = 0;
+
+    for(i=0; i<capacity; i++) dummydata[i] = (char)(97+i%26);
+
+    /* Fill and empty the buffer, so the next data wraps around */
+    test(cbuf_put(buffer, dummydata, capacity) == capacity)
+    test(cbuf_full(buffer) == 1)
+    test(cbuf_put(buffer, dummydata, 1) == 0)
+    test(cbuf_get(buffer, datagot, capacity - 6) == capacity - 6)
+    test(memcmp(datagot, dummydata, capacity - 6) == 0)
+
+    /* Wrapped data is given as a single memory area */
+    test(cbuf_put(buffer, dummydata, 100) == 100)
+    test(cbuf_iov(buffer, iov, capacity) == 1)
+    test(iov[0].iov_len == 106)
+    test(memcmp(iov[0].iov_base, dummydata + capacity - 6, 6) == 0)
+    test(memcmp((char *) iov[0].iov_base + 6, dummydata, 100) == 0)
+    test(cbuf_get(buffer, datagot, capacity) == 106)
+    test(memcmp(datagot + 6, dummydata, 100) == 0)
+
+    /* Wrapped reads and writes from and to a file descriptor */
+    test(pipe(pipefd) == 0)
+    test(write(pipefd[1], dummydata, capacity) == (ssize_t) capacity)
+    test(cbuf_readn(pipefd[0], buffer, capacity) == (ssize_t) capacity)
+    test(cbuf_writen(pipefd[1], buffer, capacity) == (ssize_t) capacity)
+    test(read(pipefd[0], datagot, capacity) == (ssize_t) capacity)
+    test(memcmp(datagot, dummydata, capacity) == 0)
+    test(cbuf_empty(buffer) == 1)
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    /* Free buffer */
+    cbuf_free(buffer);
+}
+
+/* Data is kept when the buffer grows or shrinks */
+static void test_resize(void) {
+    size_t capacity = 10;
+    char dummydata[capacity], datagot[capacity];
+
+    cbuf_t *buffer = cbuf_alloc(capacity);
+    test(buffer != NULL)
+    for(size_t i=0; i<capacity; i++) dummydata[i] = (char)(97+i);
+
+    /* Wrapped data */
+    test(cbuf_put(buffer, dummydata, 8) == 8)
+    test(cbuf_get(buffer, datagot, 6) == 6)
+    test(cbuf_put(buffer, dummydata + 8, 2) == 2)
+    test(cbuf_put(buffer, dummydata, 4) == 4)
+    test(cbuf_size(buffer) == 8)
+
+    /* Grow */
+    test(cbuf_resize(buffer, 20) == 0)
+    test(cbuf_capacity(buffer) == 20)
+    test(cbuf_size(buffer) == 8)
+    test(cbuf_put(buffer, dummydata + 4, 6) == 6)
+    test(cbuf_get(buffer, datagot, 4) == 4)
+    test(memcmp(datagot, dummydata + 6, 4) == 0)
+    test(cbuf_get(buffer, datagot, capacity) == capacity)
+    test(memcmp(datagot, dummydata, capacity) == 0)
+
+    /* Shrink, but not below the buffered data */
+    test(cbuf_put(buffer, dummydata, 5) == 5)
+    test(cbuf_resize(buffer, 4) == -1)
+    test(errno == EINVAL)
+    errno = 0;
+    test(cbuf_resize(buffer, 5) == 0)
+    test(cbuf_full(buffer) == 1)
+    test(cbuf_get(buffer, datagot, capacity) == 5)
+    test(memcmp(datagot, dummydata, 5) == 0)
+
+    /* To zero and back */
+    test(cbuf_resize(buffer, 0) == 0)
+    test(cbuf_put(buffer, dummydata, 1) == 0)
+    test(cbuf_resize(buffer, capacity) == 0)
+    test(cbuf_put(buffer, dummydata, capacity) == capacity)
+    test(cbuf_get(buffer, datagot, capacity) == capacity)
+    test(memcmp(datagot, dummydata, capacity) == 0)
+    cbuf_free(buffer);
+
+    /* A mirrored buffer stays mirrored */
+    buffer = cbuf_alloc_mirrored(capacity);
+    if (buffer == NULL) {
+        errno = 0;
+        return;
+    }
+    test(cbuf_put(buffer, dummydata, 3) == 3)
+    test(cbuf_resize(buffer, 5000) == 0)
+    test(cbuf_capacity(buffer) == 5000)
+    test(cbuf_get(buffer, datagot, capacity) == 3)
+    test(memcmp(datagot, dummydata, 3) == 0)
+    cbuf_free(buffer);
+}
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <sys/socket.h>
 #include "testutilities.h"
 #include "../include/netpipe.h"
 #include "../include/dispatcher.h"
@@ -14,9 +15,24 @@ int main(int argc, char** argv) {
     test(netpipefs_open_files_table_init() == 0)
 
     test_nonblock_operations();
+
+    /* The dispatcher waits on the socket */
+    int sv[2];
+    test(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+    netpipefs_socket.fd = sv[0];
     test(netpipefs_dispatcher_run() == 0)
     test(netpipefs_dispatcher_stop() == 0)
 
+    /* Same with io_uring, if the kernel supports it */
+    if (init_socket_uring(&netpipefs_socket) == 0) {
+        test(netpipefs_dispatcher_run() == 0)
+        test(netpipefs_dispatcher_stop() == 0)
+        free_socket_uring(&netpipefs_socket);
+    }
+    errno = 0;
+    close(sv[0]);
+    close(sv[1]);
+
     test(netpipefs_open_files_table_destroy() == 0)
 
     testpassed("Netpipe");
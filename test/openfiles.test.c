@@ -2,19 +2,24 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "../include/openfiles.h"
 #include "../include/netpipefs_socket.h"
+#include "../include/priority.h"
+#include "../include/ratelimit.h"
 
 struct netpipefs_socket netpipefs_socket;
 
 static void test_uninitialized_table(void);
 static void test_openfiles_table(void);
+static void test_lookup_while_closing(void);
 
 int main(int argc, char** argv) {
     netpipefs_options.debug = 0; // disable debug printings
 
     test_uninitialized_table();
     test_openfiles_table();
+    test_lookup_while_closing();
 
     testpassed("Open files hash table");
     return 0;
@@ -39,6 +44,11 @@ static void test_uninitialized_table(void) {
     test(netpipefs_get_or_create_open_file(path, &just_created) == NULL)
     test(errno == EPERM)
     errno = 0;
+
+    /* Update open file */
+    test(netpipefs_update_open_file(path, &netpipe_apply_rules) == -1)
+    test(errno == EPERM)
+    errno = 0;
 }
 
 /* All the operations on the open files hash table */
@@ -62,9 +72,37 @@ static void test_openfiles_table(void) {
     /* Get open file */
     test(netpipefs_get_open_file(path) == file)
 
+    /* Get open file by its handle */
+    uint32_t handle = file->handle;
+    test(netpipefs_get_open_file_by_handle(handle) == file)
+
+    /* Update open and not open files with the rules of their path */
+    test(file->priority == DEFAULT_PRIORITY)
+    test(file->ratelimit == DEFAULT_RATELIMIT)
+    test(priority_set(path, 1, 5) == 0)
+    test(ratelimit_set(path, 1000, 100) == 0)
+    test(netpipefs_update_open_file(path, &netpipe_apply_rules) == 1)
+    test(file->priority == 1)
+    test(file->weight == 5)
+    test(file->ratelimit == 1000)
+    test(file->rateburst == 100)
+    test(netpipefs_update_open_file("badpath", &netpipe_apply_rules) == 0)
+    priority_free();
+    ratelimit_free();
+
     /* Remove open file */
     test(netpipefs_remove_open_file(path) == 0)
 
+    /* The handle of a removed file is stale, even if its slot is reused */
+    test(netpipefs_get_open_file_by_handle(handle) == NULL)
+    test(errno == ENOENT)
+    errno = 0;
+    test((file = netpipefs_get_or_create_open_file(path, &just_created)) != NULL)
+    test(file->handle != handle)
+    test(netpipefs_get_open_file_by_handle(handle) == NULL)
+    test(netpipefs_get_open_file_by_handle(file->handle) == file)
+    test(netpipefs_remove_open_file(path) == 0)
+
     /* Remove not open file */
     test(netpipefs_remove_open_file("badpath") == -1)
 
@@ -74,3 +112,81 @@ static void test_openfiles_table(void) {
     close(pipefd[0]);
     close(pipefd[1]);
 }
+
+#define STRESS_ROUNDS 20000
+#define STRESS_READERS 4
+#define STRESS_PATH "./stress.txt"
+
+static uint32_t stress_handle = 0;  // handle of the file created last by the closer. Accessed atomically
+static int stress_done = 0;         // set when the closer ends. Accessed atomically
+
+/* Create a file and close it for good, again and again, as the remote CLOSE does */
+static void *stress_closer(void *arg) {
+    int just_created;
+    struct netpipe *file;
+
+    for (int i = 0; i < STRESS_ROUNDS; i++) {
+        test((file = netpipefs_get_or_create_open_file(STRESS_PATH, &just_created)) != NULL)
+        __atomic_store_n(&stress_handle, file->handle, __ATOMIC_RELEASE);
+        test(netpipe_lock(file) == 0)
+        test(netpipefs_remove_open_file(STRESS_PATH) == 0)
+        test(netpipe_unlock(file) == 0)
+        test(netpipe_put(file, NULL) == 0)
+    }
+    __atomic_store_n(&stress_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* Look the file up by its handle and use it, as a READ message does */
+static void *stress_reader(void *arg) {
+    uint32_t handle;
+    struct netpipe *file;
+
+    while (!__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE)) {
+        handle = __atomic_load_n(&stress_handle, __ATOMIC_ACQUIRE);
+        if ((file = netpipefs_get_open_file_by_handle(handle)) == NULL) continue;
+
+        test(netpipe_lock(file) == 0)
+        test(file->handle == handle)
+        test(strcmp(file->path, STRESS_PATH) == 0)
+        test(netpipe_unlock(file) == 0)
+        test(netpipe_put(file, NULL) == 0)
+    }
+
+    return NULL;
+}
+
+/* A file found by handle is not freed while it is used, even if it is closed meanwhile */
+static void test_lookup_while_closing(void) {
+    pthread_t closer, readers[STRESS_READERS];
+    int pipefd[2];
+
+    test(pipe(pipefd) != -1)
+    netpipefs_socket.fd = pipefd[1];
+    test(netpipefs_open_files_table_init() == 0)
+
+    /* The reference taken by the lookup keeps the file after it is closed for good */
+    int just_created;
+    struct netpipe *file, *found;
+    test((file = netpipefs_get_or_create_open_file(STRESS_PATH, &just_created)) != NULL)
+    test((found = netpipefs_get_open_file_by_handle(file->handle)) == file)
+    test(netpipefs_remove_open_file(STRESS_PATH) == 0)
+    test(netpipe_put(file, NULL) == 0)
+    test(found->refs == 1)
+    test(netpipe_lock(found) == 0)
+    test(strcmp(found->path, STRESS_PATH) == 0)
+    test(netpipe_unlock(found) == 0)
+    test(netpipe_put(found, NULL) == 0)
+
+    for (int i = 0; i < STRESS_READERS; i++) test(pthread_create(&readers[i], NULL, &stress_reader, NULL) == 0)
+    test(pthread_create(&closer, NULL, &stress_closer, NULL) == 0)
+    test(pthread_join(closer, NULL) == 0)
+    for (int i = 0; i < STRESS_READERS; i++) test(pthread_join(readers[i], NULL) == 0)
+    errno = 0;
+
+    test(netpipefs_get_open_file(STRESS_PATH) == NULL)
+    test(netpipefs_open_files_table_destroy() == 0)
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
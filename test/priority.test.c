@@ -0,0 +1,128 @@
+#include "testutilities.h"
+#include "../include/priority.h"
+
+static void test_parse(void);
+static void test_rules(void);
+static void test_invalid_rules(void);
+static void test_set(void);
+
+int main(int argc, char** argv) {
+    test_parse();
+    test_rules();
+    test_invalid_rules();
+    test_set();
+
+    priority_free();
+    testpassed("Priority");
+    return 0;
+}
+
+/* A class with an optional weight */
+static void test_parse(void) {
+    int priority;
+    size_t weight;
+
+    test(priority_parse("3", 1, &priority, &weight) == 0)
+    test(priority == 3)
+    test(weight == DEFAULT_WEIGHT)
+
+    test(priority_parse("0:25", 4, &priority, &weight) == 0)
+    test(priority == 0)
+    test(weight == 25)
+
+    /* Only the given length is parsed */
+    test(priority_parse("2:57", 3, &priority, &weight) == 0)
+    test(weight == 5)
+
+    test(priority_parse("", 0, &priority, &weight) == -1)
+    test(errno == EINVAL)
+    errno = 0;
+    test(priority_parse("8", 1, &priority, &weight) == -1)
+    test(priority_parse("1:", 2, &priority, &weight) == -1)
+    test(priority_parse("1:0", 3, &priority, &weight) == -1)
+    test(priority_parse("1:1001", 6, &priority, &weight) == -1)
+    test(priority_parse("-1", 2, &priority, &weight) == -1)
+    test(priority_parse("1x", 2, &priority, &weight) == -1)
+    errno = 0;
+}
+
+/* The first pattern that matches gives the class and the weight */
+static void test_rules(void) {
+    int priority;
+    size_t weight;
+
+    priority_lookup("/any", &priority, &weight);
+    test(priority == DEFAULT_PRIORITY)
+    test(weight == DEFAULT_WEIGHT)
+
+    test(priority_add_rules("/ctl*=0,/logs/*=6:4,/*=5") == 0)
+    priority_lookup("/ctl.fifo", &priority, &weight);
+    test(priority == 0)
+    test(weight == DEFAULT_WEIGHT)
+    priority_lookup("/logs/app", &priority, &weight);
+    test(priority == 6)
+    test(weight == 4)
+    priority_lookup("/other", &priority, &weight);
+    test(priority == 5)
+
+    /* Later rules come after the ones already added */
+    test(priority_add_rules("/other=1") == 0)
+    priority_lookup("/other", &priority, &weight);
+    test(priority == 5)
+
+    priority_free();
+    priority_lookup("/ctl.fifo", &priority, &weight);
+    test(priority == DEFAULT_PRIORITY)
+}
+
+/* No rule is added if one of them is not valid */
+static void test_invalid_rules(void) {
+    int priority;
+    size_t weight;
+
+    test(priority_add_rules("/a=1,/b") == -1)
+    test(errno == EINVAL)
+    errno = 0;
+    priority_lookup("/a", &priority, &weight);
+    test(priority == DEFAULT_PRIORITY)
+
+    test(priority_add_rules("=1") == -1)
+    test(priority_add_rules("/a=1,,/b=2") == -1)
+    test(priority_add_rules("/a=9") == -1)
+    errno = 0;
+
+    /* The last '=' separates the class, so a pattern can have one */
+    test(priority_add_rules("/a=b=2") == 0)
+    priority_lookup("/a=b", &priority, &weight);
+    test(priority == 2)
+    priority_free();
+}
+
+/* The class set for a path comes before the patterns, until it is unset */
+static void test_set(void) {
+    int priority;
+    size_t weight;
+
+    test(priority_add_rules("/bulk*=7") == 0)
+    test(priority_set("/bulk.log", 1, 10) == 0)
+    priority_lookup("/bulk.log", &priority, &weight);
+    test(priority == 1)
+    test(weight == 10)
+    priority_lookup("/bulk.tar", &priority, &weight);
+    test(priority == 7)
+
+    /* Replaced */
+    test(priority_set("/bulk.log", 2, 3) == 0)
+    priority_lookup("/bulk.log", &priority, &weight);
+    test(priority == 2)
+    test(weight == 3)
+
+    test(priority_unset("/bulk.log") == 0)
+    priority_lookup("/bulk.log", &priority, &weight);
+    test(priority == 7)
+    test(weight == DEFAULT_WEIGHT)
+
+    test(priority_unset("/bulk.log") == -1)
+    test(errno == ENOENT)
+    errno = 0;
+}
@@ -0,0 +1,169 @@
+#include "testutilities.h"
+#include "../include/ratelimit.h"
+
+static void test_parse(void);
+static void test_rules(void);
+static void test_set(void);
+static void test_bucket(void);
+static void test_current(void);
+
+int main(int argc, char** argv) {
+    test_parse();
+    test_rules();
+    test_set();
+    test_bucket();
+    test_current();
+
+    ratelimit_free();
+    testpassed("Rate limit");
+    return 0;
+}
+
+/* A rate with an optional burst and size suffixes */
+static void test_parse(void) {
+    size_t rate, burst;
+
+    test(ratelimit_parse("1000", 4, &rate, &burst) == 0)
+    test(rate == 1000)
+    test(burst == 1000 / RATELIMIT_BURST_FRACTION)
+
+    test(ratelimit_parse("10M:64k", 7, &rate, &burst) == 0)
+    test(rate == 10 << 20)
+    test(burst == 64 << 10)
+
+    test(ratelimit_parse("2G", 2, &rate, &burst) == 0)
+    test(rate == (size_t) 2 << 30)
+
+    /* No limit, and a burst of at least one byte */
+    test(ratelimit_parse("0", 1, &rate, &burst) == 0)
+    test(rate == 0)
+    test(ratelimit_parse("5", 1, &rate, &burst) == 0)
+    test(burst == 1)
+
+    test(ratelimit_parse("", 0, &rate, &burst) == -1)
+    test(errno == EINVAL)
+    errno = 0;
+    test(ratelimit_parse("K", 1, &rate, &burst) == -1)
+    test(ratelimit_parse("1:", 2, &rate, &burst) == -1)
+    test(ratelimit_parse("1:0", 3, &rate, &burst) == -1)
+    test(ratelimit_parse("1T", 2, &rate, &burst) == -1)
+    test(ratelimit_parse("-1", 2, &rate, &burst) == -1)
+    test(ratelimit_parse("99999999999999999999", 20, &rate, &burst) == -1)
+    errno = 0;
+}
+
+/* The longest prefix which contains the path gives the rate limit */
+static void test_rules(void) {
+    size_t rate, burst;
+
+    ratelimit_lookup("/any", &rate, &burst);
+    test(rate == DEFAULT_RATELIMIT)
+
+    test(ratelimit_add_rules("/=1M,/tenant=100k:10k,/tenant/bulk=10k") == 0)
+    ratelimit_lookup("/other", &rate, &burst);
+    test(rate == 1 << 20)
+    ratelimit_lookup("/tenant", &rate, &burst);
+    test(rate == 100 << 10)
+    test(burst == 10 << 10)
+    ratelimit_lookup("/tenant/app", &rate, &burst);
+    test(rate == 100 << 10)
+    ratelimit_lookup("/tenant/bulk/1", &rate, &burst);
+    test(rate == 10 << 10)
+
+    /* A prefix contains whole path components */
+    ratelimit_lookup("/tenantx", &rate, &burst);
+    test(rate == 1 << 20)
+
+    /* No rule is added if one of them is not valid */
+    test(ratelimit_add_rules("/a=1,/b") == -1)
+    test(errno == EINVAL)
+    test(ratelimit_add_rules("=1") == -1)
+    test(ratelimit_add_rules("/a=1,,/b=2") == -1)
+    errno = 0;
+    ratelimit_lookup("/a", &rate, &burst);
+    test(rate == 1 << 20)
+
+    ratelimit_free();
+    ratelimit_lookup("/tenant", &rate, &burst);
+    test(rate == DEFAULT_RATELIMIT)
+}
+
+/* The rate limit set for a path comes before the prefixes, until it is unset */
+static void test_set(void) {
+    size_t rate, burst;
+
+    test(ratelimit_add_rules("/logs=1000") == 0)
+    test(ratelimit_set("/logs/audit", 0, 1) == 0)
+    ratelimit_lookup("/logs/audit", &rate, &burst);
+    test(rate == 0)
+    ratelimit_lookup("/logs/app", &rate, &burst);
+    test(rate == 1000)
+
+    /* Replaced */
+    test(ratelimit_set("/logs/audit", 500, 50) == 0)
+    ratelimit_lookup("/logs/audit", &rate, &burst);
+    test(rate == 500)
+    test(burst == 50)
+
+    test(ratelimit_unset("/logs/audit") == 0)
+    ratelimit_lookup("/logs/audit", &rate, &burst);
+    test(rate == 1000)
+
+    test(ratelimit_unset("/logs/audit") == -1)
+    test(errno == ENOENT)
+    errno = 0;
+    ratelimit_free();
+}
+
+/* The bucket starts full, then it is filled with the rate up to the burst */
+static void test_bucket(void) {
+    struct ratelimit rl;
+    struct timespec now = {100, 0};
+
+    ratelimit_init(&rl);
+    test(ratelimit_take(&rl, 1000, 300, 200, &now) == 200)
+    test(ratelimit_take(&rl, 1000, 300, 100, &now) == 100)
+    test(ratelimit_take(&rl, 1000, 300, 200, &now) == 0)
+    /* 200 bytes after 200ms */
+    test(ratelimit_delay(&rl, 1000, 300, 200) > 199000)
+    test(ratelimit_delay(&rl, 1000, 300, 200) <= 200001)
+
+    /* Not before there are the tokens for the whole write */
+    now.tv_nsec = 100000000;
+    test(ratelimit_take(&rl, 1000, 300, 200, &now) == 0)
+    now.tv_nsec = 250000000;
+    test(ratelimit_take(&rl, 1000, 300, 200, &now) == 200)
+
+    /* Or for a full burst, if the write is bigger */
+    now.tv_sec = 110;
+    test(ratelimit_take(&rl, 1000, 300, 5000, &now) == 300)
+    test(ratelimit_delay(&rl, 1000, 300, 5000) > 0)
+
+    /* Tokens given back */
+    ratelimit_refund(&rl, 300, 100);
+    test(ratelimit_take(&rl, 1000, 300, 100, &now) == 100)
+
+    /* No limit */
+    test(ratelimit_take(&rl, 0, 0, 5000, &now) == 5000)
+    test(ratelimit_delay(&rl, 0, 0, 5000) == 0)
+}
+
+/* The rate is measured over about a second */
+static void test_current(void) {
+    struct ratelimit rl;
+    struct timespec now = {100, 0};
+
+    ratelimit_init(&rl);
+    test(ratelimit_current(&rl, &now) == 0)
+    test(ratelimit_take(&rl, 0, 0, 3000, &now) == 3000)
+    now.tv_nsec = 500000000;
+    test(ratelimit_take(&rl, 0, 0, 3000, &now) == 3000)
+    now.tv_sec = 101;
+    now.tv_nsec = 0;
+    test(ratelimit_take(&rl, 0, 0, 10, &now) == 10)
+    test(ratelimit_current(&rl, &now) == 6000)
+
+    /* It goes down when nothing is sent */
+    now.tv_sec = 104;
+    test(ratelimit_current(&rl, &now) < 10)
+}
@@ -0,0 +1,418 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "testutilities.h"
+#include "../include/replay.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/netpipe.h"
+#include "../include/openfiles.h"
+#include "../include/sender.h"
+#include "../include/dispatcher.h"
+#include "../include/options.h"
+#include "../include/bufpool.h"
+
+#define PARENT_PORT 7001
+#define CHILD_PORT 7002
+#define STREAM_SIZE (4 << 20)   // bytes written on the netpipe while the connection is cut
+#define CUT_AFTER (1 << 20)     // bytes read before the connection is cut
+#define WINDOW (256 << 10)      // replay window
+
+struct netpipefs_socket netpipefs_socket;
+
+static void test_empty(void);
+static void test_append_get(void);
+static void test_wrap(void);
+static void test_grow(void);
+static void test_out_of_range(void);
+static void test_ack_wrap(void);
+static void test_resume(void);
+static void test_resume_mismatch(void);
+
+int main(int argc, char** argv) {
+    test_empty();
+    test_append_get();
+    test_wrap();
+    test_grow();
+    test_out_of_range();
+    test_ack_wrap();
+
+    /* the hosts are two processes on the same machine */
+    signal(SIGPIPE, SIG_IGN);
+    bufpool_init(0, 0, 0);
+    test_resume();
+    test_resume_mismatch();
+
+    testpassed("Replay");
+    return 0;
+}
+
+/* Copy the bytes kept from the given position into buf */
+static size_t get_bytes(struct replay *r, uint64_t position, char *buf) {
+    struct iovec iov[2];
+    size_t n = 0;
+    int i, iovcnt;
+
+    test((iovcnt = replay_get(r, position, iov)) != -1)
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(buf + n, iov[i].iov_base, iov[i].iov_len);
+        n += iov[i].iov_len;
+    }
+
+    return n;
+}
+
+/* Fill the buffer with the bytes at the given position of the stream */
+static void fill(char *buf, uint64_t position, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++) buf[i] = (char) ((position + i) % 251);
+}
+
+static int check(const char *buf, uint64_t position, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++) if (buf[i] != (char) ((position + i) % 251)) return 0;
+    return 1;
+}
+
+static void test_empty(void) {
+    struct replay r;
+    struct iovec iov[2];
+
+    replay_init(&r);
+    test(replay_size(&r) == 0)
+    test(replay_get(&r, 0, iov) == 0)
+    replay_release(&r, 10);
+    test(r.start == 0)
+    replay_free(&r);
+}
+
+/* Only the bytes that were sent are kept, then they are dropped once acknowledged */
+static void test_append_get(void) {
+    struct replay r;
+    char a[100], b[50], got[150];
+    struct iovec iov[2];
+
+    fill(a, 0, 100);
+    fill(b, 100, 50);
+    iov[0].iov_base = a;
+    iov[0].iov_len = 100;
+    iov[1].iov_base = b;
+    iov[1].iov_len = 50;
+
+    replay_init(&r);
+    test(replay_append(&r, iov, 2, 120) == 0)
+    test(replay_size(&r) == 120)
+    test(get_bytes(&r, 0, got) == 120)
+    test(check(got, 0, 120))
+    test(get_bytes(&r, 110, got) == 10)
+    test(check(got, 110, 10))
+
+    replay_release(&r, 100);
+    test(replay_size(&r) == 20)
+    test(get_bytes(&r, 100, got) == 20)
+    test(check(got, 100, 20))
+    test(get_bytes(&r, 120, got) == 0)
+
+    replay_release(&r, 120);
+    test(replay_size(&r) == 0)
+    replay_free(&r);
+}
+
+/* Bytes kept across the end of the ring come back as two buffers */
+static void test_wrap(void) {
+    struct replay r;
+    static char buf[REPLAY_MIN_SIZE], got[REPLAY_MIN_SIZE];
+    struct iovec iov[2];
+    uint64_t position = 0;
+
+    replay_init(&r);
+    fill(buf, position, REPLAY_MIN_SIZE - 100);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = REPLAY_MIN_SIZE - 100;
+    test(replay_append(&r, iov, 1, iov[0].iov_len) == 0)
+    position += iov[0].iov_len;
+    replay_release(&r, position - 50);
+
+    fill(buf, position, 1000);
+    iov[0].iov_len = 1000;
+    test(replay_append(&r, iov, 1, 1000) == 0)
+    position += 1000;
+    test(r.size == REPLAY_MIN_SIZE)
+
+    test(replay_get(&r, position - 1050, iov) == 2)
+    test(iov[0].iov_len == 150)
+    test(iov[1].iov_len == 900)
+    test(get_bytes(&r, position - 1050, got) == 1050)
+    test(check(got, position - 1050, 1050))
+    replay_free(&r);
+}
+
+/* The bytes not yet acknowledged are never dropped: the ring grows and keeps them in order */
+static void test_grow(void) {
+    struct replay r;
+    static char buf[3 * REPLAY_MIN_SIZE], got[4 * REPLAY_MIN_SIZE];
+    struct iovec iov;
+    uint64_t position = 0;
+
+    replay_init(&r);
+    iov.iov_base = buf;
+
+    /* the bytes kept wrap around the end of the ring before it grows */
+    fill(buf, position, REPLAY_MIN_SIZE - 10);
+    iov.iov_len = REPLAY_MIN_SIZE - 10;
+    test(replay_append(&r, &iov, 1, iov.iov_len) == 0)
+    position += iov.iov_len;
+    replay_release(&r, position - 1000);
+    fill(buf, position, 500);
+    iov.iov_len = 500;
+    test(replay_append(&r, &iov, 1, 500) == 0)
+    position += 500;
+
+    fill(buf, position, 3 * REPLAY_MIN_SIZE);
+    iov.iov_len = 3 * REPLAY_MIN_SIZE;
+    test(replay_append(&r, &iov, 1, iov.iov_len) == 0)
+    position += iov.iov_len;
+    test(r.size == 4 * REPLAY_MIN_SIZE)
+    test(replay_size(&r) == 3 * REPLAY_MIN_SIZE + 1500)
+
+    test(get_bytes(&r, position - replay_size(&r), got) == replay_size(&r))
+    test(check(got, position - replay_size(&r), replay_size(&r)))
+    replay_free(&r);
+}
+
+/* Bytes already dropped or not yet sent can't be replayed */
+static void test_out_of_range(void) {
+    struct replay r;
+    char buf[100];
+    struct iovec iov[2];
+
+    replay_init(&r);
+    fill(buf, 0, 100);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 100;
+    test(replay_append(&r, iov, 1, 100) == 0)
+    replay_release(&r, 40);
+
+    test(replay_get(&r, 39, iov) == -1)
+    test(errno == ERANGE)
+    test(replay_get(&r, 101, iov) == -1)
+    test(errno == ERANGE)
+    errno = 0;
+
+    /* acknowledging bytes not yet sent or already dropped changes nothing */
+    replay_release(&r, 101);
+    test(r.start == 40)
+    replay_release(&r, 10);
+    test(r.start == 40)
+    replay_free(&r);
+}
+
+/* Only the low 32 bits of the position are acknowledged: the position is found across 2^32 */
+static void test_ack_wrap(void) {
+    struct netpipefs_socket skt;
+    struct netpipefs_message message;
+
+    memset(&skt, 0, sizeof(struct netpipefs_socket));
+    memset(&message, 0, sizeof(struct netpipefs_message));
+    test(pthread_mutex_init(&(skt.wr_mtx), NULL) == 0)
+    test(pthread_cond_init(&(skt.wr_cond), NULL) == 0)
+    skt.snd_acked = (UINT64_C(1) << 32) - 50;
+
+    message.header = ACK;
+    message.size = 60;
+    test(handle_ack_message(&skt, &message) == 1)
+    test(skt.snd_acked == (UINT64_C(1) << 32) + 60)
+
+    /* an acknowledgement older than the last one changes nothing */
+    message.size = (size_t) (uint32_t) ((UINT64_C(1) << 32) - 100);
+    test(handle_ack_message(&skt, &message) == 1)
+    test(skt.snd_acked == (UINT64_C(1) << 32) + 60)
+
+    pthread_mutex_destroy(&(skt.wr_mtx));
+    pthread_cond_destroy(&(skt.wr_cond));
+}
+
+/* The options of the given host. The parent accepts the connection and the child connects */
+static void set_options(int child, size_t stripes) {
+    static char localhost[] = "localhost";
+    char path[32];
+
+    memset(&netpipefs_options, 0, sizeof(struct netpipefs_options));
+    netpipefs_options.hostip = localhost;
+    netpipefs_options.stripes = stripes;
+    netpipefs_options.port = child ? CHILD_PORT : PARENT_PORT;
+    netpipefs_options.hostport = child ? PARENT_PORT : CHILD_PORT;
+    netpipefs_options.timeout = 3000;
+    netpipefs_options.replay = WINDOW;
+    netpipefs_options.readahead = child ? 128 << 10 : 0;
+    netpipefs_options.maxreadahead = DEFAULT_MAX_READAHEAD;
+    netpipefs_options.maxframe = DEFAULT_MAX_FRAME;
+    netpipefs_options.ackbytes = DEFAULT_ACK_BYTES;
+    netpipefs_options.ackdelay = DEFAULT_ACK_DELAY;
+
+    /* a socket file left by an earlier run */
+    sprintf(path, "/tmp/sockfile%d.sock", netpipefs_options.port);
+    if (unlink(path) == -1) errno = 0;
+}
+
+/* Connect the two hosts with the given connections */
+static void connect_hosts(int child, size_t stripes) {
+    memset(&netpipefs_socket, 0, sizeof(struct netpipefs_socket));
+    test(pthread_mutex_init(&(netpipefs_socket.wr_mtx), NULL) == 0)
+    test(pthread_cond_init(&(netpipefs_socket.wr_cond), NULL) == 0)
+    test(bdp_init(&(netpipefs_socket.bdp)) == 0)
+    set_options(child, stripes);
+    test(establish_socket_connection(&netpipefs_socket, 3000) == 0)
+    test(socket_resumable(&netpipefs_socket))
+    test(socket_stripes(&netpipefs_socket) == stripes)
+}
+
+/* Byte of the stream at the given position */
+static char stream_byte(size_t position) {
+    return (char) (position % 251);
+}
+
+/* The reader of the stream cuts the connection once, in the middle of the WRITE messages */
+static void resume_reader(void) {
+    char buf[4096];
+    size_t got = 0, i;
+    ssize_t n;
+    int just_created, cut = 0;
+    struct netpipe *file;
+
+    test((file = netpipefs_get_or_create_open_file("/stream", &just_created)) != NULL)
+    test(netpipe_open(file, O_RDONLY, 0) == 0)
+    while (got < STREAM_SIZE) {
+        test((n = netpipe_read(file, buf, sizeof(buf), 0)) > 0)
+        for (i = 0; i < (size_t) n; i++) test(buf[i] == stream_byte(got + i))
+        got += (size_t) n;
+        if (!cut && got >= CUT_AFTER) {
+            test(shutdown(netpipefs_socket.fd, SHUT_RDWR) == 0)
+            cut = 1;
+        }
+    }
+    test(netpipe_close(file, O_RDONLY, &netpipefs_remove_open_file, NULL) != -1)
+}
+
+/* The writer of the stream doesn't know that the connection was cut */
+static void resume_writer(void) {
+    static char buf[64 << 10];
+    size_t sent = 0, i;
+    int just_created;
+    struct netpipe *file;
+
+    test((file = netpipefs_get_or_create_open_file("/stream", &just_created)) != NULL)
+    test(netpipe_open(file, O_WRONLY, 0) == 0)
+    while (sent < STREAM_SIZE) {
+        for (i = 0; i < sizeof(buf); i++) buf[i] = stream_byte(sent + i);
+        test(netpipe_send(file, buf, sizeof(buf), 0) == (ssize_t) sizeof(buf))
+        sent += sizeof(buf);
+    }
+    test(netpipe_close(file, O_WRONLY, &netpipefs_remove_open_file, NULL) != -1)
+}
+
+/*
+ * A connection cut while WRITE messages are sent is resumed, and the stream goes on from where the reader stopped.
+ * The bytes kept by each host never go past the replay window
+ */
+static void test_resume(void) {
+    int done[2], stopped[2], child, status, sndbuf = 4096;
+    char c = 0;
+    pid_t pid;
+
+    test(pipe(done) == 0)
+    test(pipe(stopped) == 0)
+    test((pid = fork()) != -1)
+    child = pid == 0;
+
+    connect_hosts(child, 1);
+    test(netpipefs_sender_run() == 0)
+    test(netpipefs_open_files_table_init() == 0)
+    test(netpipefs_dispatcher_run() == 0)
+
+    if (child) {
+        close(done[0]);
+        close(stopped[1]);
+        resume_reader();
+        test(netpipefs_socket.resumes >= 1)
+        test(netpipefs_socket.replay.size <= 2 * WINDOW)
+        /* the parent stops, then the connection is closed */
+        test(write(done[1], &c, 1) == 1)
+        test(read(stopped[0], &c, 1) == 1)
+        _exit(EXIT_SUCCESS);
+    }
+
+    /* with a small buffer the sender is in the middle of a message most of the time */
+    test(setsockopt(netpipefs_socket.fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) == 0)
+    close(done[1]);
+    close(stopped[0]);
+    resume_writer();
+    test(read(done[0], &c, 1) == 1)
+    test(netpipefs_dispatcher_stop() == 0)
+    test(netpipefs_sender_stop() == 0)
+    test(netpipefs_socket.resumes >= 1)
+    test(netpipefs_socket.replay.size <= 2 * WINDOW)
+    test(write(stopped[1], &c, 1) == 1)
+    test(waitpid(pid, &status, 0) == pid)
+    test(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+    test(netpipefs_open_files_table_destroy() == 0)
+    test(end_socket_connection(&netpipefs_socket) == 0)
+    close(done[0]);
+    close(stopped[1]);
+}
+
+/* A host that resumes another session, or the same one with fewer connections, is refused */
+static void test_resume_mismatch(void) {
+    int done[2], child, status;
+    char c = 0;
+    pid_t pid;
+
+    test(pipe(done) == 0)
+    test((pid = fork()) != -1)
+    child = pid == 0;
+
+    connect_hosts(child, 1);
+    if (child) {
+        close(done[0]);
+        netpipefs_socket.session++;
+        test(resume_socket_connection(&netpipefs_socket, 500) == -1)
+        netpipefs_socket.session--;
+        test(write(done[1], &c, 1) == 1)
+        _exit(EXIT_SUCCESS);
+    }
+    close(done[1]);
+    test(resume_socket_connection(&netpipefs_socket, 3000) == -1)
+    test(errno == EPROTO)
+    errno = 0;
+    test(read(done[0], &c, 1) == 1)
+    test(waitpid(pid, &status, 0) == pid)
+    test(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+    test(end_socket_connection(&netpipefs_socket) == 0)
+    close(done[0]);
+
+    /* with more connections */
+    test(pipe(done) == 0)
+    test((pid = fork()) != -1)
+    child = pid == 0;
+
+    connect_hosts(child, 2);
+    if (child) {
+        close(done[0]);
+        netpipefs_socket.nstripes = 1;
+        test(resume_socket_connection(&netpipefs_socket, 500) == -1)
+        test(errno == EPROTO)
+        netpipefs_socket.nstripes = 2;
+        test(write(done[1], &c, 1) == 1)
+        _exit(EXIT_SUCCESS);
+    }
+    close(done[1]);
+    test(resume_socket_connection(&netpipefs_socket, 3000) == -1)
+    test(errno == EPROTO)
+    errno = 0;
+    test(read(done[0], &c, 1) == 1)
+    test(waitpid(pid, &status, 0) == pid)
+    test(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+    test(end_socket_connection(&netpipefs_socket) == 0)
+    close(done[0]);
+}
@@ -0,0 +1,336 @@
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "testutilities.h"
+#include "../include/rudp.h"
+
+#define MESSAGES 400
+#define STREAMS 4
+
+/** What the drop function drops */
+struct shim {
+    unsigned int seed;
+    int percent;            // datagrams dropped at random, in percent
+    long first_stream;      // if not -1, the first datagram of this stream is dropped
+    int first_dropped;
+};
+
+static int drop(void *arg, int type, uint32_t stream, int retransmission);
+static void connection_pair(struct rudp **first, struct rudp **second);
+static void send_message(struct rudp *r, uint32_t stream, uint32_t index, size_t len);
+static size_t recv_message(struct rudp *r, char *buf);
+static void test_messages(struct rudp *first, struct rudp *second);
+static void test_loss(struct rudp *first, struct rudp *second);
+static void test_streams(struct rudp *first, struct rudp *second);
+static void test_close(struct rudp *first, struct rudp *second);
+static void test_window(void);
+
+int main(int argc, char** argv) {
+    struct rudp *first, *second;
+
+    connection_pair(&first, &second);
+    test_messages(first, second);
+    test_loss(first, second);
+    test_streams(first, second);
+    test_close(first, second);
+    test_window();
+
+    testpassed("Reliable UDP");
+    return 0;
+}
+
+static int drop(void *arg, int type, uint32_t stream, int retransmission) {
+    struct shim *shim = (struct shim *) arg;
+
+    if (shim->first_stream != -1 && type == RUDP_DATA && stream == (uint32_t) shim->first_stream && !shim->first_dropped) {
+        shim->first_dropped = 1;
+        return 1;
+    }
+
+    return (int) (rand_r(&(shim->seed)) % 100) < shim->percent;
+}
+
+/* Two UDP sockets on the loopback interface connected to each other */
+static void udp_pair(int *udp) {
+    int i;
+    struct sockaddr_in sa[2];
+    socklen_t len = sizeof(struct sockaddr_in);
+
+    for (i = 0; i < 2; i++) {
+        memset(&sa[i], 0, sizeof(struct sockaddr_in));
+        sa[i].sin_family = AF_INET;
+        sa[i].sin_port = 0;
+        sa[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        test((udp[i] = socket(AF_INET, SOCK_DGRAM, 0)) != -1)
+        test(bind(udp[i], (struct sockaddr *) &sa[i], sizeof(struct sockaddr_in)) == 0)
+        test(getsockname(udp[i], (struct sockaddr *) &sa[i], &len) == 0)
+    }
+    test(connect(udp[0], (struct sockaddr *) &sa[1], sizeof(struct sockaddr_in)) == 0)
+    test(connect(udp[1], (struct sockaddr *) &sa[0], sizeof(struct sockaddr_in)) == 0)
+}
+
+/* Two connections over UDP sockets on the loopback interface, and a pair of stream sockets to tell when closed */
+static void connection_pair(struct rudp **first, struct rudp **second) {
+    int udp[2], ctl[2];
+
+    udp_pair(udp);
+    test(socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) == 0)
+
+    test((*first = rudp_create(udp[0], ctl[0])) != NULL)
+    test((*second = rudp_create(udp[1], ctl[1])) != NULL)
+}
+
+/*
+ * Send a test message: its length, stream and index as the first 12 bytes, then bytes that depend on them.
+ * Messages are read back by recv_message()
+ */
+static void send_message(struct rudp *r, uint32_t stream, uint32_t index, size_t len) {
+    char buf[16384];
+    uint32_t values[3];
+    size_t i;
+    struct iovec iov[2];
+
+    values[0] = (uint32_t) len;
+    values[1] = stream;
+    values[2] = index;
+    memcpy(buf, values, sizeof(values));
+    for (i = sizeof(values); i < len; i++) buf[i] = (char) (i + stream * 7 + index);
+
+    /* from two buffers */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 5;
+    iov[1].iov_base = buf + 5;
+    iov[1].iov_len = len - 5;
+    while (rudp_send(r, stream, iov, 2, 0, len) == -1) {
+        test(errno == EAGAIN)
+        errno = 0;
+        test(rudp_wait_send(r, 1000) != -1)
+    }
+}
+
+/* Read a whole message sent by send_message() and check its bytes. Returns its length */
+static size_t recv_message(struct rudp *r, char *buf) {
+    size_t got = 0, len = 12, i;
+    ssize_t bytes;
+    uint32_t values[3];
+
+    while (got < len) {
+        test((bytes = rudp_recv(r, buf + got, len - got)) > 0)
+        got += (size_t) bytes;
+        if (got == 12) {
+            memcpy(values, buf, sizeof(values));
+            len = values[0];
+        }
+    }
+    for (i = 12; i < len; i++) test(buf[i] == (char) (i + values[1] * 7 + values[2]))
+
+    return len;
+}
+
+static uint32_t stream_of(const char *buf) {
+    uint32_t values[3];
+    memcpy(values, buf, sizeof(values));
+    return values[1];
+}
+
+static uint32_t index_of(const char *buf) {
+    uint32_t values[3];
+    memcpy(values, buf, sizeof(values));
+    return values[2];
+}
+
+/* Messages of one or many datagrams are received as sent, both ways */
+static void test_messages(struct rudp *first, struct rudp *second) {
+    char buf[16384];
+    struct iovec iov[1];
+    struct pollfd pfd;
+
+    pfd.fd = rudp_data_fd(second);
+    pfd.events = POLLIN;
+    test(poll(&pfd, 1, 0) == 0)
+
+    send_message(first, 1, 0, 100);
+    send_message(first, 2, 1, 5000);
+    send_message(first, 0, 2, RUDP_MSS * 3);
+    test(poll(&pfd, 1, 1000) == 1)
+    test(recv_message(second, buf) == 100)
+    test(recv_message(second, buf) == 5000)
+    test(recv_message(second, buf) == RUDP_MSS * 3)
+    test(poll(&pfd, 1, 0) == 0)
+
+    send_message(second, 5, 3, 20);
+    test(recv_message(first, buf) == 20)
+
+    /* Not in the buffers, or not a message */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 4;
+    test(rudp_send(first, 1, iov, 1, 4, 1) == -1)
+    test(errno == EINVAL)
+    errno = 0;
+    test(rudp_send(first, 1, NULL, 0, 0, 0) == -1)
+    test(errno == EMSGSIZE)
+    errno = 0;
+}
+
+/* With datagrams lost both ways, every message is received and the messages of a stream keep their order */
+static void test_loss(struct rudp *first, struct rudp *second) {
+    char buf[16384];
+    uint32_t next[STREAMS] = {0}, i;
+    struct shim shim1 = {1, 10, -1, 0}, shim2 = {2, 10, -1, 0};
+    struct rudp_stats stats;
+
+    rudp_set_drop(first, &drop, &shim1);
+    rudp_set_drop(second, &drop, &shim2);
+
+    for (i = 0; i < MESSAGES; i++) send_message(first, i % STREAMS, i / STREAMS, 12 + (i * 997) % 12000);
+    for (i = 0; i < MESSAGES; i++) {
+        recv_message(second, buf);
+        test(index_of(buf) == next[stream_of(buf)])
+        next[stream_of(buf)]++;
+    }
+
+    rudp_get_stats(first, &stats);
+    test(stats.dropped > 0)
+    test(stats.retransmitted > 0)
+    test(stats.srtt > 0)
+    test(stats.cwnd >= RUDP_MIN_CWND)
+    rudp_get_stats(second, &stats);
+    test(stats.received > 0)
+
+    rudp_set_drop(first, NULL, NULL);
+    rudp_set_drop(second, NULL, NULL);
+}
+
+/* A lost datagram delays only its stream, but every stream waits for the messages of stream 0 sent before */
+static void test_streams(struct rudp *first, struct rudp *second) {
+    char buf[16384];
+    struct shim shim1 = {3, 0, 1, 0}, shim2 = {3, 0, 0, 0};
+
+    rudp_set_drop(first, &drop, &shim1);
+    send_message(first, 1, 100, 50);
+    send_message(first, 2, 100, 50);
+    recv_message(second, buf);
+    test(stream_of(buf) == 2)
+    recv_message(second, buf);
+    test(stream_of(buf) == 1)
+
+    rudp_set_drop(first, &drop, &shim2);
+    test(shim1.first_dropped == 1)
+    send_message(first, 0, 100, 50);
+    send_message(first, 3, 100, 50);
+    recv_message(second, buf);
+    test(stream_of(buf) == 0)
+    recv_message(second, buf);
+    test(stream_of(buf) == 3)
+
+    rudp_set_drop(first, NULL, NULL);
+    test(shim2.first_dropped == 1)
+}
+
+/* Closing waits until the messages are acknowledged. Then the other connection reads them, then 0 bytes */
+static void test_close(struct rudp *first, struct rudp *second) {
+    char buf[16384];
+    struct shim shim = {4, 30, -1, 0};
+    struct iovec iov[1];
+    struct pollfd pfd;
+
+    rudp_set_drop(first, &drop, &shim);
+    send_message(first, 1, 0, 10000);
+    send_message(first, 2, 0, 10000);
+    test(rudp_close(first) == 0)
+
+    test(recv_message(second, buf) == 10000)
+    test(recv_message(second, buf) == 10000)
+    pfd.fd = rudp_data_fd(second);
+    pfd.events = POLLIN;
+    test(poll(&pfd, 1, 1000) == 1)
+    test(rudp_recv(second, buf, sizeof(buf)) == 0)
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 1;
+    test(rudp_send(second, 1, iov, 1, 0, 1) == -1)
+    test(errno == EPIPE)
+    errno = 0;
+    test(rudp_wait_send(second, 0) == 1)
+    test(rudp_close(second) == 0)
+}
+
+static void put_u64(unsigned char *dest, uint64_t value) {
+    int i;
+    for (i = 7; i >= 0; i--, value >>= 8) dest[i] = (unsigned char) value;
+}
+
+static uint64_t get_u64(const unsigned char *src) {
+    int i;
+    uint64_t value = 0;
+    for (i = 0; i < 8; i++) value = value << 8 | src[i];
+    return value;
+}
+
+/* Send the first segment of a message of the given length, as a datagram with the given packet number */
+static void send_segment(int fd, uint64_t pn, uint64_t msn, uint32_t msglen) {
+    unsigned char buf[44 + RUDP_MSS];
+    size_t size = msglen < RUDP_MSS ? msglen : RUDP_MSS;
+    uint32_t values[2];
+
+    memset(buf, 0, sizeof(buf));
+    buf[0] = RUDP_DATA;
+    put_u64(buf + 4, pn);
+    put_u64(buf + 12, msn);
+    values[0] = htonl(msglen);
+    values[1] = 0;
+    memcpy(buf + 36, values, sizeof(values));
+    memset(buf + 44, 'a', size);
+    test(send(fd, buf, 44 + size, 0) == (ssize_t) (44 + size))
+}
+
+/* Returns 1 if the acknowledgement has the packet number */
+static int acknowledged(const unsigned char *ack, uint64_t pn) {
+    int i;
+
+    for (i = 0; i < (ack[2] << 8 | ack[3]); i++) {
+        if (pn >= get_u64(ack + 12 + i * 16) && pn <= get_u64(ack + 12 + i * 16 + 8)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * A message too far ahead of those received in order is dropped instead of being stored, and so is a message which
+ * doesn't fit with those being received. The next message in order is always taken
+ */
+static void test_window(void) {
+    int udp[2], ctl[2];
+    unsigned char ack[12 + RUDP_MAX_RANGES * 16];
+    char buf[16];
+    struct rudp *r;
+    struct pollfd pfd;
+
+    /* the remote host is the test itself */
+    udp_pair(udp);
+    test(socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) == 0)
+    test((r = rudp_create(udp[1], ctl[1])) != NULL)
+
+    send_segment(udp[0], 1, RUDP_RCV_WINDOW + 1, RUDP_MAX_MESSAGE);
+    send_segment(udp[0], 2, 2, RUDP_RCVBUF);
+    send_segment(udp[0], 3, 3, RUDP_MSS);
+    send_segment(udp[0], 4, 1, 10);
+    test(rudp_recv(r, buf, sizeof(buf)) == 10)
+
+    /* the last acknowledgement tells what was stored */
+    pfd.fd = udp[0];
+    pfd.events = POLLIN;
+    do {
+        test(poll(&pfd, 1, 1000) == 1)
+        test(recv(udp[0], ack, sizeof(ack), 0) >= 12)
+    } while (!acknowledged(ack, 4));
+    test(ack[0] == RUDP_ACK)
+    test(get_u64(ack + 4) == 1)
+    test(!acknowledged(ack, 1))
+    test(acknowledged(ack, 2))
+    test(!acknowledged(ack, 3))
+
+    test(rudp_close(r) == 0)
+    close(udp[0]);
+    close(ctl[0]);
+}
@@ -0,0 +1,155 @@
+#include <unistd.h>
+#include <poll.h>
+#include "testutilities.h"
+#include "../include/shm.h"
+
+static void test_write_and_peek(struct netpipefs_shm *producer, struct netpipefs_shm *consumer);
+static void test_wrap_around(struct netpipefs_shm *producer, struct netpipefs_shm *consumer);
+static void test_full(struct netpipefs_shm *producer, struct netpipefs_shm *consumer);
+static void test_doorbell(struct netpipefs_shm *producer, struct netpipefs_shm *consumer);
+
+int main(int argc, char** argv) {
+    struct netpipefs_shm producer, consumer;
+
+    /* The kernel may not support memfd. Then netpipefs uses the socket */
+    if (shm_create(&producer, 1) == -1) {
+        test(errno == ENOSYS)
+        errno = 0;
+        testpassed("Shared memory (not supported)");
+        return 0;
+    }
+    test(producer.size == (size_t) sysconf(_SC_PAGESIZE))
+
+    /* The other side maps the same ring with its own copy of the file descriptors */
+    test(shm_attach(&consumer, dup(producer.memfd), dup(producer.data_efd), dup(producer.space_efd)) == 0)
+    test(consumer.size == producer.size)
+
+    test_write_and_peek(&producer, &consumer);
+    test_wrap_around(&producer, &consumer);
+    test_full(&producer, &consumer);
+    test_doorbell(&producer, &consumer);
+
+    shm_free(&consumer);
+    shm_free(&producer);
+    test(producer.memfd == -1)
+
+    /* Not a ring */
+    test(shm_attach(&consumer, STDIN_FILENO, -1, -1) == -1)
+    errno = 0;
+
+    testpassed("Shared memory");
+    return 0;
+}
+
+/* What is written by one side is seen by the other one, until it is consumed */
+static void test_write_and_peek(struct netpipefs_shm *producer, struct netpipefs_shm *consumer) {
+    size_t available;
+    const char *data;
+    char first[] = "hello ", second[] = "world";
+    struct iovec iov[2];
+
+    data = shm_peek(consumer, &available);
+    test(available == 0)
+
+    iov[0].iov_base = first;
+    iov[0].iov_len = strlen(first);
+    iov[1].iov_base = second;
+    iov[1].iov_len = strlen(second);
+    test(shm_write(producer, iov, 2) == 11)
+
+    data = shm_peek(consumer, &available);
+    test(available == 11)
+    test(memcmp(data, "hello world", 11) == 0)
+
+    shm_consume(consumer, 6);
+    data = shm_peek(consumer, &available);
+    test(available == 5)
+    test(memcmp(data, "world", 5) == 0)
+    shm_consume(consumer, 5);
+}
+
+/* Data that wraps around the end of the ring is contiguous */
+static void test_wrap_around(struct netpipefs_shm *producer, struct netpipefs_shm *consumer) {
+    size_t available, i;
+    const char *data;
+    char buf[64];
+    struct iovec iov[1];
+
+    /* Move the positions close to the end of the ring */
+    while (producer->ctl->head % producer->size < producer->size - 32) {
+        iov[0].iov_base = buf;
+        iov[0].iov_len = producer->size - 32 - producer->ctl->head % producer->size;
+        if (iov[0].iov_len > sizeof(buf)) iov[0].iov_len = sizeof(buf);
+        test(shm_write(producer, iov, 1) == iov[0].iov_len)
+        shm_peek(consumer, &available);
+        shm_consume(consumer, available);
+    }
+
+    for (i = 0; i < sizeof(buf); i++) buf[i] = (char) i;
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    test(shm_write(producer, iov, 1) == sizeof(buf))
+    data = shm_peek(consumer, &available);
+    test(available == sizeof(buf))
+    test(memcmp(data, buf, sizeof(buf)) == 0)
+    shm_consume(consumer, available);
+}
+
+/* A full ring takes nothing more, and the producer waits until there is room */
+static void test_full(struct netpipefs_shm *producer, struct netpipefs_shm *consumer) {
+    size_t available;
+    char buf[256];
+    struct iovec iov[1];
+
+    memset(buf, 'x', sizeof(buf));
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    while (shm_write(producer, iov, 1) == sizeof(buf));
+    test(shm_write(producer, iov, 1) == 0)
+    shm_peek(consumer, &available);
+    test(available == producer->size)
+
+    test(shm_wait_space(producer, 10) == 0)
+
+    /* The producer is woken up by the consumer */
+    producer->ctl->writer_waiting = 1;
+    shm_consume(consumer, 100);
+    producer->ctl->writer_waiting = 0;
+    test(shm_wait_space(producer, 1000) == 1)
+    test(shm_write(producer, iov, 1) == 100)
+
+    shm_peek(consumer, &available);
+    shm_consume(consumer, available);
+}
+
+/* The consumer sleeps only if there is no new data, and it is woken up by the producer */
+static void test_doorbell(struct netpipefs_shm *producer, struct netpipefs_shm *consumer) {
+    size_t available;
+    char buf[] = "ding";
+    struct iovec iov[1];
+    struct pollfd pfd;
+
+    pfd.fd = consumer->data_efd;
+    pfd.events = POLLIN;
+
+    /* Nobody sleeps, nothing is written to the eventfd */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 4;
+    test(shm_write(producer, iov, 1) == 4)
+    test(poll(&pfd, 1, 0) == 0)
+
+    /* There is new data, it shouldn't sleep */
+    test(shm_arm(consumer, 0) == 1)
+    test(consumer->ctl->reader_waiting == 0)
+
+    /* It already saw the data, then it sleeps and the next write wakes it up */
+    test(shm_arm(consumer, 4) == 0)
+    test(shm_write(producer, iov, 1) == 4)
+    test(poll(&pfd, 1, 1000) == 1)
+    shm_disarm(consumer);
+    test(poll(&pfd, 1, 0) == 0)
+
+    shm_peek(consumer, &available);
+    test(available == 8)
+    shm_consume(consumer, available);
+}
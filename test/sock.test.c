@@ -0,0 +1,135 @@
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "testutilities.h"
+#include "../include/sock.h"
+#include "../include/utils.h"
+
+#define SOCKNAME "/tmp/sock.test.sock"
+#define LISTEN_AFTER 30     // milliseconds before the late host listens
+#define INTERVAL 64         // max milliseconds between two tries of connect
+
+static void *listen_later(void *arg);
+static void test_invalid(void);
+static void test_late_listen(void);
+static void test_connect_accept(void);
+static void test_timeout(void);
+
+int main(int argc, char** argv) {
+
+    test_invalid();
+    test_late_listen();
+    test_connect_accept();
+    test_timeout();
+
+    unlink(SOCKNAME);
+    testpassed("Sockets");
+    return 0;
+}
+
+static void unix_address(struct sockaddr_un *sun) {
+    memset(sun, 0, sizeof(struct sockaddr_un));
+    sun->sun_family = AF_UNIX;
+    strncpy(sun->sun_path, SOCKNAME, sizeof(sun->sun_path) - 1);
+}
+
+/* Bind and listen on SOCKNAME after LISTEN_AFTER milliseconds, then accept a connection */
+static void *listen_later(void *arg) {
+    int fd, *accepted = (int *) arg;
+    struct sockaddr_un sun;
+
+    unix_address(&sun);
+    test(msleep(LISTEN_AFTER) == 0)
+    test((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1)
+    test(bind(fd, (struct sockaddr *) &sun, sizeof(struct sockaddr_un)) == 0)
+    test(listen(fd, 1) == 0)
+    test((*accepted = accept(fd, NULL, 0)) != -1)
+    close(fd);
+
+    return NULL;
+}
+
+static void test_invalid(void) {
+    struct sockaddr_un sun;
+
+    unix_address(&sun);
+    test(sock_connect_while_accept(-1, -1, (struct sockaddr *) &sun, 100, INTERVAL) == -1)
+    test(errno == EINVAL)
+    errno = 0;
+}
+
+/* A refused connect is tried again soon: the connection is there shortly after the remote host listens */
+static void test_late_listen(void) {
+    int fd, accepted;
+    char c = 'x';
+    pthread_t thread;
+    struct sockaddr_un sun;
+    struct timespec start, elapsed;
+
+    unlink(SOCKNAME);
+    unix_address(&sun);
+    test((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1)
+    test(pthread_create(&thread, NULL, &listen_later, &accepted) == 0)
+    test(clock_gettime(CLOCK_MONOTONIC, &start) == 0)
+    test(sock_connect_while_accept(fd, -1, (struct sockaddr *) &sun, 2000, INTERVAL) == fd)
+    elapsed = elapsed_time(&start);
+    test(pthread_join(thread, NULL) == 0)
+
+    /* it waited for the listen but not much longer */
+    test(elapsed.tv_sec * 1000L + elapsed.tv_nsec / 1000000L >= LISTEN_AFTER)
+    test(elapsed.tv_sec * 1000L + elapsed.tv_nsec / 1000000L < LISTEN_AFTER + INTERVAL + 200)
+
+    /* the socket blocks again */
+    test(write(fd, &c, 1) == 1)
+    test(read(accepted, &c, 1) == 1)
+    test(c == 'x')
+    close(fd);
+    close(accepted);
+    unlink(SOCKNAME);
+}
+
+/* Connecting to itself, the connection is both opened and accepted */
+static void test_connect_accept(void) {
+    int fdconn, fdacc, accepted;
+    char c = 'y';
+    struct sockaddr_un sun;
+
+    unix_address(&sun);
+    test((fdacc = socket(AF_UNIX, SOCK_STREAM, 0)) != -1)
+    test(bind(fdacc, (struct sockaddr *) &sun, sizeof(struct sockaddr_un)) == 0)
+    test(listen(fdacc, 1) == 0)
+    test((fdconn = socket(AF_UNIX, SOCK_STREAM, 0)) != -1)
+
+    test((accepted = sock_connect_while_accept(fdconn, fdacc, (struct sockaddr *) &sun, 1000, INTERVAL)) != -1)
+    test(write(fdconn, &c, 1) == 1)
+    test(read(accepted, &c, 1) == 1)
+    test(c == 'y')
+
+    close(accepted);
+    close(fdconn);
+    close(fdacc);
+    unlink(SOCKNAME);
+}
+
+/* Nobody connects or listens */
+static void test_timeout(void) {
+    int fd;
+    struct sockaddr_un sun;
+
+    unix_address(&sun);
+    test((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1)
+    test(sock_connect_while_accept(fd, -1, (struct sockaddr *) &sun, 50, INTERVAL) == -1)
+    test(errno == ETIMEDOUT)
+    errno = 0;
+    close(fd);
+
+    test((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1)
+    test(bind(fd, (struct sockaddr *) &sun, sizeof(struct sockaddr_un)) == 0)
+    test(listen(fd, 1) == 0)
+    test(sock_connect_while_accept(-1, fd, (struct sockaddr *) &sun, 50, INTERVAL) == -1)
+    test(errno == ETIMEDOUT)
+    errno = 0;
+    close(fd);
+    unlink(SOCKNAME);
+}
@@ -0,0 +1,374 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include "testutilities.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/netpipe.h"
+#include "../include/sender.h"
+#include "../include/bufpool.h"
+
+struct netpipefs_socket netpipefs_socket;
+
+static void test_loopback(struct netpipefs_socket *first, struct netpipefs_socket *second);
+static void test_full(struct netpipefs_socket *first, struct netpipefs_socket *second);
+static void test_messages(struct netpipefs_socket *remote);
+static void test_max_message(struct netpipefs_socket *remote);
+static void test_max_length(struct netpipefs_socket *remote);
+static void test_move_flow(struct netpipefs_socket *remote);
+static void test_zero_copy(struct netpipefs_socket *remote);
+static void test_large_flush(struct netpipefs_socket *remote);
+static void test_close(struct netpipefs_socket *remote);
+
+int main(int argc, char** argv) {
+    struct netpipefs_socket remote;
+
+    memset(&remote, 0, sizeof(struct netpipefs_socket));
+    test(pthread_mutex_init(&(netpipefs_socket.wr_mtx), NULL) == 0)
+    test(pthread_cond_init(&(netpipefs_socket.wr_cond), NULL) == 0)
+
+    /* Not joined yet */
+    netpipefs_socket.transport = &netpipefs_loopback_transport;
+    test(establish_socket_connection(&netpipefs_socket, 0) == -1)
+    test(errno == ENOTCONN)
+    errno = 0;
+
+    test(loopback_transport_pair(&netpipefs_socket, &remote) == 0)
+    test(establish_socket_connection(&netpipefs_socket, 0) == 0)
+    test(establish_socket_connection(&remote, 0) == 0)
+    test(socket_stripes(&netpipefs_socket) == 1)
+
+    /* io_uring needs a socket */
+    test(init_socket_uring(&netpipefs_socket) == -1)
+    test(errno == ENOTSUP)
+    errno = 0;
+
+    test_loopback(&netpipefs_socket, &remote);
+    test_full(&netpipefs_socket, &remote);
+    test_messages(&remote);
+    test_max_message(&remote);
+    test_max_length(&remote);
+    test_move_flow(&remote);
+    test_zero_copy(&remote);
+    test_large_flush(&remote);
+    test_close(&remote);
+
+    testpassed("Transport");
+    return 0;
+}
+
+/* What is sent on a connection is received by the other one, and the fd tells when there is data */
+static void test_loopback(struct netpipefs_socket *first, struct netpipefs_socket *second) {
+    char buf[16];
+    char hello[] = "hello ", world[] = "world";
+    struct iovec iov[2];
+    struct pollfd pfd;
+
+    pfd.fd = second->fd;
+    pfd.events = POLLIN;
+    test(poll(&pfd, 1, 0) == 0)
+
+    iov[0].iov_base = hello;
+    iov[0].iov_len = strlen(hello);
+    iov[1].iov_base = world;
+    iov[1].iov_len = strlen(world);
+    test(first->transport->send(first, iov, 2) == 11)
+    test(poll(&pfd, 1, 0) == 1)
+
+    test(second->transport->recv(second, buf, 6) == 6)
+    test(memcmp(buf, "hello ", 6) == 0)
+    test(poll(&pfd, 1, 0) == 1)
+    test(second->transport->recv(second, buf, sizeof(buf)) == 5)
+    test(memcmp(buf, "world", 5) == 0)
+    test(poll(&pfd, 1, 0) == 0)
+
+    /* The other way */
+    test(second->transport->send(second, iov, 1) == 6)
+    test(first->transport->recv(first, buf, sizeof(buf)) == 6)
+}
+
+/* A full channel takes nothing more until the other connection reads */
+static void test_full(struct netpipefs_socket *first, struct netpipefs_socket *second) {
+    char *buf;
+    size_t received = 0;
+    ssize_t bytes;
+    struct iovec iov[1];
+
+    test((buf = (char *) malloc(LOOPBACK_CAPACITY + 100)) != NULL)
+    memset(buf, 'x', LOOPBACK_CAPACITY + 100);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = LOOPBACK_CAPACITY + 100;
+    test(first->transport->send(first, iov, 1) == LOOPBACK_CAPACITY)
+    test(first->transport->send(first, iov, 1) == -1)
+    test(errno == EAGAIN)
+    errno = 0;
+    test(first->transport->wait_send(first, 10) == 0)
+
+    test(second->transport->recv(second, buf, 100) == 100)
+    test(first->transport->wait_send(first, 10) == 1)
+    test(first->transport->send(first, iov, 1) == 100)
+
+    /* It wraps around the end of the channel */
+    while (received < LOOPBACK_CAPACITY) {
+        test((bytes = second->transport->recv(second, buf, LOOPBACK_CAPACITY)) > 0)
+        received += (size_t) bytes;
+    }
+    test(received == LOOPBACK_CAPACITY)
+    test(buf[0] == 'x')
+    free(buf);
+}
+
+/* The messages queued on a connection are sent by the sender thread and parsed by the other connection */
+static void test_messages(struct netpipefs_socket *remote) {
+    int parsed = 0;
+    struct netpipefs_message message;
+
+    test(netpipefs_sender_run() == 0)
+    test(send_open_message(&netpipefs_socket, "/loop", 7, O_RDONLY) == 1)
+    test(send_read_request_message(&netpipefs_socket, 3, 4096) == 1)
+    test(netpipefs_sender_stop() == 0)
+
+    while (parsed < 2) {
+        test(recv_socket_data(remote) > 0)
+        while (parsed < 2 && read_socket_message(remote, &message) == 1) {
+            if (parsed == 0) {
+                test(message.header == OPEN)
+                test(message.handle == 7)
+                test(strcmp(message.path, "/loop") == 0)
+            } else {
+                test(message.header == READ_REQUEST)
+                test(message.handle == 3)
+                test(message.size == 4096)
+            }
+            parsed++;
+        }
+    }
+}
+
+/* Without --maxframe, WRITE messages are split anyway to fit the remote host's ring */
+static void test_max_message(struct netpipefs_socket *remote) {
+    char data[200];
+    size_t i, received = 0;
+    struct netpipe *file;
+    struct netpipefs_message message;
+
+    for (i = 0; i < sizeof(data); i++) data[i] = (char) i;
+    netpipefs_options.maxframe = 0;
+    netpipefs_socket.maxmessage = MESSAGE_HEADER_SIZE + 64;
+    test((file = netpipe_alloc("/loop")) != NULL)
+    file->remote_handle = 3;
+
+    test(netpipefs_sender_run() == 0)
+    test(send_write_message(&netpipefs_socket, file, data, sizeof(data), NULL, NULL) == sizeof(data))
+    test(netpipefs_sender_stop() == 0)
+
+    while (received < sizeof(data)) {
+        test(recv_socket_data(remote) > 0)
+        while (received < sizeof(data) && read_socket_message(remote, &message) == 1) {
+            test(message.header == WRITE)
+            test(message.size == (sizeof(data) - received < 64 ? sizeof(data) - received : 64))
+            test(memcmp(message.data, data + received, message.size) == 0)
+            received += message.size;
+        }
+    }
+
+    netpipefs_socket.maxmessage = 0;
+    test(netpipe_free(file, NULL) == 0)
+}
+
+/* A message longer than the protocol allows is refused before the receive buffer grows for it */
+static void test_max_length(struct netpipefs_socket *remote) {
+    unsigned char header[MESSAGE_HEADER_SIZE];
+    uint32_t length = htonl(MESSAGE_MAX_LENGTH + 1);
+    size_t capacity = remote->recv_buf.capacity;
+    struct iovec iov[1];
+    struct netpipefs_message message;
+
+    memset(header, 0, sizeof(header));
+    header[0] = WRITE;
+    memcpy(header + 12, &length, sizeof(uint32_t));
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    test(netpipefs_socket.transport->send(&netpipefs_socket, iov, 1) == sizeof(header))
+
+    test(recv_socket_data(remote) > 0)
+    test(read_socket_message(remote, &message) == -1)
+    test(errno == EPROTO)
+    errno = 0;
+    test(remote->recv_buf.capacity == capacity)
+    remote->recv_buf.start = remote->recv_buf.end;
+}
+
+/* The data waiting to be sent moves to the netpipe's new class, in order, and it is still sent */
+static void test_move_flow(struct netpipefs_socket *remote) {
+    char data[200];
+    size_t i, received = 0;
+    struct netpipe *file;
+    struct netpipefs_message message;
+
+    for (i = 0; i < sizeof(data); i++) data[i] = (char) i;
+    netpipefs_options.maxframe = 64;
+    test((file = netpipe_alloc("/loop")) != NULL)
+    file->remote_handle = 5;
+    file->priority = PRIORITY_CLASSES - 1;
+    file->weight = 1;
+    netpipefs_socket.snd_error = 0; // queue while no sender is running
+    test(send_write_message(&netpipefs_socket, file, data, sizeof(data), NULL, NULL) == sizeof(data))
+    test(netpipefs_socket.snd_head[PRIORITY_CLASSES - 1] != NULL)
+
+    file->priority = 0;
+    file->weight = 3;
+    test(update_socket_flow(&netpipefs_socket, file) == 0)
+    test(netpipefs_socket.snd_head[PRIORITY_CLASSES - 1] == NULL)
+    test(netpipefs_socket.snd_tail[PRIORITY_CLASSES - 1] == NULL)
+    test(netpipefs_socket.snd_head[0] != NULL)
+    test(netpipefs_socket.snd_head[0] == netpipefs_socket.snd_tail[0])
+    test(netpipefs_socket.snd_head[0]->priority == 0)
+    test(netpipefs_socket.snd_head[0]->weight == 3)
+
+    test(netpipefs_sender_run() == 0)
+    test(netpipefs_sender_stop() == 0)
+    while (received < sizeof(data)) {
+        test(recv_socket_data(remote) > 0)
+        while (received < sizeof(data) && read_socket_message(remote, &message) == 1) {
+            test(message.header == WRITE)
+            test(message.handle == 5)
+            test(memcmp(message.data, data + received, message.size) == 0)
+            received += message.size;
+        }
+    }
+
+    netpipefs_options.maxframe = 0;
+    test(netpipe_free(file, NULL) == 0)
+}
+
+/** Count the bytes the sender is done with */
+static void count_sent(void *arg, size_t bytes) {
+    *((size_t *) arg) += bytes;
+}
+
+/* The data of a WRITE message is not copied when it is queued: it is written from the caller's memory, which is
+ * given back once the sender is done with it */
+static void test_zero_copy(struct netpipefs_socket *remote) {
+    char data[200];
+    size_t i, sent = 0, received = 0;
+    struct netpipe *file;
+    struct netpipefs_message message;
+
+    memset(data, 'a', sizeof(data));
+    netpipefs_options.maxframe = 64;
+    test((file = netpipe_alloc("/loop")) != NULL)
+    file->remote_handle = 9;
+    netpipefs_socket.snd_error = 0; // queue while no sender is running
+    test(send_write_message(&netpipefs_socket, file, data, sizeof(data), &count_sent, &sent) == sizeof(data))
+    for (i = 0; i < sizeof(data); i++) data[i] = (char) i;
+    test(sent == 0)
+
+    test(netpipefs_sender_run() == 0)
+    test(netpipefs_sender_stop() == 0)
+    test(sent == sizeof(data))
+    while (received < sizeof(data)) {
+        test(recv_socket_data(remote) > 0)
+        while (received < sizeof(data) && read_socket_message(remote, &message) == 1) {
+            test(message.header == WRITE)
+            test(message.handle == 9)
+            test(memcmp(message.data, data + received, message.size) == 0)
+            received += message.size;
+        }
+    }
+
+    netpipefs_options.maxframe = 0;
+    test(netpipe_free(file, NULL) == 0)
+}
+
+#define LARGE_BUFFER ((size_t) MESSAGE_MAX_LENGTH + (1 << 20))
+#define LARGE_WRITE (LARGE_BUFFER + 1000)
+
+struct large_write {
+    struct netpipe *file;
+    char *data;
+    ssize_t sent;
+};
+
+static void *large_writer(void *arg) {
+    struct large_write *large = (struct large_write *) arg;
+
+    large->sent = netpipe_send(large->file, large->data, LARGE_WRITE, 0);
+    return NULL;
+}
+
+/* A buffer larger than a message is flushed at once, before the write request waiting behind it */
+static void test_large_flush(struct netpipefs_socket *remote) {
+    size_t i, received = 0;
+    int full = 0;
+    pthread_t tid;
+    struct large_write large;
+    struct netpipefs_message message;
+
+    netpipefs_options.maxframe = 1 << 20;
+    test((large.data = (char *) malloc(LARGE_WRITE)) != NULL)
+    for (i = 0; i < LARGE_WRITE; i++) large.data[i] = (char) (i % 251);
+    test((large.file = netpipe_alloc("/loop")) != NULL)
+    cbuf_free(large.file->buffer);
+    test((large.file->buffer = cbuf_alloc(LARGE_BUFFER)) != NULL)
+    test(bufpool_charge(LARGE_BUFFER, 1) == 0)
+    large.file->remote_handle = 13;
+    large.file->open_mode = O_WRONLY;
+    large.file->writers = 1;
+    large.file->readers = 1;
+    large.file->remotemax = 0;
+
+    /* The remote host gives no credit: the buffer is filled and the rest waits as a request */
+    test(pthread_create(&tid, NULL, &large_writer, &large) == 0)
+    while (!full) {
+        test(netpipe_lock(large.file) == 0)
+        full = cbuf_full(large.file->buffer);
+        test(netpipe_unlock(large.file) == 0)
+        if (!full) sched_yield();
+    }
+
+    netpipefs_socket.snd_error = 0;
+    test(netpipefs_sender_run() == 0)
+    test(netpipe_read_request(large.file, LARGE_WRITE, NULL) > 0)
+    while (received < LARGE_WRITE) {
+        test(recv_socket_data(remote) > 0)
+        while (received < LARGE_WRITE && read_socket_message(remote, &message) == 1) {
+            test(message.header == WRITE)
+            test(message.handle == 13)
+            test(memcmp(message.data, large.data + received, message.size) == 0)
+            received += message.size;
+        }
+    }
+    test(pthread_join(tid, NULL) == 0)
+    test(large.sent == (ssize_t) LARGE_WRITE)
+    test(netpipefs_sender_stop() == 0)
+
+    netpipefs_options.maxframe = 0;
+    test(netpipe_free(large.file, NULL) == 0)
+    free(large.data);
+}
+
+/* After a connection is closed, the other one reads 0 bytes and can't send */
+static void test_close(struct netpipefs_socket *remote) {
+    char buf[4];
+    struct iovec iov[1];
+    struct pollfd pfd;
+
+    test(end_socket_connection(&netpipefs_socket) == 0)
+
+    pfd.fd = remote->fd;
+    pfd.events = POLLIN;
+    test(poll(&pfd, 1, 0) == 1)
+    test(remote->transport->recv(remote, buf, sizeof(buf)) == 0)
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    test(remote->transport->send(remote, iov, 1) == -1)
+    test(errno == EPIPE)
+    errno = 0;
+    test(remote->transport->wait_send(remote, 0) == 1)
+
+    test(end_socket_connection(remote) == 0)
+    free_socket_recv_buffer(remote);
+}
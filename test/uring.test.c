@@ -0,0 +1,140 @@
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "testutilities.h"
+#include "../include/uring.h"
+
+static void test_write_and_read(struct netpipefs_uring *ring);
+static void test_poll(struct netpipefs_uring *ring);
+static void test_write_timeout(struct netpipefs_uring *ring);
+
+int main(int argc, char** argv) {
+    struct netpipefs_uring ring;
+
+    /* The kernel may not support io_uring. Then netpipefs uses blocking system calls */
+    if (uring_init(&ring, 8) == -1) {
+        test(errno == ENOSYS || errno == EPERM)
+        errno = 0;
+        testpassed("io_uring (not supported)");
+        return 0;
+    }
+
+    test_write_and_read(&ring);
+    test_poll(&ring);
+    test_write_timeout(&ring);
+
+    uring_free(&ring);
+    test(ring.fd == -1)
+
+    testpassed("io_uring");
+    return 0;
+}
+
+/* Write a vector of buffers, then read it into a registered and into a not registered buffer */
+static void test_write_and_read(struct netpipefs_uring *ring) {
+    int pipefd[2];
+    char fixed[16], notfixed[16];
+    char first[] = "hello ", second[] = "world";
+    struct iovec iov[2];
+    struct netpipefs_uring_cqe cqe;
+
+    test(pipe(pipefd) != -1)
+
+    iov[0].iov_base = first;
+    iov[0].iov_len = strlen(first);
+    iov[1].iov_base = second;
+    iov[1].iov_len = strlen(second);
+    test(uring_writev_timeout(ring, pipefd[1], iov, 2, 1000000) == 11)
+
+    /* Read into the registered buffer */
+    test(uring_register_buffer(ring, fixed, sizeof(fixed)) == 0)
+    test(uring_prep_read(ring, pipefd[0], fixed, 6, 1) == 0)
+    test(uring_submit_and_wait(ring, 1) == 1)
+    test(uring_next_cqe(ring, &cqe) == 1)
+    test(cqe.user_data == 1)
+    test(cqe.res == 6)
+    test(memcmp(fixed, "hello ", 6) == 0)
+
+    /* Read into a buffer that isn't registered */
+    test(uring_prep_read(ring, pipefd[0], notfixed, sizeof(notfixed), 2) == 0)
+    test(uring_submit_and_wait(ring, 1) == 1)
+    test(uring_next_cqe(ring, &cqe) == 1)
+    test(cqe.user_data == 2)
+    test(cqe.res == 5)
+    test(memcmp(notfixed, "world", 5) == 0)
+    test(uring_next_cqe(ring, &cqe) == 0)
+
+    /* A forgotten buffer is read without registration, then another one can be registered */
+    test(uring_writev_timeout(ring, pipefd[1], iov, 1, 1000000) == 6)
+    uring_forget_buffer(ring);
+    test(ring->registered == 1)
+    test(uring_prep_read(ring, pipefd[0], fixed, sizeof(fixed), 4) == 0)
+    test(uring_submit_and_wait(ring, 1) == 1)
+    test(uring_next_cqe(ring, &cqe) == 1)
+    test(cqe.res == 6)
+    test(memcmp(fixed, "hello ", 6) == 0)
+    test(uring_register_buffer(ring, notfixed, sizeof(notfixed)) == 0)
+    test(ring->fixed.iov_base == notfixed)
+
+    /* End of file */
+    close(pipefd[1]);
+    test(uring_prep_read(ring, pipefd[0], fixed, sizeof(fixed), 3) == 0)
+    test(uring_submit_and_wait(ring, 1) == 1)
+    test(uring_next_cqe(ring, &cqe) == 1)
+    test(cqe.res == 0)
+
+    close(pipefd[0]);
+}
+
+/* Many operations are submitted together. The poll completes when the pipe is closed */
+static void test_poll(struct netpipefs_uring *ring) {
+    int pipefd[2], i;
+    char buf[4];
+    struct netpipefs_uring_cqe cqe;
+
+    test(pipe(pipefd) != -1)
+
+    test(uring_prep_poll(ring, pipefd[0], POLLIN, 10) == 0)
+    test(uring_submit_and_wait(ring, 0) == 1)
+    test(uring_next_cqe(ring, &cqe) == 0)
+
+    /* Fill the submission queue */
+    for (i = 0; i < 8; i++) test(uring_prep_read(ring, pipefd[0], buf, sizeof(buf), 20 + i) == 0)
+    test(uring_prep_read(ring, pipefd[0], buf, sizeof(buf), 30) == -1)
+    test(errno == EBUSY)
+    errno = 0;
+
+    close(pipefd[1]);
+    test(uring_submit_and_wait(ring, 9) == 8)
+    for (i = 0; i < 9; i++) test(uring_next_cqe(ring, &cqe) == 1)
+    test(uring_next_cqe(ring, &cqe) == 0)
+
+    close(pipefd[0]);
+}
+
+/* Writes into a full socket time out */
+static void test_write_timeout(struct netpipefs_uring *ring) {
+    int sv[2];
+    ssize_t written;
+    size_t size = 8 << 20;
+    char *buf = (char *) calloc(size, sizeof(char));
+    struct iovec iov;
+
+    test(buf != NULL)
+    test(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    while ((written = uring_writev_timeout(ring, sv[0], &iov, 1, 10000)) > 0) {
+        iov.iov_base = (char *) iov.iov_base + written;
+        iov.iov_len -= written;
+        test(iov.iov_len > 0)
+    }
+    test(written == -1)
+    test(errno == EAGAIN)
+    errno = 0;
+
+    close(sv[0]);
+    close(sv[1]);
+    free(buf);
+}
@@ -8,6 +8,7 @@ static void test_ipv4_address_to_array(void);
 static void test_macros(void);
 static void test_msleep(void);
 static void test_elapsedtime(void);
+static void test_deadline(void);
 
 int main(int argc, char** argv) {
 
@@ -15,6 +16,7 @@ int main(int argc, char** argv) {
     test_ipv4_address_to_array();
     test_msleep();
     test_elapsedtime();
+    test_deadline();
 
     testpassed("Utilities");
 
@@ -181,4 +183,21 @@ static void test_elapsedtime(void) {
     test(elapsed.tv_sec >= 0 && elapsed.tv_nsec >= 0)
     test((elapsed.tv_sec * 1000L + elapsed.tv_nsec / 1000000L) >= 100)
     test((elapsed.tv_sec * 1000L + elapsed.tv_nsec / 1000000L) <= 200)
-}
\ No newline at end of file
+}
+
+static void test_deadline(void) {
+    struct timespec now, deadline, other;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    test(deadline_after(1500000, &deadline) == 0)
+    test(timespec_cmp(&now, &deadline) < 0)
+    test(timespec_cmp(&deadline, &now) > 0)
+    test(timespec_cmp(&deadline, &deadline) == 0)
+    test(deadline.tv_nsec >= 0 && deadline.tv_nsec < 1000000000L)
+    test(deadline.tv_sec - now.tv_sec >= 1 && deadline.tv_sec - now.tv_sec <= 2)
+
+    /* Zero microseconds is now */
+    test(deadline_after(0, &other) == 0)
+    test(timespec_cmp(&now, &other) <= 0)
+    test(timespec_cmp(&other, &deadline) < 0)
+}